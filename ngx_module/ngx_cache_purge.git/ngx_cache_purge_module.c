@@ -1438,6 +1438,9 @@ ngx_http_file_cache_purge(ngx_http_request_t *r)
 {
     ngx_http_file_cache_t  *cache;
     ngx_http_cache_t       *c;
+#  ifdef ngx_http_file_cache_shard
+    ngx_http_file_cache_shard_t  *shard;
+#  endif
 
     switch (ngx_http_file_cache_open(r)) {
     case NGX_OK:
@@ -1465,6 +1468,24 @@ ngx_http_file_cache_purge(ngx_http_request_t *r)
      * because other requests might still point to it.
      */
 
+#  ifdef ngx_http_file_cache_shard
+    shard = ngx_http_file_cache_shard(cache, c->node->node.key);
+
+    ngx_shmtx_lock(&shard->mutex);
+
+    if (!c->node->exists) {
+        /* race between concurrent purges, backoff */
+        ngx_shmtx_unlock(&shard->mutex);
+        return NGX_DECLINED;
+    }
+
+    shard->size -= c->node->fs_size;
+    c->node->fs_size = 0;
+    c->node->exists = 0;
+    c->node->updating = 0;
+
+    ngx_shmtx_unlock(&shard->mutex);
+#  else
     ngx_shmtx_lock(&cache->shpool->mutex);
 
     if (!c->node->exists) {
@@ -1488,6 +1509,7 @@ ngx_http_file_cache_purge(ngx_http_request_t *r)
 #  endif
 
     ngx_shmtx_unlock(&cache->shpool->mutex);
+#  endif
 
     if (ngx_delete_file(c->file.name.data) == NGX_FILE_ERROR) {
         /* entry in error log is enough, don't notice client */
@@ -804,7 +804,6 @@ ngx_stream_lua_abort_pending_timers(ngx_event_t *ev)
     ngx_int_t                    i, n;
     ngx_event_t                **events;
     ngx_connection_t            *c, *saved_c = NULL;
-    ngx_rbtree_node_t           *cur, *prev, *next, *sentinel, *temp;
 
     ngx_stream_lua_timer_ctx_t          *tctx;
     ngx_stream_lua_main_conf_t          *lmcf;
@@ -846,83 +845,24 @@ ngx_stream_lua_abort_pending_timers(ngx_event_t *ev)
 
     /* expire pending timers immediately */
 
-    sentinel = ngx_event_timer_rbtree.sentinel;
-
-    cur = ngx_event_timer_rbtree.root;
-
-    /* XXX nginx does not guarantee the parent of root is meaningful,
-     * so we temporarily override it to simplify tree traversal. */
-    temp = cur->parent;
-    cur->parent = NULL;
-
-    prev = NULL;
-
     events = ngx_pcalloc(ngx_cycle->pool,
-                         lmcf->pending_timers * sizeof(ngx_event_t));
+                         lmcf->pending_timers * sizeof(ngx_event_t *));
     if (events == NULL) {
         return;
     }
 
-    n = 0;
-
-    dd("root: %p, root parent: %p, sentinel: %p", cur, cur->parent, sentinel);
-
-    while (n < lmcf->pending_timers) {
-        if  (cur == sentinel || cur == NULL) {
-            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                          "lua pending timer counter got out of sync: %i",
-                          lmcf->pending_timers);
-            break;
-        }
-
-        dd("prev: %p, cur: %p, cur parent: %p, cur left: %p, cur right: %p",
-           prev, cur, cur->parent, cur->left, cur->right);
-
-        if (prev == cur->parent) {
-            /* neither of the children has been accessed yet */
-
-            next = cur->left;
-            if (next == sentinel) {
-                ev = (ngx_event_t *)
-                    ((char *) cur - offsetof(ngx_event_t, timer));
-
-                if (ev->handler == ngx_stream_lua_timer_handler) {
-                    dd("found node: %p", cur);
-                    events[n++] = ev;
-                }
-
-                next = (cur->right != sentinel) ? cur->right : cur->parent;
-            }
+    /* the timers may be kept either in the rbtree or in the timer wheel */
 
-        } else if (prev == cur->left) {
-            /* just accessed the left child */
+    n = (ngx_int_t) ngx_event_timers_collect(ngx_stream_lua_timer_handler,
+                                             events,
+                                             (ngx_uint_t) lmcf->pending_timers);
 
-            ev = (ngx_event_t *)
-                ((char *) cur - offsetof(ngx_event_t, timer));
-
-            if (ev->handler == ngx_stream_lua_timer_handler) {
-                dd("found node 2: %p", cur);
-                events[n++] = ev;
-            }
-
-            next = (cur->right != sentinel) ? cur->right : cur->parent;
-
-        } else if (prev == cur->right) {
-            /* already accessed both children */
-            next = cur->parent;
-
-        } else {
-            /* not reacheable */
-            next = NULL;
-        }
-
-        prev = cur;
-        cur = next;
+    if (n != lmcf->pending_timers) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                      "lua pending timer counter got out of sync: %i",
+                      lmcf->pending_timers);
     }
 
-    /* restore the old tree root's parent */
-    ngx_event_timer_rbtree.root->parent = temp;
-
     ngx_log_debug1(NGX_LOG_DEBUG_STREAM, ngx_cycle->log, 0,
                    "stream lua found %i pending timers to be "
                    "aborted prematurely", n);
@@ -930,15 +870,7 @@ ngx_stream_lua_abort_pending_timers(ngx_event_t *ev)
     for (i = 0; i < n; i++) {
         ev = events[i];
 
-        ngx_rbtree_delete(&ngx_event_timer_rbtree, &ev->timer);
-
-#if (NGX_DEBUG)
-        ev->timer.left = NULL;
-        ev->timer.right = NULL;
-        ev->timer.parent = NULL;
-#endif
-
-        ev->timer_set = 0;
+        ngx_event_del_timer(ev);
 
         ev->timedout = 1;
 
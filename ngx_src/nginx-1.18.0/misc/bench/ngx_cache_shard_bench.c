@@ -0,0 +1,285 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+/*
+ * Contention benchmark of the file cache keys zone layout.
+ *
+ * Worker processes repeat the critical section of a cache hit:
+ * the shard of a random key is locked, the key is looked up in the shard
+ * rbtree, the node is moved to the head of the inactive queue, and the
+ * shard is unlocked.  The shards are placed either with the cache line
+ * stride used by the file cache or packed as before.
+ *
+ *     ngx_cache_shard_bench [-w workers] [-s shards] [-k keys] [-n ops] [-p]
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define ngx_bench_key(n)  ((uint32_t) ((n) * 2654435761u))
+
+
+typedef struct {
+    ngx_http_file_cache_shard_t  *shards;
+    ngx_uint_t                    nshards;
+    size_t                        stride;
+} ngx_bench_cache_t;
+
+
+static ngx_int_t ngx_bench_cache_init(ngx_bench_cache_t *cache,
+    ngx_uint_t keys);
+static ngx_uint_t ngx_bench_cache_run(ngx_bench_cache_t *cache,
+    ngx_uint_t keys, ngx_uint_t ops, ngx_uint_t seed);
+static void *ngx_bench_shalloc(size_t size);
+
+
+volatile ngx_cycle_t  *ngx_cycle;
+ngx_pid_t              ngx_pid;
+ngx_int_t              ngx_ncpu;
+
+static ngx_cycle_t     ngx_bench_cycle;
+static ngx_log_t       ngx_bench_log;
+
+
+void
+ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, ngx_err_t err,
+    const char *fmt, ...)
+{
+}
+
+
+int
+main(int argc, char *const *argv)
+{
+    int                 ch, status;
+    double              sec;
+    ngx_uint_t          i, workers, keys, ops, packed, hits, *found;
+    ngx_pid_t           pid;
+    struct timeval      start, end;
+    ngx_bench_cache_t   cache;
+
+    workers = 4;
+    cache.nshards = 16;
+    keys = 100000;
+    ops = 2000000;
+    packed = 0;
+
+    while ((ch = getopt(argc, argv, "w:s:k:n:p")) != -1) {
+        switch (ch) {
+        case 'w':
+            workers = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            cache.nshards = strtoul(optarg, NULL, 10);
+            break;
+        case 'k':
+            keys = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            ops = strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            packed = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-w workers] [-s shards] [-k keys] "
+                            "[-n ops] [-p]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (workers == 0 || cache.nshards == 0 || keys == 0) {
+        fprintf(stderr, "invalid parameters\n");
+        return 1;
+    }
+
+    ngx_bench_log.log_level = NGX_LOG_EMERG;
+    ngx_bench_cycle.log = &ngx_bench_log;
+    ngx_cycle = &ngx_bench_cycle;
+
+    ngx_ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    ngx_pid = getpid();
+
+    cache.stride = packed ? sizeof(ngx_http_file_cache_shard_t)
+                          : NGX_HTTP_FILE_CACHE_SHARD_SIZE;
+
+    if (ngx_bench_cache_init(&cache, keys) != NGX_OK) {
+        return 1;
+    }
+
+    found = ngx_bench_shalloc(workers * sizeof(ngx_uint_t));
+    if (found == NULL) {
+        return 1;
+    }
+
+    ngx_gettimeofday(&start);
+
+    for (i = 0; i < workers; i++) {
+        pid = fork();
+
+        if (pid == -1) {
+            perror("fork");
+            return 1;
+        }
+
+        if (pid == 0) {
+            ngx_pid = getpid();
+            found[i] = ngx_bench_cache_run(&cache, keys, ops, i + 1);
+            _exit(0);
+        }
+    }
+
+    for (i = 0; i < workers; i++) {
+        if (wait(&status) == -1 || !WIFEXITED(status)
+            || WEXITSTATUS(status) != 0)
+        {
+            fprintf(stderr, "worker failed\n");
+            return 1;
+        }
+    }
+
+    ngx_gettimeofday(&end);
+
+    sec = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+
+    hits = 0;
+
+    for (i = 0; i < workers; i++) {
+        hits += found[i];
+    }
+
+    printf("workers:%lu shards:%lu layout:%s keys:%lu  "
+           "%.0f lookups/s  hits:%lu/%lu\n",
+           (unsigned long) workers, (unsigned long) cache.nshards,
+           packed ? "packed" : "padded", (unsigned long) keys,
+           workers * ops / sec, (unsigned long) hits,
+           (unsigned long) (workers * ops));
+
+    return 0;
+}
+
+
+static ngx_int_t
+ngx_bench_cache_init(ngx_bench_cache_t *cache, ngx_uint_t keys)
+{
+    ngx_uint_t                    i;
+    ngx_http_file_cache_node_t   *nodes, *fcn;
+    ngx_http_file_cache_shard_t  *shard;
+
+    cache->shards = ngx_bench_shalloc(cache->nshards * cache->stride);
+    nodes = ngx_bench_shalloc(keys * sizeof(ngx_http_file_cache_node_t));
+
+    if (cache->shards == NULL || nodes == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < cache->nshards; i++) {
+        shard = (ngx_http_file_cache_shard_t *)
+                    ((u_char *) cache->shards + i * cache->stride);
+
+        if (ngx_shmtx_create(&shard->mutex, &shard->lock, NULL) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        ngx_rbtree_init(&shard->rbtree, &shard->sentinel,
+                        ngx_rbtree_insert_value);
+        ngx_queue_init(&shard->queue);
+    }
+
+    for (i = 0; i < keys; i++) {
+        fcn = &nodes[i];
+
+        /* the rbtree key of a cache node is a part of the md5 key */
+
+        fcn->node.key = ngx_bench_key(i);
+
+        shard = (ngx_http_file_cache_shard_t *)
+                    ((u_char *) cache->shards
+                     + (fcn->node.key % cache->nshards) * cache->stride);
+
+        ngx_rbtree_insert(&shard->rbtree, &fcn->node);
+        ngx_queue_insert_head(&shard->queue, &fcn->queue);
+        shard->count++;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_uint_t
+ngx_bench_cache_run(ngx_bench_cache_t *cache, ngx_uint_t keys,
+    ngx_uint_t ops, ngx_uint_t seed)
+{
+    ngx_uint_t                    i, k, found;
+    ngx_rbtree_key_t              key;
+    ngx_rbtree_node_t            *node, *sentinel;
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *shard;
+
+    srandom(seed);
+
+    found = 0;
+
+    for (i = 0; i < ops; i++) {
+        k = random() % keys;
+        key = ngx_bench_key(k);
+
+        shard = (ngx_http_file_cache_shard_t *)
+                    ((u_char *) cache->shards
+                     + (key % cache->nshards) * cache->stride);
+
+        ngx_shmtx_lock(&shard->mutex);
+
+        node = shard->rbtree.root;
+        sentinel = shard->rbtree.sentinel;
+
+        while (node != sentinel) {
+
+            if (key < node->key) {
+                node = node->left;
+                continue;
+            }
+
+            if (key > node->key) {
+                node = node->right;
+                continue;
+            }
+
+            fcn = (ngx_http_file_cache_node_t *) node;
+
+            fcn->uses++;
+
+            ngx_queue_remove(&fcn->queue);
+            ngx_queue_insert_head(&shard->queue, &fcn->queue);
+
+            found++;
+            break;
+        }
+
+        ngx_shmtx_unlock(&shard->mutex);
+    }
+
+    return found;
+}
+
+
+static void *
+ngx_bench_shalloc(size_t size)
+{
+    void  *p;
+
+    p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_ANON|MAP_SHARED, -1, 0);
+
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+
+    return p;
+}
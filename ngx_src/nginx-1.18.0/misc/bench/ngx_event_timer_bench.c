@@ -0,0 +1,235 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+/*
+ * Micro-benchmark of the event timers: the rbtree and the timer wheel.
+ *
+ * A number of idle connections have their read timers armed in the range
+ * of a typical keepalive timeout.  Random connections are then re-armed
+ * the way each I/O operation does it, that is, the timer is deleted and
+ * added again, while the clock advances and the expired timers are run.
+ * Finally the clock runs until all timers have expired.  Both
+ * implementations are fed the same sequence of operations.
+ *
+ *     ngx_event_timer_bench [-t timers] [-n ops] [-m rbtree|wheel]
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+
+#define NGX_BENCH_TIMEOUT        60000
+#define NGX_BENCH_TIMEOUT_RANGE  15000
+
+
+static ngx_int_t ngx_bench_timers(ngx_uint_t wheel, ngx_uint_t timers,
+    ngx_uint_t ops);
+static void ngx_bench_timer_handler(ngx_event_t *ev);
+static double ngx_bench_time(void);
+
+
+volatile ngx_msec_t       ngx_current_msec;
+volatile ngx_cycle_t     *ngx_cycle;
+ngx_uint_t                ngx_event_flags;
+ngx_os_io_t               ngx_io;
+
+static ngx_log_t          ngx_bench_log;
+static ngx_connection_t  *ngx_bench_conns;
+static ngx_msec_t        *ngx_bench_keys;
+static ngx_uint_t         ngx_bench_fired;
+static ngx_uint_t         ngx_bench_late;
+static ngx_uint_t         ngx_bench_early;
+
+
+void
+ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, ngx_err_t err,
+    const char *fmt, ...)
+{
+}
+
+
+int
+main(int argc, char *const *argv)
+{
+    int         ch;
+    ngx_uint_t  timers, ops, rbtree, wheel;
+
+    timers = 100000;
+    ops = 10000000;
+    rbtree = 1;
+    wheel = 1;
+
+    while ((ch = getopt(argc, argv, "t:n:m:")) != -1) {
+        switch (ch) {
+        case 't':
+            timers = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            ops = strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            rbtree = (strcmp(optarg, "rbtree") == 0);
+            wheel = (strcmp(optarg, "wheel") == 0);
+
+            if (rbtree || wheel) {
+                break;
+            }
+
+            /* fall through */
+
+        default:
+            fprintf(stderr, "usage: %s [-t timers] [-n ops] "
+                            "[-m rbtree|wheel]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (timers == 0) {
+        fprintf(stderr, "invalid parameters\n");
+        return 1;
+    }
+
+    ngx_bench_log.log_level = NGX_LOG_EMERG;
+
+    if (rbtree && ngx_bench_timers(0, timers, ops) != NGX_OK) {
+        return 1;
+    }
+
+    if (wheel && ngx_bench_timers(1, timers, ops) != NGX_OK) {
+        return 1;
+    }
+
+    return 0;
+}
+
+
+static ngx_int_t
+ngx_bench_timers(ngx_uint_t wheel, ngx_uint_t timers, ngx_uint_t ops)
+{
+    double        start, rearmed, expired;
+    ngx_uint_t    i, n;
+    ngx_event_t  *events, *ev;
+
+    events = ngx_calloc(timers * sizeof(ngx_event_t), &ngx_bench_log);
+    ngx_bench_conns = ngx_calloc(timers * sizeof(ngx_connection_t),
+                                 &ngx_bench_log);
+    ngx_bench_keys = ngx_calloc(timers * sizeof(ngx_msec_t), &ngx_bench_log);
+
+    if (events == NULL || ngx_bench_conns == NULL || ngx_bench_keys == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_event_timer_wheel = wheel;
+    ngx_current_msec = 1000;
+
+    if (ngx_event_timer_init(&ngx_bench_log) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_bench_fired = 0;
+    ngx_bench_late = 0;
+    ngx_bench_early = 0;
+
+    srandom(1);
+
+    for (i = 0; i < timers; i++) {
+        ev = &events[i];
+
+        ev->data = &ngx_bench_conns[i];
+        ev->log = &ngx_bench_log;
+        ev->handler = ngx_bench_timer_handler;
+
+        ngx_event_add_timer(ev, NGX_BENCH_TIMEOUT
+                                + random() % NGX_BENCH_TIMEOUT_RANGE);
+
+        ngx_bench_keys[i] = ev->timer.key;
+    }
+
+    start = ngx_bench_time();
+
+    for (i = 0; i < ops; i++) {
+        n = random() % timers;
+        ev = &events[n];
+
+        if (ev->timer_set) {
+            ngx_event_del_timer(ev);
+        }
+
+        ngx_event_add_timer(ev, NGX_BENCH_TIMEOUT
+                                + random() % NGX_BENCH_TIMEOUT_RANGE);
+
+        ngx_bench_keys[n] = ev->timer.key;
+
+        /* about a thousand operations per millisecond */
+
+        if ((i & 1023) == 0) {
+            ngx_current_msec++;
+
+            (void) ngx_event_find_timer();
+            ngx_event_expire_timers();
+        }
+    }
+
+    rearmed = ngx_bench_time();
+
+    while (ngx_bench_fired < timers) {
+        ngx_current_msec++;
+
+        (void) ngx_event_find_timer();
+        ngx_event_expire_timers();
+    }
+
+    expired = ngx_bench_time();
+
+    printf("%-6s timers:%lu  %.1f ns per del+add  "
+           "expire all %.3f s  late:%lu early:%lu\n",
+           wheel ? "wheel" : "rbtree", (unsigned long) timers,
+           ops ? (rearmed - start) * 1e9 / ops : 0.0, expired - rearmed,
+           (unsigned long) ngx_bench_late, (unsigned long) ngx_bench_early);
+
+    ngx_free(events);
+    ngx_free(ngx_bench_conns);
+    ngx_free(ngx_bench_keys);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_bench_timer_handler(ngx_event_t *ev)
+{
+    ngx_msec_t  key;
+
+    ngx_bench_fired++;
+
+    /*
+     * a timer must neither run before its time nor be delayed;
+     * the key is saved aside as ngx_rbtree_delete() clears it
+     */
+
+    key = ngx_bench_keys[(ngx_connection_t *) ev->data - ngx_bench_conns];
+
+    if (key < ngx_current_msec) {
+        ngx_bench_late++;
+    }
+
+    if (key > ngx_current_msec) {
+        ngx_bench_early++;
+    }
+}
+
+
+static double
+ngx_bench_time(void)
+{
+    struct timeval  tv;
+
+    ngx_gettimeofday(&tv);
+
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
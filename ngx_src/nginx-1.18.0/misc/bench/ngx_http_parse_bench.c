@@ -0,0 +1,477 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+/*
+ * Differential fuzzer and benchmark of the HTTP request parser.
+ *
+ * The parser of the configured tree, with the SIMD fast paths if they
+ * are available, is compared with the plain state machine built from the
+ * same source by ngx_http_parse_ref.c.  Random request lines and header
+ * lines are made of tokens which drive the parser into all its states,
+ * in particular "%", "//", "/." and "/.." in the path which must set the
+ * complex_uri and quoted_uri flags, and long runs of ordinary bytes which
+ * the fast paths skip.  Each input is fed in random pieces, as it would
+ * arrive from a client, and both parsers must return the same result and
+ * leave the request in the same state after each call.
+ *
+ *     ngx_http_parse_bench [-n inputs] [-s seed]
+ *     ngx_http_parse_bench -b [-n iterations]
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define NGX_BENCH_BUF_SIZE  16384
+#define NGX_BENCH_PIECES    4
+
+
+static ngx_int_t ngx_bench_fuzz(ngx_uint_t inputs);
+static size_t ngx_bench_generate(u_char *buf, ngx_uint_t header);
+static ngx_int_t ngx_bench_compare(u_char *buf, size_t len, ngx_uint_t header);
+static ngx_int_t ngx_bench_diff(ngx_http_request_t *r1, ngx_int_t rc1,
+    ngx_buf_t *b1, ngx_http_request_t *r2, ngx_int_t rc2, ngx_buf_t *b2);
+static void ngx_bench_dump(u_char *buf, size_t len);
+static void ngx_bench_speed(ngx_uint_t iterations);
+static ngx_int_t ngx_bench_ref(ngx_http_request_t *r, ngx_buf_t *b,
+    ngx_uint_t header);
+static ngx_int_t ngx_bench_fast(ngx_http_request_t *r, ngx_buf_t *b,
+    ngx_uint_t header);
+static double ngx_bench_time(void);
+
+
+ngx_int_t ngx_http_ref_parse_request_line(ngx_http_request_t *r,
+    ngx_buf_t *b);
+ngx_int_t ngx_http_ref_parse_header_line(ngx_http_request_t *r, ngx_buf_t *b,
+    ngx_uint_t allow_underscores);
+
+
+static char  *ngx_bench_methods[] = {
+    "GET ", "HEAD ", "POST ", "PROPFIND ", "GET http://", "GET HTTP://",
+    "OPTIONS * ", "get ", "GET"
+};
+
+
+static char  *ngx_bench_uri_tokens[] = {
+    "/", "//", "/.", "/..", "/./", "/../", ".", "..", "%", "%2F", "%2e",
+    "?", "#", "+", "\\", "a", "Z", "0", "-", "_", "~", ":", "@", ";", "=",
+    "&", "index.html", "abcdefghijklmnopqrstuvwxyz0123456789",
+    "/static/css/main.0123456789abcdef.css", "example.com", ":8080",
+    " ", "  ", " H", " HTTP/1.1", " HTTP/1.0", " HTTP/1.10", " HTTP/2.0",
+    "\r", "\n", "\r\n", "\t", "\x01", "\x7f", "\x80", "\xff", "\0"
+};
+
+
+static char  *ngx_bench_header_tokens[] = {
+    "Host", "User-Agent", "X-Forwarded-For", "x_under", "a", "Z", "0", "-",
+    "_", ".", ":", ": ", " ", "  ", "\t", "/", "%", "=", ";", ",", "\"",
+    "Mozilla/5.0 (X11; Linux x86_64; rv:78.0) Gecko/20100101 Firefox/78.0",
+    "text/html,application/xhtml+xml", "\r", "\n", "\r\n", "\r\n\r\n",
+    "\x01", "\x7f", "\x80", "\xff", "\0"
+};
+
+
+static char  *ngx_bench_samples[] = {
+    "GET / HTTP/1.1\r\n",
+    "GET /index.html HTTP/1.1\r\n",
+    "GET /static/js/vendor.3f1e9b27c4d5a6b8.chunk.js HTTP/1.1\r\n",
+    "GET /api/v1/users/1234567890/orders?status=open&page=2&per_page=50"
+        "&sort=created_at HTTP/1.1\r\n",
+    "GET /images/products/2020/summer-collection/thumbnails/large/"
+        "item-0123456789-front-view.jpeg HTTP/1.1\r\n",
+    "GET /search?q=the+quick+brown+fox+jumps+over+the+lazy+dog"
+        "&utm_source=newsletter&utm_medium=email&utm_campaign=spring_sale"
+        " HTTP/1.1\r\n",
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:78.0) "
+        "Gecko/20100101 Firefox/78.0\r\n",
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+        "image/webp,*/*;q=0.8\r\n",
+    "Cookie: session=0123456789abcdef0123456789abcdef; "
+        "preferences=dark_mode%3Dtrue%26lang%3Den\r\n"
+};
+
+
+volatile ngx_cycle_t  *ngx_cycle;
+volatile ngx_msec_t    ngx_current_msec;
+
+static u_char          ngx_bench_buf[NGX_BENCH_BUF_SIZE];
+static ngx_uint_t      ngx_bench_calls;
+
+
+void
+ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, ngx_err_t err,
+    const char *fmt, ...)
+{
+}
+
+
+int
+main(int argc, char *const *argv)
+{
+    int         ch;
+    ngx_uint_t  n, seed, speed;
+
+    n = 0;
+    seed = 1;
+    speed = 0;
+
+    while ((ch = getopt(argc, argv, "n:s:b")) != -1) {
+        switch (ch) {
+        case 'n':
+            n = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            speed = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n inputs] [-s seed] [-b]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (speed) {
+        ngx_bench_speed(n ? n : 1000000);
+        return 0;
+    }
+
+    srandom(seed);
+
+    return (ngx_bench_fuzz(n ? n : 1000000) == NGX_OK) ? 0 : 1;
+}
+
+
+static ngx_int_t
+ngx_bench_fuzz(ngx_uint_t inputs)
+{
+    size_t      len;
+    ngx_uint_t  i, header;
+
+    for (i = 0; i < inputs; i++) {
+        header = i & 1;
+
+        len = ngx_bench_generate(ngx_bench_buf, header);
+
+        if (ngx_bench_compare(ngx_bench_buf, len, header) != NGX_OK) {
+            printf("mismatch on %s input %lu:\n",
+                   header ? "header" : "request line", (unsigned long) i);
+            ngx_bench_dump(ngx_bench_buf, len);
+            return NGX_ERROR;
+        }
+    }
+
+    printf("%lu inputs, %lu parser calls: no differences\n",
+           (unsigned long) inputs, (unsigned long) ngx_bench_calls);
+
+    return NGX_OK;
+}
+
+
+static size_t
+ngx_bench_generate(u_char *buf, ngx_uint_t header)
+{
+    char        *s, **tokens;
+    size_t       len, n;
+    ngx_uint_t   i, tokens_n, parts, repeat;
+
+    len = 0;
+
+    if (header) {
+        tokens = ngx_bench_header_tokens;
+        tokens_n = sizeof(ngx_bench_header_tokens) / sizeof(char *);
+
+    } else {
+        tokens = ngx_bench_uri_tokens;
+        tokens_n = sizeof(ngx_bench_uri_tokens) / sizeof(char *);
+
+        s = ngx_bench_methods[random()
+                              % (sizeof(ngx_bench_methods) / sizeof(char *))];
+        n = ngx_strlen(s);
+
+        ngx_memcpy(buf, s, n);
+        len = n;
+    }
+
+    parts = random() % 40;
+
+    for (i = 0; i < parts; i++) {
+        s = tokens[random() % tokens_n];
+        n = (s[0] == '\0') ? 1 : ngx_strlen(s);
+
+        /* long runs of the same token cross the vector boundaries */
+
+        repeat = (random() % 8 == 0) ? random() % 100 : 1;
+
+        while (repeat-- && len + n < NGX_BENCH_BUF_SIZE / 2) {
+            ngx_memcpy(buf + len, s, n);
+            len += n;
+        }
+    }
+
+    /* most inputs are complete */
+
+    if (random() % 4) {
+        s = header ? "\r\n" : " HTTP/1.1\r\n";
+        n = ngx_strlen(s);
+
+        ngx_memcpy(buf + len, s, n);
+        len += n;
+    }
+
+    return len;
+}
+
+
+static ngx_int_t
+ngx_bench_compare(u_char *buf, size_t len, ngx_uint_t header)
+{
+    size_t              cuts[NGX_BENCH_PIECES];
+    ngx_int_t           rc1, rc2;
+    ngx_buf_t           b1, b2;
+    ngx_uint_t          i, n;
+    ngx_http_request_t  r1, r2;
+
+    n = random() % NGX_BENCH_PIECES;
+
+    for (i = 0; i < n; i++) {
+        cuts[i] = len ? random() % len : 0;
+    }
+
+    for (i = 1; i < n; i++) {
+        if (cuts[i] < cuts[i - 1]) {
+            cuts[i] = cuts[i - 1];
+        }
+    }
+
+    ngx_memzero(&r1, sizeof(ngx_http_request_t));
+    ngx_memzero(&r2, sizeof(ngx_http_request_t));
+    ngx_memzero(&b1, sizeof(ngx_buf_t));
+    ngx_memzero(&b2, sizeof(ngx_buf_t));
+
+    b1.start = buf;
+    b1.pos = buf;
+    b2.start = buf;
+    b2.pos = buf;
+
+    for (i = 0; i <= n; i++) {
+        b1.last = buf + (i < n ? cuts[i] : len);
+        b2.last = b1.last;
+
+        for ( ;; ) {
+            rc1 = ngx_bench_ref(&r1, &b1, header);
+            rc2 = ngx_bench_fast(&r2, &b2, header);
+
+            ngx_bench_calls++;
+
+            if (ngx_bench_diff(&r1, rc1, &b1, &r2, rc2, &b2) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            /* header lines are parsed one after another */
+
+            if (!header || rc1 != NGX_OK) {
+                break;
+            }
+        }
+
+        if (rc1 != NGX_AGAIN) {
+            break;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+#define ngx_bench_diff_field(field)                                           \
+    if (r1->field != r2->field) {                                             \
+        printf("%s: %ld, %ld\n", #field,                                      \
+               (long) r1->field, (long) r2->field);                           \
+        rc = NGX_ERROR;                                                       \
+    }
+
+#define ngx_bench_diff_ptr(field)                                             \
+    if ((r1->field ? r1->field - b1->start : -1)                              \
+        != (r2->field ? r2->field - b2->start : -1))                          \
+    {                                                                         \
+        printf("%s: %ld, %ld\n", #field,                                      \
+               (long) (r1->field ? r1->field - b1->start : -1),               \
+               (long) (r2->field ? r2->field - b2->start : -1));              \
+        rc = NGX_ERROR;                                                       \
+    }
+
+
+static ngx_int_t
+ngx_bench_diff(ngx_http_request_t *r1, ngx_int_t rc1, ngx_buf_t *b1,
+    ngx_http_request_t *r2, ngx_int_t rc2, ngx_buf_t *b2)
+{
+    ngx_int_t  rc;
+
+    rc = NGX_OK;
+
+    if (rc1 != rc2) {
+        printf("rc: %ld, %ld\n", (long) rc1, (long) rc2);
+        rc = NGX_ERROR;
+    }
+
+    if (b1->pos - b1->start != b2->pos - b2->start) {
+        printf("pos: %ld, %ld\n",
+               (long) (b1->pos - b1->start), (long) (b2->pos - b2->start));
+        rc = NGX_ERROR;
+    }
+
+    ngx_bench_diff_field(state);
+    ngx_bench_diff_field(method);
+    ngx_bench_diff_field(http_major);
+    ngx_bench_diff_field(http_minor);
+    ngx_bench_diff_field(complex_uri);
+    ngx_bench_diff_field(quoted_uri);
+    ngx_bench_diff_field(plus_in_uri);
+    ngx_bench_diff_field(space_in_uri);
+    ngx_bench_diff_field(invalid_header);
+    ngx_bench_diff_field(header_hash);
+    ngx_bench_diff_field(lowcase_index);
+
+    ngx_bench_diff_ptr(request_start);
+    ngx_bench_diff_ptr(method_end);
+    ngx_bench_diff_ptr(schema_start);
+    ngx_bench_diff_ptr(schema_end);
+    ngx_bench_diff_ptr(host_start);
+    ngx_bench_diff_ptr(host_end);
+    ngx_bench_diff_ptr(port_start);
+    ngx_bench_diff_ptr(port_end);
+    ngx_bench_diff_ptr(uri_start);
+    ngx_bench_diff_ptr(uri_end);
+    ngx_bench_diff_ptr(uri_ext);
+    ngx_bench_diff_ptr(args_start);
+    ngx_bench_diff_ptr(request_end);
+    ngx_bench_diff_ptr(http_protocol.data);
+    ngx_bench_diff_ptr(header_name_start);
+    ngx_bench_diff_ptr(header_name_end);
+    ngx_bench_diff_ptr(header_start);
+    ngx_bench_diff_ptr(header_end);
+
+    if (ngx_memcmp(r1->lowcase_header, r2->lowcase_header,
+                   ngx_min(r1->lowcase_index, NGX_HTTP_LC_HEADER_LEN))
+        != 0)
+    {
+        printf("lowcase_header differs\n");
+        rc = NGX_ERROR;
+    }
+
+    return rc;
+}
+
+
+static void
+ngx_bench_dump(u_char *buf, size_t len)
+{
+    size_t  i;
+
+    for (i = 0; i < len; i++) {
+        if (buf[i] >= 0x20 && buf[i] < 0x7f && buf[i] != '\\') {
+            putchar(buf[i]);
+
+        } else {
+            printf("\\x%02x", buf[i]);
+        }
+    }
+
+    putchar('\n');
+}
+
+
+static void
+ngx_bench_speed(ngx_uint_t iterations)
+{
+    double              t0, t1, t2;
+    size_t              len;
+    ngx_int_t           rc;
+    ngx_buf_t           b;
+    ngx_uint_t          i, k, header;
+    ngx_http_request_t  r;
+
+    for (k = 0; k < sizeof(ngx_bench_samples) / sizeof(char *); k++) {
+        len = ngx_strlen(ngx_bench_samples[k]);
+        header = (ngx_bench_samples[k][0] != 'G');
+
+        ngx_memcpy(ngx_bench_buf, ngx_bench_samples[k], len);
+
+        if (ngx_bench_compare(ngx_bench_buf, len, header) != NGX_OK) {
+            printf("mismatch on sample %lu\n", (unsigned long) k);
+            return;
+        }
+
+        rc = NGX_OK;
+
+        ngx_memzero(&r, sizeof(ngx_http_request_t));
+        ngx_memzero(&b, sizeof(ngx_buf_t));
+
+        b.start = ngx_bench_buf;
+        b.last = ngx_bench_buf + len;
+
+        t0 = ngx_bench_time();
+
+        for (i = 0; i < iterations; i++) {
+            r.state = 0;
+            b.pos = ngx_bench_buf;
+
+            rc |= ngx_bench_ref(&r, &b, header);
+        }
+
+        t1 = ngx_bench_time();
+
+        for (i = 0; i < iterations; i++) {
+            r.state = 0;
+            b.pos = ngx_bench_buf;
+
+            rc |= ngx_bench_fast(&r, &b, header);
+        }
+
+        t2 = ngx_bench_time();
+
+        printf("%4lu bytes  state machine %6.1f ns  fast path %6.1f ns%s\n",
+               (unsigned long) len, (t1 - t0) * 1e9 / iterations,
+               (t2 - t1) * 1e9 / iterations, rc == NGX_OK ? "" : "  (failed)");
+    }
+}
+
+
+static ngx_int_t
+ngx_bench_ref(ngx_http_request_t *r, ngx_buf_t *b, ngx_uint_t header)
+{
+    if (header) {
+        return ngx_http_ref_parse_header_line(r, b, 1);
+    }
+
+    return ngx_http_ref_parse_request_line(r, b);
+}
+
+
+static ngx_int_t
+ngx_bench_fast(ngx_http_request_t *r, ngx_buf_t *b, ngx_uint_t header)
+{
+    if (header) {
+        return ngx_http_parse_header_line(r, b, 1);
+    }
+
+    return ngx_http_parse_request_line(r, b);
+}
+
+
+static double
+ngx_bench_time(void)
+{
+    struct timeval  tv;
+
+    ngx_gettimeofday(&tv);
+
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
@@ -0,0 +1,28 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+/*
+ * The HTTP parser built without the SIMD fast paths, with its external
+ * functions renamed, to be linked along with the regular parser.
+ */
+
+
+#define NGX_HTTP_PARSE_NO_SIMD  1
+
+#define ngx_http_parse_request_line        ngx_http_ref_parse_request_line
+#define ngx_http_parse_header_line         ngx_http_ref_parse_header_line
+#define ngx_http_parse_uri                 ngx_http_ref_parse_uri
+#define ngx_http_parse_complex_uri         ngx_http_ref_parse_complex_uri
+#define ngx_http_parse_status_line         ngx_http_ref_parse_status_line
+#define ngx_http_parse_unsafe_uri          ngx_http_ref_parse_unsafe_uri
+#define ngx_http_parse_multi_header_lines  ngx_http_ref_parse_multi_header_lines
+#define ngx_http_parse_set_cookie_lines    ngx_http_ref_parse_set_cookie_lines
+#define ngx_http_arg                       ngx_http_ref_arg
+#define ngx_http_split_args                ngx_http_ref_split_args
+#define ngx_http_parse_chunked             ngx_http_ref_parse_chunked
+
+
+#include "ngx_http_parse.c"
@@ -0,0 +1,537 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+/*
+ * Scaling benchmark of the sharded limit_req and limit_conn zones.
+ *
+ * The modules are compiled into the benchmark, and worker processes call
+ * their access phase handlers with requests for random keys against a zone
+ * in shared memory, initialized by the module itself.  For limit_req, each
+ * request looks up the key and updates its state, or inserts a new node;
+ * for limit_conn, each worker keeps a number of requests open, so the
+ * counter is incremented on lookup and decremented on the request cleanup,
+ * with the node deleted on the last reference.
+ *
+ *     ngx_limit_shard_bench [-m req|conn] [-w workers] [-s shards]
+ *                           [-k keys] [-n ops] [-r rate] [-c conns] [-S]
+ *
+ * Rate is per key, in requests per second, with the burst of the same
+ * size and nodelay; conns is the number of open requests per worker for
+ * limit_conn, the limit is the same; -S selects the limit_req sketch.
+ * Requests per second against the number of workers:
+ *
+ *     for w in 1 2 4 8; do
+ *         objs/bench/ngx_limit_shard_bench -m req -w $w -s 1
+ *         objs/bench/ngx_limit_shard_bench -m req -w $w -s 16
+ *     done
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include "ngx_http_limit_req_module.c"
+#include "ngx_http_limit_conn_module.c"
+
+
+#define NGX_BENCH_ZONE_SIZE  (64 * 1024 * 1024)
+
+
+typedef struct {
+    ngx_uint_t             passed;
+    ngx_uint_t             rejected;
+} ngx_bench_result_t;
+
+
+static ngx_int_t ngx_bench_zone(ngx_shm_zone_t *zone, char *name,
+    ngx_shm_zone_init_pt init, void *data);
+static void ngx_bench_run(ngx_uint_t conn, ngx_uint_t keys, ngx_uint_t ops,
+    ngx_uint_t conns, ngx_uint_t seed, ngx_bench_result_t *res);
+static void ngx_bench_update_time(void);
+static void *ngx_bench_shalloc(size_t size);
+
+
+volatile ngx_cycle_t                *ngx_cycle;
+volatile ngx_msec_t                  ngx_current_msec;
+ngx_pid_t                            ngx_pid;
+ngx_int_t                            ngx_ncpu;
+ngx_module_t                         ngx_http_core_module;
+
+static ngx_cycle_t                   ngx_bench_cycle;
+static ngx_log_t                     ngx_bench_log;
+static ngx_str_t                     ngx_bench_key;
+
+static ngx_shm_zone_t                ngx_bench_req_zone;
+static ngx_shm_zone_t                ngx_bench_conn_zone;
+static ngx_http_limit_req_ctx_t      ngx_bench_req_ctx;
+static ngx_http_limit_conn_ctx_t     ngx_bench_conn_ctx;
+static ngx_http_limit_req_conf_t     ngx_bench_req_conf;
+static ngx_http_limit_conn_conf_t    ngx_bench_conn_conf;
+static ngx_http_limit_req_limit_t    ngx_bench_req_limit;
+static ngx_http_limit_conn_limit_t   ngx_bench_conn_limit;
+
+
+int
+main(int argc, char *const *argv)
+{
+    int                  ch, status;
+    double               sec;
+    ngx_uint_t           i, workers, shards, keys, ops, rate, conns, conn,
+                         sketch, passed, rejected;
+    ngx_pid_t            pid;
+    struct timeval       start, end;
+    ngx_bench_result_t  *res;
+
+    conn = 0;
+    workers = 4;
+    shards = 16;
+    keys = 100000;
+    ops = 1000000;
+    rate = 1000;
+    conns = 16;
+    sketch = 0;
+
+    while ((ch = getopt(argc, argv, "m:w:s:k:n:r:c:S")) != -1) {
+        switch (ch) {
+        case 'm':
+            if (strcmp(optarg, "req") == 0) {
+                conn = 0;
+                break;
+            }
+
+            if (strcmp(optarg, "conn") == 0) {
+                conn = 1;
+                break;
+            }
+
+            goto usage;
+
+        case 'w':
+            workers = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            shards = strtoul(optarg, NULL, 10);
+            break;
+        case 'k':
+            keys = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            ops = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            rate = strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            conns = strtoul(optarg, NULL, 10);
+            break;
+        case 'S':
+            sketch = 1;
+            break;
+        default:
+            goto usage;
+        }
+    }
+
+    if (workers == 0 || shards == 0 || keys == 0 || rate == 0 || conns == 0) {
+        fprintf(stderr, "invalid parameters\n");
+        return 1;
+    }
+
+    ngx_bench_log.log_level = NGX_LOG_EMERG;
+    ngx_bench_cycle.log = &ngx_bench_log;
+    ngx_cycle = &ngx_bench_cycle;
+
+    ngx_ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    ngx_pid = getpid();
+
+    ngx_pagesize = getpagesize();
+    for (i = ngx_pagesize; i >>= 1; ngx_pagesize_shift++) { /* void */ }
+
+    ngx_cacheline_size = NGX_CPU_CACHE_LINE;
+
+    ngx_slab_sizes_init();
+
+    if (ngx_crc32_table_init() != NGX_OK) {
+        return 1;
+    }
+
+    ngx_bench_update_time();
+
+    /* the modules are the only ones of the location configuration */
+
+    ngx_http_limit_req_module.ctx_index = 0;
+    ngx_http_limit_conn_module.ctx_index = 1;
+
+    if (conn) {
+        ngx_bench_conn_ctx.nshards = shards;
+
+        if (ngx_bench_zone(&ngx_bench_conn_zone, "conn",
+                           ngx_http_limit_conn_init_zone, &ngx_bench_conn_ctx)
+            != NGX_OK)
+        {
+            return 1;
+        }
+
+        ngx_bench_conn_limit.shm_zone = &ngx_bench_conn_zone;
+        ngx_bench_conn_limit.conn = conns;
+
+        ngx_bench_conn_conf.limits.elts = &ngx_bench_conn_limit;
+        ngx_bench_conn_conf.limits.nelts = 1;
+        ngx_bench_conn_conf.log_level = NGX_LOG_ERR;
+        ngx_bench_conn_conf.status_code = NGX_HTTP_SERVICE_UNAVAILABLE;
+
+    } else {
+        ngx_bench_req_ctx.nshards = shards;
+        ngx_bench_req_ctx.rate = rate * 1000;
+        ngx_bench_req_ctx.sketch = sketch;
+
+        if (ngx_bench_zone(&ngx_bench_req_zone, "req",
+                           ngx_http_limit_req_init_zone, &ngx_bench_req_ctx)
+            != NGX_OK)
+        {
+            return 1;
+        }
+
+        ngx_bench_req_limit.shm_zone = &ngx_bench_req_zone;
+        ngx_bench_req_limit.burst = rate * 1000;
+        ngx_bench_req_limit.delay = NGX_MAX_INT_T_VALUE / 1000;
+
+        ngx_bench_req_conf.limits.elts = &ngx_bench_req_limit;
+        ngx_bench_req_conf.limits.nelts = 1;
+        ngx_bench_req_conf.limit_log_level = NGX_LOG_ERR;
+        ngx_bench_req_conf.delay_log_level = NGX_LOG_WARN;
+        ngx_bench_req_conf.status_code = NGX_HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    res = ngx_bench_shalloc(workers * sizeof(ngx_bench_result_t));
+    if (res == NULL) {
+        return 1;
+    }
+
+    ngx_gettimeofday(&start);
+
+    for (i = 0; i < workers; i++) {
+        pid = fork();
+
+        if (pid == -1) {
+            perror("fork");
+            return 1;
+        }
+
+        if (pid == 0) {
+            ngx_pid = getpid();
+            ngx_bench_run(conn, keys, ops, conns, i + 1, &res[i]);
+            _exit(0);
+        }
+    }
+
+    for (i = 0; i < workers; i++) {
+        if (wait(&status) == -1 || !WIFEXITED(status)
+            || WEXITSTATUS(status) != 0)
+        {
+            fprintf(stderr, "worker failed\n");
+            return 1;
+        }
+    }
+
+    ngx_gettimeofday(&end);
+
+    sec = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+
+    passed = 0;
+    rejected = 0;
+
+    for (i = 0; i < workers; i++) {
+        passed += res[i].passed;
+        rejected += res[i].rejected;
+    }
+
+    printf("%s workers:%lu shards:%lu keys:%lu  %.0f rps  "
+           "passed:%lu rejected:%lu\n",
+           conn ? "limit_conn" : (sketch ? "limit_req sketch" : "limit_req"),
+           (unsigned long) workers, (unsigned long) shards,
+           (unsigned long) keys, workers * ops / sec,
+           (unsigned long) passed, (unsigned long) rejected);
+
+    return 0;
+
+usage:
+
+    fprintf(stderr, "usage: %s [-m req|conn] [-w workers] [-s shards] "
+                    "[-k keys] [-n ops] [-r rate] [-c conns] [-S]\n",
+                    argv[0]);
+    return 1;
+}
+
+
+static ngx_int_t
+ngx_bench_zone(ngx_shm_zone_t *zone, char *name, ngx_shm_zone_init_pt init,
+    void *data)
+{
+    ngx_slab_pool_t  *sp;
+
+    zone->shm.size = NGX_BENCH_ZONE_SIZE;
+    zone->shm.addr = ngx_bench_shalloc(zone->shm.size);
+
+    if (zone->shm.addr == NULL) {
+        return NGX_ERROR;
+    }
+
+    zone->shm.name.len = ngx_strlen(name);
+    zone->shm.name.data = (u_char *) name;
+    zone->shm.log = &ngx_bench_log;
+    zone->init = init;
+    zone->data = data;
+
+    /* as ngx_init_zone_pool() does */
+
+    sp = (ngx_slab_pool_t *) zone->shm.addr;
+
+    sp->end = zone->shm.addr + zone->shm.size;
+    sp->min_shift = 3;
+    sp->addr = zone->shm.addr;
+
+    if (ngx_shmtx_create(&sp->mutex, &sp->lock, NULL) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_slab_init(sp);
+
+    return zone->init(zone, NULL);
+}
+
+
+static void
+ngx_bench_run(ngx_uint_t conn, ngx_uint_t keys, ngx_uint_t ops,
+    ngx_uint_t conns, ngx_uint_t seed, ngx_bench_result_t *res)
+{
+    u_char               buf[NGX_INT_T_LEN + 1];
+    void                *loc_conf[2];
+    ngx_int_t            rc;
+    ngx_uint_t           i;
+    ngx_pool_t         **pools, *pool;
+    ngx_connection_t     c;
+    ngx_http_request_t   r;
+
+    pools = ngx_alloc(conns * sizeof(ngx_pool_t *), &ngx_bench_log);
+    if (pools == NULL) {
+        exit(1);
+    }
+
+    for (i = 0; i < conns; i++) {
+        pools[i] = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, &ngx_bench_log);
+        if (pools[i] == NULL) {
+            exit(1);
+        }
+    }
+
+    loc_conf[0] = &ngx_bench_req_conf;
+    loc_conf[1] = &ngx_bench_conn_conf;
+
+    ngx_memzero(&c, sizeof(ngx_connection_t));
+    c.log = &ngx_bench_log;
+
+    ngx_memzero(&r, sizeof(ngx_http_request_t));
+    r.main = &r;
+    r.connection = &c;
+    r.loc_conf = loc_conf;
+
+    ngx_bench_key.data = buf;
+
+    srandom(seed);
+
+    for (i = 0; i < ops; i++) {
+
+        if ((i & 1023) == 0) {
+            ngx_bench_update_time();
+        }
+
+        ngx_bench_key.len = ngx_sprintf(buf, "k%ui", random() % keys) - buf;
+
+        if (conn) {
+
+            /* the oldest open request of the worker is finalized */
+
+            pool = pools[i % conns];
+
+            ngx_http_limit_conn_cleanup_all(pool);
+            ngx_reset_pool(pool);
+
+            r.pool = pool;
+            r.limit_conn_status = 0;
+
+            rc = ngx_http_limit_conn_handler(&r);
+
+        } else {
+            r.limit_req_status = 0;
+
+            rc = ngx_http_limit_req_handler(&r);
+        }
+
+        if (rc == NGX_DECLINED) {
+            res->passed++;
+
+        } else {
+            res->rejected++;
+        }
+    }
+
+    for (i = 0; i < conns; i++) {
+        ngx_http_limit_conn_cleanup_all(pools[i]);
+        ngx_destroy_pool(pools[i]);
+    }
+
+    ngx_free(pools);
+}
+
+
+static void
+ngx_bench_update_time(void)
+{
+    struct timeval  tv;
+
+    ngx_gettimeofday(&tv);
+
+    ngx_current_msec = (ngx_msec_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+
+static void *
+ngx_bench_shalloc(size_t size)
+{
+    void  *p;
+
+    p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_ANON|MAP_SHARED, -1, 0);
+
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+
+    return p;
+}
+
+
+/* the key is the same for all the limits */
+
+ngx_int_t
+ngx_http_complex_value(ngx_http_request_t *r, ngx_http_complex_value_t *val,
+    ngx_str_t *value)
+{
+    *value = ngx_bench_key;
+
+    return NGX_OK;
+}
+
+
+/* the rest is not used by the access phase handlers */
+
+void
+ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, ngx_err_t err,
+    const char *fmt, ...)
+{
+}
+
+
+void
+ngx_debug_point(void)
+{
+}
+
+
+void ngx_cdecl
+ngx_conf_log_error(ngx_uint_t level, ngx_conf_t *cf, ngx_err_t err,
+    const char *fmt, ...)
+{
+}
+
+
+char *
+ngx_conf_set_flag_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    return NGX_CONF_ERROR;
+}
+
+
+char *
+ngx_conf_set_num_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    return NGX_CONF_ERROR;
+}
+
+
+char *
+ngx_conf_set_enum_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    return NGX_CONF_ERROR;
+}
+
+
+char *
+ngx_conf_check_num_bounds(ngx_conf_t *cf, void *post, void *data)
+{
+    return NGX_CONF_ERROR;
+}
+
+
+ngx_shm_zone_t *
+ngx_shared_memory_add(ngx_conf_t *cf, ngx_str_t *name, size_t size, void *tag)
+{
+    return NULL;
+}
+
+
+ngx_http_variable_t *
+ngx_http_add_variable(ngx_conf_t *cf, ngx_str_t *name, ngx_uint_t flags)
+{
+    return NULL;
+}
+
+
+ngx_int_t
+ngx_http_compile_complex_value(ngx_http_compile_complex_value_t *ccv)
+{
+    return NGX_ERROR;
+}
+
+
+ngx_int_t
+ngx_handle_read_event(ngx_event_t *rev, ngx_uint_t flags)
+{
+    return NGX_ERROR;
+}
+
+
+ngx_int_t
+ngx_handle_write_event(ngx_event_t *wev, size_t lowat)
+{
+    return NGX_ERROR;
+}
+
+
+void
+ngx_http_core_run_phases(ngx_http_request_t *r)
+{
+}
+
+
+void
+ngx_http_finalize_request(ngx_http_request_t *r, ngx_int_t rc)
+{
+}
+
+
+void
+ngx_http_block_reading(ngx_http_request_t *r)
+{
+}
+
+
+void
+ngx_http_test_reading(ngx_http_request_t *r)
+{
+}
@@ -124,6 +124,13 @@ static ngx_command_t  ngx_core_commands[] = {
       offsetof(ngx_core_conf_t, rlimit_core),
       NULL },
 
+    { ngx_string("worker_pool_cache_size"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      0,
+      offsetof(ngx_core_conf_t, pool_cache_size),
+      NULL },
+
     { ngx_string("worker_shutdown_timeout"),
       NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_msec_slot,
@@ -1035,6 +1042,7 @@ ngx_core_module_create_conf(ngx_cycle_t *cycle)
 
     ccf->rlimit_nofile = NGX_CONF_UNSET;
     ccf->rlimit_core = NGX_CONF_UNSET;
+    ccf->pool_cache_size = NGX_CONF_UNSET_SIZE;
 
     ccf->user = (ngx_uid_t) NGX_CONF_UNSET_UINT;
     ccf->group = (ngx_gid_t) NGX_CONF_UNSET_UINT;
@@ -1061,6 +1069,7 @@ ngx_core_module_init_conf(ngx_cycle_t *cycle, void *conf)
 
     ngx_conf_init_value(ccf->worker_processes, 1);
     ngx_conf_init_value(ccf->debug_points, 0);
+    ngx_conf_init_size_value(ccf->pool_cache_size, 0);
 
 #if (NGX_HAVE_CPU_AFFINITY)
 
@@ -1411,6 +1420,13 @@ ngx_set_cpu_affinity(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
 ngx_cpuset_t *
 ngx_get_cpu_affinity(ngx_uint_t n)
+{
+    return ngx_get_cycle_cpu_affinity((ngx_cycle_t *) ngx_cycle, n);
+}
+
+
+ngx_cpuset_t *
+ngx_get_cycle_cpu_affinity(ngx_cycle_t *cycle, ngx_uint_t n)
 {
 #if (NGX_HAVE_CPU_AFFINITY)
     ngx_uint_t        i, j;
@@ -1419,8 +1435,7 @@ ngx_get_cpu_affinity(ngx_uint_t n)
 
     static ngx_cpuset_t  result;
 
-    ccf = (ngx_core_conf_t *) ngx_get_conf(ngx_cycle->conf_ctx,
-                                           ngx_core_module);
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
 
     if (ccf->cpu_affinity == NULL) {
         return NULL;
@@ -13,6 +13,10 @@
 ngx_os_io_t  ngx_io;
 
 
+#if (NGX_HAVE_REUSEPORT_CBPF)
+static void ngx_set_incoming_cpu_filter(ngx_cycle_t *cycle,
+    ngx_listening_t *ls);
+#endif
 static void ngx_drain_connections(ngx_cycle_t *cycle);
 
 
@@ -835,6 +839,34 @@ ngx_configure_listening_sockets(ngx_cycle_t *cycle)
         }
 #endif
 
+#if (NGX_HAVE_REUSEPORT_CBPF)
+
+        /* the filter is shared by all sockets of a reuseport group */
+
+        if (ls[i].reuseport && ls[i].worker == 0) {
+
+            if (ls[i].incoming_cpu) {
+                ngx_set_incoming_cpu_filter(cycle, &ls[i]);
+
+#ifdef SO_DETACH_REUSEPORT_BPF
+            } else if (ls[i].previous && ls[i].previous->incoming_cpu) {
+                value = 0;
+
+                if (setsockopt(ls[i].fd, SOL_SOCKET, SO_DETACH_REUSEPORT_BPF,
+                               (const void *) &value, sizeof(int))
+                    == -1)
+                {
+                    ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                                  "setsockopt(SO_DETACH_REUSEPORT_BPF) "
+                                  "%V failed, ignored",
+                                  &ls[i].addr_text);
+                }
+#endif
+            }
+        }
+
+#endif
+
 #if 0
         if (1) {
             int tcp_nodelay = 1;
@@ -1017,6 +1049,103 @@ ngx_configure_listening_sockets(ngx_cycle_t *cycle)
 }
 
 
+#if (NGX_HAVE_REUSEPORT_CBPF)
+
+static void
+ngx_set_incoming_cpu_filter(ngx_cycle_t *cycle, ngx_listening_t *ls)
+{
+    ngx_int_t            n;
+    ngx_uint_t           cpu, nmask;
+    ngx_cpuset_t        *mask, seen;
+    ngx_core_conf_t     *ccf;
+    struct sock_fprog    prog;
+    struct sock_filter  *code, *pc;
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+
+    if (ccf->worker_processes < 2) {
+        return;
+    }
+
+    /*
+     * sockets of the group are indexed in the order they were opened,
+     * that is, by worker number; the program returns the number of
+     * the worker bound to the CPU which processed the packet, or
+     * the CPU number modulo the number of workers for other CPUs
+     */
+
+    nmask = 0;
+
+    for (n = 0; n < ccf->worker_processes; n++) {
+        mask = ngx_get_cycle_cpu_affinity(cycle, n);
+
+        if (mask) {
+            nmask += CPU_COUNT(mask);
+        }
+    }
+
+    if (2 * nmask + 3 > BPF_MAXINSNS) {
+        ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                      "too many CPUs in worker_cpu_affinity, "
+                      "incoming_cpu uses CPU numbers for %V",
+                      &ls->addr_text);
+        nmask = 0;
+    }
+
+    code = ngx_alloc((2 * nmask + 3) * sizeof(struct sock_filter), cycle->log);
+    if (code == NULL) {
+        return;
+    }
+
+    pc = code;
+
+    *pc++ = (struct sock_filter)
+                BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+
+    CPU_ZERO(&seen);
+
+    for (n = 0; nmask && n < ccf->worker_processes; n++) {
+        mask = ngx_get_cycle_cpu_affinity(cycle, n);
+
+        if (mask == NULL) {
+            continue;
+        }
+
+        for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (!CPU_ISSET(cpu, mask) || CPU_ISSET(cpu, &seen)) {
+                continue;
+            }
+
+            CPU_SET(cpu, &seen);
+
+            *pc++ = (struct sock_filter)
+                        BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, cpu, 0, 1);
+            *pc++ = (struct sock_filter) BPF_STMT(BPF_RET|BPF_K, n);
+        }
+    }
+
+    *pc++ = (struct sock_filter)
+                BPF_STMT(BPF_ALU|BPF_MOD|BPF_K, ccf->worker_processes);
+    *pc++ = (struct sock_filter) BPF_STMT(BPF_RET|BPF_A, 0);
+
+    prog.len = pc - code;
+    prog.filter = code;
+
+    if (setsockopt(ls->fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                   (const void *) &prog, sizeof(struct sock_fprog))
+        == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                      "setsockopt(SO_ATTACH_REUSEPORT_CBPF) %V failed, "
+                      "ignored", &ls->addr_text);
+    }
+
+    ngx_free(code);
+}
+
+#endif
+
+
 void
 ngx_close_listening_sockets(ngx_cycle_t *cycle)
 {
@@ -74,6 +74,9 @@ struct ngx_listening_s {
 #endif
     unsigned            reuseport:1;
     unsigned            add_reuseport:1;
+#if (NGX_HAVE_REUSEPORT_CBPF)
+    unsigned            incoming_cpu:1;
+#endif
     unsigned            keepalive:2;
 
     unsigned            deferred_accept:1;
@@ -119,6 +122,7 @@ typedef enum {
 #define NGX_LOWLEVEL_BUFFERED  0x0f
 #define NGX_SSL_BUFFERED       0x01
 #define NGX_HTTP_V2_BUFFERED   0x02
+#define NGX_IOURING_BUFFERED   0x04
 
 
 struct ngx_connection_s {
@@ -1342,6 +1342,7 @@ ngx_shared_memory_add(ngx_conf_t *cf, ngx_str_t *name, size_t size, void *tag)
     shm_zone->shm.name = *name;
     shm_zone->shm.exists = 0;
     shm_zone->init = NULL;
+    shm_zone->unlock = NULL;
     shm_zone->tag = tag;
     shm_zone->noreuse = 0;
 
@@ -25,11 +25,13 @@
 typedef struct ngx_shm_zone_s  ngx_shm_zone_t;
 
 typedef ngx_int_t (*ngx_shm_zone_init_pt) (ngx_shm_zone_t *zone, void *data);
+typedef void (*ngx_shm_zone_unlock_pt) (ngx_shm_zone_t *zone, ngx_pid_t pid);
 
 struct ngx_shm_zone_s {
     void                     *data;
     ngx_shm_t                 shm;
     ngx_shm_zone_init_pt      init;
+    ngx_shm_zone_unlock_pt    unlock;
     void                     *tag;
     void                     *sync;
     ngx_uint_t                noreuse;  /* unsigned  noreuse:1; */
@@ -97,6 +99,8 @@ typedef struct {
     ngx_int_t                 rlimit_nofile;
     off_t                     rlimit_core;
 
+    size_t                    pool_cache_size;
+
     int                       priority;
 
     ngx_uint_t                cpu_affinity_auto;
@@ -131,6 +135,7 @@ void ngx_reopen_files(ngx_cycle_t *cycle, ngx_uid_t user);
 char **ngx_set_environment(ngx_cycle_t *cycle, ngx_uint_t *last);
 ngx_pid_t ngx_exec_new_binary(ngx_cycle_t *cycle, char *const *argv);
 ngx_cpuset_t *ngx_get_cpu_affinity(ngx_uint_t n);
+ngx_cpuset_t *ngx_get_cycle_cpu_affinity(ngx_cycle_t *cycle, ngx_uint_t n);
 ngx_shm_zone_t *ngx_shared_memory_add(ngx_conf_t *cf, ngx_str_t *name,
     size_t size, void *tag);
 void ngx_set_shutdown_timer(ngx_cycle_t *cycle);
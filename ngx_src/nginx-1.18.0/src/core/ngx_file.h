@@ -45,6 +45,7 @@ struct ngx_file_s {
 typedef ngx_msec_t (*ngx_path_manager_pt) (void *data);
 typedef ngx_msec_t (*ngx_path_purger_pt) (void *data);
 typedef void (*ngx_path_loader_pt) (void *data);
+typedef void (*ngx_path_saver_pt) (void *data);
 
 
 typedef struct {
@@ -55,6 +56,7 @@ typedef struct {
     ngx_path_manager_pt        manager;
     ngx_path_purger_pt         purger;
     ngx_path_loader_pt         loader;
+    ngx_path_saver_pt          saver;
     void                      *data;
 
     u_char                    *conf_file;
@@ -118,6 +120,7 @@ struct ngx_tree_ctx_s {
     off_t                      fs_size;
     ngx_uint_t                 access;
     time_t                     mtime;
+    ngx_file_uniq_t            uniq;
 
     ngx_tree_init_handler_pt   init_handler;
     ngx_tree_handler_pt        file_handler;
@@ -13,6 +13,30 @@ static ngx_inline void *ngx_palloc_small(ngx_pool_t *pool, size_t size,
     ngx_uint_t align);
 static void *ngx_palloc_block(ngx_pool_t *pool, size_t size);
 static void *ngx_palloc_large(ngx_pool_t *pool, size_t size);
+static ngx_inline ngx_uint_t ngx_pool_cache_slot(size_t size);
+static void *ngx_pool_cache_alloc(size_t *size, ngx_log_t *log);
+static void ngx_pool_cache_free(void *p, size_t size);
+
+
+typedef struct ngx_pool_cache_block_s  ngx_pool_cache_block_t;
+
+struct ngx_pool_cache_block_s {
+    ngx_pool_cache_block_t  *next;
+};
+
+
+typedef struct {
+    ngx_pool_cache_block_t  *block;
+    ngx_uint_t               number;
+    ngx_uint_t               low;
+} ngx_pool_cache_slot_t;
+
+
+ngx_pool_cache_stat_t         ngx_pool_cache_stat;
+
+static ngx_pool_cache_slot_t  ngx_pool_cache[NGX_POOL_CACHE_SLOTS];
+static size_t                 ngx_pool_cache_max;
+static ngx_msec_t             ngx_pool_cache_trimmed;
 
 
 ngx_pool_t *
@@ -20,7 +44,7 @@ ngx_create_pool(size_t size, ngx_log_t *log)
 {
     ngx_pool_t  *p;
 
-    p = ngx_memalign(NGX_POOL_ALIGNMENT, size, log);
+    p = ngx_pool_cache_alloc(&size, log);
     if (p == NULL) {
         return NULL;
     }
@@ -82,12 +106,12 @@ ngx_destroy_pool(ngx_pool_t *pool)
 
     for (l = pool->large; l; l = l->next) {
         if (l->alloc) {
-            ngx_free(l->alloc);
+            ngx_pool_cache_free(l->alloc, l->size);
         }
     }
 
     for (p = pool, n = pool->d.next; /* void */; p = n, n = n->d.next) {
-        ngx_free(p);
+        ngx_pool_cache_free(p, (size_t) (p->d.end - (u_char *) p));
 
         if (n == NULL) {
             break;
@@ -104,7 +128,7 @@ ngx_reset_pool(ngx_pool_t *pool)
 
     for (l = pool->large; l; l = l->next) {
         if (l->alloc) {
-            ngx_free(l->alloc);
+            ngx_pool_cache_free(l->alloc, l->size);
         }
     }
 
@@ -183,7 +207,7 @@ ngx_palloc_block(ngx_pool_t *pool, size_t size)
 
     psize = (size_t) (pool->d.end - (u_char *) pool);
 
-    m = ngx_memalign(NGX_POOL_ALIGNMENT, psize, pool->log);
+    m = ngx_pool_cache_alloc(&psize, pool->log);
     if (m == NULL) {
         return NULL;
     }
@@ -217,7 +241,7 @@ ngx_palloc_large(ngx_pool_t *pool, size_t size)
     ngx_uint_t         n;
     ngx_pool_large_t  *large;
 
-    p = ngx_alloc(size, pool->log);
+    p = ngx_pool_cache_alloc(&size, pool->log);
     if (p == NULL) {
         return NULL;
     }
@@ -227,6 +251,7 @@ ngx_palloc_large(ngx_pool_t *pool, size_t size)
     for (large = pool->large; large; large = large->next) {
         if (large->alloc == NULL) {
             large->alloc = p;
+            large->size = size;
             return p;
         }
 
@@ -237,11 +262,12 @@ ngx_palloc_large(ngx_pool_t *pool, size_t size)
 
     large = ngx_palloc_small(pool, sizeof(ngx_pool_large_t), 1);
     if (large == NULL) {
-        ngx_free(p);
+        ngx_pool_cache_free(p, size);
         return NULL;
     }
 
     large->alloc = p;
+    large->size = size;
     large->next = pool->large;
     pool->large = large;
 
@@ -266,7 +292,10 @@ ngx_pmemalign(ngx_pool_t *pool, size_t size, size_t alignment)
         return NULL;
     }
 
+    /* blocks of arbitrary alignment are never cached */
+
     large->alloc = p;
+    large->size = 0;
     large->next = pool->large;
     pool->large = large;
 
@@ -283,7 +312,7 @@ ngx_pfree(ngx_pool_t *pool, void *p)
         if (p == l->alloc) {
             ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, pool->log, 0,
                            "free: %p", l->alloc);
-            ngx_free(l->alloc);
+            ngx_pool_cache_free(l->alloc, l->size);
             l->alloc = NULL;
 
             return NGX_OK;
@@ -401,30 +430,158 @@ ngx_pool_delete_file(void *data)
 }
 
 
-#if 0
+/*
+ * The cache is private to a process and is enabled in worker processes
+ * only.  The free lists are not locked: pools may only be created and
+ * destroyed by the thread running the event loop, thread pool tasks must
+ * not use them.
+ *
+ * With the cache enabled, cacheable sizes are rounded up to their class
+ * and the rounded size is returned to the caller, so it is known when
+ * the block is freed.  Blocks of other sizes, e.g., allocated by the
+ * master process with the cache disabled, are never cached.
+ */
+
+static ngx_inline ngx_uint_t
+ngx_pool_cache_slot(size_t size)
+{
+#if !(NGX_DEBUG_PALLOC)
+
+    ngx_uint_t  n;
+
+    if (size && size <= (size_t) 1 << NGX_POOL_CACHE_MAX_SHIFT) {
+
+        for (n = 0; size > (size_t) 1 << (n + NGX_POOL_CACHE_MIN_SHIFT); n++) {
+            /* void */
+        }
+
+        return n;
+    }
+
+#endif
+
+    return NGX_POOL_CACHE_SLOTS;
+}
+
 
 static void *
-ngx_get_cached_block(size_t size)
+ngx_pool_cache_alloc(size_t *size, ngx_log_t *log)
 {
-    void                     *p;
-    ngx_cached_block_slot_t  *slot;
+    ngx_uint_t               n;
+    ngx_pool_cache_slot_t   *slot;
+    ngx_pool_cache_block_t  *b;
 
-    if (ngx_cycle->cache == NULL) {
-        return NULL;
+    n = ngx_pool_cache_slot(*size);
+
+    if (n == NGX_POOL_CACHE_SLOTS || ngx_pool_cache_max == 0) {
+        return ngx_memalign(NGX_POOL_ALIGNMENT, *size, log);
     }
 
-    slot = &ngx_cycle->cache[(size + ngx_pagesize - 1) / ngx_pagesize];
+    *size = (size_t) 1 << (n + NGX_POOL_CACHE_MIN_SHIFT);
+    slot = &ngx_pool_cache[n];
+
+    if (slot->block) {
+        b = slot->block;
+        slot->block = b->next;
+
+        if (--slot->number < slot->low) {
+            slot->low = slot->number;
+        }
 
-    slot->tries++;
+        ngx_pool_cache_stat.hits++;
+        ngx_pool_cache_stat.size -= *size;
 
-    if (slot->number) {
-        p = slot->block;
-        slot->block = slot->block->next;
-        slot->number--;
-        return p;
+        return b;
     }
 
-    return NULL;
+    ngx_pool_cache_stat.misses++;
+
+    return ngx_memalign(NGX_POOL_ALIGNMENT, *size, log);
 }
 
-#endif
+
+static void
+ngx_pool_cache_free(void *p, size_t size)
+{
+    ngx_uint_t               n;
+    ngx_pool_cache_slot_t   *slot;
+    ngx_pool_cache_block_t  *b;
+
+    n = ngx_pool_cache_slot(size);
+
+    if (n == NGX_POOL_CACHE_SLOTS
+        || size != (size_t) 1 << (n + NGX_POOL_CACHE_MIN_SHIFT))
+    {
+        ngx_free(p);
+        return;
+    }
+
+    if (ngx_pool_cache_stat.size + size > ngx_pool_cache_max) {
+
+        if (ngx_pool_cache_max) {
+            ngx_pool_cache_stat.trimmed++;
+        }
+
+        ngx_free(p);
+        return;
+    }
+
+    slot = &ngx_pool_cache[n];
+
+    b = p;
+    b->next = slot->block;
+    slot->block = b;
+    slot->number++;
+
+    ngx_pool_cache_stat.size += size;
+}
+
+
+void
+ngx_pool_cache_init(size_t max)
+{
+    ngx_pool_cache_max = max;
+    ngx_pool_cache_trimmed = ngx_current_msec;
+}
+
+
+/*
+ * Blocks that stayed unused during the whole interval are beyond the
+ * high-water mark of the slot; half of them is released on every pass,
+ * so an idle worker gradually returns its cache to the system.
+ */
+
+void
+ngx_pool_cache_trim(void)
+{
+    ngx_uint_t               i, n;
+    ngx_pool_cache_slot_t   *slot;
+    ngx_pool_cache_block_t  *b;
+
+    if (ngx_pool_cache_stat.size == 0
+        || ngx_current_msec - ngx_pool_cache_trimmed
+           < NGX_POOL_CACHE_TRIM_INTERVAL)
+    {
+        return;
+    }
+
+    ngx_pool_cache_trimmed = ngx_current_msec;
+
+    for (i = 0; i < NGX_POOL_CACHE_SLOTS; i++) {
+        slot = &ngx_pool_cache[i];
+
+        for (n = slot->low - slot->low / 2; n; n--) {
+            b = slot->block;
+            slot->block = b->next;
+            slot->number--;
+
+            ngx_free(b);
+
+            ngx_pool_cache_stat.trimmed++;
+            ngx_pool_cache_stat.size -= (size_t) 1
+                                        << (i + NGX_POOL_CACHE_MIN_SHIFT);
+        }
+
+        slot->low = slot->number;
+    }
+}
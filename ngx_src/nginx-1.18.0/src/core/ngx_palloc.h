@@ -26,6 +26,17 @@
     ngx_align((sizeof(ngx_pool_t) + 2 * sizeof(ngx_pool_large_t)),            \
               NGX_POOL_ALIGNMENT)
 
+/*
+ * pool blocks and large allocations from 256 bytes up to 64K are
+ * rounded up to a power of two and recycled through per-process lists
+ */
+#define NGX_POOL_CACHE_MIN_SHIFT  8
+#define NGX_POOL_CACHE_MAX_SHIFT  16
+#define NGX_POOL_CACHE_SLOTS                                                  \
+    (NGX_POOL_CACHE_MAX_SHIFT - NGX_POOL_CACHE_MIN_SHIFT + 1)
+
+#define NGX_POOL_CACHE_TRIM_INTERVAL  10000
+
 
 typedef void (*ngx_pool_cleanup_pt)(void *data);
 
@@ -43,6 +54,7 @@ typedef struct ngx_pool_large_s  ngx_pool_large_t;
 struct ngx_pool_large_s {
     ngx_pool_large_t     *next;
     void                 *alloc;
+    size_t                size;
 };
 
 
@@ -65,6 +77,14 @@ struct ngx_pool_s {
 };
 
 
+typedef struct {
+    ngx_uint_t            hits;
+    ngx_uint_t            misses;
+    ngx_uint_t            trimmed;
+    size_t                size;
+} ngx_pool_cache_stat_t;
+
+
 typedef struct {
     ngx_fd_t              fd;
     u_char               *name;
@@ -88,5 +108,11 @@ void ngx_pool_run_cleanup_file(ngx_pool_t *p, ngx_fd_t fd);
 void ngx_pool_cleanup_file(void *data);
 void ngx_pool_delete_file(void *data);
 
+void ngx_pool_cache_init(size_t max);
+void ngx_pool_cache_trim(void);
+
+
+extern ngx_pool_cache_stat_t  ngx_pool_cache_stat;
+
 
 #endif /* _NGX_PALLOC_H_INCLUDED_ */
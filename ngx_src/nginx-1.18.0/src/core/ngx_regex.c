@@ -14,12 +14,26 @@ typedef struct {
 } ngx_regex_conf_t;
 
 
+#define NGX_REGEX_SET_BITS    (8 * sizeof(ngx_uint_t))
+#define NGX_REGEX_SET_NONE    ((ngx_uint_t) -1)
+
+#define ngx_regex_set_mark(bits, i)                                          \
+    (bits)[(i) / NGX_REGEX_SET_BITS] |=                                      \
+                                   (ngx_uint_t) 1 << ((i) % NGX_REGEX_SET_BITS)
+
+
 static void * ngx_libc_cdecl ngx_regex_malloc(size_t size);
 static void ngx_libc_cdecl ngx_regex_free(void *p);
 #if (NGX_HAVE_PCRE_JIT)
 static void ngx_pcre_free_studies(void *data);
 #endif
 
+static ngx_int_t ngx_regex_set_literal(ngx_str_t *pattern, ngx_str_t *literal);
+static u_char *ngx_regex_set_skip_class(u_char *p, u_char *last);
+static u_char *ngx_regex_set_skip_group(u_char *p, u_char *last);
+static u_char *ngx_regex_set_quantifier(u_char *p, u_char *last,
+    ngx_int_t *min);
+
 static ngx_int_t ngx_regex_module_init(ngx_cycle_t *cycle);
 
 static void *ngx_regex_create_conf(ngx_cycle_t *cycle);
@@ -227,6 +241,528 @@ ngx_regex_exec_array(ngx_array_t *a, ngx_str_t *s, ngx_log_t *log)
 }
 
 
+ngx_regex_set_t *
+ngx_regex_set_init(ngx_pool_t *pool, ngx_pool_t *temp_pool,
+    ngx_str_t *patterns, ngx_uint_t n)
+{
+    u_char            *p, used[256];
+    uint32_t          *next, *fail, *queue, s, t, f;
+    ngx_uint_t         i, c, nc, total, nstates, head, tail;
+    ngx_str_t         *literals;
+    ngx_regex_set_t   *set;
+
+    set = ngx_pcalloc(pool, sizeof(ngx_regex_set_t));
+    if (set == NULL) {
+        return NULL;
+    }
+
+    set->nelts = n;
+    set->nwords = (n + NGX_REGEX_SET_BITS - 1) / NGX_REGEX_SET_BITS;
+
+    set->always = ngx_pcalloc(pool, set->nwords * sizeof(ngx_uint_t));
+    if (set->always == NULL) {
+        return NULL;
+    }
+
+    set->candidates = ngx_palloc(pool, set->nwords * sizeof(ngx_uint_t));
+    if (set->candidates == NULL) {
+        return NULL;
+    }
+
+    literals = ngx_palloc(temp_pool, n * sizeof(ngx_str_t));
+    if (literals == NULL) {
+        return NULL;
+    }
+
+    ngx_memzero(used, sizeof(used));
+    total = 0;
+
+    for (i = 0; i < n; i++) {
+
+        literals[i].data = ngx_pnalloc(temp_pool, patterns[i].len + 1);
+        if (literals[i].data == NULL) {
+            return NULL;
+        }
+
+        if (ngx_regex_set_literal(&patterns[i], &literals[i]) != NGX_OK) {
+            literals[i].len = 0;
+            ngx_regex_set_mark(set->always, i);
+            continue;
+        }
+
+        for (p = literals[i].data; p < literals[i].data + literals[i].len; p++)
+        {
+            used[*p] = 1;
+        }
+
+        total += literals[i].len;
+    }
+
+    /*
+     * bytes which occur in literals get their own classes, uppercase
+     * letters share the classes of lowercase ones, class 0 is for the rest
+     */
+
+    nc = 1;
+
+    for (c = 0; c < 256; c++) {
+        if (used[c]) {
+            set->classes[c] = (u_char) nc++;
+        }
+    }
+
+    for (c = 'A'; c <= 'Z'; c++) {
+        set->classes[c] = set->classes[c | 0x20];
+    }
+
+    set->nclasses = nc;
+
+    /* the trie: state 0 is the root, a zero transition means none yet */
+
+    next = ngx_pcalloc(temp_pool, (total + 1) * nc * sizeof(uint32_t));
+    if (next == NULL) {
+        return NULL;
+    }
+
+    set->out = ngx_palloc(pool, (total + 1) * sizeof(ngx_uint_t));
+    if (set->out == NULL) {
+        return NULL;
+    }
+
+    set->out_next = ngx_palloc(pool, n * sizeof(ngx_uint_t));
+    if (set->out_next == NULL) {
+        return NULL;
+    }
+
+    for (i = 0; i < total + 1; i++) {
+        set->out[i] = NGX_REGEX_SET_NONE;
+    }
+
+    nstates = 1;
+
+    for (i = 0; i < n; i++) {
+
+        if (literals[i].len == 0) {
+            continue;
+        }
+
+        s = 0;
+
+        for (p = literals[i].data; p < literals[i].data + literals[i].len; p++)
+        {
+            c = set->classes[*p];
+            t = next[s * nc + c];
+
+            if (t == 0) {
+                t = nstates++;
+                next[s * nc + c] = t;
+            }
+
+            s = t;
+        }
+
+        set->out_next[i] = set->out[s];
+        set->out[s] = i;
+    }
+
+    /*
+     * turn the trie into an automaton: states are visited breadth-first,
+     * so failure transitions of shorter prefixes are already complete
+     */
+
+    fail = ngx_pcalloc(temp_pool, nstates * sizeof(uint32_t));
+    queue = ngx_palloc(temp_pool, nstates * sizeof(uint32_t));
+    set->dict = ngx_pcalloc(pool, nstates * sizeof(uint32_t));
+
+    if (fail == NULL || queue == NULL || set->dict == NULL) {
+        return NULL;
+    }
+
+    head = 0;
+    tail = 0;
+
+    for (c = 0; c < nc; c++) {
+        t = next[c];
+
+        if (t) {
+            queue[tail++] = t;
+        }
+    }
+
+    while (head < tail) {
+        s = queue[head++];
+
+        for (c = 0; c < nc; c++) {
+            t = next[s * nc + c];
+            f = next[fail[s] * nc + c];
+
+            if (t == 0) {
+                next[s * nc + c] = f;
+                continue;
+            }
+
+            fail[t] = f;
+            set->dict[t] = (set->out[f] != NGX_REGEX_SET_NONE) ? f
+                                                               : set->dict[f];
+            queue[tail++] = t;
+        }
+    }
+
+    set->nstates = nstates;
+
+    set->next = ngx_palloc(pool, nstates * nc * sizeof(uint32_t));
+    if (set->next == NULL) {
+        return NULL;
+    }
+
+    ngx_memcpy(set->next, next, nstates * nc * sizeof(uint32_t));
+
+    return set;
+}
+
+
+ngx_uint_t *
+ngx_regex_set_match(ngx_regex_set_t *set, ngx_str_t *s)
+{
+    u_char      *p, *last;
+    uint32_t     state, t;
+    ngx_uint_t   k, *cand;
+
+    cand = set->candidates;
+
+    ngx_memcpy(cand, set->always, set->nwords * sizeof(ngx_uint_t));
+
+    if (set->nstates == 1) {
+        return cand;
+    }
+
+    state = 0;
+    last = s->data + s->len;
+
+    for (p = s->data; p < last; p++) {
+
+        state = set->next[state * set->nclasses + set->classes[*p]];
+
+        for (t = state; t; t = set->dict[t]) {
+
+            for (k = set->out[t];
+                 k != NGX_REGEX_SET_NONE;
+                 k = set->out_next[k])
+            {
+                ngx_regex_set_mark(cand, k);
+            }
+        }
+    }
+
+    return cand;
+}
+
+
+/*
+ * finds the longest run of literal bytes every match of the pattern
+ * has to contain; anything the parser is not sure about stops the run,
+ * and a pattern it cannot follow gets no literal at all
+ */
+
+static ngx_int_t
+ngx_regex_set_literal(ngx_str_t *pattern, ngx_str_t *literal)
+{
+    u_char      *p, *q, *last, *run, ch;
+    size_t       len, best;
+    ngx_int_t    min;
+    ngx_uint_t   lit, quant;
+
+    p = pattern->data;
+    last = p + pattern->len;
+
+    /* comments and the extended syntax are not followed */
+
+    for (q = p; q + 1 < last; q++) {
+
+        if (q[0] != '(' || q[1] != '?') {
+            continue;
+        }
+
+        for (q += 2; q < last && *q != ':' && *q != ')'; q++) {
+            if (*q == '#' || *q == 'x') {
+                return NGX_DECLINED;
+            }
+        }
+    }
+
+    /* the best run is kept at the start of literal->data, the current after */
+
+    run = literal->data;
+    len = 0;
+    best = 0;
+    ch = '\0';
+
+    while (p < last) {
+
+        lit = 0;
+
+        switch (*p) {
+
+        case '\\':
+            if (p + 1 == last) {
+                return NGX_DECLINED;
+            }
+
+            if ((p[1] >= '0' && p[1] <= '9')
+                || ((p[1] | 0x20) >= 'a' && (p[1] | 0x20) <= 'z'))
+            {
+                /* only escapes which do not consume anything after them */
+
+                if (ngx_strchr("dDwWsShHvVbBAzZtnrfea", p[1]) == NULL) {
+                    return NGX_DECLINED;
+                }
+
+            } else if (p[1] < 0x80) {
+                ch = p[1];
+                lit = 1;
+            }
+
+            p += 2;
+            break;
+
+        case '[':
+            p = ngx_regex_set_skip_class(p, last);
+            if (p == NULL) {
+                return NGX_DECLINED;
+            }
+
+            break;
+
+        case '(':
+            p = ngx_regex_set_skip_group(p, last);
+            if (p == NULL) {
+                return NGX_DECLINED;
+            }
+
+            break;
+
+        case '.':
+        case '^':
+        case '$':
+            p++;
+            break;
+
+        case '{':
+            if (ngx_regex_set_quantifier(p, last, &min) != NULL) {
+                return NGX_DECLINED;
+            }
+
+            ch = '{';
+            lit = 1;
+            p++;
+            break;
+
+        case '|':
+        case ')':
+        case '*':
+        case '+':
+        case '?':
+            return NGX_DECLINED;
+
+        default:
+            if (*p < 0x80) {
+                ch = *p;
+                lit = 1;
+            }
+
+            p++;
+        }
+
+        min = 1;
+        quant = 0;
+
+        if (p < last) {
+
+            if (*p == '?' || *p == '*') {
+                min = 0;
+                quant = 1;
+                p++;
+
+            } else if (*p == '+') {
+                quant = 1;
+                p++;
+
+            } else if (*p == '{') {
+                q = ngx_regex_set_quantifier(p, last, &min);
+
+                if (q) {
+                    quant = 1;
+                    p = q;
+                }
+            }
+
+            if (quant && p < last && (*p == '?' || *p == '+')) {
+                p++;
+            }
+        }
+
+        if (lit && min > 0) {
+            run[best + len++] = ngx_tolower(ch);
+        }
+
+        if (lit && !quant) {
+            continue;
+        }
+
+        if (len > best) {
+            ngx_memmove(run, run + best, len);
+            best = len;
+        }
+
+        len = 0;
+    }
+
+    if (len > best) {
+        ngx_memmove(run, run + best, len);
+        best = len;
+    }
+
+    if (best < 2) {
+        return NGX_DECLINED;
+    }
+
+    literal->len = best;
+
+    return NGX_OK;
+}
+
+
+static u_char *
+ngx_regex_set_skip_class(u_char *p, u_char *last)
+{
+    p++;
+
+    if (p < last && *p == '^') {
+        p++;
+    }
+
+    if (p < last && *p == ']') {
+        p++;
+    }
+
+    while (p < last) {
+
+        switch (*p) {
+
+        case '\\':
+            if (p + 1 < last && (p[1] == 'Q' || p[1] == 'c')) {
+                return NULL;
+            }
+
+            p += 2;
+            break;
+
+        case '[':
+            /* POSIX classes are not followed */
+            return NULL;
+
+        case ']':
+            return p + 1;
+
+        default:
+            p++;
+        }
+    }
+
+    return NULL;
+}
+
+
+static u_char *
+ngx_regex_set_skip_group(u_char *p, u_char *last)
+{
+    ngx_uint_t  depth;
+
+    depth = 0;
+
+    while (p < last) {
+
+        switch (*p) {
+
+        case '\\':
+            if (p + 1 < last && (p[1] == 'Q' || p[1] == 'c')) {
+                return NULL;
+            }
+
+            p += 2;
+            break;
+
+        case '[':
+            p = ngx_regex_set_skip_class(p, last);
+            if (p == NULL) {
+                return NULL;
+            }
+
+            break;
+
+        case '(':
+            depth++;
+            p++;
+            break;
+
+        case ')':
+            p++;
+
+            if (--depth == 0) {
+                return p;
+            }
+
+            break;
+
+        default:
+            p++;
+        }
+    }
+
+    return NULL;
+}
+
+
+static u_char *
+ngx_regex_set_quantifier(u_char *p, u_char *last, ngx_int_t *min)
+{
+    ngx_int_t  n;
+
+    /* "{n}", "{n,}", and "{n,m}" */
+
+    p++;
+    n = 0;
+
+    if (p == last || *p < '0' || *p > '9') {
+        return NULL;
+    }
+
+    while (p < last && *p >= '0' && *p <= '9') {
+        n = n * 10 + (*p++ - '0');
+
+        if (n > 65535) {
+            return NULL;
+        }
+    }
+
+    if (p < last && *p == ',') {
+        p++;
+
+        while (p < last && *p >= '0' && *p <= '9') {
+            p++;
+        }
+    }
+
+    if (p == last || *p != '}') {
+        return NULL;
+    }
+
+    *min = n;
+
+    return p + 1;
+}
+
+
 static void * ngx_libc_cdecl
 ngx_regex_malloc(size_t size)
 {
@@ -46,6 +46,31 @@ typedef struct {
 } ngx_regex_elt_t;
 
 
+/*
+ * a literal prefilter for an ordered list of regular expressions:
+ * a required literal of each pattern is added to an Aho-Corasick automaton,
+ * and a single pass over a subject yields the patterns that may match it
+ */
+
+#define NGX_REGEX_SET_MIN     8
+
+typedef struct {
+    ngx_uint_t    nelts;
+    ngx_uint_t    nwords;
+    ngx_uint_t   *always;
+    ngx_uint_t   *candidates;
+
+    ngx_uint_t    nstates;
+    ngx_uint_t    nclasses;
+    uint32_t     *next;
+    uint32_t     *dict;
+    ngx_uint_t   *out;
+    ngx_uint_t   *out_next;
+
+    u_char        classes[256];
+} ngx_regex_set_t;
+
+
 void ngx_regex_init(void);
 ngx_int_t ngx_regex_compile(ngx_regex_compile_t *rc);
 
@@ -56,5 +81,13 @@ ngx_int_t ngx_regex_compile(ngx_regex_compile_t *rc);
 
 ngx_int_t ngx_regex_exec_array(ngx_array_t *a, ngx_str_t *s, ngx_log_t *log);
 
+ngx_regex_set_t *ngx_regex_set_init(ngx_pool_t *pool, ngx_pool_t *temp_pool,
+    ngx_str_t *patterns, ngx_uint_t n);
+ngx_uint_t *ngx_regex_set_match(ngx_regex_set_t *set, ngx_str_t *s);
+
+#define ngx_regex_set_candidate(cand, i)                                     \
+    ((cand)[(i) / (8 * sizeof(ngx_uint_t))]                                  \
+     & ((ngx_uint_t) 1 << ((i) % (8 * sizeof(ngx_uint_t)))))
+
 
 #endif /* _NGX_REGEX_H_INCLUDED_ */
@@ -0,0 +1,2181 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+
+/*
+ * The low bits of the user_data of a submission are used to distinguish
+ * the kind of the request: the bit 0 is the event instance as in epoll,
+ * the bits 1 and 2 are the request type.  ngx_event_t and ngx_iouring_op_t
+ * are always aligned at least to a pointer size, so the bits are free.
+ * Completions of requests posted with NGX_IOURING_OP and no operation
+ * are ignored.
+ */
+
+#define NGX_IOURING_POLL      0
+#define NGX_IOURING_AIO       2
+#define NGX_IOURING_NOTIFY    4
+#define NGX_IOURING_OP        6
+
+#define NGX_IOURING_TYPE      6
+
+
+#if (NGX_HAVE_IOURING_BUF_RING)
+
+/*
+ * Listening sockets keep several accept requests posted, and accepted
+ * sockets are passed to ngx_event_accept() instead of calling accept4().
+ *
+ * The recv() and send() calls are completion based only for connections
+ * passed to ngx_iouring_set_io(), as nothing else may read from such
+ * a socket: currently plain http client connections.  A receive request is posted instead
+ * of a readiness poll and the data are read into a buffer provided by
+ * the ring, then ngx_iouring_recv() copies the data to the caller buffer.
+ * Memory buffers being sent are copied to a buffer owned by the request,
+ * as ngx_send_chain() callers reuse their buffers as soon as the call
+ * returns, and the connection stays NGX_IOURING_BUFFERED until the send
+ * completes.  File buffers are sent with sendfile() once no send is pending.
+ */
+
+#define NGX_IOURING_BGID      0
+
+
+typedef struct ngx_iouring_op_s  ngx_iouring_op_t;
+
+typedef void (*ngx_iouring_handler_pt)(ngx_iouring_op_t *op,
+    struct io_uring_cqe *cqe, ngx_uint_t flags);
+
+struct ngx_iouring_op_s {
+    ngx_iouring_handler_pt    handler;
+    ngx_connection_t         *connection;
+    ngx_iouring_op_t         *next;
+    ngx_queue_t               queue;
+
+    u_char                   *start;
+    u_char                   *pos;
+    u_char                   *last;
+
+    ngx_sockaddr_t            sockaddr;
+    socklen_t                 socklen;
+    int                       res;
+};
+
+
+typedef struct {
+    ngx_iouring_op_t         *recv;
+    ngx_iouring_op_t         *send;
+
+    u_char                   *pos;
+    size_t                    size;
+    ngx_uint_t                bid;
+
+    ngx_err_t                 recv_err;
+    ngx_err_t                 send_err;
+
+    ngx_queue_t               accepting;
+    ngx_queue_t               accepted;
+    ngx_uint_t                accepts;
+
+    unsigned                  io:1;
+    unsigned                  listening:1;
+    unsigned                  nonempty:1;
+    unsigned                  eof:1;
+    unsigned                  nobufs:1;
+} ngx_iouring_conn_t;
+
+#endif
+
+
+typedef struct {
+    ngx_uint_t            entries;
+    ngx_uint_t            accepts;
+    ngx_bufs_t            buffers;
+} ngx_iouring_conf_t;
+
+
+typedef struct {
+    uint32_t             *head;
+    uint32_t             *tail;
+    uint32_t             *ring_mask;
+    uint32_t             *ring_entries;
+    uint32_t             *array;
+    struct io_uring_sqe  *sqes;
+    uint32_t              local_tail;
+    ngx_uint_t            pending;
+} ngx_iouring_sq_t;
+
+
+typedef struct {
+    uint32_t             *head;
+    uint32_t             *tail;
+    uint32_t             *ring_mask;
+    struct io_uring_cqe  *cqes;
+} ngx_iouring_cq_t;
+
+
+static ngx_int_t ngx_iouring_init(ngx_cycle_t *cycle, ngx_msec_t timer);
+static ngx_int_t ngx_iouring_setup(ngx_cycle_t *cycle,
+    ngx_iouring_conf_t *urcf);
+#if (NGX_HAVE_EVENTFD)
+static ngx_int_t ngx_iouring_notify_init(ngx_log_t *log);
+static void ngx_iouring_notify_handler(ngx_event_t *ev);
+#endif
+static void ngx_iouring_done(ngx_cycle_t *cycle);
+static struct io_uring_sqe *ngx_iouring_get_sqe(ngx_log_t *log);
+static ngx_int_t ngx_iouring_submit(ngx_log_t *log);
+static ngx_int_t ngx_iouring_poll(ngx_event_t *ev, int fd, uint32_t events,
+    uint64_t data);
+static ngx_int_t ngx_iouring_add_event(ngx_event_t *ev, ngx_int_t event,
+    ngx_uint_t flags);
+static ngx_int_t ngx_iouring_del_event(ngx_event_t *ev, ngx_int_t event,
+    ngx_uint_t flags);
+#if (NGX_HAVE_EVENTFD)
+static ngx_int_t ngx_iouring_notify(ngx_event_handler_pt handler);
+#endif
+static ngx_int_t ngx_iouring_process_events(ngx_cycle_t *cycle,
+    ngx_msec_t timer, ngx_uint_t flags);
+static void ngx_iouring_process_poll(ngx_cycle_t *cycle,
+    struct io_uring_cqe *cqe, ngx_uint_t flags);
+
+#if (NGX_HAVE_IOURING_BUF_RING)
+static ngx_int_t ngx_iouring_buffers_init(ngx_cycle_t *cycle,
+    ngx_iouring_conf_t *urcf);
+static void ngx_iouring_recycle_buffer(ngx_uint_t bid);
+static ngx_iouring_conn_t *ngx_iouring_conn(ngx_connection_t *c);
+static ngx_iouring_op_t *ngx_iouring_get_op(ngx_log_t *log);
+static void ngx_iouring_free_op(ngx_iouring_op_t *op);
+static ngx_int_t ngx_iouring_cancel(ngx_iouring_op_t *op, ngx_log_t *log);
+static ngx_int_t ngx_iouring_del_connection(ngx_connection_t *c,
+    ngx_uint_t flags);
+static void ngx_iouring_detach(ngx_connection_t *c, ngx_iouring_conn_t *st);
+
+static ngx_int_t ngx_iouring_add_accept(ngx_event_t *ev,
+    ngx_iouring_conn_t *st, ngx_uint_t flags);
+static ngx_int_t ngx_iouring_del_accept(ngx_event_t *ev,
+    ngx_iouring_conn_t *st, ngx_uint_t flags);
+static ngx_int_t ngx_iouring_post_accept(ngx_connection_t *lc,
+    ngx_iouring_conn_t *st, ngx_iouring_op_t *op);
+static void ngx_iouring_accept_handler(ngx_iouring_op_t *op,
+    struct io_uring_cqe *cqe, ngx_uint_t flags);
+
+static ngx_int_t ngx_iouring_add_io_event(ngx_event_t *ev,
+    ngx_iouring_conn_t *st, ngx_uint_t flags);
+static ngx_int_t ngx_iouring_post_recv(ngx_connection_t *c,
+    ngx_iouring_conn_t *st);
+static void ngx_iouring_recv_handler(ngx_iouring_op_t *op,
+    struct io_uring_cqe *cqe, ngx_uint_t flags);
+static ngx_int_t ngx_iouring_post_send(ngx_connection_t *c,
+    ngx_iouring_op_t *op);
+static void ngx_iouring_send_handler(ngx_iouring_op_t *op,
+    struct io_uring_cqe *cqe, ngx_uint_t flags);
+
+static ssize_t ngx_iouring_recv(ngx_connection_t *c, u_char *buf,
+    size_t size);
+static ssize_t ngx_iouring_recv_chain(ngx_connection_t *c, ngx_chain_t *in,
+    off_t limit);
+static ssize_t ngx_iouring_send(ngx_connection_t *c, u_char *buf,
+    size_t size);
+static ngx_chain_t *ngx_iouring_send_chain(ngx_connection_t *c,
+    ngx_chain_t *in, off_t limit);
+#endif
+
+static void *ngx_iouring_create_conf(ngx_cycle_t *cycle);
+static char *ngx_iouring_init_conf(ngx_cycle_t *cycle, void *conf);
+
+
+static int                        ring = -1;
+static u_char                    *sq_ring;
+static size_t                     sq_ring_size;
+static u_char                    *cq_ring;
+static size_t                     cq_ring_size;
+static size_t                     sqes_size;
+static ngx_iouring_sq_t           sq;
+static ngx_iouring_cq_t           cq;
+static struct __kernel_timespec   wait_ts;
+
+#if (NGX_HAVE_EVENTFD)
+static int                        notify_fd = -1;
+static ngx_event_t                notify_event;
+static ngx_connection_t           notify_conn;
+#endif
+
+#if (NGX_HAVE_FILE_AIO)
+ngx_uint_t                        ngx_iouring_aio;
+#endif
+
+#if (NGX_HAVE_IOURING_BUF_RING)
+static struct io_uring_buf_ring  *buf_ring;
+static u_char                    *buf_data;
+static size_t                     buf_size;
+static ngx_uint_t                 buf_mask;
+static uint16_t                   buf_tail;
+static ngx_iouring_conn_t        *conns;
+static ngx_uint_t                 nconns;
+static ngx_iouring_op_t          *free_ops;
+static ngx_uint_t                 accepts;
+
+ngx_uint_t                        ngx_use_iouring_io;
+#endif
+
+
+static ngx_str_t      iouring_name = ngx_string("io_uring");
+
+static ngx_command_t  ngx_iouring_commands[] = {
+
+    { ngx_string("io_uring_entries"),
+      NGX_EVENT_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      0,
+      offsetof(ngx_iouring_conf_t, entries),
+      NULL },
+
+    { ngx_string("io_uring_accepts"),
+      NGX_EVENT_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      0,
+      offsetof(ngx_iouring_conf_t, accepts),
+      NULL },
+
+    { ngx_string("io_uring_buffers"),
+      NGX_EVENT_CONF|NGX_CONF_TAKE2,
+      ngx_conf_set_bufs_slot,
+      0,
+      offsetof(ngx_iouring_conf_t, buffers),
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_event_module_t  ngx_iouring_module_ctx = {
+    &iouring_name,
+    ngx_iouring_create_conf,             /* create configuration */
+    ngx_iouring_init_conf,               /* init configuration */
+
+    {
+        ngx_iouring_add_event,           /* add an event */
+        ngx_iouring_del_event,           /* delete an event */
+        ngx_iouring_add_event,           /* enable an event */
+        ngx_iouring_del_event,           /* disable an event */
+        NULL,                            /* add an connection */
+#if (NGX_HAVE_IOURING_BUF_RING)
+        ngx_iouring_del_connection,      /* delete an connection */
+#else
+        NULL,                            /* delete an connection */
+#endif
+#if (NGX_HAVE_EVENTFD)
+        ngx_iouring_notify,              /* trigger a notify */
+#else
+        NULL,                            /* trigger a notify */
+#endif
+        ngx_iouring_process_events,      /* process the events */
+        ngx_iouring_init,                /* init the events */
+        ngx_iouring_done,                /* done the events */
+    }
+};
+
+ngx_module_t  ngx_iouring_module = {
+    NGX_MODULE_V1,
+    &ngx_iouring_module_ctx,             /* module context */
+    ngx_iouring_commands,                /* module directives */
+    NGX_EVENT_MODULE,                    /* module type */
+    NULL,                                /* init master */
+    NULL,                                /* init module */
+    NULL,                                /* init process */
+    NULL,                                /* init thread */
+    NULL,                                /* exit thread */
+    NULL,                                /* exit process */
+    NULL,                                /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+/*
+ * We call io_uring_setup() and io_uring_enter() directly as syscalls
+ * instead of liburing usage, as it is done for Linux AIO.
+ */
+
+static int
+io_uring_setup(u_int entries, struct io_uring_params *p)
+{
+    return syscall(SYS_io_uring_setup, entries, p);
+}
+
+
+static int
+io_uring_enter(int fd, u_int to_submit, u_int min_complete, u_int flags)
+{
+    return syscall(SYS_io_uring_enter, fd, to_submit, min_complete, flags,
+                   NULL, 0);
+}
+
+
+#if (NGX_HAVE_IOURING_BUF_RING)
+
+static int
+io_uring_register(int fd, u_int opcode, void *arg, u_int nr_args)
+{
+    return syscall(SYS_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_iouring_init(ngx_cycle_t *cycle, ngx_msec_t timer)
+{
+    ngx_iouring_conf_t  *urcf;
+
+    urcf = ngx_event_get_conf(cycle->conf_ctx, ngx_iouring_module);
+
+    if (ring == -1) {
+        if (ngx_iouring_setup(cycle, urcf) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+#if (NGX_HAVE_EVENTFD)
+        if (ngx_iouring_notify_init(cycle->log) != NGX_OK) {
+            ngx_iouring_module_ctx.actions.notify = NULL;
+        }
+#endif
+
+#if (NGX_HAVE_IOURING_BUF_RING)
+        if (ngx_iouring_buffers_init(cycle, urcf) != NGX_OK) {
+            ngx_iouring_module_ctx.actions.del_conn = NULL;
+        }
+#endif
+    }
+
+    ngx_io = ngx_os_io;
+
+    ngx_event_actions = ngx_iouring_module_ctx.actions;
+
+    /*
+     * multishot poll requests stay armed after a notification
+     * and report every readiness change like EPOLLET
+     */
+
+    ngx_event_flags = NGX_USE_CLEAR_EVENT|NGX_USE_GREEDY_EVENT;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_iouring_setup(ngx_cycle_t *cycle, ngx_iouring_conf_t *urcf)
+{
+    struct io_uring_params  p;
+
+    ngx_memzero(&p, sizeof(struct io_uring_params));
+
+    ring = io_uring_setup(urcf->entries, &p);
+
+    if (ring == -1) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                      "io_uring_setup() failed");
+        return NGX_ERROR;
+    }
+
+    sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_ring_size = ngx_max(sq_ring_size, cq_ring_size);
+        cq_ring_size = sq_ring_size;
+    }
+
+    sq_ring = mmap(NULL, sq_ring_size, PROT_READ|PROT_WRITE,
+                   MAP_SHARED|MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+
+    if (sq_ring == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                      "mmap(IORING_OFF_SQ_RING) failed");
+        goto failed;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ring = sq_ring;
+
+    } else {
+        cq_ring = mmap(NULL, cq_ring_size, PROT_READ|PROT_WRITE,
+                       MAP_SHARED|MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+
+        if (cq_ring == MAP_FAILED) {
+            ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                          "mmap(IORING_OFF_CQ_RING) failed");
+            goto failed;
+        }
+    }
+
+    sq.sqes = mmap(NULL, sqes_size, PROT_READ|PROT_WRITE,
+                   MAP_SHARED|MAP_POPULATE, ring, IORING_OFF_SQES);
+
+    if (sq.sqes == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                      "mmap(IORING_OFF_SQES) failed");
+        goto failed;
+    }
+
+    sq.head = (uint32_t *) (sq_ring + p.sq_off.head);
+    sq.tail = (uint32_t *) (sq_ring + p.sq_off.tail);
+    sq.ring_mask = (uint32_t *) (sq_ring + p.sq_off.ring_mask);
+    sq.ring_entries = (uint32_t *) (sq_ring + p.sq_off.ring_entries);
+    sq.array = (uint32_t *) (sq_ring + p.sq_off.array);
+    sq.local_tail = *sq.tail;
+    sq.pending = 0;
+
+    cq.head = (uint32_t *) (cq_ring + p.cq_off.head);
+    cq.tail = (uint32_t *) (cq_ring + p.cq_off.tail);
+    cq.ring_mask = (uint32_t *) (cq_ring + p.cq_off.ring_mask);
+    cq.cqes = (struct io_uring_cqe *) (cq_ring + p.cq_off.cqes);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "io_uring: fd:%d sq:%uD cq:%uD",
+                   ring, p.sq_entries, p.cq_entries);
+
+#if (NGX_HAVE_FILE_AIO)
+
+    /*
+     * IORING_OP_READ appeared in Linux 5.6, IORING_FEAT_FAST_POLL in 5.7,
+     * so the latter is used to test if buffered file reads may be posted
+     */
+
+    if (p.features & IORING_FEAT_FAST_POLL) {
+        ngx_iouring_aio = 1;
+
+    } else {
+        ngx_iouring_aio = 0;
+        ngx_file_aio = 0;
+    }
+
+#endif
+
+    return NGX_OK;
+
+failed:
+
+    if (sq_ring && sq_ring != MAP_FAILED) {
+        (void) munmap(sq_ring, sq_ring_size);
+    }
+
+    if (cq_ring && cq_ring != MAP_FAILED && cq_ring != sq_ring) {
+        (void) munmap(cq_ring, cq_ring_size);
+    }
+
+    sq_ring = NULL;
+    cq_ring = NULL;
+
+    if (close(ring) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "io_uring close() failed");
+    }
+
+    ring = -1;
+
+    return NGX_ERROR;
+}
+
+
+#if (NGX_HAVE_EVENTFD)
+
+static ngx_int_t
+ngx_iouring_notify_init(ngx_log_t *log)
+{
+#if (NGX_HAVE_SYS_EVENTFD_H)
+    notify_fd = eventfd(0, 0);
+#else
+    notify_fd = syscall(SYS_eventfd, 0);
+#endif
+
+    if (notify_fd == -1) {
+        ngx_log_error(NGX_LOG_EMERG, log, ngx_errno, "eventfd() failed");
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "notify eventfd: %d", notify_fd);
+
+    notify_event.handler = ngx_iouring_notify_handler;
+    notify_event.log = log;
+    notify_event.active = 1;
+
+    notify_conn.fd = notify_fd;
+    notify_conn.read = &notify_event;
+    notify_conn.log = log;
+
+    if (ngx_iouring_poll(&notify_event, notify_fd, POLLIN,
+                         (uintptr_t) &notify_event | NGX_IOURING_NOTIFY)
+        != NGX_OK)
+    {
+        if (close(notify_fd) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                            "eventfd close() failed");
+        }
+
+        notify_fd = -1;
+
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_iouring_notify_handler(ngx_event_t *ev)
+{
+    ssize_t               n;
+    uint64_t              count;
+    ngx_err_t             err;
+    ngx_event_handler_pt  handler;
+
+    if (++ev->index == NGX_MAX_UINT32_VALUE) {
+        ev->index = 0;
+
+        n = read(notify_fd, &count, sizeof(uint64_t));
+
+        err = ngx_errno;
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                       "read() eventfd %d: %z count:%uL", notify_fd, n, count);
+
+        if ((size_t) n != sizeof(uint64_t)) {
+            ngx_log_error(NGX_LOG_ALERT, ev->log, err,
+                          "read() eventfd %d failed", notify_fd);
+        }
+    }
+
+    handler = ev->data;
+    handler(ev);
+}
+
+#endif
+
+
+static void
+ngx_iouring_done(ngx_cycle_t *cycle)
+{
+#if (NGX_HAVE_IOURING_BUF_RING)
+    ngx_iouring_op_t  *op;
+#endif
+
+    (void) munmap(sq.sqes, sqes_size);
+
+    if (cq_ring != sq_ring) {
+        (void) munmap(cq_ring, cq_ring_size);
+    }
+
+    (void) munmap(sq_ring, sq_ring_size);
+
+    sq_ring = NULL;
+    cq_ring = NULL;
+
+    if (close(ring) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "io_uring close() failed");
+    }
+
+    ring = -1;
+
+#if (NGX_HAVE_EVENTFD)
+
+    if (notify_fd != -1 && close(notify_fd) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "eventfd close() failed");
+    }
+
+    notify_fd = -1;
+
+#endif
+
+#if (NGX_HAVE_FILE_AIO)
+    ngx_iouring_aio = 0;
+#endif
+
+#if (NGX_HAVE_IOURING_BUF_RING)
+
+    if (buf_ring) {
+        ngx_free(buf_ring);
+        ngx_free(buf_data);
+        ngx_free(conns);
+    }
+
+    while (free_ops) {
+        op = free_ops;
+        free_ops = op->next;
+
+        if (op->start) {
+            ngx_free(op->start);
+        }
+
+        ngx_free(op);
+    }
+
+    buf_ring = NULL;
+    buf_data = NULL;
+    conns = NULL;
+    nconns = 0;
+
+    ngx_use_iouring_io = 0;
+
+#endif
+}
+
+
+static struct io_uring_sqe *
+ngx_iouring_get_sqe(ngx_log_t *log)
+{
+    uint32_t              index;
+    struct io_uring_sqe  *sqe;
+
+    ngx_memory_barrier();
+
+    if (sq.local_tail - *sq.head >= *sq.ring_entries) {
+
+        /* the submission queue is full, pass the batch to the kernel */
+
+        if (ngx_iouring_submit(log) != NGX_OK) {
+            return NULL;
+        }
+
+        ngx_memory_barrier();
+
+        if (sq.local_tail - *sq.head >= *sq.ring_entries) {
+            ngx_log_error(NGX_LOG_ALERT, log, 0,
+                          "io_uring submission queue overflow");
+            return NULL;
+        }
+    }
+
+    index = sq.local_tail & *sq.ring_mask;
+
+    sqe = &sq.sqes[index];
+    ngx_memzero(sqe, sizeof(struct io_uring_sqe));
+
+    sq.array[index] = index;
+    sq.local_tail++;
+    sq.pending++;
+
+    return sqe;
+}
+
+
+static ngx_int_t
+ngx_iouring_submit(ngx_log_t *log)
+{
+    int  n;
+
+    ngx_memory_barrier();
+
+    *sq.tail = sq.local_tail;
+
+    ngx_memory_barrier();
+
+    n = io_uring_enter(ring, sq.pending, 0, 0);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "io_uring submit: %ui, %d", sq.pending, n);
+
+    if (n == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      "io_uring_enter() failed");
+        return NGX_ERROR;
+    }
+
+    sq.pending -= ngx_min((ngx_uint_t) n, sq.pending);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_iouring_poll(ngx_event_t *ev, int fd, uint32_t events, uint64_t data)
+{
+    struct io_uring_sqe  *sqe;
+
+    sqe = ngx_iouring_get_sqe(ev->log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = events;
+    sqe->user_data = data;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_iouring_add_event(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags)
+{
+    ngx_connection_t    *c;
+#if (NGX_HAVE_IOURING_BUF_RING)
+    ngx_iouring_conn_t  *st;
+#endif
+
+    c = ev->data;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "io_uring add event: fd:%d w:%d", c->fd, ev->write);
+
+#if (NGX_HAVE_IOURING_BUF_RING)
+
+    st = ngx_iouring_conn(c);
+
+    if (st) {
+        if (ev->accept && c->type == SOCK_STREAM) {
+            return ngx_iouring_add_accept(ev, st, flags);
+        }
+
+        if (st->io) {
+            return ngx_iouring_add_io_event(ev, st, flags);
+        }
+    }
+
+#endif
+
+    if (ngx_iouring_poll(ev, c->fd, ev->write ? POLLOUT : POLLIN,
+                         (uintptr_t) ev | ev->instance)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    ev->active = 1;
+
+    if (flags & NGX_FLUSH_EVENT) {
+        return ngx_iouring_submit(ev->log);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_iouring_del_event(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags)
+{
+    struct io_uring_sqe  *sqe;
+#if (NGX_DEBUG || NGX_HAVE_IOURING_BUF_RING)
+    ngx_connection_t     *c;
+#endif
+#if (NGX_HAVE_IOURING_BUF_RING)
+    ngx_iouring_conn_t   *st;
+
+    c = ev->data;
+    st = ngx_iouring_conn(c);
+
+    if (st) {
+        if (ev->accept && c->type == SOCK_STREAM) {
+            return ngx_iouring_del_accept(ev, st, flags);
+        }
+
+        if (st->io) {
+
+            /*
+             * posted requests are left as is, their completions are kept
+             * until the event is added again, see ngx_iouring_detach()
+             * for the closing
+             */
+
+            ev->active = 0;
+            return NGX_OK;
+        }
+    }
+#endif
+
+    /*
+     * unlike epoll, a pending poll request holds a reference to the file,
+     * so the request must be removed even if the descriptor is going to be
+     * closed, and the removal must reach the kernel before the closing
+     */
+
+#if (NGX_DEBUG)
+    c = ev->data;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "io_uring del event: fd:%d w:%d", c->fd, ev->write);
+#endif
+
+    sqe = ngx_iouring_get_sqe(ev->log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t) ev | ev->instance;
+    sqe->user_data = NGX_IOURING_OP;
+
+    ev->active = 0;
+
+    if (flags & (NGX_CLOSE_EVENT|NGX_FLUSH_EVENT)) {
+        return ngx_iouring_submit(ev->log);
+    }
+
+    return NGX_OK;
+}
+
+
+#if (NGX_HAVE_EVENTFD)
+
+static ngx_int_t
+ngx_iouring_notify(ngx_event_handler_pt handler)
+{
+    static uint64_t inc = 1;
+
+    notify_event.data = handler;
+
+    if ((size_t) write(notify_fd, &inc, sizeof(uint64_t)) != sizeof(uint64_t)) {
+        ngx_log_error(NGX_LOG_ALERT, notify_event.log, ngx_errno,
+                      "write() to eventfd %d failed", notify_fd);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_iouring_process_events(ngx_cycle_t *cycle, ngx_msec_t timer,
+    ngx_uint_t flags)
+{
+    int                   n;
+    uint32_t              head, tail;
+    ngx_err_t             err;
+    ngx_uint_t            level, events;
+    struct io_uring_cqe  *cqe, copy;
+#if (NGX_HAVE_FILE_AIO)
+    ngx_event_t          *ev;
+    ngx_event_aio_t      *aio;
+#endif
+#if (NGX_HAVE_IOURING_BUF_RING)
+    ngx_iouring_op_t     *op;
+#endif
+    struct io_uring_sqe  *sqe;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "io_uring timer: %M, submit: %ui", timer, sq.pending);
+
+    if (timer != NGX_TIMER_INFINITE) {
+
+        /* the timeout completes on expiration or on any other completion */
+
+        sqe = ngx_iouring_get_sqe(cycle->log);
+        if (sqe == NULL) {
+            return NGX_ERROR;
+        }
+
+        wait_ts.tv_sec = timer / 1000;
+        wait_ts.tv_nsec = (timer % 1000) * 1000000;
+
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->fd = -1;
+        sqe->addr = (uintptr_t) &wait_ts;
+        sqe->len = 1;
+        sqe->off = 1;
+        sqe->user_data = NGX_IOURING_OP;
+    }
+
+    ngx_memory_barrier();
+
+    *sq.tail = sq.local_tail;
+
+    ngx_memory_barrier();
+
+    n = io_uring_enter(ring, sq.pending, 1, IORING_ENTER_GETEVENTS);
+
+    err = (n == -1) ? ngx_errno : 0;
+
+    if (flags & NGX_UPDATE_TIME || ngx_event_timer_alarm) {
+        ngx_time_update();
+    }
+
+    if (err) {
+        if (err == NGX_EINTR) {
+
+            if (ngx_event_timer_alarm) {
+                ngx_event_timer_alarm = 0;
+                return NGX_OK;
+            }
+
+            level = NGX_LOG_INFO;
+
+        } else {
+            level = NGX_LOG_ALERT;
+        }
+
+        ngx_log_error(level, cycle->log, err, "io_uring_enter() failed");
+        return NGX_ERROR;
+    }
+
+    sq.pending -= ngx_min((ngx_uint_t) n, sq.pending);
+
+    events = 0;
+
+    for ( ;; ) {
+        ngx_memory_barrier();
+
+        head = *cq.head;
+        tail = *cq.tail;
+
+        if (head == tail) {
+            break;
+        }
+
+        cqe = &cq.cqes[head & *cq.ring_mask];
+
+        /* the completion is consumed before a handler is called */
+
+        copy = *cqe;
+
+        ngx_memory_barrier();
+
+        *cq.head = head + 1;
+
+        events++;
+
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                       "io_uring: ud:%XL res:%d",
+                       (uint64_t) copy.user_data, copy.res);
+
+        switch (copy.user_data & NGX_IOURING_TYPE) {
+
+        case NGX_IOURING_POLL:
+            ngx_iouring_process_poll(cycle, &copy, flags);
+            continue;
+
+#if (NGX_HAVE_FILE_AIO)
+        case NGX_IOURING_AIO:
+
+            ev = (ngx_event_t *) (uintptr_t) (copy.user_data
+                                              & ~(uint64_t) NGX_IOURING_TYPE);
+
+            ev->complete = 1;
+            ev->active = 0;
+            ev->ready = 1;
+
+            aio = ev->data;
+            aio->res = copy.res;
+
+            ngx_post_event(ev, &ngx_posted_events);
+            continue;
+#endif
+
+#if (NGX_HAVE_EVENTFD)
+        case NGX_IOURING_NOTIFY:
+
+            if (!(copy.flags & IORING_CQE_F_MORE)) {
+                (void) ngx_iouring_poll(&notify_event, notify_fd, POLLIN,
+                                        copy.user_data);
+            }
+
+            if (copy.res < 0) {
+                ngx_log_error(NGX_LOG_ALERT, cycle->log, -copy.res,
+                              "io_uring poll on eventfd %d failed",
+                              notify_fd);
+                continue;
+            }
+
+            ngx_iouring_notify_handler(&notify_event);
+            continue;
+#endif
+
+        default: /* NGX_IOURING_OP */
+
+#if (NGX_HAVE_IOURING_BUF_RING)
+            op = (ngx_iouring_op_t *) (uintptr_t) (copy.user_data
+                                                 & ~(uint64_t) NGX_IOURING_TYPE);
+
+            if (op) {
+                op->handler(op, &copy, flags);
+            }
+#endif
+
+            continue;
+        }
+    }
+
+    if (events == 0 && timer == NGX_TIMER_INFINITE) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, 0,
+                      "io_uring_enter() returned no events without timeout");
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_iouring_process_poll(ngx_cycle_t *cycle, struct io_uring_cqe *cqe,
+    ngx_uint_t flags)
+{
+    ngx_int_t          instance;
+    ngx_event_t       *ev;
+    ngx_queue_t       *queue;
+    ngx_connection_t  *c;
+
+    ev = (ngx_event_t *) (uintptr_t) (cqe->user_data & ~(uint64_t) 1);
+    instance = cqe->user_data & 1;
+
+    c = ev->data;
+
+    if (c->fd == -1 || ev->instance != instance || !ev->active) {
+
+        /*
+         * the stale event from a file descriptor
+         * that was just closed or from a removed request
+         */
+
+        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                       "io_uring: stale event %p", ev);
+        return;
+    }
+
+    if (cqe->res == -ECANCELED) {
+        return;
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+
+        /*
+         * the multishot request was terminated by the kernel, e.g.,
+         * on a completion queue overflow, so it is armed again
+         * to keep the event registered as it is with epoll;
+         * on an error the event is added again after the handler
+         */
+
+        if (cqe->res < 0
+            || ngx_iouring_poll(ev, c->fd, ev->write ? POLLOUT : POLLIN,
+                                cqe->user_data)
+               != NGX_OK)
+        {
+            ev->active = 0;
+        }
+    }
+
+    /*
+     * if an error was returned, the event is reported as ready anyway
+     * to let a handler see the error
+     */
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "io_uring: fd:%d w:%d res:%d", c->fd, ev->write, cqe->res);
+
+    ev->ready = 1;
+
+    if (ev->write) {
+#if (NGX_THREADS)
+        ev->complete = 1;
+#endif
+
+        if (flags & NGX_POST_EVENTS) {
+            ngx_post_event(ev, &ngx_posted_events);
+
+        } else {
+            ev->handler(ev);
+        }
+
+        return;
+    }
+
+    ev->available = -1;
+
+    if (flags & NGX_POST_EVENTS) {
+        queue = ev->accept ? &ngx_posted_accept_events
+                           : &ngx_posted_events;
+
+        ngx_post_event(ev, queue);
+
+    } else {
+        ev->handler(ev);
+    }
+}
+
+
+#if (NGX_HAVE_FILE_AIO)
+
+ngx_int_t
+ngx_iouring_aio_read(ngx_file_t *file, u_char *buf, size_t size,
+    off_t offset)
+{
+    ngx_event_aio_t      *aio;
+    struct io_uring_sqe  *sqe;
+
+    aio = file->aio;
+
+    sqe = ngx_iouring_get_sqe(file->log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = file->fd;
+    sqe->addr = (uintptr_t) buf;
+    sqe->len = size;
+    sqe->off = offset;
+    sqe->user_data = (uintptr_t) &aio->event | NGX_IOURING_AIO;
+
+    return NGX_OK;
+}
+
+#endif
+
+
+#if (NGX_HAVE_IOURING_BUF_RING)
+
+static ngx_int_t
+ngx_iouring_buffers_init(ngx_cycle_t *cycle, ngx_iouring_conf_t *urcf)
+{
+    ngx_uint_t               i;
+    struct io_uring_buf_reg  reg;
+
+    buf_size = urcf->buffers.size;
+    buf_mask = urcf->buffers.num - 1;
+
+    buf_ring = ngx_memalign(ngx_pagesize,
+                            urcf->buffers.num * sizeof(struct io_uring_buf),
+                            cycle->log);
+    if (buf_ring == NULL) {
+        return NGX_ERROR;
+    }
+
+    buf_data = ngx_alloc(urcf->buffers.num * buf_size, cycle->log);
+    if (buf_data == NULL) {
+        goto failed;
+    }
+
+    conns = ngx_calloc(cycle->connection_n * sizeof(ngx_iouring_conn_t),
+                       cycle->log);
+    if (conns == NULL) {
+        goto failed;
+    }
+
+    ngx_memzero(&reg, sizeof(struct io_uring_buf_reg));
+
+    reg.ring_addr = (uintptr_t) buf_ring;
+    reg.ring_entries = urcf->buffers.num;
+    reg.bgid = NGX_IOURING_BGID;
+
+    if (io_uring_register(ring, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+
+        /* provided buffer rings appeared in Linux 5.19 */
+
+        ngx_log_error(NGX_LOG_NOTICE, cycle->log, ngx_errno,
+                      "io_uring_register(IORING_REGISTER_PBUF_RING) failed, "
+                      "accept(), recv() and send() are not completion based");
+        goto failed;
+    }
+
+    buf_tail = 0;
+    buf_ring->tail = 0;
+
+    for (i = 0; i < (ngx_uint_t) urcf->buffers.num; i++) {
+        ngx_iouring_recycle_buffer(i);
+    }
+
+    nconns = cycle->connection_n;
+    accepts = urcf->accepts;
+
+    ngx_use_iouring_io = 1;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "io_uring buffers: %ui %uz",
+                   urcf->buffers.num, buf_size);
+
+    return NGX_OK;
+
+failed:
+
+    ngx_free(buf_ring);
+
+    if (buf_data) {
+        ngx_free(buf_data);
+    }
+
+    if (conns) {
+        ngx_free(conns);
+    }
+
+    buf_ring = NULL;
+    buf_data = NULL;
+    conns = NULL;
+
+    return NGX_ERROR;
+}
+
+
+static void
+ngx_iouring_recycle_buffer(ngx_uint_t bid)
+{
+    struct io_uring_buf  *buf;
+
+    /*
+     * the ring tail overlays the reserved field of the first entry,
+     * so the entries are filled field by field
+     */
+
+    buf = &buf_ring->bufs[buf_tail & buf_mask];
+
+    buf->addr = (uintptr_t) (buf_data + bid * buf_size);
+    buf->len = buf_size;
+    buf->bid = bid;
+
+    buf_tail++;
+
+    ngx_memory_barrier();
+
+    buf_ring->tail = buf_tail;
+}
+
+
+static ngx_iouring_conn_t *
+ngx_iouring_conn(ngx_connection_t *c)
+{
+    if (conns == NULL
+        || c < ngx_cycle->connections
+        || c >= ngx_cycle->connections + nconns)
+    {
+        return NULL;
+    }
+
+    return &conns[c - ngx_cycle->connections];
+}
+
+
+static ngx_iouring_op_t *
+ngx_iouring_get_op(ngx_log_t *log)
+{
+    ngx_iouring_op_t  *op;
+
+    op = free_ops;
+
+    if (op) {
+        free_ops = op->next;
+        return op;
+    }
+
+    op = ngx_alloc(sizeof(ngx_iouring_op_t), log);
+    if (op == NULL) {
+        return NULL;
+    }
+
+    op->start = NULL;
+
+    return op;
+}
+
+
+static void
+ngx_iouring_free_op(ngx_iouring_op_t *op)
+{
+    op->connection = NULL;
+    op->next = free_ops;
+    free_ops = op;
+}
+
+
+static ngx_int_t
+ngx_iouring_cancel(ngx_iouring_op_t *op, ngx_log_t *log)
+{
+    struct io_uring_sqe  *sqe;
+
+    sqe = ngx_iouring_get_sqe(log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t) op | NGX_IOURING_OP;
+    sqe->user_data = NGX_IOURING_OP;
+
+    return NGX_OK;
+}
+
+
+void
+ngx_iouring_set_io(ngx_connection_t *c)
+{
+    ngx_iouring_conn_t  *st;
+
+    if (!ngx_use_iouring_io || c->type != SOCK_STREAM) {
+        return;
+    }
+
+    st = ngx_iouring_conn(c);
+    if (st == NULL) {
+        return;
+    }
+
+    ngx_memzero(st, sizeof(ngx_iouring_conn_t));
+
+    st->io = 1;
+
+    c->recv = ngx_iouring_recv;
+    c->recv_chain = ngx_iouring_recv_chain;
+    c->send = ngx_iouring_send;
+    c->send_chain = ngx_iouring_send_chain;
+}
+
+
+static ngx_int_t
+ngx_iouring_del_connection(ngx_connection_t *c, ngx_uint_t flags)
+{
+    ngx_iouring_conn_t  *st;
+
+    st = ngx_iouring_conn(c);
+
+    if (st && st->io) {
+        ngx_iouring_detach(c, st);
+
+        c->read->active = 0;
+        c->write->active = 0;
+
+        if (flags & NGX_CLOSE_EVENT) {
+            return ngx_iouring_submit(c->log);
+        }
+
+        return NGX_OK;
+    }
+
+    if (c->read->active || c->read->disabled) {
+        if (ngx_iouring_del_event(c->read, NGX_READ_EVENT, flags) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (c->write->active || c->write->disabled) {
+        if (ngx_iouring_del_event(c->write, NGX_WRITE_EVENT, flags)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_iouring_detach(ngx_connection_t *c, ngx_iouring_conn_t *st)
+{
+    /*
+     * the pending requests are cancelled and left to be freed
+     * on their completions, as the kernel still owns their buffers
+     */
+
+    if (st->recv) {
+        st->recv->connection = NULL;
+        (void) ngx_iouring_cancel(st->recv, c->log);
+    }
+
+    if (st->send) {
+        st->send->connection = NULL;
+        (void) ngx_iouring_cancel(st->send, c->log);
+    }
+
+    if (st->size) {
+        ngx_iouring_recycle_buffer(st->bid);
+    }
+
+    ngx_memzero(st, sizeof(ngx_iouring_conn_t));
+}
+
+
+static ngx_int_t
+ngx_iouring_add_accept(ngx_event_t *ev, ngx_iouring_conn_t *st,
+    ngx_uint_t flags)
+{
+    ngx_connection_t  *lc;
+    ngx_iouring_op_t  *op;
+
+    lc = ev->data;
+
+    if (!st->listening) {
+        ngx_queue_init(&st->accepting);
+        ngx_queue_init(&st->accepted);
+        st->accepts = 0;
+        st->listening = 1;
+    }
+
+    while (st->accepts < accepts) {
+        op = ngx_iouring_get_op(ev->log);
+        if (op == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (ngx_iouring_post_accept(lc, st, op) != NGX_OK) {
+            ngx_iouring_free_op(op);
+            return NGX_ERROR;
+        }
+
+        st->accepts++;
+    }
+
+    ev->active = 1;
+
+    if (!ngx_queue_empty(&st->accepted)) {
+        ev->ready = 1;
+        ngx_post_event(ev, &ngx_posted_accept_events);
+    }
+
+    if (flags & NGX_FLUSH_EVENT) {
+        return ngx_iouring_submit(ev->log);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_iouring_del_accept(ngx_event_t *ev, ngx_iouring_conn_t *st,
+    ngx_uint_t flags)
+{
+    ngx_queue_t       *q;
+    ngx_iouring_op_t  *op;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "io_uring del accept: %ui", st->accepts);
+
+    ev->active = 0;
+
+    if (!st->listening) {
+        return NGX_OK;
+    }
+
+    /*
+     * on disabling, the sockets accepted before the cancellation
+     * are still passed to ngx_event_accept()
+     */
+
+    for (q = ngx_queue_head(&st->accepting);
+         q != ngx_queue_sentinel(&st->accepting);
+         q = ngx_queue_next(q))
+    {
+        op = ngx_queue_data(q, ngx_iouring_op_t, queue);
+
+        if (flags & NGX_CLOSE_EVENT) {
+            op->connection = NULL;
+        }
+
+        if (ngx_iouring_cancel(op, ev->log) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (flags & NGX_CLOSE_EVENT) {
+
+        while (!ngx_queue_empty(&st->accepted)) {
+            q = ngx_queue_head(&st->accepted);
+            ngx_queue_remove(q);
+
+            op = ngx_queue_data(q, ngx_iouring_op_t, queue);
+
+            if (op->res >= 0 && ngx_close_socket(op->res) == -1) {
+                ngx_log_error(NGX_LOG_ALERT, ev->log, ngx_socket_errno,
+                              ngx_close_socket_n " failed");
+            }
+
+            ngx_iouring_free_op(op);
+        }
+
+        st->listening = 0;
+        st->accepts = 0;
+    }
+
+    if (flags & (NGX_CLOSE_EVENT|NGX_FLUSH_EVENT)) {
+        return ngx_iouring_submit(ev->log);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_iouring_post_accept(ngx_connection_t *lc, ngx_iouring_conn_t *st,
+    ngx_iouring_op_t *op)
+{
+    struct io_uring_sqe  *sqe;
+
+    sqe = ngx_iouring_get_sqe(lc->log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    op->handler = ngx_iouring_accept_handler;
+    op->connection = lc;
+    op->socklen = sizeof(ngx_sockaddr_t);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = lc->fd;
+    sqe->addr = (uintptr_t) &op->sockaddr;
+    sqe->addr2 = (uintptr_t) &op->socklen;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    sqe->user_data = (uintptr_t) op | NGX_IOURING_OP;
+
+    ngx_queue_insert_tail(&st->accepting, &op->queue);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_iouring_accept_handler(ngx_iouring_op_t *op, struct io_uring_cqe *cqe,
+    ngx_uint_t flags)
+{
+    ngx_event_t         *ev;
+    ngx_connection_t    *lc;
+    ngx_iouring_conn_t  *st;
+
+    lc = op->connection;
+
+    if (lc == NULL) {
+
+        /* the listening socket was closed */
+
+        if (cqe->res >= 0 && ngx_close_socket(cqe->res) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_socket_errno,
+                          ngx_close_socket_n " failed");
+        }
+
+        ngx_iouring_free_op(op);
+        return;
+    }
+
+    st = ngx_iouring_conn(lc);
+    ev = lc->read;
+
+    ngx_queue_remove(&op->queue);
+
+    if (cqe->res == -ECANCELED) {
+        if (ev->active && ngx_iouring_post_accept(lc, st, op) == NGX_OK) {
+            return;
+        }
+
+        st->accepts--;
+        ngx_iouring_free_op(op);
+        return;
+    }
+
+    op->res = cqe->res;
+
+    ngx_queue_insert_tail(&st->accepted, &op->queue);
+
+    ev->ready = 1;
+
+    if (flags & NGX_POST_EVENTS) {
+        ngx_post_event(ev, &ngx_posted_accept_events);
+
+    } else {
+        ev->handler(ev);
+    }
+}
+
+
+ngx_socket_t
+ngx_iouring_accept(ngx_connection_t *lc, struct sockaddr *sa,
+    socklen_t *socklen)
+{
+    ngx_queue_t         *q;
+    ngx_socket_t         s;
+    ngx_iouring_op_t    *op;
+    ngx_iouring_conn_t  *st;
+
+    st = ngx_iouring_conn(lc);
+
+    if (st == NULL || !st->listening || ngx_queue_empty(&st->accepted)) {
+        ngx_set_socket_errno(NGX_EAGAIN);
+        return (ngx_socket_t) -1;
+    }
+
+    q = ngx_queue_head(&st->accepted);
+    ngx_queue_remove(q);
+
+    op = ngx_queue_data(q, ngx_iouring_op_t, queue);
+
+    s = op->res;
+
+    if (s >= 0) {
+        ngx_memcpy(sa, &op->sockaddr, ngx_min(*socklen, op->socklen));
+        *socklen = op->socklen;
+    }
+
+    /* the request is posted again to keep the number of accepts */
+
+    if (!lc->read->active || ngx_iouring_post_accept(lc, st, op) != NGX_OK) {
+        st->accepts--;
+        ngx_iouring_free_op(op);
+    }
+
+    if (!ngx_queue_empty(&st->accepted)) {
+        ngx_post_event(lc->read, &ngx_posted_accept_events);
+    }
+
+    if (s < 0) {
+        ngx_set_socket_errno(-s);
+        return (ngx_socket_t) -1;
+    }
+
+    return s;
+}
+
+
+static ngx_int_t
+ngx_iouring_add_io_event(ngx_event_t *ev, ngx_iouring_conn_t *st,
+    ngx_uint_t flags)
+{
+    ev->active = 1;
+
+    /*
+     * the event is reported at once if there is nothing to wait for:
+     * a send request is not pending, or the received data, the end of
+     * file, or an error were not consumed yet
+     */
+
+    if (ev->write) {
+        if (st->send == NULL) {
+            ev->ready = 1;
+            ngx_post_event(ev, &ngx_posted_events);
+        }
+
+        return NGX_OK;
+    }
+
+    if (st->size || st->eof || st->nobufs || st->recv_err) {
+        ev->ready = 1;
+        ngx_post_event(ev, &ngx_posted_events);
+        return NGX_OK;
+    }
+
+    if (st->recv == NULL) {
+        return ngx_iouring_post_recv(ev->data, st);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_iouring_post_recv(ngx_connection_t *c, ngx_iouring_conn_t *st)
+{
+    ngx_iouring_op_t     *op;
+    struct io_uring_sqe  *sqe;
+
+    op = ngx_iouring_get_op(c->log);
+    if (op == NULL) {
+        return NGX_ERROR;
+    }
+
+    sqe = ngx_iouring_get_sqe(c->log);
+    if (sqe == NULL) {
+        ngx_iouring_free_op(op);
+        return NGX_ERROR;
+    }
+
+    op->handler = ngx_iouring_recv_handler;
+    op->connection = c;
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = NGX_IOURING_BGID;
+    sqe->len = buf_size;
+    sqe->user_data = (uintptr_t) op | NGX_IOURING_OP;
+
+    st->recv = op;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_iouring_recv_handler(ngx_iouring_op_t *op, struct io_uring_cqe *cqe,
+    ngx_uint_t flags)
+{
+    ngx_uint_t           bid;
+    ngx_event_t         *rev;
+    ngx_connection_t    *c;
+    ngx_iouring_conn_t  *st;
+
+    c = op->connection;
+
+    ngx_iouring_free_op(op);
+
+    bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+    if (c == NULL) {
+
+        /* the connection was closed */
+
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            ngx_iouring_recycle_buffer(bid);
+        }
+
+        return;
+    }
+
+    st = ngx_iouring_conn(c);
+    st->recv = NULL;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "io_uring recv: fd:%d %d", c->fd, cqe->res);
+
+    if (cqe->res > 0) {
+        st->pos = buf_data + bid * buf_size;
+        st->size = cqe->res;
+        st->bid = bid;
+        st->nonempty = (cqe->flags & IORING_CQE_F_SOCK_NONEMPTY) ? 1 : 0;
+
+    } else if (cqe->res == 0) {
+        st->eof = 1;
+
+    } else if (cqe->res == -ENOBUFS) {
+        st->nobufs = 1;
+
+    } else {
+        st->recv_err = -cqe->res;
+    }
+
+    rev = c->read;
+    rev->ready = 1;
+
+    if (!rev->active) {
+        return;
+    }
+
+    if (flags & NGX_POST_EVENTS) {
+        ngx_post_event(rev, &ngx_posted_events);
+
+    } else {
+        rev->handler(rev);
+    }
+}
+
+
+static ngx_int_t
+ngx_iouring_post_send(ngx_connection_t *c, ngx_iouring_op_t *op)
+{
+    struct io_uring_sqe  *sqe;
+
+    sqe = ngx_iouring_get_sqe(c->log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    op->handler = ngx_iouring_send_handler;
+    op->connection = c;
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = c->fd;
+    sqe->addr = (uintptr_t) op->pos;
+    sqe->len = op->last - op->pos;
+    sqe->msg_flags = MSG_NOSIGNAL|MSG_WAITALL;
+    sqe->user_data = (uintptr_t) op | NGX_IOURING_OP;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_iouring_send_handler(ngx_iouring_op_t *op, struct io_uring_cqe *cqe,
+    ngx_uint_t flags)
+{
+    ngx_event_t         *wev;
+    ngx_connection_t    *c;
+    ngx_iouring_conn_t  *st;
+
+    c = op->connection;
+
+    if (c == NULL) {
+
+        /* the connection was closed */
+
+        ngx_iouring_free_op(op);
+        return;
+    }
+
+    st = ngx_iouring_conn(c);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "io_uring send: fd:%d %d of %z",
+                   c->fd, cqe->res, op->last - op->pos);
+
+    if (cqe->res >= 0) {
+        op->pos += cqe->res;
+
+        if (op->pos < op->last) {
+
+            /* a short send on kernels without MSG_WAITALL support */
+
+            if (ngx_iouring_post_send(c, op) == NGX_OK) {
+                return;
+            }
+
+            st->send_err = NGX_ENOMEM;
+        }
+
+    } else {
+        st->send_err = -cqe->res;
+    }
+
+    st->send = NULL;
+    ngx_iouring_free_op(op);
+
+    c->buffered &= ~NGX_IOURING_BUFFERED;
+
+    wev = c->write;
+    wev->ready = 1;
+
+    if (!wev->active) {
+        return;
+    }
+
+#if (NGX_THREADS)
+    wev->complete = 1;
+#endif
+
+    if (flags & NGX_POST_EVENTS) {
+        ngx_post_event(wev, &ngx_posted_events);
+
+    } else {
+        wev->handler(wev);
+    }
+}
+
+
+static ssize_t
+ngx_iouring_recv(ngx_connection_t *c, u_char *buf, size_t size)
+{
+    ssize_t              n;
+    ngx_err_t            err;
+    ngx_event_t         *rev;
+    ngx_iouring_conn_t  *st;
+
+    st = ngx_iouring_conn(c);
+    rev = c->read;
+
+    if (st->size) {
+        n = ngx_min(st->size, size);
+
+        ngx_memcpy(buf, st->pos, n);
+
+        st->pos += n;
+        st->size -= n;
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "recv: fd:%d %z of %uz", c->fd, n, size);
+
+        if (st->size == 0) {
+            ngx_iouring_recycle_buffer(st->bid);
+
+            /*
+             * if the socket has no more data, the next receive request
+             * is posted at once, otherwise the next call will post it
+             */
+
+            if (!st->nonempty && ngx_iouring_post_recv(c, st) == NGX_OK) {
+                rev->ready = 0;
+            }
+        }
+
+        return n;
+    }
+
+    if (st->recv_err) {
+        rev->ready = 0;
+        rev->error = 1;
+
+        return ngx_connection_error(c, st->recv_err, "recv() failed");
+    }
+
+    if (st->eof) {
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "recv: fd:%d 0 of %uz", c->fd, size);
+
+        rev->ready = 0;
+        rev->eof = 1;
+
+        return 0;
+    }
+
+    if (st->nobufs) {
+
+        /*
+         * the ring ran out of buffers, the data are read directly,
+         * and the event stays ready to post a request on the next call
+         */
+
+        st->nobufs = 0;
+
+        n = recv(c->fd, buf, size, 0);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "recv: fd:%d %z of %uz", c->fd, n, size);
+
+        if (n > 0) {
+            rev->ready = 1;
+            return n;
+        }
+
+        if (n == 0) {
+            st->eof = 1;
+            rev->ready = 0;
+            rev->eof = 1;
+            return 0;
+        }
+
+        err = ngx_socket_errno;
+
+        if (err != NGX_EAGAIN && err != NGX_EINTR) {
+            st->recv_err = err;
+            rev->ready = 0;
+            rev->error = 1;
+            return ngx_connection_error(c, err, "recv() failed");
+        }
+    }
+
+    if (st->recv == NULL && ngx_iouring_post_recv(c, st) != NGX_OK) {
+        rev->ready = 0;
+        rev->error = 1;
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "recv: fd:%d not ready", c->fd);
+
+    rev->ready = 0;
+
+    return NGX_AGAIN;
+}
+
+
+static ssize_t
+ngx_iouring_recv_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
+{
+    size_t   size;
+    ssize_t  n, total;
+
+    total = 0;
+
+    for ( /* void */ ; in; in = in->next) {
+
+        size = in->buf->end - in->buf->last;
+
+        if (limit) {
+            if (total >= limit) {
+                break;
+            }
+
+            size = ngx_min(size, (size_t) (limit - total));
+        }
+
+        if (size == 0) {
+            continue;
+        }
+
+        n = ngx_iouring_recv(c, in->buf->last, size);
+
+        if (n <= 0) {
+            return total ? total : n;
+        }
+
+        total += n;
+
+        if ((size_t) n < size) {
+            break;
+        }
+    }
+
+    return total;
+}
+
+
+static ssize_t
+ngx_iouring_send(ngx_connection_t *c, u_char *buf, size_t size)
+{
+    ngx_buf_t     b;
+    ngx_chain_t   cl, *rc;
+
+    ngx_memzero(&b, sizeof(ngx_buf_t));
+
+    b.pos = buf;
+    b.last = buf + size;
+    b.memory = 1;
+
+    cl.buf = &b;
+    cl.next = NULL;
+
+    rc = ngx_iouring_send_chain(c, &cl, 0);
+
+    if (rc == NGX_CHAIN_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (b.pos == buf) {
+        return NGX_AGAIN;
+    }
+
+    return b.pos - buf;
+}
+
+
+static ngx_chain_t *
+ngx_iouring_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
+{
+    u_char              *p;
+    size_t               size;
+    ngx_buf_t           *b;
+    ngx_chain_t         *cl;
+    ngx_event_t         *wev;
+    ngx_iouring_op_t    *op;
+    ngx_iouring_conn_t  *st;
+
+    st = ngx_iouring_conn(c);
+    wev = c->write;
+
+    if (st->send_err) {
+        wev->error = 1;
+        (void) ngx_connection_error(c, st->send_err, "send() failed");
+        return NGX_CHAIN_ERROR;
+    }
+
+    if (st->send) {
+        wev->ready = 0;
+        return in;
+    }
+
+    for (cl = in; cl && ngx_buf_special(cl->buf); cl = cl->next) {
+        /* void */
+    }
+
+    if (cl == NULL) {
+        return NULL;
+    }
+
+    if (!ngx_buf_in_memory(cl->buf)) {
+        return ngx_os_io.send_chain(c, in, limit);
+    }
+
+    if (limit == 0 || limit > (off_t) buf_size) {
+        limit = buf_size;
+    }
+
+    op = ngx_iouring_get_op(c->log);
+    if (op == NULL) {
+        return NGX_CHAIN_ERROR;
+    }
+
+    if (op->start == NULL) {
+        op->start = ngx_alloc(buf_size, c->log);
+        if (op->start == NULL) {
+            ngx_iouring_free_op(op);
+            return NGX_CHAIN_ERROR;
+        }
+    }
+
+    /* the memory buffers are copied up to the first file buffer */
+
+    p = op->start;
+
+    for ( /* void */ ; cl && p - op->start < limit; cl = cl->next) {
+        b = cl->buf;
+
+        if (ngx_buf_special(b)) {
+            continue;
+        }
+
+        if (!ngx_buf_in_memory(b)) {
+            break;
+        }
+
+        size = ngx_min((size_t) (b->last - b->pos),
+                       (size_t) (limit - (p - op->start)));
+
+        p = ngx_cpymem(p, b->pos, size);
+    }
+
+    size = p - op->start;
+
+    if (size == 0) {
+        ngx_iouring_free_op(op);
+        return ngx_chain_update_sent(in, 0);
+    }
+
+    op->pos = op->start;
+    op->last = p;
+
+    if (ngx_iouring_post_send(c, op) != NGX_OK) {
+        ngx_iouring_free_op(op);
+        return NGX_CHAIN_ERROR;
+    }
+
+    st->send = op;
+
+    c->buffered |= NGX_IOURING_BUFFERED;
+    c->sent += size;
+
+    /* the write event is reported on the send completion */
+
+    wev->ready = 0;
+
+    return ngx_chain_update_sent(in, size);
+}
+
+#endif
+
+
+static void *
+ngx_iouring_create_conf(ngx_cycle_t *cycle)
+{
+    ngx_iouring_conf_t  *urcf;
+
+    urcf = ngx_palloc(cycle->pool, sizeof(ngx_iouring_conf_t));
+    if (urcf == NULL) {
+        return NULL;
+    }
+
+    urcf->entries = NGX_CONF_UNSET;
+    urcf->accepts = NGX_CONF_UNSET;
+    urcf->buffers.num = 0;
+
+    return urcf;
+}
+
+
+static char *
+ngx_iouring_init_conf(ngx_cycle_t *cycle, void *conf)
+{
+    ngx_iouring_conf_t *urcf = conf;
+
+    ngx_conf_init_uint_value(urcf->entries, 1024);
+    ngx_conf_init_uint_value(urcf->accepts, 16);
+
+    if (urcf->buffers.num == 0) {
+        urcf->buffers.num = 64;
+        urcf->buffers.size = 16384;
+    }
+
+    if (urcf->buffers.num & (urcf->buffers.num - 1)
+        || urcf->buffers.num > 32768)
+    {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                      "the number of \"io_uring_buffers\" must be "
+                      "a power of 2 not greater than 32768");
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
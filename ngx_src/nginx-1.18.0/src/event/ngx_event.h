@@ -191,6 +191,13 @@ extern ngx_event_actions_t   ngx_event_actions;
 #if (NGX_HAVE_EPOLLRDHUP)
 extern ngx_uint_t            ngx_use_epoll_rdhup;
 #endif
+#if (NGX_HAVE_IOURING_BUF_RING)
+extern ngx_uint_t            ngx_use_iouring_io;
+
+ngx_socket_t ngx_iouring_accept(ngx_connection_t *lc, struct sockaddr *sa,
+    socklen_t *socklen);
+void ngx_iouring_set_io(ngx_connection_t *c);
+#endif
 
 
 /*
@@ -439,6 +446,8 @@ typedef struct {
 
     ngx_msec_t    accept_mutex_delay;
 
+    ngx_flag_t    timer_wheel;
+
     u_char       *name;
 
 #if (NGX_DEBUG)
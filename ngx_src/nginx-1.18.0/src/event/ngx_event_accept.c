@@ -55,6 +55,12 @@ ngx_event_accept(ngx_event_t *ev)
     do {
         socklen = sizeof(ngx_sockaddr_t);
 
+#if (NGX_HAVE_IOURING_BUF_RING)
+        if (ngx_use_iouring_io) {
+            s = ngx_iouring_accept(lc, &sa.sockaddr, &socklen);
+
+        } else
+#endif
 #if (NGX_HAVE_ACCEPT4)
         if (use_accept4) {
             s = accept4(lc->fd, &sa.sockaddr, &socklen, SOCK_NONBLOCK);
@@ -10,9 +10,63 @@
 #include <ngx_event.h>
 
 
+/*
+ * The timer wheel keeps the event timers in circular lists linked through
+ * the left and right pointers of the timer node, the node color holds the
+ * wheel level.  The root level has a slot for every millisecond of the next
+ * 256 ms, each of the upper levels covers 64 times more than the previous
+ * one, so timers up to about 49 days are kept without wrapping.  The timers
+ * of an upper level slot are cascaded down when the wheel reaches the slot.
+ */
+
+#define NGX_TIMER_WHEEL_ROOT_BITS   8
+#define NGX_TIMER_WHEEL_LEVEL_BITS  6
+#define NGX_TIMER_WHEEL_LEVELS      4
+
+#define NGX_TIMER_WHEEL_ROOT_SIZE   (1 << NGX_TIMER_WHEEL_ROOT_BITS)
+#define NGX_TIMER_WHEEL_ROOT_MASK   (NGX_TIMER_WHEEL_ROOT_SIZE - 1)
+#define NGX_TIMER_WHEEL_LEVEL_SIZE  (1 << NGX_TIMER_WHEEL_LEVEL_BITS)
+#define NGX_TIMER_WHEEL_LEVEL_MASK  (NGX_TIMER_WHEEL_LEVEL_SIZE - 1)
+
+#define NGX_TIMER_WHEEL_EXPIRED     (NGX_TIMER_WHEEL_LEVELS + 1)
+
+#define ngx_timer_wheel_shift(level)                                          \
+    (NGX_TIMER_WHEEL_ROOT_BITS + ((level) - 1) * NGX_TIMER_WHEEL_LEVEL_BITS)
+
+
+typedef struct {
+    ngx_rbtree_node_t   root[NGX_TIMER_WHEEL_ROOT_SIZE];
+    ngx_rbtree_node_t   levels[NGX_TIMER_WHEEL_LEVELS]
+                              [NGX_TIMER_WHEEL_LEVEL_SIZE];
+
+    /* timers that were already due when added */
+    ngx_rbtree_node_t   expired;
+
+    /* the first millisecond not yet processed */
+    ngx_msec_t          time;
+
+    ngx_uint_t          nroot;
+    ngx_uint_t          n;
+} ngx_event_timer_wheel_t;
+
+
+static void ngx_event_timer_wheel_init(void);
+static ngx_msec_t ngx_event_timer_wheel_find(void);
+static void ngx_event_timer_wheel_expire(void);
+static void ngx_event_timer_wheel_cascade(void);
+static void ngx_event_timer_wheel_expire_list(ngx_rbtree_node_t *list);
+static ngx_int_t ngx_event_timer_wheel_no_timers_left(void);
+static ngx_int_t ngx_event_timer_wheel_cancelable(ngx_rbtree_node_t *list);
+static ngx_uint_t ngx_event_timer_wheel_collect(ngx_rbtree_node_t *list,
+    ngx_event_handler_pt handler, ngx_event_t **events, ngx_uint_t n);
+
+
 ngx_rbtree_t              ngx_event_timer_rbtree;
 static ngx_rbtree_node_t  ngx_event_timer_sentinel;
 
+ngx_uint_t                ngx_event_timer_wheel;
+static ngx_event_timer_wheel_t  ngx_event_wheel;
+
 /*
  * the event timer rbtree may contain the duplicate keys, however,
  * it should not be a problem, because we use the rbtree to find
@@ -22,9 +76,15 @@ static ngx_rbtree_node_t  ngx_event_timer_sentinel;
 ngx_int_t
 ngx_event_timer_init(ngx_log_t *log)
 {
+    /* the rbtree is left empty, but valid, if the timer wheel is used */
+
     ngx_rbtree_init(&ngx_event_timer_rbtree, &ngx_event_timer_sentinel,
                     ngx_rbtree_insert_timer_value);
 
+    if (ngx_event_timer_wheel) {
+        ngx_event_timer_wheel_init();
+    }
+
     return NGX_OK;
 }
 
@@ -35,6 +95,10 @@ ngx_event_find_timer(void)
     ngx_msec_int_t      timer;
     ngx_rbtree_node_t  *node, *root, *sentinel;
 
+    if (ngx_event_timer_wheel) {
+        return ngx_event_timer_wheel_find();
+    }
+
     if (ngx_event_timer_rbtree.root == &ngx_event_timer_sentinel) {
         return NGX_TIMER_INFINITE;
     }
@@ -56,6 +120,11 @@ ngx_event_expire_timers(void)
     ngx_event_t        *ev;
     ngx_rbtree_node_t  *node, *root, *sentinel;
 
+    if (ngx_event_timer_wheel) {
+        ngx_event_timer_wheel_expire();
+        return;
+    }
+
     sentinel = ngx_event_timer_rbtree.sentinel;
 
     for ( ;; ) {
@@ -102,6 +171,10 @@ ngx_event_no_timers_left(void)
     ngx_event_t        *ev;
     ngx_rbtree_node_t  *node, *root, *sentinel;
 
+    if (ngx_event_timer_wheel) {
+        return ngx_event_timer_wheel_no_timers_left();
+    }
+
     sentinel = ngx_event_timer_rbtree.sentinel;
     root = ngx_event_timer_rbtree.root;
 
@@ -124,3 +197,403 @@ ngx_event_no_timers_left(void)
 
     return NGX_OK;
 }
+
+
+/*
+ * collects up to n pending timers with the given handler, regardless
+ * of the timers implementation; the caller is expected to delete them
+ * with ngx_event_del_timer() after the walk
+ */
+
+ngx_uint_t
+ngx_event_timers_collect(ngx_event_handler_pt handler, ngx_event_t **events,
+    ngx_uint_t n)
+{
+    ngx_uint_t                i, j, found;
+    ngx_event_t              *ev;
+    ngx_rbtree_node_t        *node, *root, *sentinel;
+    ngx_event_timer_wheel_t  *w;
+
+    found = 0;
+
+    if (ngx_event_timer_wheel) {
+        w = &ngx_event_wheel;
+
+        found += ngx_event_timer_wheel_collect(&w->expired, handler,
+                                               events + found, n - found);
+
+        for (i = 0; i < NGX_TIMER_WHEEL_ROOT_SIZE; i++) {
+            found += ngx_event_timer_wheel_collect(&w->root[i], handler,
+                                                   events + found, n - found);
+        }
+
+        for (i = 0; i < NGX_TIMER_WHEEL_LEVELS; i++) {
+            for (j = 0; j < NGX_TIMER_WHEEL_LEVEL_SIZE; j++) {
+                found += ngx_event_timer_wheel_collect(&w->levels[i][j],
+                                                       handler, events + found,
+                                                       n - found);
+            }
+        }
+
+        return found;
+    }
+
+    sentinel = ngx_event_timer_rbtree.sentinel;
+    root = ngx_event_timer_rbtree.root;
+
+    if (root == sentinel) {
+        return 0;
+    }
+
+    for (node = ngx_rbtree_min(root, sentinel);
+         node && found < n;
+         node = ngx_rbtree_next(&ngx_event_timer_rbtree, node))
+    {
+        ev = (ngx_event_t *) ((char *) node - offsetof(ngx_event_t, timer));
+
+        if (ev->handler == handler) {
+            events[found++] = ev;
+        }
+    }
+
+    return found;
+}
+
+
+static void
+ngx_event_timer_wheel_init(void)
+{
+    ngx_uint_t                i, j;
+    ngx_rbtree_node_t        *slot;
+    ngx_event_timer_wheel_t  *w;
+
+    w = &ngx_event_wheel;
+
+    for (i = 0; i < NGX_TIMER_WHEEL_ROOT_SIZE; i++) {
+        slot = &w->root[i];
+        slot->left = slot;
+        slot->right = slot;
+    }
+
+    for (i = 0; i < NGX_TIMER_WHEEL_LEVELS; i++) {
+        for (j = 0; j < NGX_TIMER_WHEEL_LEVEL_SIZE; j++) {
+            slot = &w->levels[i][j];
+            slot->left = slot;
+            slot->right = slot;
+        }
+    }
+
+    w->expired.left = &w->expired;
+    w->expired.right = &w->expired;
+
+    w->time = ngx_current_msec;
+    w->nroot = 0;
+    w->n = 0;
+}
+
+
+void
+ngx_event_timer_wheel_add(ngx_rbtree_node_t *node)
+{
+    ngx_msec_t                delta;
+    ngx_uint_t                level;
+    ngx_rbtree_node_t        *slot;
+    ngx_event_timer_wheel_t  *w;
+
+    w = &ngx_event_wheel;
+
+    delta = node->key - w->time;
+
+    if ((ngx_msec_int_t) delta < 0) {
+        level = NGX_TIMER_WHEEL_EXPIRED;
+        slot = &w->expired;
+
+    } else if (delta < NGX_TIMER_WHEEL_ROOT_SIZE) {
+        level = 0;
+        slot = &w->root[node->key & NGX_TIMER_WHEEL_ROOT_MASK];
+        w->nroot++;
+
+    } else {
+        for (level = 1; level < NGX_TIMER_WHEEL_LEVELS; level++) {
+            if (delta < (ngx_msec_t) 1 << ngx_timer_wheel_shift(level + 1)) {
+                break;
+            }
+        }
+
+        slot = &w->levels[level - 1][(node->key >> ngx_timer_wheel_shift(level))
+                                     & NGX_TIMER_WHEEL_LEVEL_MASK];
+    }
+
+    node->color = (u_char) level;
+
+    node->left = slot->left;
+    node->right = slot;
+    slot->left->right = node;
+    slot->left = node;
+
+    w->n++;
+}
+
+
+void
+ngx_event_timer_wheel_delete(ngx_rbtree_node_t *node)
+{
+    node->left->right = node->right;
+    node->right->left = node->left;
+
+    if (node->color == 0) {
+        ngx_event_wheel.nroot--;
+    }
+
+    ngx_event_wheel.n--;
+}
+
+
+/*
+ * The exact value is returned for the timers that fall into the current
+ * round of the root level only, otherwise the time left to the end of
+ * the round is returned, where the upper levels are cascaded down.
+ */
+
+static ngx_msec_t
+ngx_event_timer_wheel_find(void)
+{
+    ngx_msec_t                t;
+    ngx_msec_int_t            timer;
+    ngx_rbtree_node_t        *slot;
+    ngx_event_timer_wheel_t  *w;
+
+    w = &ngx_event_wheel;
+
+    if (w->n == 0) {
+        return NGX_TIMER_INFINITE;
+    }
+
+    if (w->expired.right != &w->expired) {
+        return 0;
+    }
+
+    t = w->time;
+
+    if (w->nroot) {
+        do {
+            slot = &w->root[t & NGX_TIMER_WHEEL_ROOT_MASK];
+
+            if (slot->right != slot) {
+                break;
+            }
+
+            t++;
+
+        } while (t & NGX_TIMER_WHEEL_ROOT_MASK);
+
+    } else {
+        t = (t | NGX_TIMER_WHEEL_ROOT_MASK) + 1;
+    }
+
+    timer = (ngx_msec_int_t) (t - ngx_current_msec);
+
+    return (ngx_msec_t) (timer > 0 ? timer : 0);
+}
+
+
+static void
+ngx_event_timer_wheel_expire(void)
+{
+    ngx_uint_t                idx;
+    ngx_msec_t                end;
+    ngx_event_timer_wheel_t  *w;
+
+    w = &ngx_event_wheel;
+
+    ngx_event_timer_wheel_expire_list(&w->expired);
+
+    while ((ngx_msec_int_t) (ngx_current_msec - w->time) >= 0) {
+
+        if (w->n == 0) {
+            w->time = ngx_current_msec + 1;
+            return;
+        }
+
+        idx = w->time & NGX_TIMER_WHEEL_ROOT_MASK;
+
+        if (idx == 0) {
+            ngx_event_timer_wheel_cascade();
+        }
+
+        if (w->nroot == 0) {
+
+            /* skip the empty slots up to the end of the round */
+
+            end = (w->time | NGX_TIMER_WHEEL_ROOT_MASK) + 1;
+
+            if ((ngx_msec_int_t) (end - ngx_current_msec) > 0) {
+                w->time = ngx_current_msec + 1;
+                return;
+            }
+
+            w->time = end;
+            continue;
+        }
+
+        ngx_event_timer_wheel_expire_list(&w->root[idx]);
+
+        w->time++;
+    }
+}
+
+
+static void
+ngx_event_timer_wheel_cascade(void)
+{
+    ngx_uint_t                level, idx;
+    ngx_rbtree_node_t        *slot, *node, list;
+    ngx_event_timer_wheel_t  *w;
+
+    w = &ngx_event_wheel;
+
+    for (level = 1; level <= NGX_TIMER_WHEEL_LEVELS; level++) {
+
+        idx = (w->time >> ngx_timer_wheel_shift(level))
+              & NGX_TIMER_WHEEL_LEVEL_MASK;
+
+        slot = &w->levels[level - 1][idx];
+
+        if (slot->right != slot) {
+
+            /*
+             * the slot list is moved aside first, as far timers
+             * of the top level may be placed into the same slot again
+             */
+
+            list.right = slot->right;
+            list.left = slot->left;
+            list.right->left = &list;
+            list.left->right = &list;
+
+            slot->left = slot;
+            slot->right = slot;
+
+            while (list.right != &list) {
+                node = list.right;
+
+                ngx_event_timer_wheel_delete(node);
+                ngx_event_timer_wheel_add(node);
+            }
+        }
+
+        if (idx != 0) {
+            break;
+        }
+    }
+}
+
+
+static void
+ngx_event_timer_wheel_expire_list(ngx_rbtree_node_t *list)
+{
+    ngx_event_t        *ev;
+    ngx_rbtree_node_t  *node;
+
+    /* the handlers may delete other timers of the list */
+
+    while (list->right != list) {
+        node = list->right;
+
+        ev = (ngx_event_t *) ((char *) node - offsetof(ngx_event_t, timer));
+
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                       "event timer del: %d: %M",
+                       ngx_event_ident(ev->data), ev->timer.key);
+
+        ngx_event_timer_wheel_delete(node);
+
+#if (NGX_DEBUG)
+        ev->timer.left = NULL;
+        ev->timer.right = NULL;
+        ev->timer.parent = NULL;
+#endif
+
+        ev->timer_set = 0;
+
+        ev->timedout = 1;
+
+        ev->handler(ev);
+    }
+}
+
+
+static ngx_int_t
+ngx_event_timer_wheel_no_timers_left(void)
+{
+    ngx_uint_t                i, j;
+    ngx_event_timer_wheel_t  *w;
+
+    w = &ngx_event_wheel;
+
+    if (w->n == 0) {
+        return NGX_OK;
+    }
+
+    if (ngx_event_timer_wheel_cancelable(&w->expired) != NGX_OK) {
+        return NGX_AGAIN;
+    }
+
+    for (i = 0; i < NGX_TIMER_WHEEL_ROOT_SIZE; i++) {
+        if (ngx_event_timer_wheel_cancelable(&w->root[i]) != NGX_OK) {
+            return NGX_AGAIN;
+        }
+    }
+
+    for (i = 0; i < NGX_TIMER_WHEEL_LEVELS; i++) {
+        for (j = 0; j < NGX_TIMER_WHEEL_LEVEL_SIZE; j++) {
+            if (ngx_event_timer_wheel_cancelable(&w->levels[i][j]) != NGX_OK) {
+                return NGX_AGAIN;
+            }
+        }
+    }
+
+    /* only cancelable timers left */
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_event_timer_wheel_cancelable(ngx_rbtree_node_t *list)
+{
+    ngx_event_t        *ev;
+    ngx_rbtree_node_t  *node;
+
+    for (node = list->right; node != list; node = node->right) {
+        ev = (ngx_event_t *) ((char *) node - offsetof(ngx_event_t, timer));
+
+        if (!ev->cancelable) {
+            return NGX_AGAIN;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_uint_t
+ngx_event_timer_wheel_collect(ngx_rbtree_node_t *list,
+    ngx_event_handler_pt handler, ngx_event_t **events, ngx_uint_t n)
+{
+    ngx_uint_t          found;
+    ngx_event_t        *ev;
+    ngx_rbtree_node_t  *node;
+
+    found = 0;
+
+    for (node = list->right; node != list && found < n; node = node->right) {
+        ev = (ngx_event_t *) ((char *) node - offsetof(ngx_event_t, timer));
+
+        if (ev->handler == handler) {
+            events[found++] = ev;
+        }
+    }
+
+    return found;
+}
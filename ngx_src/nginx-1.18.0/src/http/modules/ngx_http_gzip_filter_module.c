@@ -26,6 +26,11 @@ typedef struct {
     size_t               memlevel;
     ssize_t              min_length;
 
+#if (NGX_THREADS)
+    ngx_thread_pool_t   *thread_pool;
+#endif
+    size_t               threads_min_size;
+
     ngx_array_t         *types_keys;
 } ngx_http_gzip_conf_t;
 
@@ -63,9 +68,24 @@ typedef struct {
 
     z_stream             zstream;
     ngx_http_request_t  *request;
+
+#if (NGX_THREADS)
+    ngx_thread_task_t   *thread_task;
+#endif
 } ngx_http_gzip_ctx_t;
 
 
+#if (NGX_THREADS)
+
+typedef struct {
+    z_stream            *zstream;
+    int                  flush;
+    int                  rc;
+} ngx_http_gzip_thread_ctx_t;
+
+#endif
+
+
 static void ngx_http_gzip_filter_memory(ngx_http_request_t *r,
     ngx_http_gzip_ctx_t *ctx);
 static ngx_int_t ngx_http_gzip_filter_buffer(ngx_http_gzip_ctx_t *ctx,
@@ -80,6 +100,12 @@ static ngx_int_t ngx_http_gzip_filter_deflate(ngx_http_request_t *r,
     ngx_http_gzip_ctx_t *ctx);
 static ngx_int_t ngx_http_gzip_filter_deflate_end(ngx_http_request_t *r,
     ngx_http_gzip_ctx_t *ctx);
+#if (NGX_THREADS)
+static ngx_int_t ngx_http_gzip_filter_thread_post(ngx_http_request_t *r,
+    ngx_http_gzip_ctx_t *ctx);
+static void ngx_http_gzip_filter_thread(void *data, ngx_log_t *log);
+static void ngx_http_gzip_filter_thread_event_handler(ngx_event_t *ev);
+#endif
 
 static void *ngx_http_gzip_filter_alloc(void *opaque, u_int items,
     u_int size);
@@ -97,6 +123,8 @@ static char *ngx_http_gzip_merge_conf(ngx_conf_t *cf,
     void *parent, void *child);
 static char *ngx_http_gzip_window(ngx_conf_t *cf, void *post, void *data);
 static char *ngx_http_gzip_hash(ngx_conf_t *cf, void *post, void *data);
+static char *ngx_http_gzip_threads(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
 
 
 static ngx_conf_num_bounds_t  ngx_http_gzip_comp_level_bounds = {
@@ -173,6 +201,20 @@ static ngx_command_t  ngx_http_gzip_filter_commands[] = {
       offsetof(ngx_http_gzip_conf_t, min_length),
       NULL },
 
+    { ngx_string("gzip_threads"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_gzip_threads,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("gzip_threads_min_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_gzip_conf_t, threads_min_size),
+      NULL },
+
       ngx_null_command
 };
 
@@ -355,6 +397,12 @@ ngx_http_gzip_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
         r->connection->buffered |= NGX_HTTP_GZIP_BUFFERED;
     }
 
+#if (NGX_THREADS)
+    if (ctx->thread_task && ctx->thread_task->event.active) {
+        return NGX_AGAIN;
+    }
+#endif
+
     if (ctx->nomem) {
 
         /* flush busy buffers */
@@ -408,7 +456,7 @@ ngx_http_gzip_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
 
             rc = ngx_http_gzip_filter_deflate(r, ctx);
 
-            if (rc == NGX_OK) {
+            if (rc == NGX_OK || rc == NGX_BUSY) {
                 break;
             }
 
@@ -422,6 +470,12 @@ ngx_http_gzip_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
         if (ctx->out == NULL && !flush) {
             ngx_http_gzip_filter_free_copy_buf(r, ctx);
 
+#if (NGX_THREADS)
+            if (ctx->thread_task && ctx->thread_task->event.active) {
+                return NGX_AGAIN;
+            }
+#endif
+
             return ctx->busy ? NGX_AGAIN : NGX_OK;
         }
 
@@ -443,6 +497,12 @@ ngx_http_gzip_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
         if (ctx->done) {
             return rc;
         }
+
+#if (NGX_THREADS)
+        if (ctx->thread_task && ctx->thread_task->event.active) {
+            return NGX_AGAIN;
+        }
+#endif
     }
 
     /* unreachable */
@@ -451,6 +511,17 @@ failed:
 
     ctx->done = 1;
 
+#if (NGX_THREADS)
+    if (ctx->thread_task && ctx->thread_task->event.active) {
+
+        /* zlib state is still in use by a thread, it goes with the pool */
+
+        ngx_http_gzip_filter_free_copy_buf(r, ctx);
+
+        return NGX_ERROR;
+    }
+#endif
+
     if (ctx->preallocated) {
         deflateEnd(&ctx->zstream);
 
@@ -640,6 +711,12 @@ ngx_http_gzip_filter_add_data(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx)
         return NGX_OK;
     }
 
+#if (NGX_THREADS)
+    if (ctx->thread_task && ctx->thread_task->event.complete) {
+        return NGX_OK;
+    }
+#endif
+
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "gzip in: %p", ctx->in);
 
@@ -703,6 +780,12 @@ ngx_http_gzip_filter_get_buf(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx)
         return NGX_OK;
     }
 
+#if (NGX_THREADS)
+    if (ctx->thread_task && ctx->thread_task->event.complete) {
+        return NGX_OK;
+    }
+#endif
+
     conf = ngx_http_get_module_loc_conf(r, ngx_http_gzip_filter_module);
 
     if (ctx->free) {
@@ -744,14 +827,43 @@ ngx_http_gzip_filter_deflate(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx)
     ngx_chain_t           *cl;
     ngx_http_gzip_conf_t  *conf;
 
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_gzip_filter_module);
+
+#if (NGX_THREADS)
+
+    if (ctx->thread_task && ctx->thread_task->event.complete) {
+        ctx->thread_task->event.complete = 0;
+
+        rc = ((ngx_http_gzip_thread_ctx_t *) ctx->thread_task->ctx)->rc;
+
+        goto deflated;
+    }
+
+#endif
+
     ngx_log_debug6(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                  "deflate in: ni:%p no:%p ai:%ud ao:%ud fl:%d redo:%d",
                  ctx->zstream.next_in, ctx->zstream.next_out,
                  ctx->zstream.avail_in, ctx->zstream.avail_out,
                  ctx->flush, ctx->redo);
 
+#if (NGX_THREADS)
+
+    if (conf->thread_pool
+        && ctx->zstream.avail_in >= conf->threads_min_size
+        && ngx_http_gzip_filter_thread_post(r, ctx) == NGX_OK)
+    {
+        return NGX_BUSY;
+    }
+
+#endif
+
     rc = deflate(&ctx->zstream, ctx->flush);
 
+#if (NGX_THREADS)
+deflated:
+#endif
+
     if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
         ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
                       "deflate() failed: %d, %d", ctx->flush, rc);
@@ -842,8 +954,6 @@ ngx_http_gzip_filter_deflate(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx)
         return NGX_OK;
     }
 
-    conf = ngx_http_get_module_loc_conf(r, ngx_http_gzip_filter_module);
-
     if (conf->no_buffer && ctx->in == NULL) {
 
         cl = ngx_alloc_chain_link(r->pool);
@@ -913,6 +1023,107 @@ ngx_http_gzip_filter_deflate_end(ngx_http_request_t *r,
 }
 
 
+#if (NGX_THREADS)
+
+static ngx_int_t
+ngx_http_gzip_filter_thread_post(ngx_http_request_t *r,
+    ngx_http_gzip_ctx_t *ctx)
+{
+    ngx_thread_task_t           *task;
+    ngx_http_gzip_conf_t        *conf;
+    ngx_http_gzip_thread_ctx_t  *tctx;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_gzip_filter_module);
+
+    task = ctx->thread_task;
+
+    if (task == NULL) {
+        task = ngx_thread_task_alloc(r->pool,
+                                     sizeof(ngx_http_gzip_thread_ctx_t));
+        if (task == NULL) {
+            return NGX_ERROR;
+        }
+
+        task->handler = ngx_http_gzip_filter_thread;
+
+        ctx->thread_task = task;
+    }
+
+    tctx = task->ctx;
+
+    tctx->zstream = &ctx->zstream;
+    tctx->flush = ctx->flush;
+
+    task->event.data = r;
+    task->event.handler = ngx_http_gzip_filter_thread_event_handler;
+
+    /* on a queue overflow deflate() is called in the worker itself */
+
+    if (ngx_thread_task_post(conf->thread_pool, task) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    r->main->blocked++;
+    r->aio = 1;
+
+    /*
+     * the zlib state and buffers are used by the thread, so the request
+     * must not be finalized even if a flush completion has cleared the flag
+     */
+
+    r->connection->buffered |= NGX_HTTP_GZIP_BUFFERED;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_gzip_filter_thread(void *data, ngx_log_t *log)
+{
+    ngx_http_gzip_thread_ctx_t *ctx = data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_CORE, log, 0, "gzip thread handler");
+
+    ctx->rc = deflate(ctx->zstream, ctx->flush);
+}
+
+
+static void
+ngx_http_gzip_filter_thread_event_handler(ngx_event_t *ev)
+{
+    ngx_connection_t    *c;
+    ngx_http_request_t  *r;
+
+    r = ev->data;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http gzip thread: \"%V?%V\"", &r->uri, &r->args);
+
+    r->main->blocked--;
+    r->aio = 0;
+
+    /*
+     * the filters above may have nothing new to pass down for a while,
+     * e.g., the upstream pipe does not flush if it has no new data,
+     * so the output is continued here before the request handler
+     */
+
+    if (!c->error && ngx_http_gzip_body_filter(r, NULL) == NGX_ERROR) {
+        ngx_http_finalize_request(r, NGX_ERROR);
+
+    } else {
+        r->write_event_handler(r);
+    }
+
+    ngx_http_run_posted_requests(c);
+}
+
+#endif
+
+
 static void *
 ngx_http_gzip_filter_alloc(void *opaque, u_int items, u_int size)
 {
@@ -1073,6 +1284,11 @@ ngx_http_gzip_create_conf(ngx_conf_t *cf)
     conf->memlevel = NGX_CONF_UNSET_SIZE;
     conf->min_length = NGX_CONF_UNSET;
 
+#if (NGX_THREADS)
+    conf->thread_pool = NGX_CONF_UNSET_PTR;
+#endif
+    conf->threads_min_size = NGX_CONF_UNSET_SIZE;
+
     return conf;
 }
 
@@ -1097,6 +1313,12 @@ ngx_http_gzip_merge_conf(ngx_conf_t *cf, void *parent, void *child)
                               MAX_MEM_LEVEL - 1);
     ngx_conf_merge_value(conf->min_length, prev->min_length, 20);
 
+#if (NGX_THREADS)
+    ngx_conf_merge_ptr_value(conf->thread_pool, prev->thread_pool, NULL);
+#endif
+    ngx_conf_merge_size_value(conf->threads_min_size, prev->threads_min_size,
+                              16384);
+
     if (ngx_http_merge_types(cf, &conf->types_keys, &conf->types,
                              &prev->types_keys, &prev->types,
                              ngx_http_html_default_types)
@@ -1168,3 +1390,52 @@ ngx_http_gzip_hash(ngx_conf_t *cf, void *post, void *data)
 
     return "must be 512, 1k, 2k, 4k, 8k, 16k, 32k, 64k, or 128k";
 }
+
+
+static char *
+ngx_http_gzip_threads(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+#if (NGX_THREADS)
+    ngx_http_gzip_conf_t *gcf = conf;
+#endif
+
+    ngx_str_t  *value;
+
+    value = cf->args->elts;
+
+#if (NGX_THREADS)
+
+    if (gcf->thread_pool != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        gcf->thread_pool = NULL;
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strcmp(value[1].data, "on") == 0) {
+        gcf->thread_pool = ngx_thread_pool_add(cf, NULL);
+
+    } else {
+        gcf->thread_pool = ngx_thread_pool_add(cf, &value[1]);
+    }
+
+    if (gcf->thread_pool == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+
+#else
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        return NGX_CONF_OK;
+    }
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "\"gzip_threads\" is unsupported on this platform");
+    return NGX_CONF_ERROR;
+
+#endif
+}
@@ -18,7 +18,7 @@
 typedef struct {
     u_char                        color;
     u_char                        len;
-    u_short                       conn;
+    ngx_atomic_t                  conn;
     u_char                        data[1];
 } ngx_http_limit_conn_node_t;
 
@@ -30,18 +30,25 @@ typedef struct {
 
 
 typedef struct {
+    ngx_shmtx_sh_t                lock;
+    ngx_shmtx_t                   mutex;
     ngx_rbtree_t                  rbtree;
     ngx_rbtree_node_t             sentinel;
 } ngx_http_limit_conn_shctx_t;
 
 
 typedef struct {
-    ngx_http_limit_conn_shctx_t  *sh;
+    ngx_http_limit_conn_shctx_t  *sh;       /* array of nshards */
     ngx_slab_pool_t              *shpool;
+    ngx_uint_t                    nshards;
     ngx_http_complex_value_t      key;
 } ngx_http_limit_conn_ctx_t;
 
 
+#define ngx_http_limit_conn_shard(ctx, hash)                                 \
+    (&(ctx)->sh[(hash) % (ctx)->nshards])
+
+
 typedef struct {
     ngx_shm_zone_t               *shm_zone;
     ngx_uint_t                    conn;
@@ -60,6 +67,7 @@ static ngx_rbtree_node_t *ngx_http_limit_conn_lookup(ngx_rbtree_t *rbtree,
     ngx_str_t *key, uint32_t hash);
 static void ngx_http_limit_conn_cleanup(void *data);
 static ngx_inline void ngx_http_limit_conn_cleanup_all(ngx_pool_t *pool);
+static void ngx_http_limit_conn_unlock(ngx_shm_zone_t *shm_zone, ngx_pid_t pid);
 
 static ngx_int_t ngx_http_limit_conn_status_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
@@ -91,7 +99,7 @@ static ngx_conf_num_bounds_t  ngx_http_limit_conn_status_bounds = {
 static ngx_command_t  ngx_http_limit_conn_commands[] = {
 
     { ngx_string("limit_conn_zone"),
-      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE2,
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE23,
       ngx_http_limit_conn_zone,
       0,
       0,
@@ -189,6 +197,7 @@ ngx_http_limit_conn_handler(ngx_http_request_t *r)
     ngx_http_limit_conn_node_t     *lc;
     ngx_http_limit_conn_conf_t     *lccf;
     ngx_http_limit_conn_limit_t    *limits;
+    ngx_http_limit_conn_shctx_t    *shard;
     ngx_http_limit_conn_cleanup_t  *lccln;
 
     if (r->main->limit_conn_status) {
@@ -221,9 +230,11 @@ ngx_http_limit_conn_handler(ngx_http_request_t *r)
 
         hash = ngx_crc32_short(key.data, key.len);
 
-        ngx_shmtx_lock(&ctx->shpool->mutex);
+        shard = ngx_http_limit_conn_shard(ctx, hash);
 
-        node = ngx_http_limit_conn_lookup(&ctx->sh->rbtree, &key, hash);
+        ngx_shmtx_lock(&shard->mutex);
+
+        node = ngx_http_limit_conn_lookup(&shard->rbtree, &key, hash);
 
         if (node == NULL) {
 
@@ -231,10 +242,10 @@ ngx_http_limit_conn_handler(ngx_http_request_t *r)
                 + offsetof(ngx_http_limit_conn_node_t, data)
                 + key.len;
 
-            node = ngx_slab_alloc_locked(ctx->shpool, n);
+            node = ngx_slab_alloc(ctx->shpool, n);
 
             if (node == NULL) {
-                ngx_shmtx_unlock(&ctx->shpool->mutex);
+                ngx_shmtx_unlock(&shard->mutex);
                 ngx_http_limit_conn_cleanup_all(r->pool);
 
                 if (lccf->dry_run) {
@@ -255,7 +266,7 @@ ngx_http_limit_conn_handler(ngx_http_request_t *r)
             lc->conn = 1;
             ngx_memcpy(lc->data, key.data, key.len);
 
-            ngx_rbtree_insert(&ctx->sh->rbtree, node);
+            ngx_rbtree_insert(&shard->rbtree, node);
 
         } else {
 
@@ -263,7 +274,7 @@ ngx_http_limit_conn_handler(ngx_http_request_t *r)
 
             if ((ngx_uint_t) lc->conn >= limits[i].conn) {
 
-                ngx_shmtx_unlock(&ctx->shpool->mutex);
+                ngx_shmtx_unlock(&shard->mutex);
 
                 ngx_log_error(lccf->log_level, r->connection->log, 0,
                               "limiting connections%s by zone \"%V\"",
@@ -283,13 +294,15 @@ ngx_http_limit_conn_handler(ngx_http_request_t *r)
                 return lccf->status_code;
             }
 
-            lc->conn++;
+            /* the counter may be decremented without the lock held */
+
+            (void) ngx_atomic_fetch_add(&lc->conn, 1);
         }
 
         ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "limit conn: %08Xi %d", node->key, lc->conn);
+                       "limit conn: %08Xi %uA", node->key, lc->conn);
 
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        ngx_shmtx_unlock(&shard->mutex);
 
         cln = ngx_pool_cleanup_add(r->pool,
                                    sizeof(ngx_http_limit_conn_cleanup_t));
@@ -393,27 +406,52 @@ ngx_http_limit_conn_cleanup(void *data)
 {
     ngx_http_limit_conn_cleanup_t  *lccln = data;
 
-    ngx_rbtree_node_t           *node;
-    ngx_http_limit_conn_ctx_t   *ctx;
-    ngx_http_limit_conn_node_t  *lc;
+    ngx_atomic_uint_t             conn;
+    ngx_rbtree_node_t            *node;
+    ngx_http_limit_conn_ctx_t    *ctx;
+    ngx_http_limit_conn_node_t   *lc;
+    ngx_http_limit_conn_shctx_t  *shard;
 
     ctx = lccln->shm_zone->data;
     node = lccln->node;
     lc = (ngx_http_limit_conn_node_t *) &node->color;
 
-    ngx_shmtx_lock(&ctx->shpool->mutex);
-
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, lccln->shm_zone->shm.log, 0,
-                   "limit conn cleanup: %08Xi %d", node->key, lc->conn);
+                   "limit conn cleanup: %08Xi %uA", node->key, lc->conn);
+
+#if (NGX_HAVE_ATOMIC_OPS)
+
+    /*
+     * unless this is the last reference, the node cannot be deleted
+     * under us, and the counter is decremented without locking
+     */
+
+    for ( ;; ) {
+        conn = lc->conn;
+
+        if (conn <= 1) {
+            break;
+        }
 
-    lc->conn--;
+        if (ngx_atomic_cmp_set(&lc->conn, conn, conn - 1)) {
+            return;
+        }
+    }
+
+#endif
+
+    shard = ngx_http_limit_conn_shard(ctx, node->key);
 
-    if (lc->conn == 0) {
-        ngx_rbtree_delete(&ctx->sh->rbtree, node);
-        ngx_slab_free_locked(ctx->shpool, node);
+    ngx_shmtx_lock(&shard->mutex);
+
+    conn = ngx_atomic_fetch_add(&lc->conn, -1);
+
+    if (conn == 1) {
+        ngx_rbtree_delete(&shard->rbtree, node);
+        ngx_slab_free(ctx->shpool, node);
     }
 
-    ngx_shmtx_unlock(&ctx->shpool->mutex);
+    ngx_shmtx_unlock(&shard->mutex);
 }
 
 
@@ -438,8 +476,11 @@ ngx_http_limit_conn_init_zone(ngx_shm_zone_t *shm_zone, void *data)
 {
     ngx_http_limit_conn_ctx_t  *octx = data;
 
-    size_t                      len;
-    ngx_http_limit_conn_ctx_t  *ctx;
+    size_t                        len;
+    u_char                       *file;
+    ngx_uint_t                    n;
+    ngx_http_limit_conn_ctx_t    *ctx;
+    ngx_http_limit_conn_shctx_t  *shard;
 
     ctx = shm_zone->data;
 
@@ -457,6 +498,13 @@ ngx_http_limit_conn_init_zone(ngx_shm_zone_t *shm_zone, void *data)
             return NGX_ERROR;
         }
 
+        if (ctx->nshards != octx->nshards) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "limit_conn_zone \"%V\" had previously "
+                          "different shards", &shm_zone->shm.name);
+            return NGX_ERROR;
+        }
+
         ctx->sh = octx->sh;
         ctx->shpool = octx->shpool;
 
@@ -471,15 +519,43 @@ ngx_http_limit_conn_init_zone(ngx_shm_zone_t *shm_zone, void *data)
         return NGX_OK;
     }
 
-    ctx->sh = ngx_slab_alloc(ctx->shpool, sizeof(ngx_http_limit_conn_shctx_t));
+    ctx->sh = ngx_slab_calloc(ctx->shpool,
+                             ctx->nshards * sizeof(ngx_http_limit_conn_shctx_t));
     if (ctx->sh == NULL) {
         return NGX_ERROR;
     }
 
     ctx->shpool->data = ctx->sh;
 
-    ngx_rbtree_init(&ctx->sh->rbtree, &ctx->sh->sentinel,
-                    ngx_http_limit_conn_rbtree_insert_value);
+    for (n = 0; n < ctx->nshards; n++) {
+        shard = &ctx->sh[n];
+
+#if (NGX_HAVE_ATOMIC_OPS)
+
+        file = NULL;
+
+#else
+
+        len = ngx_cycle->lock_file.len + shm_zone->shm.name.len
+              + sizeof(".") + NGX_INT_T_LEN;
+
+        file = ngx_alloc(len, shm_zone->shm.log);
+        if (file == NULL) {
+            return NGX_ERROR;
+        }
+
+        (void) ngx_sprintf(file, "%V%V.%ui%Z", &ngx_cycle->lock_file,
+                           &shm_zone->shm.name, n);
+
+#endif
+
+        if (ngx_shmtx_create(&shard->mutex, &shard->lock, file) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        ngx_rbtree_init(&shard->rbtree, &shard->sentinel,
+                        ngx_http_limit_conn_rbtree_insert_value);
+    }
 
     len = sizeof(" in limit_conn_zone \"\"") + shm_zone->shm.name.len;
 
@@ -495,6 +571,27 @@ ngx_http_limit_conn_init_zone(ngx_shm_zone_t *shm_zone, void *data)
 }
 
 
+static void
+ngx_http_limit_conn_unlock(ngx_shm_zone_t *shm_zone, ngx_pid_t pid)
+{
+    ngx_http_limit_conn_ctx_t  *ctx = shm_zone->data;
+
+    ngx_uint_t  n;
+
+    if (ctx->sh == NULL) {
+        return;
+    }
+
+    for (n = 0; n < ctx->nshards; n++) {
+        if (ngx_shmtx_force_unlock(&ctx->sh[n].mutex, pid)) {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                          "limit_conn_zone \"%V\" shard %ui was locked by %P",
+                          &shm_zone->shm.name, n, pid);
+        }
+    }
+}
+
+
 static ngx_int_t
 ngx_http_limit_conn_status_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data)
@@ -564,6 +661,7 @@ ngx_http_limit_conn_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     u_char                            *p;
     ssize_t                            size;
     ngx_str_t                         *value, name, s;
+    ngx_int_t                          shards;
     ngx_uint_t                         i;
     ngx_shm_zone_t                    *shm_zone;
     ngx_http_limit_conn_ctx_t         *ctx;
@@ -587,6 +685,7 @@ ngx_http_limit_conn_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     }
 
     size = 0;
+    shards = 1;
     name.len = 0;
 
     for (i = 2; i < cf->args->nelts; i++) {
@@ -625,6 +724,18 @@ ngx_http_limit_conn_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "shards=", 7) == 0) {
+
+            shards = ngx_atoi(value[i].data + 7, value[i].len - 7);
+            if (shards == NGX_ERROR || shards == 0 || shards > 1024) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid shards value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "invalid parameter \"%V\"", &value[i]);
         return NGX_CONF_ERROR;
@@ -652,7 +763,10 @@ ngx_http_limit_conn_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    ctx->nshards = shards;
+
     shm_zone->init = ngx_http_limit_conn_init_zone;
+    shm_zone->unlock = ngx_http_limit_conn_unlock;
     shm_zone->data = ctx;
 
     return NGX_CONF_OK;
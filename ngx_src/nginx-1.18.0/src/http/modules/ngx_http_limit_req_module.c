@@ -17,6 +17,9 @@
 #define NGX_HTTP_LIMIT_REQ_REJECTED_DRY_RUN  5
 
 
+#define NGX_HTTP_LIMIT_REQ_SKETCH_DEPTH      4
+
+
 typedef struct {
     u_char                       color;
     u_char                       dummy;
@@ -31,22 +34,43 @@ typedef struct {
 
 
 typedef struct {
+    ngx_msec_t                   last;
+    /* integer value, 1 corresponds to 0.001 r/s */
+    ngx_uint_t                   excess;
+} ngx_http_limit_req_cell_t;
+
+
+typedef struct {
+    ngx_shmtx_sh_t                lock;
+    ngx_shmtx_t                   mutex;
     ngx_rbtree_t                  rbtree;
     ngx_rbtree_node_t             sentinel;
     ngx_queue_t                   queue;
+    ngx_http_limit_req_cell_t    *cells;
 } ngx_http_limit_req_shctx_t;
 
 
 typedef struct {
-    ngx_http_limit_req_shctx_t  *sh;
+    ngx_http_limit_req_shctx_t  *sh;        /* array of nshards */
     ngx_slab_pool_t             *shpool;
+    ngx_uint_t                   nshards;
     /* integer value, 1 corresponds to 0.001 r/s */
     ngx_uint_t                   rate;
     ngx_http_complex_value_t     key;
     ngx_http_limit_req_node_t   *node;
+    ngx_http_limit_req_shctx_t  *shard;
+
+    /* count-min sketch row width, 0 if keys are stored in the rbtree */
+    ngx_uint_t                   width;
+    ngx_uint_t                   sketch;    /* unsigned  sketch:1 */
+    ngx_http_limit_req_cell_t   *cells[NGX_HTTP_LIMIT_REQ_SKETCH_DEPTH];
 } ngx_http_limit_req_ctx_t;
 
 
+#define ngx_http_limit_req_shard(ctx, hash)                                  \
+    (&(ctx)->sh[(hash) % (ctx)->nshards])
+
+
 typedef struct {
     ngx_shm_zone_t              *shm_zone;
     /* integer value, 1 corresponds to 0.001 r/s */
@@ -66,11 +90,20 @@ typedef struct {
 
 static void ngx_http_limit_req_delay(ngx_http_request_t *r);
 static ngx_int_t ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit,
-    ngx_uint_t hash, ngx_str_t *key, ngx_uint_t *ep, ngx_uint_t account);
+    ngx_http_limit_req_shctx_t *shard, ngx_uint_t hash, ngx_str_t *key,
+    ngx_uint_t *ep, ngx_uint_t account);
 static ngx_msec_t ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits,
     ngx_uint_t n, ngx_uint_t *ep, ngx_http_limit_req_limit_t **limit);
 static void ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx,
-    ngx_uint_t n);
+    ngx_http_limit_req_shctx_t *shard, ngx_uint_t n);
+static ngx_int_t ngx_http_limit_req_sketch_lookup(
+    ngx_http_limit_req_limit_t *limit, ngx_http_limit_req_shctx_t *shard,
+    ngx_uint_t hash, ngx_str_t *key, ngx_uint_t *ep, ngx_uint_t account);
+static ngx_int_t ngx_http_limit_req_sketch_excess(
+    ngx_http_limit_req_ctx_t *ctx, ngx_msec_t now);
+static void ngx_http_limit_req_sketch_update(ngx_http_limit_req_ctx_t *ctx,
+    ngx_int_t excess, ngx_msec_t now);
+static void ngx_http_limit_req_unlock(ngx_shm_zone_t *shm_zone, ngx_pid_t pid);
 
 static ngx_int_t ngx_http_limit_req_status_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
@@ -102,7 +135,7 @@ static ngx_conf_num_bounds_t  ngx_http_limit_req_status_bounds = {
 static ngx_command_t  ngx_http_limit_req_commands[] = {
 
     { ngx_string("limit_req_zone"),
-      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE3,
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE3|NGX_CONF_TAKE4|NGX_CONF_TAKE5,
       ngx_http_limit_req_zone,
       0,
       0,
@@ -199,6 +232,7 @@ ngx_http_limit_req_handler(ngx_http_request_t *r)
     ngx_msec_t                   delay;
     ngx_http_limit_req_ctx_t    *ctx;
     ngx_http_limit_req_conf_t   *lrcf;
+    ngx_http_limit_req_shctx_t  *shard;
     ngx_http_limit_req_limit_t  *limit, *limits;
 
     if (r->main->limit_req_status) {
@@ -240,12 +274,21 @@ ngx_http_limit_req_handler(ngx_http_request_t *r)
 
         hash = ngx_crc32_short(key.data, key.len);
 
-        ngx_shmtx_lock(&ctx->shpool->mutex);
+        shard = ngx_http_limit_req_shard(ctx, hash);
+
+        ngx_shmtx_lock(&shard->mutex);
+
+        if (ctx->sketch) {
+            rc = ngx_http_limit_req_sketch_lookup(limit, shard, hash, &key,
+                                                  &excess,
+                                                  (n == lrcf->limits.nelts - 1));
 
-        rc = ngx_http_limit_req_lookup(limit, hash, &key, &excess,
-                                       (n == lrcf->limits.nelts - 1));
+        } else {
+            rc = ngx_http_limit_req_lookup(limit, shard, hash, &key, &excess,
+                                           (n == lrcf->limits.nelts - 1));
+        }
 
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        ngx_shmtx_unlock(&shard->mutex);
 
         ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                        "limit_req[%ui]: %i %ui.%03ui",
@@ -274,16 +317,18 @@ ngx_http_limit_req_handler(ngx_http_request_t *r)
             ctx = limits[n].shm_zone->data;
 
             if (ctx->node == NULL) {
+                ctx->shard = NULL;
                 continue;
             }
 
-            ngx_shmtx_lock(&ctx->shpool->mutex);
+            ngx_shmtx_lock(&ctx->shard->mutex);
 
             ctx->node->count--;
 
-            ngx_shmtx_unlock(&ctx->shpool->mutex);
+            ngx_shmtx_unlock(&ctx->shard->mutex);
 
             ctx->node = NULL;
+            ctx->shard = NULL;
         }
 
         if (lrcf->dry_run) {
@@ -408,8 +453,9 @@ ngx_http_limit_req_rbtree_insert_value(ngx_rbtree_node_t *temp,
 
 
 static ngx_int_t
-ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
-    ngx_str_t *key, ngx_uint_t *ep, ngx_uint_t account)
+ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit,
+    ngx_http_limit_req_shctx_t *shard, ngx_uint_t hash, ngx_str_t *key,
+    ngx_uint_t *ep, ngx_uint_t account)
 {
     size_t                      size;
     ngx_int_t                   rc, excess;
@@ -423,8 +469,8 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
 
     ctx = limit->shm_zone->data;
 
-    node = ctx->sh->rbtree.root;
-    sentinel = ctx->sh->rbtree.sentinel;
+    node = shard->rbtree.root;
+    sentinel = shard->rbtree.sentinel;
 
     while (node != sentinel) {
 
@@ -446,7 +492,7 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
 
         if (rc == 0) {
             ngx_queue_remove(&lr->queue);
-            ngx_queue_insert_head(&ctx->sh->queue, &lr->queue);
+            ngx_queue_insert_head(&shard->queue, &lr->queue);
 
             ms = (ngx_msec_int_t) (now - lr->last);
 
@@ -482,6 +528,7 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
             lr->count++;
 
             ctx->node = lr;
+            ctx->shard = shard;
 
             return NGX_AGAIN;
         }
@@ -495,14 +542,14 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
            + offsetof(ngx_http_limit_req_node_t, data)
            + key->len;
 
-    ngx_http_limit_req_expire(ctx, 1);
+    ngx_http_limit_req_expire(ctx, shard, 1);
 
-    node = ngx_slab_alloc_locked(ctx->shpool, size);
+    node = ngx_slab_alloc(ctx->shpool, size);
 
     if (node == NULL) {
-        ngx_http_limit_req_expire(ctx, 0);
+        ngx_http_limit_req_expire(ctx, shard, 0);
 
-        node = ngx_slab_alloc_locked(ctx->shpool, size);
+        node = ngx_slab_alloc(ctx->shpool, size);
         if (node == NULL) {
             ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
                           "could not allocate node%s", ctx->shpool->log_ctx);
@@ -519,9 +566,9 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
 
     ngx_memcpy(lr->data, key->data, key->len);
 
-    ngx_rbtree_insert(&ctx->sh->rbtree, node);
+    ngx_rbtree_insert(&shard->rbtree, node);
 
-    ngx_queue_insert_head(&ctx->sh->queue, &lr->queue);
+    ngx_queue_insert_head(&shard->queue, &lr->queue);
 
     if (account) {
         lr->last = now;
@@ -533,6 +580,7 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
     lr->count = 1;
 
     ctx->node = lr;
+    ctx->shard = shard;
 
     return NGX_AGAIN;
 }
@@ -560,40 +608,48 @@ ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits, ngx_uint_t n,
 
     while (n--) {
         ctx = limits[n].shm_zone->data;
-        lr = ctx->node;
 
-        if (lr == NULL) {
+        if (ctx->shard == NULL) {
             continue;
         }
 
-        ngx_shmtx_lock(&ctx->shpool->mutex);
+        ngx_shmtx_lock(&ctx->shard->mutex);
 
         now = ngx_current_msec;
-        ms = (ngx_msec_int_t) (now - lr->last);
 
-        if (ms < -60000) {
-            ms = 1;
+        if (ctx->sketch) {
+            excess = ngx_http_limit_req_sketch_excess(ctx, now);
+            ngx_http_limit_req_sketch_update(ctx, excess, now);
 
-        } else if (ms < 0) {
-            ms = 0;
-        }
+        } else {
+            lr = ctx->node;
+            ms = (ngx_msec_int_t) (now - lr->last);
+
+            if (ms < -60000) {
+                ms = 1;
 
-        excess = lr->excess - ctx->rate * ms / 1000 + 1000;
+            } else if (ms < 0) {
+                ms = 0;
+            }
 
-        if (excess < 0) {
-            excess = 0;
-        }
+            excess = lr->excess - ctx->rate * ms / 1000 + 1000;
 
-        if (ms) {
-            lr->last = now;
-        }
+            if (excess < 0) {
+                excess = 0;
+            }
 
-        lr->excess = excess;
-        lr->count--;
+            if (ms) {
+                lr->last = now;
+            }
 
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+            lr->excess = excess;
+            lr->count--;
+        }
+
+        ngx_shmtx_unlock(&ctx->shard->mutex);
 
         ctx->node = NULL;
+        ctx->shard = NULL;
 
         if ((ngx_uint_t) excess <= limits[n].delay) {
             continue;
@@ -613,7 +669,8 @@ ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits, ngx_uint_t n,
 
 
 static void
-ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx, ngx_uint_t n)
+ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx,
+    ngx_http_limit_req_shctx_t *shard, ngx_uint_t n)
 {
     ngx_int_t                   excess;
     ngx_msec_t                  now;
@@ -632,11 +689,11 @@ ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx, ngx_uint_t n)
 
     while (n < 3) {
 
-        if (ngx_queue_empty(&ctx->sh->queue)) {
+        if (ngx_queue_empty(&shard->queue)) {
             return;
         }
 
-        q = ngx_queue_last(&ctx->sh->queue);
+        q = ngx_queue_last(&shard->queue);
 
         lr = ngx_queue_data(q, ngx_http_limit_req_node_t, queue);
 
@@ -671,9 +728,139 @@ ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx, ngx_uint_t n)
         node = (ngx_rbtree_node_t *)
                    ((u_char *) lr - offsetof(ngx_rbtree_node_t, color));
 
-        ngx_rbtree_delete(&ctx->sh->rbtree, node);
+        ngx_rbtree_delete(&shard->rbtree, node);
 
-        ngx_slab_free_locked(ctx->shpool, node);
+        ngx_slab_free(ctx->shpool, node);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_limit_req_sketch_lookup(ngx_http_limit_req_limit_t *limit,
+    ngx_http_limit_req_shctx_t *shard, ngx_uint_t hash, ngx_str_t *key,
+    ngx_uint_t *ep, ngx_uint_t account)
+{
+    uint32_t                   h1, h2;
+    ngx_int_t                  excess;
+    ngx_msec_t                 now;
+    ngx_uint_t                 i;
+    ngx_http_limit_req_ctx_t  *ctx;
+
+    ctx = limit->shm_zone->data;
+
+    /*
+     * the key is mapped to a cell in each row of the shard by double
+     * hashing; the rows are independent of the hash used to select
+     * the shard
+     */
+
+    h1 = ngx_murmur_hash2(key->data, key->len);
+    h2 = (uint32_t) (hash / ctx->nshards) | 1;
+
+    for (i = 0; i < NGX_HTTP_LIMIT_REQ_SKETCH_DEPTH; i++) {
+        ctx->cells[i] = &shard->cells[i * ctx->width
+                                      + (h1 + i * h2) % ctx->width];
+    }
+
+    now = ngx_current_msec;
+
+    excess = ngx_http_limit_req_sketch_excess(ctx, now);
+
+    *ep = excess;
+
+    if ((ngx_uint_t) excess > limit->burst) {
+        return NGX_BUSY;
+    }
+
+    if (account) {
+        ngx_http_limit_req_sketch_update(ctx, excess, now);
+        return NGX_OK;
+    }
+
+    ctx->shard = shard;
+
+    return NGX_AGAIN;
+}
+
+
+static ngx_int_t
+ngx_http_limit_req_sketch_excess(ngx_http_limit_req_ctx_t *ctx,
+    ngx_msec_t now)
+{
+    ngx_int_t                   excess, min;
+    ngx_uint_t                  i;
+    ngx_msec_int_t              ms;
+    ngx_http_limit_req_cell_t  *cell;
+
+    /*
+     * the excess of a key is estimated as the minimum over its cells,
+     * a cell never used before means that the key is new
+     */
+
+    min = NGX_MAX_INT_T_VALUE;
+
+    for (i = 0; i < NGX_HTTP_LIMIT_REQ_SKETCH_DEPTH; i++) {
+        cell = ctx->cells[i];
+
+        if (cell->last == 0) {
+            return 0;
+        }
+
+        ms = (ngx_msec_int_t) (now - cell->last);
+
+        if (ms < -60000) {
+            ms = 1;
+
+        } else if (ms < 0) {
+            ms = 0;
+        }
+
+        excess = cell->excess - ctx->rate * ms / 1000 + 1000;
+
+        if (excess < min) {
+            min = excess;
+        }
+    }
+
+    return (min < 0) ? 0 : min;
+}
+
+
+static void
+ngx_http_limit_req_sketch_update(ngx_http_limit_req_ctx_t *ctx,
+    ngx_int_t excess, ngx_msec_t now)
+{
+    ngx_int_t                   e;
+    ngx_uint_t                  i;
+    ngx_msec_int_t              ms;
+    ngx_http_limit_req_cell_t  *cell;
+
+    /*
+     * conservative update: a cell is only raised to the new excess
+     * of the key, so cells shared with heavier keys are not inflated
+     */
+
+    for (i = 0; i < NGX_HTTP_LIMIT_REQ_SKETCH_DEPTH; i++) {
+        cell = ctx->cells[i];
+
+        if (cell->last == 0) {
+            e = 0;
+
+        } else {
+            ms = (ngx_msec_int_t) (now - cell->last);
+
+            if (ms < -60000) {
+                ms = 1;
+
+            } else if (ms < 0) {
+                ms = 0;
+            }
+
+            e = cell->excess - ctx->rate * ms / 1000;
+        }
+
+        cell->excess = ngx_max(e, excess);
+        cell->last = now;
     }
 }
 
@@ -683,8 +870,11 @@ ngx_http_limit_req_init_zone(ngx_shm_zone_t *shm_zone, void *data)
 {
     ngx_http_limit_req_ctx_t  *octx = data;
 
-    size_t                     len;
-    ngx_http_limit_req_ctx_t  *ctx;
+    size_t                       len;
+    u_char                      *file;
+    ngx_uint_t                   n;
+    ngx_http_limit_req_ctx_t    *ctx;
+    ngx_http_limit_req_shctx_t  *shard;
 
     ctx = shm_zone->data;
 
@@ -702,8 +892,23 @@ ngx_http_limit_req_init_zone(ngx_shm_zone_t *shm_zone, void *data)
             return NGX_ERROR;
         }
 
+        if (ctx->nshards != octx->nshards) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "limit_req \"%V\" had previously different shards",
+                          &shm_zone->shm.name);
+            return NGX_ERROR;
+        }
+
+        if (ctx->sketch != octx->sketch) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "limit_req \"%V\" had previously different type",
+                          &shm_zone->shm.name);
+            return NGX_ERROR;
+        }
+
         ctx->sh = octx->sh;
         ctx->shpool = octx->shpool;
+        ctx->width = octx->width;
 
         return NGX_OK;
     }
@@ -716,17 +921,45 @@ ngx_http_limit_req_init_zone(ngx_shm_zone_t *shm_zone, void *data)
         return NGX_OK;
     }
 
-    ctx->sh = ngx_slab_alloc(ctx->shpool, sizeof(ngx_http_limit_req_shctx_t));
+    ctx->sh = ngx_slab_calloc(ctx->shpool,
+                              ctx->nshards * sizeof(ngx_http_limit_req_shctx_t));
     if (ctx->sh == NULL) {
         return NGX_ERROR;
     }
 
     ctx->shpool->data = ctx->sh;
 
-    ngx_rbtree_init(&ctx->sh->rbtree, &ctx->sh->sentinel,
-                    ngx_http_limit_req_rbtree_insert_value);
+    for (n = 0; n < ctx->nshards; n++) {
+        shard = &ctx->sh[n];
+
+#if (NGX_HAVE_ATOMIC_OPS)
+
+        file = NULL;
+
+#else
+
+        len = ngx_cycle->lock_file.len + shm_zone->shm.name.len
+              + sizeof(".") + NGX_INT_T_LEN;
+
+        file = ngx_alloc(len, shm_zone->shm.log);
+        if (file == NULL) {
+            return NGX_ERROR;
+        }
+
+        (void) ngx_sprintf(file, "%V%V.%ui%Z", &ngx_cycle->lock_file,
+                           &shm_zone->shm.name, n);
+
+#endif
+
+        if (ngx_shmtx_create(&shard->mutex, &shard->lock, file) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        ngx_rbtree_init(&shard->rbtree, &shard->sentinel,
+                        ngx_http_limit_req_rbtree_insert_value);
 
-    ngx_queue_init(&ctx->sh->queue);
+        ngx_queue_init(&shard->queue);
+    }
 
     len = sizeof(" in limit_req zone \"\"") + shm_zone->shm.name.len;
 
@@ -740,10 +973,63 @@ ngx_http_limit_req_init_zone(ngx_shm_zone_t *shm_zone, void *data)
 
     ctx->shpool->log_nomem = 0;
 
+    if (!ctx->sketch) {
+        return NGX_OK;
+    }
+
+    /* the sketch takes all the remaining memory of the zone */
+
+    len = ctx->shpool->pfree / ctx->nshards * ngx_pagesize;
+
+    ctx->width = len / (NGX_HTTP_LIMIT_REQ_SKETCH_DEPTH
+                        * sizeof(ngx_http_limit_req_cell_t));
+
+    if (ctx->width == 0) {
+        ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                      "limit_req \"%V\" is too small for %ui shards",
+                      &shm_zone->shm.name, ctx->nshards);
+        return NGX_ERROR;
+    }
+
+    len = ctx->width * NGX_HTTP_LIMIT_REQ_SKETCH_DEPTH
+          * sizeof(ngx_http_limit_req_cell_t);
+
+    for (n = 0; n < ctx->nshards; n++) {
+        ctx->sh[n].cells = ngx_slab_calloc(ctx->shpool, len);
+        if (ctx->sh[n].cells == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, shm_zone->shm.log, 0,
+                   "limit_req sketch: %ui shards, width %ui",
+                   ctx->nshards, ctx->width);
+
     return NGX_OK;
 }
 
 
+static void
+ngx_http_limit_req_unlock(ngx_shm_zone_t *shm_zone, ngx_pid_t pid)
+{
+    ngx_http_limit_req_ctx_t  *ctx = shm_zone->data;
+
+    ngx_uint_t  n;
+
+    if (ctx->sh == NULL) {
+        return;
+    }
+
+    for (n = 0; n < ctx->nshards; n++) {
+        if (ngx_shmtx_force_unlock(&ctx->sh[n].mutex, pid)) {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                          "limit_req \"%V\" shard %ui was locked by %P",
+                          &shm_zone->shm.name, n, pid);
+        }
+    }
+}
+
+
 static ngx_int_t
 ngx_http_limit_req_status_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data)
@@ -819,7 +1105,7 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     size_t                             len;
     ssize_t                            size;
     ngx_str_t                         *value, name, s;
-    ngx_int_t                          rate, scale;
+    ngx_int_t                          rate, scale, shards;
     ngx_uint_t                         i;
     ngx_shm_zone_t                    *shm_zone;
     ngx_http_limit_req_ctx_t          *ctx;
@@ -845,6 +1131,7 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     size = 0;
     rate = 1;
     scale = 1;
+    shards = 1;
     name.len = 0;
 
     for (i = 2; i < cf->args->nelts; i++) {
@@ -907,6 +1194,28 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "shards=", 7) == 0) {
+
+            shards = ngx_atoi(value[i].data + 7, value[i].len - 7);
+            if (shards == NGX_ERROR || shards == 0 || shards > 1024) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid shards value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "type=rbtree") == 0) {
+            ctx->sketch = 0;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "type=sketch") == 0) {
+            ctx->sketch = 1;
+            continue;
+        }
+
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "invalid parameter \"%V\"", &value[i]);
         return NGX_CONF_ERROR;
@@ -920,6 +1229,7 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     }
 
     ctx->rate = rate * 1000 / scale;
+    ctx->nshards = shards;
 
     shm_zone = ngx_shared_memory_add(cf, &name, size,
                                      &ngx_http_limit_req_module);
@@ -937,6 +1247,7 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     }
 
     shm_zone->init = ngx_http_limit_req_init_zone;
+    shm_zone->unlock = ngx_http_limit_req_unlock;
     shm_zone->data = ctx;
 
     return NGX_CONF_OK;
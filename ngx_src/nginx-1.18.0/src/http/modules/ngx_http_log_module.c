@@ -52,9 +52,33 @@ typedef struct {
     ngx_event_t                *event;
     ngx_msec_t                  flush;
     ngx_int_t                   gzip;
+
+#if (NGX_THREADS)
+    ngx_thread_pool_t          *thread_pool;
+    ngx_thread_task_t          *task;
+    u_char                     *spare;
+    ngx_uint_t                  entries;
+    ngx_uint_t                  dropped;
+#endif
 } ngx_http_log_buf_t;
 
 
+#if (NGX_THREADS)
+
+typedef struct {
+    ngx_fd_t                    fd;
+    u_char                     *buf;
+    size_t                      len;
+    ngx_int_t                   gzip;
+    ngx_uint_t                  entries;
+    ssize_t                     n;
+    ngx_err_t                   err;
+    ngx_atomic_t                done;
+} ngx_http_log_thread_ctx_t;
+
+#endif
+
+
 typedef struct {
     ngx_array_t                *lengths;
     ngx_array_t                *values;
@@ -111,6 +135,16 @@ static void ngx_http_log_gzip_free(void *opaque, void *address);
 static void ngx_http_log_flush(ngx_open_file_t *file, ngx_log_t *log);
 static void ngx_http_log_flush_handler(ngx_event_t *ev);
 
+#if (NGX_THREADS)
+static ngx_int_t ngx_http_log_thread_write(ngx_open_file_t *file,
+    ngx_log_t *log);
+static void ngx_http_log_thread_handler(void *data, ngx_log_t *log);
+static void ngx_http_log_thread_event_handler(ngx_event_t *ev);
+static void ngx_http_log_thread_wait(ngx_open_file_t *file, ngx_log_t *log);
+static void ngx_http_log_report_dropped(ngx_open_file_t *file,
+    ngx_log_t *log);
+#endif
+
 static u_char *ngx_http_log_pipe(ngx_http_request_t *r, u_char *buf,
     ngx_http_log_op_t *op);
 static u_char *ngx_http_log_time(ngx_http_request_t *r, u_char *buf,
@@ -325,6 +359,37 @@ ngx_http_log_handler(ngx_http_request_t *r)
 
         if (buffer) {
 
+#if (NGX_THREADS)
+            if (buffer->thread_pool) {
+
+                /*
+                 * the worker only copies the line into the buffer, while
+                 * compression and writing are done by a thread; if both
+                 * buffers are busy, the line is dropped instead of blocking
+                 */
+
+                if (len > (size_t) (buffer->last - buffer->pos)) {
+                    (void) ngx_http_log_thread_write(log[l].file,
+                                                     r->connection->log);
+                }
+
+                if (len > (size_t) (buffer->last - buffer->start)) {
+
+                    /* a line larger than the buffer is written directly */
+
+                    goto alloc_line;
+                }
+
+                if (len > (size_t) (buffer->last - buffer->pos)) {
+                    buffer->dropped++;
+                    continue;
+                }
+
+                buffer->entries++;
+
+            } else
+#endif
+
             if (len > (size_t) (buffer->last - buffer->pos)) {
 
                 ngx_http_log_write(r, &log[l], buffer->start,
@@ -724,6 +789,12 @@ ngx_http_log_flush(ngx_open_file_t *file, ngx_log_t *log)
 
     buffer = file->data;
 
+#if (NGX_THREADS)
+    if (buffer->thread_pool) {
+        ngx_http_log_thread_wait(file, log);
+    }
+#endif
+
     len = buffer->pos - buffer->start;
 
     if (len == 0) {
@@ -756,19 +827,229 @@ ngx_http_log_flush(ngx_open_file_t *file, ngx_log_t *log)
     if (buffer->event && buffer->event->timer_set) {
         ngx_del_timer(buffer->event);
     }
+
+#if (NGX_THREADS)
+    buffer->entries = 0;
+
+    ngx_http_log_report_dropped(file, log);
+#endif
 }
 
 
 static void
 ngx_http_log_flush_handler(ngx_event_t *ev)
 {
+#if (NGX_THREADS)
+    ngx_open_file_t     *file;
+    ngx_http_log_buf_t  *buffer;
+#endif
+
     ngx_log_debug0(NGX_LOG_DEBUG_EVENT, ev->log, 0,
                    "http log buffer flush handler");
 
+#if (NGX_THREADS)
+    file = ev->data;
+    buffer = file->data;
+
+    if (buffer->thread_pool) {
+        if (ngx_http_log_thread_write(file, ev->log) == NGX_BUSY) {
+            ngx_add_timer(ev, buffer->flush);
+        }
+
+        return;
+    }
+#endif
+
     ngx_http_log_flush(ev->data, ev->log);
 }
 
 
+#if (NGX_THREADS)
+
+static ngx_int_t
+ngx_http_log_thread_write(ngx_open_file_t *file, ngx_log_t *log)
+{
+    u_char                     *p;
+    size_t                      len;
+    ngx_thread_task_t          *task;
+    ngx_http_log_buf_t         *buffer;
+    ngx_http_log_thread_ctx_t  *ctx;
+
+    buffer = file->data;
+
+    len = buffer->pos - buffer->start;
+
+    if (len == 0) {
+        return NGX_OK;
+    }
+
+    task = buffer->task;
+
+    if (task->event.active) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "http log thread write busy \"%s\"", file->name.data);
+        return NGX_BUSY;
+    }
+
+    ctx = task->ctx;
+
+    /*
+     * the descriptor is duplicated as the file may be reopened
+     * while the thread is still writing to it
+     */
+
+    ctx->fd = dup(file->fd);
+
+    if (ctx->fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      "dup() of \"%s\" failed", file->name.data);
+        return NGX_ERROR;
+    }
+
+    ctx->buf = buffer->start;
+    ctx->len = len;
+    ctx->gzip = buffer->gzip;
+    ctx->entries = buffer->entries;
+    ctx->done = 0;
+
+    task->handler = ngx_http_log_thread_handler;
+    task->event.data = file;
+    task->event.handler = ngx_http_log_thread_event_handler;
+
+    if (ngx_thread_task_post(buffer->thread_pool, task) != NGX_OK) {
+        (void) ngx_close_file(ctx->fd);
+        return NGX_ERROR;
+    }
+
+    /* swap buffers: the spare one is free as no task is active */
+
+    p = buffer->spare;
+    buffer->spare = buffer->start;
+
+    buffer->last = p + (buffer->last - buffer->start);
+    buffer->start = p;
+    buffer->pos = p;
+    buffer->entries = 0;
+
+    if (buffer->event && buffer->event->timer_set) {
+        ngx_del_timer(buffer->event);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_log_thread_handler(void *data, ngx_log_t *log)
+{
+    ngx_http_log_thread_ctx_t *ctx = data;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, log, 0,
+                   "http log thread write: %d, %uz", ctx->fd, ctx->len);
+
+#if (NGX_ZLIB)
+    if (ctx->gzip) {
+        ctx->n = ngx_http_log_gzip(ctx->fd, ctx->buf, ctx->len, ctx->gzip,
+                                   log);
+    } else {
+        ctx->n = ngx_write_fd(ctx->fd, ctx->buf, ctx->len);
+    }
+#else
+    ctx->n = ngx_write_fd(ctx->fd, ctx->buf, ctx->len);
+#endif
+
+    ctx->err = (ctx->n == -1) ? ngx_errno : 0;
+
+    (void) ngx_close_file(ctx->fd);
+
+    ngx_memory_barrier();
+
+    ctx->done = 1;
+}
+
+
+static void
+ngx_http_log_thread_event_handler(ngx_event_t *ev)
+{
+    ngx_open_file_t            *file;
+    ngx_thread_task_t          *task;
+    ngx_http_log_buf_t         *buffer;
+    ngx_http_log_thread_ctx_t  *ctx;
+
+    file = ev->data;
+    buffer = file->data;
+    task = buffer->task;
+    ctx = task->ctx;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "http log thread write done: %z", ctx->n);
+
+    if (ctx->n == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ev->log, ctx->err,
+                      ngx_write_fd_n " to \"%s\" failed", file->name.data);
+
+        buffer->dropped += ctx->entries;
+
+    } else if ((size_t) ctx->n != ctx->len) {
+        ngx_log_error(NGX_LOG_ALERT, ev->log, 0,
+                      ngx_write_fd_n " to \"%s\" was incomplete: %z of %uz",
+                      file->name.data, ctx->n, ctx->len);
+    }
+
+    ngx_http_log_report_dropped(file, ev->log);
+}
+
+
+static void
+ngx_http_log_thread_wait(ngx_open_file_t *file, ngx_log_t *log)
+{
+    ngx_http_log_buf_t         *buffer;
+    ngx_http_log_thread_ctx_t  *ctx;
+
+    buffer = file->data;
+
+    if (!buffer->task->event.active) {
+        return;
+    }
+
+    ctx = buffer->task->ctx;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "http log thread write wait \"%s\"", file->name.data);
+
+    /*
+     * the file is about to be reopened or the process exits, so the
+     * lines being written by the thread must reach the old file first;
+     * the completion event itself is still handled later
+     */
+
+    while (!ctx->done) {
+        ngx_msleep(1);
+    }
+}
+
+
+static void
+ngx_http_log_report_dropped(ngx_open_file_t *file, ngx_log_t *log)
+{
+    ngx_http_log_buf_t  *buffer;
+
+    buffer = file->data;
+
+    if (buffer->dropped == 0) {
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_WARN, log, 0,
+                  "%ui access log entries dropped for \"%s\"",
+                  buffer->dropped, file->name.data);
+
+    buffer->dropped = 0;
+}
+
+#endif
+
+
 static u_char *
 ngx_http_log_copy_short(ngx_http_request_t *r, u_char *buf,
     ngx_http_log_op_t *op)
@@ -1251,6 +1532,9 @@ ngx_http_log_set_log(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_http_log_main_conf_t          *lmcf;
     ngx_http_script_compile_t          sc;
     ngx_http_compile_complex_value_t   ccv;
+#if (NGX_THREADS)
+    ngx_thread_pool_t                 *tp;
+#endif
 
     value = cf->args->elts;
 
@@ -1364,6 +1648,9 @@ process_formats:
     size = 0;
     flush = 0;
     gzip = 0;
+#if (NGX_THREADS)
+    tp = NULL;
+#endif
 
     for (i = 3; i < cf->args->nelts; i++) {
 
@@ -1430,6 +1717,37 @@ process_formats:
 #endif
         }
 
+        if (ngx_strncmp(value[i].data, "async", 5) == 0
+            && (value[i].len == 5 || value[i].data[5] == '='))
+        {
+#if (NGX_THREADS)
+            if (size == 0) {
+                size = 64 * 1024;
+            }
+
+            if (value[i].len == 5) {
+                tp = ngx_thread_pool_add(cf, NULL);
+
+            } else {
+                s.len = value[i].len - 6;
+                s.data = value[i].data + 6;
+
+                tp = ngx_thread_pool_add(cf, &s);
+            }
+
+            if (tp == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+
+#else
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"async\" is unsupported on this platform");
+            return NGX_CONF_ERROR;
+#endif
+        }
+
         if (ngx_strncmp(value[i].data, "if=", 3) == 0) {
             s.len = value[i].len - 3;
             s.data = value[i].data + 3;
@@ -1484,7 +1802,11 @@ process_formats:
 
             if (buffer->last - buffer->start != size
                 || buffer->flush != flush
-                || buffer->gzip != gzip)
+                || buffer->gzip != gzip
+#if (NGX_THREADS)
+                || buffer->thread_pool != tp
+#endif
+                )
             {
                 ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                                    "access_log \"%V\" already defined "
@@ -1525,6 +1847,24 @@ process_formats:
 
         buffer->gzip = gzip;
 
+#if (NGX_THREADS)
+        if (tp) {
+            buffer->spare = ngx_pnalloc(cf->pool, size);
+            if (buffer->spare == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            buffer->task = ngx_thread_task_alloc(cf->pool,
+                                             sizeof(ngx_http_log_thread_ctx_t));
+            if (buffer->task == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            buffer->task->event.log = &cf->cycle->new_log;
+            buffer->thread_pool = tp;
+        }
+#endif
+
         log->file->flush = ngx_http_log_flush;
         log->file->data = buffer;
     }
@@ -357,6 +357,31 @@ ngx_http_map_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         map->map.nregex = ctx.regexes.nelts;
     }
 
+    if (ctx.regexes.nelts >= NGX_REGEX_SET_MIN) {
+        ngx_str_t             *patterns;
+        ngx_uint_t             i;
+        ngx_http_map_regex_t  *reg;
+
+        patterns = ngx_palloc(pool, ctx.regexes.nelts * sizeof(ngx_str_t));
+        if (patterns == NULL) {
+            ngx_destroy_pool(pool);
+            return NGX_CONF_ERROR;
+        }
+
+        reg = ctx.regexes.elts;
+
+        for (i = 0; i < ctx.regexes.nelts; i++) {
+            patterns[i] = reg[i].regex->name;
+        }
+
+        map->map.regex_set = ngx_regex_set_init(cf->pool, pool, patterns,
+                                                ctx.regexes.nelts);
+        if (map->map.regex_set == NULL) {
+            ngx_destroy_pool(pool);
+            return NGX_CONF_ERROR;
+        }
+    }
+
 #endif
 
     ngx_destroy_pool(pool);
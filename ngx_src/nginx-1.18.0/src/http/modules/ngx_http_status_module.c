@@ -0,0 +1,1311 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define NGX_HTTP_STATUS_JSON        1
+#define NGX_HTTP_STATUS_PROMETHEUS  2
+
+#define NGX_HTTP_STATUS_BUCKETS     64
+
+#define NGX_HTTP_STATUS_POOL_CACHE_STRIDE                                     \
+    ngx_align(sizeof(ngx_pool_cache_stat_t), NGX_CPU_CACHE_LINE)
+
+
+/*
+ * Each worker process owns a private row of counters in shared memory
+ * and is the only writer of it, so no locks and no atomic operations
+ * are needed on the request path.  Every slot is padded to the cache
+ * line size to avoid false sharing.  Readers sum the rows on demand.
+ */
+
+typedef struct {
+    uint64_t                        requests;
+    uint64_t                        responses[5];
+    uint64_t                        received;
+    uint64_t                        sent;
+    uint64_t                        time;
+    uint64_t                        buckets[NGX_HTTP_STATUS_BUCKETS];
+} ngx_http_status_counters_t;
+
+
+typedef struct {
+    ngx_str_t                       name;
+    ngx_uint_t                      slot;
+} ngx_http_status_zone_t;
+
+
+typedef struct {
+    ngx_http_upstream_srv_conf_t   *upstream;
+    ngx_array_t                     peers;       /* ngx_http_status_zone_t */
+} ngx_http_status_upstream_t;
+
+
+typedef struct {
+    ngx_array_t                     server_zones;     /* of zone_t */
+    ngx_array_t                     location_zones;   /* of zone_t */
+    ngx_array_t                     upstreams;        /* of upstream_t */
+
+    ngx_uint_t                      nslots;
+    ngx_uint_t                      workers;
+    size_t                          stride;
+
+    ngx_shm_zone_t                 *shm_zone;
+    u_char                         *counters;
+    u_char                         *pool_cache;
+
+    ngx_uint_t                      enabled;     /* unsigned enabled:1; */
+} ngx_http_status_main_conf_t;
+
+
+typedef struct {
+    ngx_str_t                       labels;
+    ngx_http_status_counters_t      counters;
+} ngx_http_status_metric_t;
+
+
+typedef struct {
+    ngx_uint_t                      zone;
+} ngx_http_status_srv_conf_t;
+
+
+typedef struct {
+    ngx_uint_t                      zone;
+    ngx_uint_t                      format;
+} ngx_http_status_loc_conf_t;
+
+
+static ngx_int_t ngx_http_status_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_status_log_handler(ngx_http_request_t *r);
+static void ngx_http_status_account(ngx_http_status_main_conf_t *smcf,
+    ngx_uint_t slot, ngx_uint_t status, off_t received, off_t sent,
+    ngx_msec_t ms);
+static ngx_uint_t ngx_http_status_bucket(ngx_msec_t ms);
+static ngx_msec_t ngx_http_status_bucket_bound(ngx_uint_t n);
+static void ngx_http_status_sum(ngx_http_status_main_conf_t *smcf,
+    ngx_uint_t slot, ngx_http_status_counters_t *sum);
+static void ngx_http_status_update_pool_cache(
+    ngx_http_status_main_conf_t *smcf);
+static void ngx_http_status_sum_pool_cache(ngx_http_status_main_conf_t *smcf,
+    ngx_pool_cache_stat_t *sum);
+static size_t ngx_http_status_json_size(ngx_http_status_main_conf_t *smcf);
+static u_char *ngx_http_status_json(ngx_http_status_main_conf_t *smcf,
+    u_char *p);
+static u_char *ngx_http_status_json_zones(ngx_http_status_main_conf_t *smcf,
+    u_char *p, ngx_array_t *zones);
+static u_char *ngx_http_status_json_counters(u_char *p,
+    ngx_http_status_counters_t *c);
+static ngx_buf_t *ngx_http_status_prometheus(ngx_http_request_t *r,
+    ngx_http_status_main_conf_t *smcf);
+static ngx_int_t ngx_http_status_prometheus_add(ngx_http_request_t *r,
+    ngx_http_status_main_conf_t *smcf, ngx_array_t *metrics, ngx_uint_t slot,
+    char *name1, ngx_str_t *value1, char *name2, ngx_str_t *value2);
+static u_char *ngx_http_status_prometheus_family(u_char *p, char *prefix,
+    ngx_array_t *metrics);
+static u_char *ngx_http_status_escape(u_char *p, ngx_str_t *name);
+
+static ngx_int_t ngx_http_status_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+static void *ngx_http_status_create_main_conf(ngx_conf_t *cf);
+static void *ngx_http_status_create_srv_conf(ngx_conf_t *cf);
+static char *ngx_http_status_merge_srv_conf(ngx_conf_t *cf, void *parent,
+    void *child);
+static void *ngx_http_status_create_loc_conf(ngx_conf_t *cf);
+static char *ngx_http_status_merge_loc_conf(ngx_conf_t *cf, void *parent,
+    void *child);
+static char *ngx_http_status_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_http_status_add_zone(ngx_conf_t *cf,
+    ngx_http_status_main_conf_t *smcf, ngx_array_t *zones, ngx_str_t *name);
+static ngx_int_t ngx_http_status_init(ngx_conf_t *cf);
+
+
+static ngx_command_t  ngx_http_status_commands[] = {
+
+    { ngx_string("status_zone"),
+      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_status_zone,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("status"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE1,
+      ngx_http_status,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_status_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    ngx_http_status_init,                  /* postconfiguration */
+
+    ngx_http_status_create_main_conf,      /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_http_status_create_srv_conf,       /* create server configuration */
+    ngx_http_status_merge_srv_conf,        /* merge server configuration */
+
+    ngx_http_status_create_loc_conf,       /* create location configuration */
+    ngx_http_status_merge_loc_conf         /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_status_module = {
+    NGX_MODULE_V1,
+    &ngx_http_status_module_ctx,           /* module context */
+    ngx_http_status_commands,              /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_str_t  ngx_http_status_classes[] = {
+    ngx_string("1xx"),
+    ngx_string("2xx"),
+    ngx_string("3xx"),
+    ngx_string("4xx"),
+    ngx_string("5xx")
+};
+
+
+static ngx_int_t
+ngx_http_status_handler(ngx_http_request_t *r)
+{
+    ngx_int_t                      rc;
+    ngx_buf_t                     *b;
+    ngx_chain_t                    out;
+    ngx_http_status_loc_conf_t    *slcf;
+    ngx_http_status_main_conf_t   *smcf;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    smcf = ngx_http_get_module_main_conf(r, ngx_http_status_module);
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_status_module);
+
+    if (slcf->format == NGX_HTTP_STATUS_PROMETHEUS) {
+        ngx_str_set(&r->headers_out.content_type, "text/plain; version=0.0.4");
+
+    } else {
+        ngx_str_set(&r->headers_out.content_type, "application/json");
+    }
+
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+    r->headers_out.content_type_lowcase = NULL;
+
+    if (r->method == NGX_HTTP_HEAD) {
+        r->headers_out.status = NGX_HTTP_OK;
+
+        rc = ngx_http_send_header(r);
+
+        if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+            return rc;
+        }
+    }
+
+    ngx_http_status_update_pool_cache(smcf);
+
+    if (slcf->format == NGX_HTTP_STATUS_PROMETHEUS) {
+        b = ngx_http_status_prometheus(r, smcf);
+
+    } else {
+        b = ngx_create_temp_buf(r->pool, ngx_http_status_json_size(smcf));
+
+        if (b) {
+            b->last = ngx_http_status_json(smcf, b->last);
+        }
+    }
+
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+static ngx_int_t
+ngx_http_status_log_handler(ngx_http_request_t *r)
+{
+    ngx_str_t                     *name;
+    ngx_msec_t                     ms;
+    ngx_uint_t                     i, j;
+    ngx_time_t                    *tp;
+    ngx_http_upstream_t           *u;
+    ngx_http_status_zone_t        *peer;
+    ngx_http_upstream_state_t     *state;
+    ngx_http_status_srv_conf_t    *sscf;
+    ngx_http_status_loc_conf_t    *slcf;
+    ngx_http_status_upstream_t    *upstream;
+    ngx_http_status_main_conf_t   *smcf;
+
+    smcf = ngx_http_get_module_main_conf(r, ngx_http_status_module);
+
+    if (smcf->counters == NULL || ngx_worker >= smcf->workers) {
+        return NGX_OK;
+    }
+
+    ngx_http_status_update_pool_cache(smcf);
+
+    tp = ngx_timeofday();
+
+    ms = (ngx_msec_t)
+             ((tp->sec - r->start_sec) * 1000 + (tp->msec - r->start_msec));
+
+    sscf = ngx_http_get_module_srv_conf(r, ngx_http_status_module);
+
+    if (sscf->zone != NGX_CONF_UNSET_UINT) {
+        ngx_http_status_account(smcf, sscf->zone, r->headers_out.status,
+                                r->request_length, r->connection->sent, ms);
+    }
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_status_module);
+
+    if (slcf->zone != NGX_CONF_UNSET_UINT) {
+        ngx_http_status_account(smcf, slcf->zone, r->headers_out.status,
+                                r->request_length, r->connection->sent, ms);
+    }
+
+    u = r->upstream;
+
+    if (u == NULL || u->upstream == NULL || r->upstream_states == NULL) {
+        return NGX_OK;
+    }
+
+    upstream = smcf->upstreams.elts;
+
+    for (i = 0; i < smcf->upstreams.nelts; i++) {
+        if (upstream[i].upstream == u->upstream) {
+            break;
+        }
+    }
+
+    if (i == smcf->upstreams.nelts) {
+        return NGX_OK;
+    }
+
+    upstream = &upstream[i];
+    state = r->upstream_states->elts;
+
+    for (i = 0; i < r->upstream_states->nelts; i++) {
+
+        name = state[i].peer;
+
+        if (name == NULL) {
+            continue;
+        }
+
+        peer = upstream->peers.elts;
+
+        for (j = 0; j < upstream->peers.nelts; j++) {
+            if (peer[j].name.len == name->len
+                && ngx_strncmp(peer[j].name.data, name->data, name->len) == 0)
+            {
+                ms = state[i].response_time;
+
+                ngx_http_status_account(smcf, peer[j].slot, state[i].status,
+                                        state[i].bytes_received,
+                                        state[i].bytes_sent,
+                                        ms == (ngx_msec_t) -1 ? 0 : ms);
+                break;
+            }
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_status_account(ngx_http_status_main_conf_t *smcf, ngx_uint_t slot,
+    ngx_uint_t status, off_t received, off_t sent, ngx_msec_t ms)
+{
+    ngx_http_status_counters_t  *c;
+
+    c = (ngx_http_status_counters_t *)
+            (smcf->counters
+             + (ngx_worker * smcf->nslots + slot) * smcf->stride);
+
+    c->requests++;
+
+    if (status >= 100 && status < 600) {
+        c->responses[status / 100 - 1]++;
+    }
+
+    c->received += received;
+    c->sent += sent;
+    c->time += ms;
+    c->buckets[ngx_http_status_bucket(ms)]++;
+}
+
+
+/*
+ * A log-linear histogram: values below 4 ms have their own buckets,
+ * then each power of two is split into 4 buckets, which keeps the
+ * relative error under 25% up to the last bucket that catches the rest.
+ */
+
+static ngx_uint_t
+ngx_http_status_bucket(ngx_msec_t ms)
+{
+    ngx_uint_t  n, shift;
+
+    if (ms < 4) {
+        return ms;
+    }
+
+    for (shift = 0; (ms >> shift) >= 8; shift++) { /* void */ }
+
+    n = 4 * (shift + 1) + (ms >> shift) - 4;
+
+    return ngx_min(n, NGX_HTTP_STATUS_BUCKETS - 1);
+}
+
+
+static ngx_msec_t
+ngx_http_status_bucket_bound(ngx_uint_t n)
+{
+    ngx_uint_t  shift;
+
+    if (n < 4) {
+        return n;
+    }
+
+    shift = n / 4 - 1;
+
+    return ((5 + n % 4) << shift) - 1;
+}
+
+
+static void
+ngx_http_status_sum(ngx_http_status_main_conf_t *smcf, ngx_uint_t slot,
+    ngx_http_status_counters_t *sum)
+{
+    ngx_uint_t                   w, i;
+    ngx_http_status_counters_t  *c;
+
+    ngx_memzero(sum, sizeof(ngx_http_status_counters_t));
+
+    for (w = 0; w < smcf->workers; w++) {
+        c = (ngx_http_status_counters_t *)
+                (smcf->counters + (w * smcf->nslots + slot) * smcf->stride);
+
+        sum->requests += c->requests;
+
+        for (i = 0; i < 5; i++) {
+            sum->responses[i] += c->responses[i];
+        }
+
+        sum->received += c->received;
+        sum->sent += c->sent;
+        sum->time += c->time;
+
+        for (i = 0; i < NGX_HTTP_STATUS_BUCKETS; i++) {
+            sum->buckets[i] += c->buckets[i];
+        }
+    }
+}
+
+
+/*
+ * the pool cache statistics are private to a process, so each worker
+ * publishes a copy of its own ones whenever it logs a request
+ */
+
+static void
+ngx_http_status_update_pool_cache(ngx_http_status_main_conf_t *smcf)
+{
+    if (smcf->counters == NULL || ngx_worker >= smcf->workers) {
+        return;
+    }
+
+    ngx_memcpy(smcf->pool_cache
+               + ngx_worker * NGX_HTTP_STATUS_POOL_CACHE_STRIDE,
+               &ngx_pool_cache_stat, sizeof(ngx_pool_cache_stat_t));
+}
+
+
+static void
+ngx_http_status_sum_pool_cache(ngx_http_status_main_conf_t *smcf,
+    ngx_pool_cache_stat_t *sum)
+{
+    ngx_uint_t              w;
+    ngx_pool_cache_stat_t  *c;
+
+    ngx_memzero(sum, sizeof(ngx_pool_cache_stat_t));
+
+    if (smcf->counters == NULL) {
+        return;
+    }
+
+    for (w = 0; w < smcf->workers; w++) {
+        c = (ngx_pool_cache_stat_t *)
+                (smcf->pool_cache + w * NGX_HTTP_STATUS_POOL_CACHE_STRIDE);
+
+        sum->hits += c->hits;
+        sum->misses += c->misses;
+        sum->trimmed += c->trimmed;
+        sum->size += c->size;
+    }
+}
+
+
+#define NGX_HTTP_STATUS_JSON_ENTRY_LEN                                        \
+    (sizeof("\"\":{\"requests\":,\"responses\":{},\"received\":,\"sent\":,"   \
+            "\"time\":,\"histogram\":{}},") - 1                               \
+     + 4 * NGX_INT64_LEN                                                      \
+     + 5 * (sizeof("\"1xx\":,") - 1 + NGX_INT64_LEN)                          \
+     + NGX_HTTP_STATUS_BUCKETS                                                \
+       * (sizeof("\"\":,") - 1 + NGX_INT_T_LEN + NGX_INT64_LEN))
+
+
+static size_t
+ngx_http_status_json_size(ngx_http_status_main_conf_t *smcf)
+{
+    size_t                       size;
+    ngx_uint_t                   i, j, k;
+    ngx_array_t                 *zones[2];
+    ngx_http_status_zone_t      *zone, *peer;
+    ngx_http_status_upstream_t  *upstream;
+
+    size = sizeof("{\"server_zones\":{},\"location_zones\":{},"
+                  "\"upstreams\":{},\"pool_cache\":{\"hits\":,\"misses\":,"
+                  "\"trimmed\":,\"cached\":}}") - 1
+           + 4 * NGX_INT64_LEN;
+
+    zones[0] = &smcf->server_zones;
+    zones[1] = &smcf->location_zones;
+
+    for (k = 0; k < 2; k++) {
+        zone = zones[k]->elts;
+
+        for (i = 0; i < zones[k]->nelts; i++) {
+            size += NGX_HTTP_STATUS_JSON_ENTRY_LEN + zone[i].name.len
+                    + ngx_escape_json(NULL, zone[i].name.data,
+                                      zone[i].name.len);
+        }
+    }
+
+    upstream = smcf->upstreams.elts;
+
+    for (i = 0; i < smcf->upstreams.nelts; i++) {
+        size += sizeof("\"\":{\"peers\":{}},") - 1
+                + upstream[i].upstream->host.len
+                + ngx_escape_json(NULL, upstream[i].upstream->host.data,
+                                  upstream[i].upstream->host.len);
+
+        peer = upstream[i].peers.elts;
+
+        for (j = 0; j < upstream[i].peers.nelts; j++) {
+            size += NGX_HTTP_STATUS_JSON_ENTRY_LEN + peer[j].name.len
+                    + ngx_escape_json(NULL, peer[j].name.data,
+                                      peer[j].name.len);
+        }
+    }
+
+    return size;
+}
+
+
+static u_char *
+ngx_http_status_json(ngx_http_status_main_conf_t *smcf, u_char *p)
+{
+    ngx_uint_t                   i, j;
+    ngx_pool_cache_stat_t        pc;
+    ngx_http_status_zone_t      *peer;
+    ngx_http_status_counters_t   c;
+    ngx_http_status_upstream_t  *upstream;
+
+    p = ngx_cpymem(p, "{\"server_zones\":{", sizeof("{\"server_zones\":{") - 1);
+    p = ngx_http_status_json_zones(smcf, p, &smcf->server_zones);
+
+    p = ngx_cpymem(p, "},\"location_zones\":{",
+                   sizeof("},\"location_zones\":{") - 1);
+    p = ngx_http_status_json_zones(smcf, p, &smcf->location_zones);
+
+    p = ngx_cpymem(p, "},\"upstreams\":{", sizeof("},\"upstreams\":{") - 1);
+
+    upstream = smcf->upstreams.elts;
+
+    for (i = 0; i < smcf->upstreams.nelts; i++) {
+        if (i) {
+            *p++ = ',';
+        }
+
+        *p++ = '"';
+        p = ngx_http_status_escape(p, &upstream[i].upstream->host);
+        p = ngx_cpymem(p, "\":{\"peers\":{", sizeof("\":{\"peers\":{") - 1);
+
+        peer = upstream[i].peers.elts;
+
+        for (j = 0; j < upstream[i].peers.nelts; j++) {
+            if (j) {
+                *p++ = ',';
+            }
+
+            ngx_http_status_sum(smcf, peer[j].slot, &c);
+
+            *p++ = '"';
+            p = ngx_http_status_escape(p, &peer[j].name);
+            *p++ = '"';
+            *p++ = ':';
+            p = ngx_http_status_json_counters(p, &c);
+        }
+
+        *p++ = '}';
+        *p++ = '}';
+    }
+
+    ngx_http_status_sum_pool_cache(smcf, &pc);
+
+    p = ngx_sprintf(p, "},\"pool_cache\":{\"hits\":%ui,\"misses\":%ui,"
+                    "\"trimmed\":%ui,\"cached\":%uz}}",
+                    pc.hits, pc.misses, pc.trimmed, pc.size);
+
+    return p;
+}
+
+
+static u_char *
+ngx_http_status_json_zones(ngx_http_status_main_conf_t *smcf, u_char *p,
+    ngx_array_t *zones)
+{
+    ngx_uint_t                   i;
+    ngx_http_status_zone_t      *zone;
+    ngx_http_status_counters_t   c;
+
+    zone = zones->elts;
+
+    for (i = 0; i < zones->nelts; i++) {
+        if (i) {
+            *p++ = ',';
+        }
+
+        ngx_http_status_sum(smcf, zone[i].slot, &c);
+
+        *p++ = '"';
+        p = ngx_http_status_escape(p, &zone[i].name);
+        *p++ = '"';
+        *p++ = ':';
+        p = ngx_http_status_json_counters(p, &c);
+    }
+
+    return p;
+}
+
+
+static u_char *
+ngx_http_status_json_counters(u_char *p, ngx_http_status_counters_t *c)
+{
+    ngx_uint_t  i, n;
+
+    p = ngx_sprintf(p, "{\"requests\":%uL,\"responses\":{", c->requests);
+
+    for (i = 0; i < 5; i++) {
+        p = ngx_sprintf(p, "%s\"%V\":%uL", i ? "," : "",
+                        &ngx_http_status_classes[i], c->responses[i]);
+    }
+
+    p = ngx_sprintf(p, "},\"received\":%uL,\"sent\":%uL,\"time\":%uL,"
+                    "\"histogram\":{", c->received, c->sent, c->time);
+
+    n = 0;
+
+    for (i = 0; i < NGX_HTTP_STATUS_BUCKETS; i++) {
+        if (c->buckets[i] == 0) {
+            continue;
+        }
+
+        if (n++) {
+            *p++ = ',';
+        }
+
+        if (i == NGX_HTTP_STATUS_BUCKETS - 1) {
+            p = ngx_sprintf(p, "\"+Inf\":%uL", c->buckets[i]);
+
+        } else {
+            p = ngx_sprintf(p, "\"%M\":%uL",
+                            ngx_http_status_bucket_bound(i), c->buckets[i]);
+        }
+    }
+
+    *p++ = '}';
+    *p++ = '}';
+
+    return p;
+}
+
+
+#define NGX_HTTP_STATUS_PROMETHEUS_TYPE_LEN                                   \
+    (5 * sizeof("# TYPE nginx_upstream_request_duration_seconds histogram\n"))
+
+#define NGX_HTTP_STATUS_PROMETHEUS_LINE_LEN                                   \
+    (sizeof("nginx_upstream_request_duration_seconds_bucket{,le=\"\"} \n")    \
+     - 1 + 2 * NGX_INT64_LEN + sizeof(",code=\"1xx\"") - 1)
+
+#define NGX_HTTP_STATUS_PROMETHEUS_LINES                                      \
+    (1 + 5 + 1 + 1 + NGX_HTTP_STATUS_BUCKETS + 2)
+
+#define NGX_HTTP_STATUS_PROMETHEUS_POOL_CACHE_LEN                             \
+    (4 * (sizeof("# TYPE nginx_pool_cache_trimmed_total counter\n")          \
+          + sizeof("nginx_pool_cache_trimmed_total \n") + NGX_INT64_LEN))
+
+
+static ngx_buf_t *
+ngx_http_status_prometheus(ngx_http_request_t *r,
+    ngx_http_status_main_conf_t *smcf)
+{
+    size_t                        size;
+    ngx_buf_t                    *b;
+    ngx_str_t                     kind;
+    ngx_uint_t                    i, j;
+    ngx_array_t                   http, upstreams;
+    ngx_pool_cache_stat_t         pc;
+    ngx_http_status_zone_t       *zone, *peer;
+    ngx_http_status_metric_t     *metric;
+    ngx_http_status_upstream_t   *upstream;
+
+    /*
+     * the text format requires all samples of a metric family to be
+     * grouped together, so the counters are summed up front
+     */
+
+    if (ngx_array_init(&http, r->pool,
+                       smcf->server_zones.nelts + smcf->location_zones.nelts
+                       + 1, sizeof(ngx_http_status_metric_t))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    if (ngx_array_init(&upstreams, r->pool, 4,
+                       sizeof(ngx_http_status_metric_t))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    ngx_str_set(&kind, "server");
+
+    zone = smcf->server_zones.elts;
+
+    for (i = 0; i < smcf->server_zones.nelts; i++) {
+        if (ngx_http_status_prometheus_add(r, smcf, &http, zone[i].slot,
+                                           "kind", &kind,
+                                           "zone", &zone[i].name)
+            != NGX_OK)
+        {
+            return NULL;
+        }
+    }
+
+    ngx_str_set(&kind, "location");
+
+    zone = smcf->location_zones.elts;
+
+    for (i = 0; i < smcf->location_zones.nelts; i++) {
+        if (ngx_http_status_prometheus_add(r, smcf, &http, zone[i].slot,
+                                           "kind", &kind,
+                                           "zone", &zone[i].name)
+            != NGX_OK)
+        {
+            return NULL;
+        }
+    }
+
+    upstream = smcf->upstreams.elts;
+
+    for (i = 0; i < smcf->upstreams.nelts; i++) {
+        peer = upstream[i].peers.elts;
+
+        for (j = 0; j < upstream[i].peers.nelts; j++) {
+            if (ngx_http_status_prometheus_add(r, smcf, &upstreams,
+                                               peer[j].slot, "upstream",
+                                               &upstream[i].upstream->host,
+                                               "peer", &peer[j].name)
+                != NGX_OK)
+            {
+                return NULL;
+            }
+        }
+    }
+
+    size = 2 * NGX_HTTP_STATUS_PROMETHEUS_TYPE_LEN
+           + NGX_HTTP_STATUS_PROMETHEUS_POOL_CACHE_LEN;
+
+    metric = http.elts;
+
+    for (i = 0; i < http.nelts; i++) {
+        size += NGX_HTTP_STATUS_PROMETHEUS_LINES
+                * (NGX_HTTP_STATUS_PROMETHEUS_LINE_LEN + metric[i].labels.len);
+    }
+
+    metric = upstreams.elts;
+
+    for (i = 0; i < upstreams.nelts; i++) {
+        size += NGX_HTTP_STATUS_PROMETHEUS_LINES
+                * (NGX_HTTP_STATUS_PROMETHEUS_LINE_LEN + metric[i].labels.len);
+    }
+
+    b = ngx_create_temp_buf(r->pool, size);
+    if (b == NULL) {
+        return NULL;
+    }
+
+    b->last = ngx_http_status_prometheus_family(b->last, "nginx_http", &http);
+    b->last = ngx_http_status_prometheus_family(b->last, "nginx_upstream",
+                                                &upstreams);
+
+    ngx_http_status_sum_pool_cache(smcf, &pc);
+
+    b->last = ngx_sprintf(b->last,
+                          "# TYPE nginx_pool_cache_hits_total counter\n"
+                          "nginx_pool_cache_hits_total %ui\n"
+                          "# TYPE nginx_pool_cache_misses_total counter\n"
+                          "nginx_pool_cache_misses_total %ui\n"
+                          "# TYPE nginx_pool_cache_trimmed_total counter\n"
+                          "nginx_pool_cache_trimmed_total %ui\n"
+                          "# TYPE nginx_pool_cache_bytes gauge\n"
+                          "nginx_pool_cache_bytes %uz\n",
+                          pc.hits, pc.misses, pc.trimmed, pc.size);
+
+    return b;
+}
+
+
+static ngx_int_t
+ngx_http_status_prometheus_add(ngx_http_request_t *r,
+    ngx_http_status_main_conf_t *smcf, ngx_array_t *metrics, ngx_uint_t slot,
+    char *name1, ngx_str_t *value1, char *name2, ngx_str_t *value2)
+{
+    size_t                     len;
+    u_char                    *p;
+    ngx_http_status_metric_t  *metric;
+
+    metric = ngx_array_push(metrics);
+    if (metric == NULL) {
+        return NGX_ERROR;
+    }
+
+    len = ngx_strlen(name1) + ngx_strlen(name2) + sizeof("=\"\",=\"\"") - 1
+          + value1->len + ngx_escape_json(NULL, value1->data, value1->len)
+          + value2->len + ngx_escape_json(NULL, value2->data, value2->len);
+
+    p = ngx_pnalloc(r->pool, len);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    metric->labels.data = p;
+
+    p = ngx_sprintf(p, "%s=\"", name1);
+    p = ngx_http_status_escape(p, value1);
+    p = ngx_sprintf(p, "\",%s=\"", name2);
+    p = ngx_http_status_escape(p, value2);
+    *p++ = '"';
+
+    metric->labels.len = p - metric->labels.data;
+
+    ngx_http_status_sum(smcf, slot, &metric->counters);
+
+    return NGX_OK;
+}
+
+
+static u_char *
+ngx_http_status_prometheus_family(u_char *p, char *prefix,
+    ngx_array_t *metrics)
+{
+    uint64_t                      total;
+    ngx_uint_t                    i, n;
+    ngx_http_status_metric_t     *metric;
+    ngx_http_status_counters_t   *c;
+
+    if (metrics->nelts == 0) {
+        return p;
+    }
+
+    metric = metrics->elts;
+
+    p = ngx_sprintf(p, "# TYPE %s_requests_total counter\n", prefix);
+
+    for (i = 0; i < metrics->nelts; i++) {
+        p = ngx_sprintf(p, "%s_requests_total{%V} %uL\n",
+                        prefix, &metric[i].labels,
+                        metric[i].counters.requests);
+    }
+
+    p = ngx_sprintf(p, "# TYPE %s_responses_total counter\n", prefix);
+
+    for (i = 0; i < metrics->nelts; i++) {
+        for (n = 0; n < 5; n++) {
+            p = ngx_sprintf(p, "%s_responses_total{%V,code=\"%V\"} %uL\n",
+                            prefix, &metric[i].labels,
+                            &ngx_http_status_classes[n],
+                            metric[i].counters.responses[n]);
+        }
+    }
+
+    p = ngx_sprintf(p, "# TYPE %s_received_bytes_total counter\n", prefix);
+
+    for (i = 0; i < metrics->nelts; i++) {
+        p = ngx_sprintf(p, "%s_received_bytes_total{%V} %uL\n",
+                        prefix, &metric[i].labels,
+                        metric[i].counters.received);
+    }
+
+    p = ngx_sprintf(p, "# TYPE %s_sent_bytes_total counter\n", prefix);
+
+    for (i = 0; i < metrics->nelts; i++) {
+        p = ngx_sprintf(p, "%s_sent_bytes_total{%V} %uL\n",
+                        prefix, &metric[i].labels,
+                        metric[i].counters.sent);
+    }
+
+    p = ngx_sprintf(p, "# TYPE %s_request_duration_seconds histogram\n",
+                    prefix);
+
+    for (i = 0; i < metrics->nelts; i++) {
+        c = &metric[i].counters;
+        total = 0;
+
+        for (n = 0; n < NGX_HTTP_STATUS_BUCKETS - 1; n++) {
+            total += c->buckets[n];
+
+            p = ngx_sprintf(p, "%s_request_duration_seconds_bucket"
+                            "{%V,le=\"%M.%03M\"} %uL\n",
+                            prefix, &metric[i].labels,
+                            ngx_http_status_bucket_bound(n) / 1000,
+                            ngx_http_status_bucket_bound(n) % 1000, total);
+        }
+
+        total += c->buckets[n];
+
+        p = ngx_sprintf(p, "%s_request_duration_seconds_bucket"
+                        "{%V,le=\"+Inf\"} %uL\n"
+                        "%s_request_duration_seconds_sum{%V} %uL.%03uL\n"
+                        "%s_request_duration_seconds_count{%V} %uL\n",
+                        prefix, &metric[i].labels, total,
+                        prefix, &metric[i].labels,
+                        c->time / 1000, c->time % 1000,
+                        prefix, &metric[i].labels, total);
+    }
+
+    return p;
+}
+
+
+static u_char *
+ngx_http_status_escape(u_char *p, ngx_str_t *name)
+{
+    if (ngx_escape_json(NULL, name->data, name->len) == 0) {
+        return ngx_cpymem(p, name->data, name->len);
+    }
+
+    return (u_char *) ngx_escape_json(p, name->data, name->len);
+}
+
+
+static ngx_int_t
+ngx_http_status_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_status_main_conf_t  *smcf = shm_zone->data;
+
+    ngx_slab_pool_t  *shpool;
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    /* the zone is never reused, so the counters start from zero */
+
+    smcf->counters = ngx_slab_calloc(shpool,
+                                     smcf->workers * smcf->nslots
+                                     * smcf->stride
+                                     + smcf->workers
+                                       * NGX_HTTP_STATUS_POOL_CACHE_STRIDE);
+    if (smcf->counters == NULL) {
+        return NGX_ERROR;
+    }
+
+    smcf->pool_cache = smcf->counters
+                       + smcf->workers * smcf->nslots * smcf->stride;
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_http_status_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_status_main_conf_t  *smcf;
+
+    smcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_status_main_conf_t));
+    if (smcf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     smcf->nslots = 0;
+     *     smcf->shm_zone = NULL;
+     *     smcf->counters = NULL;
+     *     smcf->enabled = 0;
+     */
+
+    if (ngx_array_init(&smcf->server_zones, cf->pool, 4,
+                       sizeof(ngx_http_status_zone_t))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    if (ngx_array_init(&smcf->location_zones, cf->pool, 4,
+                       sizeof(ngx_http_status_zone_t))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    if (ngx_array_init(&smcf->upstreams, cf->pool, 4,
+                       sizeof(ngx_http_status_upstream_t))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    return smcf;
+}
+
+
+static void *
+ngx_http_status_create_srv_conf(ngx_conf_t *cf)
+{
+    ngx_http_status_srv_conf_t  *conf;
+
+    conf = ngx_palloc(cf->pool, sizeof(ngx_http_status_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    conf->zone = NGX_CONF_UNSET_UINT;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_status_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_status_srv_conf_t *prev = parent;
+    ngx_http_status_srv_conf_t *conf = child;
+
+    ngx_conf_merge_uint_value(conf->zone, prev->zone, NGX_CONF_UNSET_UINT);
+
+    return NGX_CONF_OK;
+}
+
+
+static void *
+ngx_http_status_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_status_loc_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_status_loc_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->format = 0;
+     */
+
+    conf->zone = NGX_CONF_UNSET_UINT;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_status_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_status_loc_conf_t *prev = parent;
+    ngx_http_status_loc_conf_t *conf = child;
+
+    ngx_conf_merge_uint_value(conf->zone, prev->zone, NGX_CONF_UNSET_UINT);
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_status_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_status_loc_conf_t *slcf = conf;
+
+    ngx_str_t                    *value;
+    ngx_int_t                     slot;
+    ngx_http_status_srv_conf_t   *sscf;
+    ngx_http_status_main_conf_t  *smcf;
+
+    value = cf->args->elts;
+
+    smcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_status_module);
+
+    if (cf->cmd_type == NGX_HTTP_SRV_CONF) {
+        sscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_status_module);
+
+        if (sscf->zone != NGX_CONF_UNSET_UINT) {
+            return "is duplicate";
+        }
+
+        slot = ngx_http_status_add_zone(cf, smcf, &smcf->server_zones,
+                                        &value[1]);
+        if (slot == NGX_ERROR) {
+            return NGX_CONF_ERROR;
+        }
+
+        sscf->zone = slot;
+
+        return NGX_CONF_OK;
+    }
+
+    if (slcf->zone != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    slot = ngx_http_status_add_zone(cf, smcf, &smcf->location_zones,
+                                    &value[1]);
+    if (slot == NGX_ERROR) {
+        return NGX_CONF_ERROR;
+    }
+
+    slcf->zone = slot;
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_status_add_zone(ngx_conf_t *cf, ngx_http_status_main_conf_t *smcf,
+    ngx_array_t *zones, ngx_str_t *name)
+{
+    ngx_uint_t               i;
+    ngx_http_status_zone_t  *zone;
+
+    smcf->enabled = 1;
+
+    zone = zones->elts;
+
+    for (i = 0; i < zones->nelts; i++) {
+        if (zone[i].name.len == name->len
+            && ngx_strncmp(zone[i].name.data, name->data, name->len) == 0)
+        {
+            return zone[i].slot;
+        }
+    }
+
+    zone = ngx_array_push(zones);
+    if (zone == NULL) {
+        return NGX_ERROR;
+    }
+
+    zone->name = *name;
+    zone->slot = smcf->nslots++;
+
+    return zone->slot;
+}
+
+
+static char *
+ngx_http_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_status_loc_conf_t *slcf = conf;
+
+    ngx_str_t                    *value;
+    ngx_http_core_loc_conf_t     *clcf;
+    ngx_http_status_main_conf_t  *smcf;
+
+    if (slcf->format) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (cf->args->nelts == 1 || ngx_strcmp(value[1].data, "json") == 0) {
+        slcf->format = NGX_HTTP_STATUS_JSON;
+
+    } else if (ngx_strcmp(value[1].data, "prometheus") == 0) {
+        slcf->format = NGX_HTTP_STATUS_PROMETHEUS;
+
+    } else {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid value \"%V\", it must be "
+                           "\"json\" or \"prometheus\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    smcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_status_module);
+    smcf->enabled = 1;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_status_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_status_init(ngx_conf_t *cf)
+{
+    size_t                           size;
+    ngx_str_t                        name;
+    ngx_uint_t                       i, j, k;
+    ngx_core_conf_t                 *ccf;
+    ngx_http_handler_pt             *h;
+    ngx_http_status_zone_t          *peer;
+    ngx_http_core_main_conf_t       *cmcf;
+    ngx_http_upstream_server_t      *server;
+    ngx_http_status_upstream_t      *upstream;
+    ngx_http_status_main_conf_t     *smcf;
+    ngx_http_upstream_srv_conf_t   **uscfp;
+    ngx_http_upstream_main_conf_t   *umcf;
+
+    smcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_status_module);
+
+    if (!smcf->enabled) {
+        return NGX_OK;
+    }
+
+    /* a slot for every peer of every upstream{} block */
+
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (!(uscfp[i]->flags & NGX_HTTP_UPSTREAM_CREATE)
+            || uscfp[i]->servers == NULL)
+        {
+            continue;
+        }
+
+        upstream = ngx_array_push(&smcf->upstreams);
+        if (upstream == NULL) {
+            return NGX_ERROR;
+        }
+
+        upstream->upstream = uscfp[i];
+
+        if (ngx_array_init(&upstream->peers, cf->pool, 4,
+                           sizeof(ngx_http_status_zone_t))
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        server = uscfp[i]->servers->elts;
+
+        for (j = 0; j < uscfp[i]->servers->nelts; j++) {
+            for (k = 0; k < server[j].naddrs; k++) {
+
+                peer = ngx_array_push(&upstream->peers);
+                if (peer == NULL) {
+                    return NGX_ERROR;
+                }
+
+                peer->name = server[j].addrs[k].name;
+                peer->slot = smcf->nslots++;
+            }
+        }
+    }
+
+    /*
+     * worker_processes may be not yet known here, so the number
+     * of CPUs is used as a lower bound for the number of rows
+     */
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cf->cycle->conf_ctx,
+                                           ngx_core_module);
+
+    smcf->workers = ngx_max(ngx_ncpu, 1);
+
+    if (ccf->worker_processes != NGX_CONF_UNSET
+        && (ngx_uint_t) ccf->worker_processes > smcf->workers)
+    {
+        smcf->workers = ccf->worker_processes;
+    }
+
+    smcf->stride = ngx_align(sizeof(ngx_http_status_counters_t),
+                             NGX_CPU_CACHE_LINE);
+
+    size = smcf->workers * smcf->nslots * smcf->stride
+           + smcf->workers * NGX_HTTP_STATUS_POOL_CACHE_STRIDE;
+    size += size / 64 + 8 * ngx_pagesize;
+
+    ngx_str_set(&name, "http_status");
+
+    smcf->shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                           &ngx_http_status_module);
+    if (smcf->shm_zone == NULL) {
+        return NGX_ERROR;
+    }
+
+    smcf->shm_zone->init = ngx_http_status_init_zone;
+    smcf->shm_zone->data = smcf;
+    smcf->shm_zone->noreuse = 1;
+
+    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+
+    h = ngx_array_push(&cmcf->phases[NGX_HTTP_LOG_PHASE].handlers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_http_status_log_handler;
+
+    return NGX_OK;
+}
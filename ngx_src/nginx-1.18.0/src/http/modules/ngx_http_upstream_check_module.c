@@ -0,0 +1,666 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+/*
+ * Balancers only test peer->down for being non-zero, so a peer failing
+ * health checks is marked with a separate bit, and the "down" parameter
+ * of the "server" directive is preserved.
+ */
+
+#define NGX_HTTP_UPSTREAM_CHECK_DOWN  0x02
+
+
+typedef struct ngx_http_upstream_check_srv_conf_s
+    ngx_http_upstream_check_srv_conf_t;
+
+
+typedef struct {
+    ngx_http_upstream_rr_peer_t          *peer;
+    ngx_http_upstream_check_srv_conf_t   *conf;
+    ngx_connection_t                     *connection;
+
+    size_t                                sent;
+    size_t                                received;
+    u_char                                status[sizeof("HTTP/1.x 200") - 1];
+} ngx_http_upstream_check_peer_t;
+
+
+struct ngx_http_upstream_check_srv_conf_s {
+    ngx_msec_t                            interval;
+    ngx_msec_t                            timeout;
+    ngx_uint_t                            fails;
+    ngx_uint_t                            passes;
+    ngx_str_t                             uri;
+    ngx_str_t                             request;
+
+    ngx_http_upstream_srv_conf_t         *upstream;
+
+    ngx_http_upstream_check_peer_t       *peers;
+    ngx_uint_t                            npeers;
+
+    ngx_event_t                           event;
+};
+
+
+static void ngx_http_upstream_check_handler(ngx_event_t *ev);
+static void ngx_http_upstream_check_connect(ngx_http_upstream_check_peer_t *p);
+static void ngx_http_upstream_check_write_handler(ngx_event_t *wev);
+static void ngx_http_upstream_check_read_handler(ngx_event_t *rev);
+static void ngx_http_upstream_check_done(ngx_http_upstream_check_peer_t *p,
+    ngx_uint_t ok);
+
+static void *ngx_http_upstream_check_create_conf(ngx_conf_t *cf);
+static char *ngx_http_upstream_check(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static ngx_int_t ngx_http_upstream_check_postconfiguration(ngx_conf_t *cf);
+static ngx_int_t ngx_http_upstream_check_init_process(ngx_cycle_t *cycle);
+
+
+static ngx_command_t  ngx_http_upstream_check_commands[] = {
+
+    { ngx_string("health_check"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_ANY,
+      ngx_http_upstream_check,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_upstream_check_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    ngx_http_upstream_check_postconfiguration, /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_http_upstream_check_create_conf,   /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_upstream_check_module = {
+    NGX_MODULE_V1,
+    &ngx_http_upstream_check_module_ctx,   /* module context */
+    ngx_http_upstream_check_commands,      /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    ngx_http_upstream_check_init_process,  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static void
+ngx_http_upstream_check_handler(ngx_event_t *ev)
+{
+    ngx_http_upstream_check_srv_conf_t *ccf = ev->data;
+
+    ngx_uint_t                       i, due;
+    ngx_msec_t                       now;
+    ngx_http_upstream_rr_peer_t     *peer;
+    ngx_http_upstream_rr_peers_t    *peers;
+    ngx_http_upstream_check_peer_t  *p;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "health check handler: \"%V\"", &ccf->upstream->host);
+
+    if (ngx_terminate || ngx_exiting) {
+        return;
+    }
+
+    peers = ccf->upstream->peer.data;
+    now = ngx_current_msec;
+
+    for (i = 0; i < ccf->npeers; i++) {
+        p = &ccf->peers[i];
+
+        if (p->connection) {
+            continue;
+        }
+
+        peer = p->peer;
+
+        /*
+         * all workers run the timer, and the first one to find a peer due
+         * for a check in the shared memory zone claims it
+         */
+
+        ngx_http_upstream_rr_peers_rlock(peers);
+        ngx_http_upstream_rr_peer_lock(peers, peer);
+
+        due = (peer->check_time == 0
+               || now - peer->check_time >= ccf->interval);
+
+        if (due) {
+            peer->check_time = now;
+        }
+
+        ngx_http_upstream_rr_peer_unlock(peers, peer);
+        ngx_http_upstream_rr_peers_unlock(peers);
+
+        if (due) {
+            ngx_http_upstream_check_connect(p);
+        }
+    }
+
+    ngx_add_timer(ev, ccf->interval);
+}
+
+
+static void
+ngx_http_upstream_check_connect(ngx_http_upstream_check_peer_t *p)
+{
+    ngx_int_t              rc;
+    ngx_connection_t      *c;
+    ngx_peer_connection_t  pc;
+
+    ngx_memzero(&pc, sizeof(ngx_peer_connection_t));
+
+    pc.sockaddr = p->peer->sockaddr;
+    pc.socklen = p->peer->socklen;
+    pc.name = &p->peer->name;
+    pc.get = ngx_event_get_peer;
+    pc.log = ngx_cycle->log;
+    pc.log_error = NGX_ERROR_INFO;
+
+    rc = ngx_event_connect_peer(&pc);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc.log, 0,
+                   "health check connect to %V: %i", pc.name, rc);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        ngx_http_upstream_check_done(p, 0);
+        return;
+    }
+
+    c = pc.connection;
+
+    c->addr_text = p->peer->name;
+    c->data = p;
+    c->read->handler = ngx_http_upstream_check_read_handler;
+    c->write->handler = ngx_http_upstream_check_write_handler;
+
+    p->connection = c;
+    p->sent = 0;
+    p->received = 0;
+
+    /* health checks do not delay graceful shutdown */
+
+    c->read->cancelable = 1;
+    c->write->cancelable = 1;
+
+    ngx_add_timer(c->write, p->conf->timeout);
+
+    if (rc == NGX_OK) {
+        ngx_http_upstream_check_write_handler(c->write);
+    }
+}
+
+
+static void
+ngx_http_upstream_check_write_handler(ngx_event_t *wev)
+{
+    ssize_t                          n;
+    ngx_str_t                       *request;
+    ngx_connection_t                *c;
+    ngx_http_upstream_check_peer_t  *p;
+
+    c = wev->data;
+    p = c->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, wev->log, 0,
+                   "health check write handler");
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                      "health check of %V timed out", &c->addr_text);
+        ngx_http_upstream_check_done(p, 0);
+        return;
+    }
+
+    request = &p->conf->request;
+
+    while (p->sent < request->len) {
+
+        n = c->send(c, request->data + p->sent, request->len - p->sent);
+
+        if (n == NGX_ERROR) {
+            ngx_http_upstream_check_done(p, 0);
+            return;
+        }
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+                ngx_http_upstream_check_done(p, 0);
+            }
+
+            return;
+        }
+
+        p->sent += n;
+    }
+
+    if (wev->timer_set) {
+        ngx_del_timer(wev);
+    }
+
+    if (!c->read->timer_set) {
+        ngx_add_timer(c->read, p->conf->timeout);
+    }
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_http_upstream_check_done(p, 0);
+        return;
+    }
+
+    if (c->read->ready) {
+        ngx_http_upstream_check_read_handler(c->read);
+    }
+}
+
+
+static void
+ngx_http_upstream_check_read_handler(ngx_event_t *rev)
+{
+    ssize_t                          n;
+    ngx_int_t                        status;
+    ngx_connection_t                *c;
+    ngx_http_upstream_check_peer_t  *p;
+
+    c = rev->data;
+    p = c->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, rev->log, 0,
+                   "health check read handler");
+
+    if (rev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                      "health check of %V timed out", &c->addr_text);
+        ngx_http_upstream_check_done(p, 0);
+        return;
+    }
+
+    while (p->received < sizeof(p->status)) {
+
+        n = c->recv(c, p->status + p->received,
+                    sizeof(p->status) - p->received);
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+                ngx_http_upstream_check_done(p, 0);
+            }
+
+            return;
+        }
+
+        if (n == NGX_ERROR || n == 0) {
+            ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                          "health check of %V failed: "
+                          "connection closed before status line",
+                          &c->addr_text);
+            ngx_http_upstream_check_done(p, 0);
+            return;
+        }
+
+        p->received += n;
+    }
+
+    if (ngx_strncmp(p->status, "HTTP/1.", 7) != 0 || p->status[8] != ' ') {
+        ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                      "health check of %V failed: invalid status line",
+                      &c->addr_text);
+        ngx_http_upstream_check_done(p, 0);
+        return;
+    }
+
+    status = ngx_atoi(&p->status[9], 3);
+
+    if (status < 200 || status >= 400) {
+        ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                      "health check of %V failed: status %*s",
+                      &c->addr_text, (size_t) 3, &p->status[9]);
+        ngx_http_upstream_check_done(p, 0);
+        return;
+    }
+
+    ngx_http_upstream_check_done(p, 1);
+}
+
+
+static void
+ngx_http_upstream_check_done(ngx_http_upstream_check_peer_t *p, ngx_uint_t ok)
+{
+    ngx_http_upstream_rr_peer_t         *peer;
+    ngx_http_upstream_rr_peers_t        *peers;
+    ngx_http_upstream_check_srv_conf_t  *ccf;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "health check of %V done: %ui", &p->peer->name, ok);
+
+    if (p->connection) {
+        ngx_close_connection(p->connection);
+        p->connection = NULL;
+    }
+
+    ccf = p->conf;
+    peers = ccf->upstream->peer.data;
+    peer = p->peer;
+
+    ngx_http_upstream_rr_peers_rlock(peers);
+    ngx_http_upstream_rr_peer_lock(peers, peer);
+
+    if (ok) {
+        peer->check_fails = 0;
+        peer->check_passes++;
+
+        if ((peer->down & NGX_HTTP_UPSTREAM_CHECK_DOWN)
+            && peer->check_passes >= ccf->passes)
+        {
+            peer->down &= ~NGX_HTTP_UPSTREAM_CHECK_DOWN;
+            peer->fails = 0;
+
+            ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                          "upstream server %V in \"%V\" is up "
+                          "after %ui passed health checks",
+                          &peer->name, &ccf->upstream->host,
+                          peer->check_passes);
+        }
+
+    } else {
+        peer->check_passes = 0;
+        peer->check_fails++;
+
+        if (!(peer->down & NGX_HTTP_UPSTREAM_CHECK_DOWN)
+            && peer->check_fails >= ccf->fails)
+        {
+            peer->down |= NGX_HTTP_UPSTREAM_CHECK_DOWN;
+
+            ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                          "upstream server %V in \"%V\" is down "
+                          "after %ui failed health checks",
+                          &peer->name, &ccf->upstream->host,
+                          peer->check_fails);
+        }
+    }
+
+    ngx_http_upstream_rr_peer_unlock(peers, peer);
+    ngx_http_upstream_rr_peers_unlock(peers);
+}
+
+
+static void *
+ngx_http_upstream_check_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_check_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_check_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->interval = 0;
+     *     conf->uri = { 0, NULL };
+     *     conf->request = { 0, NULL };
+     *     conf->upstream = NULL;
+     *     conf->peers = NULL;
+     *     conf->npeers = 0;
+     */
+
+    return conf;
+}
+
+
+static char *
+ngx_http_upstream_check(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_check_srv_conf_t  *ccf = conf;
+
+    u_char                        *last;
+    ngx_int_t                      n;
+    ngx_str_t                     *value, s;
+    ngx_msec_t                     interval, timeout;
+    ngx_uint_t                     i;
+    ngx_http_upstream_srv_conf_t  *uscf;
+
+    if (ccf->interval) {
+        return "is duplicate";
+    }
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    ccf->upstream = uscf;
+    ccf->interval = 5000;
+    ccf->timeout = NGX_CONF_UNSET_MSEC;
+    ccf->fails = 1;
+    ccf->passes = 1;
+    ngx_str_set(&ccf->uri, "/");
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = &value[i].data[9];
+
+            interval = ngx_parse_time(&s, 0);
+            if (interval == (ngx_msec_t) NGX_ERROR || interval == 0) {
+                goto invalid;
+            }
+
+            ccf->interval = interval;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+
+            s.len = value[i].len - 8;
+            s.data = &value[i].data[8];
+
+            timeout = ngx_parse_time(&s, 0);
+            if (timeout == (ngx_msec_t) NGX_ERROR || timeout == 0) {
+                goto invalid;
+            }
+
+            ccf->timeout = timeout;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "fails=", 6) == 0) {
+
+            n = ngx_atoi(&value[i].data[6], value[i].len - 6);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            ccf->fails = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "passes=", 7) == 0) {
+
+            n = ngx_atoi(&value[i].data[7], value[i].len - 7);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            ccf->passes = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "uri=", 4) == 0) {
+
+            s.len = value[i].len - 4;
+            s.data = &value[i].data[4];
+
+            if (s.len == 0 || s.data[0] != '/') {
+                goto invalid;
+            }
+
+            ccf->uri = s;
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if (ccf->timeout == NGX_CONF_UNSET_MSEC) {
+        ccf->timeout = ngx_min(ccf->interval, 1000);
+    }
+
+    ccf->request.len = sizeof("GET ") - 1 + ccf->uri.len
+                       + sizeof(" HTTP/1.0" CRLF "Host: ") - 1
+                       + uscf->host.len
+                       + sizeof(CRLF "Connection: close" CRLF CRLF) - 1;
+
+    ccf->request.data = ngx_pnalloc(cf->pool, ccf->request.len);
+    if (ccf->request.data == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    last = ngx_sprintf(ccf->request.data,
+                       "GET %V HTTP/1.0" CRLF "Host: %V" CRLF
+                       "Connection: close" CRLF CRLF,
+                       &ccf->uri, &uscf->host);
+
+    ccf->request.len = last - ccf->request.data;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_check_postconfiguration(ngx_conf_t *cf)
+{
+    ngx_uint_t                           i;
+    ngx_http_upstream_srv_conf_t       **uscfp;
+    ngx_http_upstream_main_conf_t       *umcf;
+    ngx_http_upstream_check_srv_conf_t  *ccf;
+
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        ccf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                              ngx_http_upstream_check_module);
+
+        if (ccf->interval && uscfp[i]->shm_zone == NULL) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "health checks require \"zone\" in upstream \"%V\" "
+                          "in %s:%ui",
+                          &uscfp[i]->host, uscfp[i]->file_name,
+                          uscfp[i]->line);
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_check_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                           i, n;
+    ngx_http_upstream_rr_peer_t         *peer;
+    ngx_http_upstream_rr_peers_t        *peers, *backup;
+    ngx_http_upstream_srv_conf_t       **uscfp;
+    ngx_http_upstream_main_conf_t       *umcf;
+    ngx_http_upstream_check_srv_conf_t  *ccf;
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        ccf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                              ngx_http_upstream_check_module);
+
+        if (ccf->interval == 0) {
+            continue;
+        }
+
+        peers = uscfp[i]->peer.data;
+        backup = peers->next;
+
+        ccf->npeers = peers->number + (backup ? backup->number : 0);
+
+        ccf->peers = ngx_pcalloc(cycle->pool, ccf->npeers
+                                 * sizeof(ngx_http_upstream_check_peer_t));
+        if (ccf->peers == NULL) {
+            return NGX_ERROR;
+        }
+
+        n = 0;
+
+        for (peer = peers->peer; peer; peer = peer->next) {
+            ccf->peers[n].peer = peer;
+            ccf->peers[n++].conf = ccf;
+        }
+
+        if (backup) {
+            for (peer = backup->peer; peer; peer = peer->next) {
+                ccf->peers[n].peer = peer;
+                ccf->peers[n++].conf = ccf;
+            }
+        }
+
+        ccf->event.handler = ngx_http_upstream_check_handler;
+        ccf->event.data = ccf;
+        ccf->event.log = cycle->log;
+        ccf->event.cancelable = 1;
+
+        ngx_add_timer(&ccf->event, 1);
+    }
+
+    return NGX_OK;
+}
@@ -10,13 +10,25 @@
 #include <ngx_http.h>
 
 
+#define NGX_HTTP_UPSTREAM_KEEPALIVE_MISS  1
+#define NGX_HTTP_UPSTREAM_KEEPALIVE_HIT   2
+#define NGX_HTTP_UPSTREAM_KEEPALIVE_WARM  3
+
+
 typedef struct {
     ngx_uint_t                         max_cached;
     ngx_uint_t                         requests;
     ngx_msec_t                         timeout;
 
+    ngx_uint_t                         warm;
+    ngx_msec_t                         warm_interval;
+
     ngx_queue_t                        cache;
     ngx_queue_t                        free;
+    ngx_queue_t                        connecting;
+
+    ngx_http_upstream_srv_conf_t      *upstream;
+    ngx_event_t                        warm_event;
 
     ngx_http_upstream_init_pt          original_init_upstream;
     ngx_http_upstream_init_peer_pt     original_init_peer;
@@ -33,6 +45,8 @@ typedef struct {
     socklen_t                          socklen;
     ngx_sockaddr_t                     sockaddr;
 
+    unsigned                           warm:1;
+
 } ngx_http_upstream_keepalive_cache_t;
 
 
@@ -46,6 +60,8 @@ typedef struct {
     ngx_event_get_peer_pt              original_get_peer;
     ngx_event_free_peer_pt             original_free_peer;
 
+    ngx_uint_t                         status;
+
 #if (NGX_HTTP_SSL)
     ngx_event_set_peer_session_pt      original_set_session;
     ngx_event_save_peer_session_pt     original_save_session;
@@ -64,6 +80,16 @@ static void ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc,
 static void ngx_http_upstream_keepalive_dummy_handler(ngx_event_t *ev);
 static void ngx_http_upstream_keepalive_close_handler(ngx_event_t *ev);
 static void ngx_http_upstream_keepalive_close(ngx_connection_t *c);
+static void ngx_http_upstream_keepalive_save(
+    ngx_http_upstream_keepalive_cache_t *item, ngx_connection_t *c);
+
+static void ngx_http_upstream_keepalive_warm_handler(ngx_event_t *ev);
+static ngx_uint_t ngx_http_upstream_keepalive_count(ngx_queue_t *queue,
+    struct sockaddr *sockaddr, socklen_t socklen);
+static ngx_int_t ngx_http_upstream_keepalive_connect(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf,
+    ngx_http_upstream_rr_peer_t *peer);
+static void ngx_http_upstream_keepalive_connect_handler(ngx_event_t *ev);
 
 #if (NGX_HTTP_SSL)
 static ngx_int_t ngx_http_upstream_keepalive_set_session(
@@ -72,9 +98,17 @@ static void ngx_http_upstream_keepalive_save_session(ngx_peer_connection_t *pc,
     void *data);
 #endif
 
+static ngx_int_t ngx_http_upstream_keepalive_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+
+static ngx_int_t ngx_http_upstream_keepalive_add_variables(ngx_conf_t *cf);
 static void *ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf);
 static char *ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_http_upstream_keepalive_warm(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_http_upstream_keepalive_init(ngx_conf_t *cf);
+static ngx_int_t ngx_http_upstream_keepalive_init_process(ngx_cycle_t *cycle);
 
 
 static ngx_command_t  ngx_http_upstream_keepalive_commands[] = {
@@ -100,13 +134,20 @@ static ngx_command_t  ngx_http_upstream_keepalive_commands[] = {
       offsetof(ngx_http_upstream_keepalive_srv_conf_t, requests),
       NULL },
 
+    { ngx_string("keepalive_warm"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE12,
+      ngx_http_upstream_keepalive_warm,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
       ngx_null_command
 };
 
 
 static ngx_http_module_t  ngx_http_upstream_keepalive_module_ctx = {
-    NULL,                                  /* preconfiguration */
-    NULL,                                  /* postconfiguration */
+    ngx_http_upstream_keepalive_add_variables, /* preconfiguration */
+    ngx_http_upstream_keepalive_init,      /* postconfiguration */
 
     NULL,                                  /* create main configuration */
     NULL,                                  /* init main configuration */
@@ -126,7 +167,7 @@ ngx_module_t  ngx_http_upstream_keepalive_module = {
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_upstream_keepalive_init_process, /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
     NULL,                                  /* exit process */
@@ -135,6 +176,23 @@ ngx_module_t  ngx_http_upstream_keepalive_module = {
 };
 
 
+static ngx_http_variable_t  ngx_http_upstream_keepalive_vars[] = {
+
+    { ngx_string("upstream_keepalive"), NULL,
+      ngx_http_upstream_keepalive_variable, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+      ngx_http_null_variable
+};
+
+
+static ngx_str_t  ngx_http_upstream_keepalive_status[] = {
+    ngx_string("MISS"),
+    ngx_string("HIT"),
+    ngx_string("WARM")
+};
+
+
 static ngx_int_t
 ngx_http_upstream_init_keepalive(ngx_conf_t *cf,
     ngx_http_upstream_srv_conf_t *us)
@@ -152,6 +210,8 @@ ngx_http_upstream_init_keepalive(ngx_conf_t *cf,
     ngx_conf_init_msec_value(kcf->timeout, 60000);
     ngx_conf_init_uint_value(kcf->requests, 100);
 
+    kcf->upstream = us;
+
     if (kcf->original_init_upstream(cf, us) != NGX_OK) {
         return NGX_ERROR;
     }
@@ -170,6 +230,7 @@ ngx_http_upstream_init_keepalive(ngx_conf_t *cf,
 
     ngx_queue_init(&kcf->cache);
     ngx_queue_init(&kcf->free);
+    ngx_queue_init(&kcf->connecting);
 
     for (i = 0; i < kcf->max_cached; i++) {
         ngx_queue_insert_head(&kcf->free, &cached[i].queue);
@@ -207,6 +268,7 @@ ngx_http_upstream_init_keepalive_peer(ngx_http_request_t *r,
     kp->data = r->upstream->peer.data;
     kp->original_get_peer = r->upstream->peer.get;
     kp->original_free_peer = r->upstream->peer.free;
+    kp->status = 0;
 
     r->upstream->peer.data = kp;
     r->upstream->peer.get = ngx_http_upstream_get_keepalive_peer;
@@ -244,6 +306,8 @@ ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc, void *data)
         return rc;
     }
 
+    kp->status = NGX_HTTP_UPSTREAM_KEEPALIVE_MISS;
+
     /* search cache for suitable connection */
 
     cache = &kp->conf->cache;
@@ -273,6 +337,9 @@ found:
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "get keepalive peer: using connection %p", c);
 
+    kp->status = item->warm ? NGX_HTTP_UPSTREAM_KEEPALIVE_WARM
+                            : NGX_HTTP_UPSTREAM_KEEPALIVE_HIT;
+
     c->idle = 0;
     c->sent = 0;
     c->data = NULL;
@@ -363,12 +430,28 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
 
     ngx_queue_insert_head(&kp->conf->cache, q);
 
-    item->connection = c;
-
     pc->connection = NULL;
 
+    item->socklen = pc->socklen;
+    ngx_memcpy(&item->sockaddr, pc->sockaddr, pc->socklen);
+    item->warm = 0;
+
+    ngx_http_upstream_keepalive_save(item, c);
+
+invalid:
+
+    kp->original_free_peer(pc, kp->data, state);
+}
+
+
+static void
+ngx_http_upstream_keepalive_save(ngx_http_upstream_keepalive_cache_t *item,
+    ngx_connection_t *c)
+{
+    item->connection = c;
+
     c->read->delayed = 0;
-    ngx_add_timer(c->read, kp->conf->timeout);
+    ngx_add_timer(c->read, item->conf->timeout);
 
     if (c->write->timer_set) {
         ngx_del_timer(c->write);
@@ -384,16 +467,9 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
     c->write->log = ngx_cycle->log;
     c->pool->log = ngx_cycle->log;
 
-    item->socklen = pc->socklen;
-    ngx_memcpy(&item->sockaddr, pc->sockaddr, pc->socklen);
-
     if (c->read->ready) {
         ngx_http_upstream_keepalive_close_handler(c->read);
     }
-
-invalid:
-
-    kp->original_free_peer(pc, kp->data, state);
 }
 
 
@@ -471,6 +547,221 @@ ngx_http_upstream_keepalive_close(ngx_connection_t *c)
 }
 
 
+static void
+ngx_http_upstream_keepalive_warm_handler(ngx_event_t *ev)
+{
+    ngx_http_upstream_keepalive_srv_conf_t *kcf = ev->data;
+
+    ngx_uint_t                     n;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "keepalive warm handler: \"%V\"", &kcf->upstream->host);
+
+    if (ngx_terminate || ngx_exiting) {
+        return;
+    }
+
+    peers = kcf->upstream->peer.data;
+
+    ngx_http_upstream_rr_peers_rlock(peers);
+
+    for (peer = peers->peer; peer; peer = peer->next) {
+
+        if (peer->down) {
+            continue;
+        }
+
+        if (peer->max_fails
+            && peer->fails >= peer->max_fails
+            && ngx_time() - peer->checked <= peer->fail_timeout)
+        {
+            continue;
+        }
+
+        n = ngx_http_upstream_keepalive_count(&kcf->cache, peer->sockaddr,
+                                              peer->socklen)
+            + ngx_http_upstream_keepalive_count(&kcf->connecting,
+                                                peer->sockaddr, peer->socklen);
+
+        while (n++ < kcf->warm) {
+            if (ngx_http_upstream_keepalive_connect(kcf, peer) != NGX_OK) {
+                break;
+            }
+        }
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    ngx_add_timer(ev, kcf->warm_interval);
+}
+
+
+static ngx_uint_t
+ngx_http_upstream_keepalive_count(ngx_queue_t *queue,
+    struct sockaddr *sockaddr, socklen_t socklen)
+{
+    ngx_uint_t                            n;
+    ngx_queue_t                          *q;
+    ngx_http_upstream_keepalive_cache_t  *item;
+
+    n = 0;
+
+    for (q = ngx_queue_head(queue);
+         q != ngx_queue_sentinel(queue);
+         q = ngx_queue_next(q))
+    {
+        item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
+
+        if (ngx_memn2cmp((u_char *) &item->sockaddr, (u_char *) sockaddr,
+                         item->socklen, socklen)
+            == 0)
+        {
+            n++;
+        }
+    }
+
+    return n;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_connect(ngx_http_upstream_keepalive_srv_conf_t *kcf,
+    ngx_http_upstream_rr_peer_t *peer)
+{
+    ngx_int_t                             rc;
+    ngx_queue_t                          *q;
+    ngx_connection_t                     *c;
+    ngx_peer_connection_t                 pc;
+    ngx_http_upstream_keepalive_cache_t  *item;
+
+    /* warm connections never evict connections already cached */
+
+    if (ngx_queue_empty(&kcf->free)) {
+        return NGX_DECLINED;
+    }
+
+    ngx_memzero(&pc, sizeof(ngx_peer_connection_t));
+
+    pc.sockaddr = peer->sockaddr;
+    pc.socklen = peer->socklen;
+    pc.name = &peer->name;
+    pc.get = ngx_event_get_peer;
+    pc.log = ngx_cycle->log;
+    pc.log_error = NGX_ERROR_INFO;
+
+    rc = ngx_event_connect_peer(&pc);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc.log, 0,
+                   "keepalive warm connect to %V: %i", pc.name, rc);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        return NGX_ERROR;
+    }
+
+    c = pc.connection;
+
+    c->addr_text = peer->name;
+
+    c->pool = ngx_create_pool(128, ngx_cycle->log);
+    if (c->pool == NULL) {
+        ngx_close_connection(c);
+        return NGX_ERROR;
+    }
+
+    q = ngx_queue_head(&kcf->free);
+    ngx_queue_remove(q);
+
+    item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
+
+    item->socklen = pc.socklen;
+    ngx_memcpy(&item->sockaddr, pc.sockaddr, pc.socklen);
+    item->warm = 1;
+
+    if (rc == NGX_OK) {
+        ngx_queue_insert_head(&kcf->cache, q);
+        ngx_http_upstream_keepalive_save(item, c);
+        return NGX_OK;
+    }
+
+    /* rc == NGX_AGAIN */
+
+    ngx_queue_insert_head(&kcf->connecting, q);
+
+    item->connection = c;
+
+    c->data = item;
+    c->read->handler = ngx_http_upstream_keepalive_connect_handler;
+    c->write->handler = ngx_http_upstream_keepalive_connect_handler;
+
+    /* pending warm connections do not delay graceful shutdown */
+
+    c->write->cancelable = 1;
+    ngx_add_timer(c->write, kcf->timeout);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_keepalive_connect_handler(ngx_event_t *ev)
+{
+    int                                   err;
+    socklen_t                             len;
+    ngx_connection_t                     *c;
+    ngx_http_upstream_keepalive_cache_t  *item;
+
+    c = ev->data;
+    item = c->data;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "keepalive warm connect handler: %d", ev->timedout);
+
+    ngx_queue_remove(&item->queue);
+
+    if (ev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                      "keepalive warm connect to %V timed out",
+                      &c->addr_text);
+        goto failed;
+    }
+
+    if (ngx_terminate || ngx_exiting) {
+        goto failed;
+    }
+
+    err = 0;
+    len = sizeof(int);
+
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len) == -1) {
+        err = ngx_socket_errno;
+    }
+
+    if (err) {
+        (void) ngx_connection_error(c, err,
+                                    "keepalive warm connect() failed");
+        goto failed;
+    }
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        goto failed;
+    }
+
+    ngx_queue_insert_head(&item->conf->cache, &item->queue);
+
+    ngx_http_upstream_keepalive_save(item, c);
+
+    return;
+
+failed:
+
+    ngx_queue_insert_head(&item->conf->free, &item->queue);
+
+    ngx_http_upstream_keepalive_close(c);
+}
+
+
 #if (NGX_HTTP_SSL)
 
 static ngx_int_t
@@ -494,6 +785,55 @@ ngx_http_upstream_keepalive_save_session(ngx_peer_connection_t *pc, void *data)
 #endif
 
 
+static ngx_int_t
+ngx_http_upstream_keepalive_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_http_upstream_keepalive_peer_data_t  *kp;
+
+    if (r->upstream == NULL
+        || r->upstream->peer.get != ngx_http_upstream_get_keepalive_peer)
+    {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    kp = r->upstream->peer.data;
+
+    if (kp->status == 0) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->len = ngx_http_upstream_keepalive_status[kp->status - 1].len;
+    v->data = ngx_http_upstream_keepalive_status[kp->status - 1].data;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_add_variables(ngx_conf_t *cf)
+{
+    ngx_http_variable_t  *var, *v;
+
+    for (v = ngx_http_upstream_keepalive_vars; v->name.len; v++) {
+        var = ngx_http_add_variable(cf, &v->name, v->flags);
+        if (var == NULL) {
+            return NGX_ERROR;
+        }
+
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
+
+    return NGX_OK;
+}
+
+
 static void *
 ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf)
 {
@@ -511,6 +851,8 @@ ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf)
      *     conf->original_init_upstream = NULL;
      *     conf->original_init_peer = NULL;
      *     conf->max_cached = 0;
+     *     conf->warm = 0;
+     *     conf->warm_interval = 0;
      */
 
     conf->timeout = NGX_CONF_UNSET_MSEC;
@@ -560,3 +902,133 @@ ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     return NGX_CONF_OK;
 }
+
+
+static char *
+ngx_http_upstream_keepalive_warm(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf = conf;
+
+    ngx_int_t    n;
+    ngx_str_t   *value, s;
+    ngx_msec_t   interval;
+
+    if (kcf->warm) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    n = ngx_atoi(value[1].data, value[1].len);
+
+    if (n == NGX_ERROR || n == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid value \"%V\" in \"%V\" directive",
+                           &value[1], &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    interval = 1000;
+
+    if (cf->args->nelts == 3) {
+
+        if (ngx_strncmp(value[2].data, "interval=", 9) != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        s.len = value[2].len - 9;
+        s.data = value[2].data + 9;
+
+        interval = ngx_parse_time(&s, 0);
+
+        if (interval == (ngx_msec_t) NGX_ERROR || interval == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid interval \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    kcf->warm = n;
+    kcf->warm_interval = interval;
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_init(ngx_conf_t *cf)
+{
+    ngx_uint_t                                i;
+    ngx_http_upstream_srv_conf_t            **uscfp;
+    ngx_http_upstream_main_conf_t            *umcf;
+    ngx_http_upstream_keepalive_srv_conf_t   *kcf;
+
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        kcf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                            ngx_http_upstream_keepalive_module);
+
+        if (kcf->warm && kcf->max_cached == 0) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "\"keepalive_warm\" requires \"keepalive\" "
+                          "in upstream \"%V\" in %s:%ui",
+                          &uscfp[i]->host, uscfp[i]->file_name,
+                          uscfp[i]->line);
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                                i;
+    ngx_http_upstream_srv_conf_t            **uscfp;
+    ngx_http_upstream_main_conf_t            *umcf;
+    ngx_http_upstream_keepalive_srv_conf_t   *kcf;
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        kcf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                            ngx_http_upstream_keepalive_module);
+
+        if (kcf->warm == 0 || kcf->max_cached == 0) {
+            continue;
+        }
+
+        kcf->warm_event.handler = ngx_http_upstream_keepalive_warm_handler;
+        kcf->warm_event.data = kcf;
+        kcf->warm_event.log = cycle->log;
+        kcf->warm_event.cancelable = 1;
+
+        ngx_add_timer(&kcf->warm_event, 1);
+    }
+
+    return NGX_OK;
+}
@@ -0,0 +1,711 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include <zstd.h>
+
+
+typedef struct {
+    ngx_flag_t           enable;
+
+    ngx_hash_t           types;
+
+    ngx_bufs_t           bufs;
+
+    ngx_int_t            level;
+    ssize_t              min_length;
+
+    ngx_array_t         *types_keys;
+} ngx_http_zstd_conf_t;
+
+
+typedef struct {
+    ngx_chain_t         *in;
+    ngx_chain_t         *free;
+    ngx_chain_t         *busy;
+    ngx_chain_t         *out;
+    ngx_chain_t        **last_out;
+
+    ngx_buf_t           *in_buf;
+    ngx_buf_t           *out_buf;
+    ngx_int_t            bufs;
+
+    ZSTD_inBuffer        input;
+    ZSTD_outBuffer       output;
+
+    ZSTD_EndDirective    flush;
+
+    unsigned             redo:1;
+    unsigned             done:1;
+    unsigned             nomem:1;
+
+    ZSTD_CCtx           *cctx;
+    ngx_http_request_t  *request;
+} ngx_http_zstd_ctx_t;
+
+
+static ngx_int_t ngx_http_zstd_filter_compress_start(ngx_http_request_t *r,
+    ngx_http_zstd_ctx_t *ctx);
+static ngx_int_t ngx_http_zstd_filter_add_data(ngx_http_request_t *r,
+    ngx_http_zstd_ctx_t *ctx);
+static ngx_int_t ngx_http_zstd_filter_get_buf(ngx_http_request_t *r,
+    ngx_http_zstd_ctx_t *ctx);
+static ngx_int_t ngx_http_zstd_filter_compress(ngx_http_request_t *r,
+    ngx_http_zstd_ctx_t *ctx);
+static ngx_int_t ngx_http_zstd_filter_compress_end(ngx_http_request_t *r,
+    ngx_http_zstd_ctx_t *ctx);
+static void ngx_http_zstd_filter_cleanup(void *data);
+
+static ngx_int_t ngx_http_zstd_filter_init(ngx_conf_t *cf);
+static void *ngx_http_zstd_create_conf(ngx_conf_t *cf);
+static char *ngx_http_zstd_merge_conf(ngx_conf_t *cf,
+    void *parent, void *child);
+
+
+static ngx_conf_num_bounds_t  ngx_http_zstd_comp_level_bounds = {
+    ngx_conf_check_num_bounds, 1, 19
+};
+
+
+static ngx_command_t  ngx_http_zstd_filter_commands[] = {
+
+    { ngx_string("zstd"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF
+                        |NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_zstd_conf_t, enable),
+      NULL },
+
+    { ngx_string("zstd_buffers"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE2,
+      ngx_conf_set_bufs_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_zstd_conf_t, bufs),
+      NULL },
+
+    { ngx_string("zstd_types"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_http_types_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_zstd_conf_t, types_keys),
+      &ngx_http_html_default_types[0] },
+
+    { ngx_string("zstd_comp_level"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_zstd_conf_t, level),
+      &ngx_http_zstd_comp_level_bounds },
+
+    { ngx_string("zstd_min_length"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_zstd_conf_t, min_length),
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_zstd_filter_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    ngx_http_zstd_filter_init,             /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    ngx_http_zstd_create_conf,             /* create location configuration */
+    ngx_http_zstd_merge_conf               /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_zstd_filter_module = {
+    NGX_MODULE_V1,
+    &ngx_http_zstd_filter_module_ctx,      /* module context */
+    ngx_http_zstd_filter_commands,         /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_http_output_header_filter_pt  ngx_http_next_header_filter;
+static ngx_http_output_body_filter_pt    ngx_http_next_body_filter;
+
+
+static ngx_int_t
+ngx_http_zstd_header_filter(ngx_http_request_t *r)
+{
+    ngx_table_elt_t       *h;
+    ngx_http_zstd_ctx_t   *ctx;
+    ngx_http_zstd_conf_t  *conf;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_zstd_filter_module);
+
+    if (!conf->enable
+        || (r->headers_out.status != NGX_HTTP_OK
+            && r->headers_out.status != NGX_HTTP_FORBIDDEN
+            && r->headers_out.status != NGX_HTTP_NOT_FOUND)
+        || (r->headers_out.content_encoding
+            && r->headers_out.content_encoding->value.len)
+        || (r->headers_out.content_length_n != -1
+            && r->headers_out.content_length_n < conf->min_length)
+        || ngx_http_test_content_type(r, &conf->types) == NULL
+        || r->header_only)
+    {
+        return ngx_http_next_header_filter(r);
+    }
+
+    r->gzip_vary = 1;
+
+#if (NGX_HTTP_DEGRADATION)
+    {
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (clcf->gzip_disable_degradation && ngx_http_degraded(r)) {
+        return ngx_http_next_header_filter(r);
+    }
+    }
+#endif
+
+    if (ngx_http_encoding_ok(r, NGX_HTTP_ENCODING_ZSTD) != NGX_OK) {
+        return ngx_http_next_header_filter(r);
+    }
+
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_zstd_ctx_t));
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_http_set_ctx(r, ctx, ngx_http_zstd_filter_module);
+
+    ctx->request = r;
+
+    h = ngx_list_push(&r->headers_out.headers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    h->hash = 1;
+    ngx_str_set(&h->key, "Content-Encoding");
+    ngx_str_set(&h->value, "zstd");
+    r->headers_out.content_encoding = h;
+
+    r->main_filter_need_in_memory = 1;
+
+    ngx_http_clear_content_length(r);
+    ngx_http_clear_accept_ranges(r);
+    ngx_http_weak_etag(r);
+
+    return ngx_http_next_header_filter(r);
+}
+
+
+static ngx_int_t
+ngx_http_zstd_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
+{
+    ngx_int_t             rc;
+    ngx_uint_t            flush;
+    ngx_chain_t          *cl;
+    ngx_http_zstd_ctx_t  *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_zstd_filter_module);
+
+    if (ctx == NULL || ctx->done || r->header_only) {
+        return ngx_http_next_body_filter(r, in);
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http zstd filter");
+
+    if (ctx->cctx == NULL) {
+        if (ngx_http_zstd_filter_compress_start(r, ctx) != NGX_OK) {
+            goto failed;
+        }
+    }
+
+    if (in) {
+        if (ngx_chain_add_copy(r->pool, &ctx->in, in) != NGX_OK) {
+            goto failed;
+        }
+
+        r->connection->buffered |= NGX_HTTP_GZIP_BUFFERED;
+    }
+
+    if (ctx->nomem) {
+
+        /* flush busy buffers */
+
+        if (ngx_http_next_body_filter(r, NULL) == NGX_ERROR) {
+            goto failed;
+        }
+
+        cl = NULL;
+
+        ngx_chain_update_chains(r->pool, &ctx->free, &ctx->busy, &cl,
+                                (ngx_buf_tag_t) &ngx_http_zstd_filter_module);
+        ctx->nomem = 0;
+        flush = 0;
+
+    } else {
+        flush = ctx->busy ? 1 : 0;
+    }
+
+    for ( ;; ) {
+
+        /* cycle while we can write to a client */
+
+        for ( ;; ) {
+
+            /* cycle while there is data to feed zstd and ... */
+
+            rc = ngx_http_zstd_filter_add_data(r, ctx);
+
+            if (rc == NGX_DECLINED) {
+                break;
+            }
+
+            if (rc == NGX_AGAIN) {
+                continue;
+            }
+
+
+            /* ... there are buffers to write zstd output */
+
+            rc = ngx_http_zstd_filter_get_buf(r, ctx);
+
+            if (rc == NGX_DECLINED) {
+                break;
+            }
+
+            if (rc == NGX_ERROR) {
+                goto failed;
+            }
+
+
+            rc = ngx_http_zstd_filter_compress(r, ctx);
+
+            if (rc == NGX_OK) {
+                break;
+            }
+
+            if (rc == NGX_ERROR) {
+                goto failed;
+            }
+
+            /* rc == NGX_AGAIN */
+        }
+
+        if (ctx->out == NULL && !flush) {
+            return ctx->busy ? NGX_AGAIN : NGX_OK;
+        }
+
+        rc = ngx_http_next_body_filter(r, ctx->out);
+
+        if (rc == NGX_ERROR) {
+            goto failed;
+        }
+
+        ngx_chain_update_chains(r->pool, &ctx->free, &ctx->busy, &ctx->out,
+                                (ngx_buf_tag_t) &ngx_http_zstd_filter_module);
+        ctx->last_out = &ctx->out;
+
+        ctx->nomem = 0;
+        flush = 0;
+
+        if (ctx->done) {
+            return rc;
+        }
+    }
+
+    /* unreachable */
+
+failed:
+
+    ctx->done = 1;
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_zstd_filter_compress_start(ngx_http_request_t *r,
+    ngx_http_zstd_ctx_t *ctx)
+{
+    size_t                 rc;
+    ngx_pool_cleanup_t    *cln;
+    ngx_http_zstd_conf_t  *conf;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_zstd_filter_module);
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->cctx = ZSTD_createCCtx();
+    if (ctx->cctx == NULL) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                      "ZSTD_createCCtx() failed");
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_http_zstd_filter_cleanup;
+    cln->data = ctx;
+
+    rc = ZSTD_CCtx_setParameter(ctx->cctx, ZSTD_c_compressionLevel,
+                                (int) conf->level);
+
+    if (ZSTD_isError(rc)) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                      "ZSTD_CCtx_setParameter() failed: %s",
+                      ZSTD_getErrorName(rc));
+        return NGX_ERROR;
+    }
+
+    ctx->last_out = &ctx->out;
+    ctx->flush = ZSTD_e_continue;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_zstd_filter_add_data(ngx_http_request_t *r, ngx_http_zstd_ctx_t *ctx)
+{
+    ngx_chain_t  *cl;
+
+    if (ctx->input.pos < ctx->input.size
+        || ctx->flush != ZSTD_e_continue
+        || ctx->redo)
+    {
+        return NGX_OK;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "zstd in: %p", ctx->in);
+
+    if (ctx->in == NULL) {
+        return NGX_DECLINED;
+    }
+
+    cl = ctx->in;
+    ctx->in_buf = cl->buf;
+    ctx->in = cl->next;
+
+    ngx_free_chain(r->pool, cl);
+
+    ctx->input.src = ctx->in_buf->pos;
+    ctx->input.size = ctx->in_buf->last - ctx->in_buf->pos;
+    ctx->input.pos = 0;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "zstd in_buf:%p ni:%p ai:%uz",
+                   ctx->in_buf, ctx->input.src, ctx->input.size);
+
+    if (ctx->in_buf->last_buf) {
+        ctx->flush = ZSTD_e_end;
+
+    } else if (ctx->in_buf->flush) {
+        ctx->flush = ZSTD_e_flush;
+
+    } else if (ctx->input.size == 0) {
+        /* ctx->flush == ZSTD_e_continue */
+        return NGX_AGAIN;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_zstd_filter_get_buf(ngx_http_request_t *r, ngx_http_zstd_ctx_t *ctx)
+{
+    ngx_chain_t           *cl;
+    ngx_http_zstd_conf_t  *conf;
+
+    if (ctx->output.pos < ctx->output.size) {
+        return NGX_OK;
+    }
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_zstd_filter_module);
+
+    if (ctx->free) {
+
+        cl = ctx->free;
+        ctx->out_buf = cl->buf;
+        ctx->free = cl->next;
+
+        ngx_free_chain(r->pool, cl);
+
+    } else if (ctx->bufs < conf->bufs.num) {
+
+        ctx->out_buf = ngx_create_temp_buf(r->pool, conf->bufs.size);
+        if (ctx->out_buf == NULL) {
+            return NGX_ERROR;
+        }
+
+        ctx->out_buf->tag = (ngx_buf_tag_t) &ngx_http_zstd_filter_module;
+        ctx->out_buf->recycled = 1;
+        ctx->bufs++;
+
+    } else {
+        ctx->nomem = 1;
+        return NGX_DECLINED;
+    }
+
+    ctx->output.dst = ctx->out_buf->pos;
+    ctx->output.size = conf->bufs.size;
+    ctx->output.pos = 0;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_zstd_filter_compress(ngx_http_request_t *r, ngx_http_zstd_ctx_t *ctx)
+{
+    size_t        rc;
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl;
+
+    ngx_log_debug6(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                 "zstd in: ni:%uz no:%uz ai:%uz ao:%uz fl:%d redo:%d",
+                 ctx->input.pos, ctx->output.pos,
+                 ctx->input.size, ctx->output.size,
+                 ctx->flush, ctx->redo);
+
+    rc = ZSTD_compressStream2(ctx->cctx, &ctx->output, &ctx->input,
+                              ctx->flush);
+
+    if (ZSTD_isError(rc)) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                      "ZSTD_compressStream2() failed: %s",
+                      ZSTD_getErrorName(rc));
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug5(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "zstd out: ni:%uz no:%uz ai:%uz ao:%uz rc:%uz",
+                   ctx->input.pos, ctx->output.pos,
+                   ctx->input.size, ctx->output.size, rc);
+
+    if (ctx->input.src) {
+        ctx->in_buf->pos = (u_char *) ctx->input.src + ctx->input.pos;
+
+        if (ctx->input.pos == ctx->input.size) {
+            ctx->input.src = NULL;
+            ctx->input.size = 0;
+            ctx->input.pos = 0;
+        }
+    }
+
+    ctx->out_buf->last = (u_char *) ctx->output.dst + ctx->output.pos;
+
+    if (ctx->output.pos == ctx->output.size
+        && (ctx->flush == ZSTD_e_continue || rc != 0))
+    {
+
+        /* zstd wants to output some more data */
+
+        cl = ngx_alloc_chain_link(r->pool);
+        if (cl == NULL) {
+            return NGX_ERROR;
+        }
+
+        cl->buf = ctx->out_buf;
+        cl->next = NULL;
+        *ctx->last_out = cl;
+        ctx->last_out = &cl->next;
+
+        ctx->redo = 1;
+
+        return NGX_AGAIN;
+    }
+
+    ctx->redo = 0;
+
+    if (ctx->flush == ZSTD_e_flush && rc == 0) {
+
+        ctx->flush = ZSTD_e_continue;
+
+        cl = ngx_alloc_chain_link(r->pool);
+        if (cl == NULL) {
+            return NGX_ERROR;
+        }
+
+        b = ctx->out_buf;
+
+        if (ngx_buf_size(b) == 0) {
+
+            b = ngx_calloc_buf(ctx->request->pool);
+            if (b == NULL) {
+                return NGX_ERROR;
+            }
+
+        } else {
+            ctx->output.pos = ctx->output.size;
+        }
+
+        b->flush = 1;
+
+        cl->buf = b;
+        cl->next = NULL;
+        *ctx->last_out = cl;
+        ctx->last_out = &cl->next;
+
+        r->connection->buffered &= ~NGX_HTTP_GZIP_BUFFERED;
+
+        return NGX_OK;
+    }
+
+    if (ctx->flush == ZSTD_e_end && rc == 0) {
+
+        if (ngx_http_zstd_filter_compress_end(r, ctx) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        return NGX_OK;
+    }
+
+    return NGX_AGAIN;
+}
+
+
+static ngx_int_t
+ngx_http_zstd_filter_compress_end(ngx_http_request_t *r,
+    ngx_http_zstd_ctx_t *ctx)
+{
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl;
+
+    ZSTD_freeCCtx(ctx->cctx);
+    ctx->cctx = NULL;
+
+    cl = ngx_alloc_chain_link(r->pool);
+    if (cl == NULL) {
+        return NGX_ERROR;
+    }
+
+    b = ctx->out_buf;
+
+    if (ngx_buf_size(b) == 0) {
+        b->temporary = 0;
+    }
+
+    b->last_buf = 1;
+
+    cl->buf = b;
+    cl->next = NULL;
+    *ctx->last_out = cl;
+    ctx->last_out = &cl->next;
+
+    ctx->input.size = 0;
+    ctx->input.pos = 0;
+    ctx->output.size = 0;
+    ctx->output.pos = 0;
+
+    ctx->done = 1;
+
+    r->connection->buffered &= ~NGX_HTTP_GZIP_BUFFERED;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_zstd_filter_cleanup(void *data)
+{
+    ngx_http_zstd_ctx_t *ctx = data;
+
+    if (ctx->cctx) {
+        ZSTD_freeCCtx(ctx->cctx);
+        ctx->cctx = NULL;
+    }
+}
+
+
+static void *
+ngx_http_zstd_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_zstd_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_zstd_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->bufs.num = 0;
+     *     conf->types = { NULL };
+     *     conf->types_keys = NULL;
+     */
+
+    conf->enable = NGX_CONF_UNSET;
+
+    conf->level = NGX_CONF_UNSET;
+    conf->min_length = NGX_CONF_UNSET;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_zstd_merge_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_zstd_conf_t *prev = parent;
+    ngx_http_zstd_conf_t *conf = child;
+
+    ngx_conf_merge_value(conf->enable, prev->enable, 0);
+
+    ngx_conf_merge_bufs_value(conf->bufs, prev->bufs,
+                              (128 * 1024) / ngx_pagesize, ngx_pagesize);
+
+    ngx_conf_merge_value(conf->level, prev->level, 3);
+    ngx_conf_merge_value(conf->min_length, prev->min_length, 20);
+
+    if (ngx_http_merge_types(cf, &conf->types_keys, &conf->types,
+                             &prev->types_keys, &prev->types,
+                             ngx_http_html_default_types)
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_zstd_filter_init(ngx_conf_t *cf)
+{
+    ngx_http_next_header_filter = ngx_http_top_header_filter;
+    ngx_http_top_header_filter = ngx_http_zstd_header_filter;
+
+    ngx_http_next_body_filter = ngx_http_top_body_filter;
+    ngx_http_top_body_filter = ngx_http_zstd_body_filter;
+
+    return NGX_OK;
+}
@@ -675,6 +675,7 @@ ngx_http_init_locations(ngx_conf_t *cf, ngx_http_core_srv_conf_t *cscf,
     ngx_http_core_loc_conf_t   **clcfp;
 #if (NGX_PCRE)
     ngx_uint_t                   r;
+    ngx_str_t                   *patterns;
     ngx_queue_t                 *regex;
 #endif
 
@@ -785,6 +786,23 @@ ngx_http_init_locations(ngx_conf_t *cf, ngx_http_core_srv_conf_t *cscf,
         *clcfp = NULL;
 
         ngx_queue_split(locations, regex, &tail);
+
+        if (r >= NGX_REGEX_SET_MIN) {
+            patterns = ngx_palloc(cf->temp_pool, r * sizeof(ngx_str_t));
+            if (patterns == NULL) {
+                return NGX_ERROR;
+            }
+
+            for (n = 0; n < r; n++) {
+                patterns[n] = pclcf->regex_locations[n]->name;
+            }
+
+            pclcf->regex_set = ngx_regex_set_init(cf->pool, cf->temp_pool,
+                                                  patterns, r);
+            if (pclcf->regex_set == NULL) {
+                return NGX_ERROR;
+            }
+        }
     }
 
 #endif
@@ -1326,6 +1344,7 @@ ngx_http_add_address(ngx_conf_t *cf, ngx_http_core_srv_conf_t *cscf,
 #if (NGX_PCRE)
     addr->nregex = 0;
     addr->regex = NULL;
+    addr->regex_set = NULL;
 #endif
     addr->default_server = cscf;
     addr->servers.elts = NULL;
@@ -1433,6 +1452,7 @@ ngx_http_server_names(ngx_conf_t *cf, ngx_http_core_main_conf_t *cmcf,
     ngx_http_core_srv_conf_t  **cscfp;
 #if (NGX_PCRE)
     ngx_uint_t                  regex, i;
+    ngx_str_t                  *patterns;
 
     regex = 0;
 #endif
@@ -1565,6 +1585,23 @@ ngx_http_server_names(ngx_conf_t *cf, ngx_http_core_main_conf_t *cmcf,
         }
     }
 
+    if (regex >= NGX_REGEX_SET_MIN) {
+        patterns = ngx_palloc(cf->temp_pool, regex * sizeof(ngx_str_t));
+        if (patterns == NULL) {
+            return NGX_ERROR;
+        }
+
+        for (i = 0; i < regex; i++) {
+            patterns[i] = addr->regex[i].regex->name;
+        }
+
+        addr->regex_set = ngx_regex_set_init(cf->pool, cf->temp_pool,
+                                             patterns, regex);
+        if (addr->regex_set == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
 #endif
 
     return NGX_OK;
@@ -1770,6 +1807,10 @@ ngx_http_add_listening(ngx_conf_t *cf, ngx_http_conf_addr_t *addr)
     ls->reuseport = addr->opt.reuseport;
 #endif
 
+#if (NGX_HAVE_REUSEPORT_CBPF)
+    ls->incoming_cpu = addr->opt.incoming_cpu;
+#endif
+
     return ls;
 }
 
@@ -1830,6 +1871,7 @@ ngx_http_add_addrs(ngx_conf_t *cf, ngx_http_port_t *hport,
 #if (NGX_PCRE)
         vn->nregex = addr[i].nregex;
         vn->regex = addr[i].regex;
+        vn->regex_set = addr[i].regex_set;
 #endif
     }
 
@@ -1895,6 +1937,7 @@ ngx_http_add_addrs6(ngx_conf_t *cf, ngx_http_port_t *hport,
 #if (NGX_PCRE)
         vn->nregex = addr[i].nregex;
         vn->regex = addr[i].regex;
+        vn->regex_set = addr[i].regex_set;
 #endif
     }
 
@@ -36,6 +36,24 @@ typedef struct {
 } ngx_http_cache_valid_t;
 
 
+/*
+ * a cache element being filled, shared with the requests which wait
+ * for it and stream the temporary file as it grows
+ */
+
+typedef struct {
+    off_t                            offset;
+    size_t                           body_start;
+    ngx_uint_t                       refs;
+    unsigned                         done:1;
+    unsigned                         error:1;
+    u_char                           name[1];
+} ngx_http_file_cache_fill_t;
+
+
+typedef struct ngx_http_file_cache_ram_s  ngx_http_file_cache_ram_t;
+
+
 typedef struct {
     ngx_rbtree_node_t                node;
     ngx_queue_t                      queue;
@@ -51,7 +69,8 @@ typedef struct {
     unsigned                         updating:1;
     unsigned                         deleting:1;
     unsigned                         purged:1;
-                                     /* 10 unused bits */
+    unsigned                         unverified:1;
+                                     /* 9 unused bits */
 
     ngx_file_uniq_t                  uniq;
     time_t                           expire;
@@ -59,9 +78,27 @@ typedef struct {
     size_t                           body_start;
     off_t                            fs_size;
     ngx_msec_t                       lock_time;
+    ngx_http_file_cache_fill_t      *fill;
+    ngx_http_file_cache_ram_t       *ram;
 } ngx_http_file_cache_node_t;
 
 
+/*
+ * a copy of a small and frequently used cache file kept in the keys zone;
+ * it is copied to requests without the shard mutex held, so a copy freed
+ * while referenced is detached from its node and released by the last
+ * reader
+ */
+
+struct ngx_http_file_cache_ram_s {
+    ngx_queue_t                      queue;
+    ngx_http_file_cache_node_t      *node;
+    ngx_uint_t                       refs;
+    size_t                           len;
+    u_char                           data[1];
+};
+
+
 struct ngx_http_cache_s {
     ngx_file_t                       file;
     ngx_array_t                      keys;
@@ -91,6 +128,7 @@ struct ngx_http_cache_s {
     ngx_uint_t                       vary_tag;
 
     ngx_buf_t                       *buf;
+    u_char                          *ram;
 
     ngx_http_file_cache_t           *file_cache;
     ngx_http_file_cache_node_t      *node;
@@ -104,10 +142,20 @@ struct ngx_http_cache_s {
     ngx_msec_t                       lock_time;
     ngx_msec_t                       wait_time;
 
+    time_t                           prefetch;
+    ngx_uint_t                       prefetch_uses;
+
     ngx_event_t                      wait_event;
 
+    ngx_http_file_cache_fill_t      *fill;
+    ngx_msec_t                       fill_time;
+    ngx_chain_t                     *free;
+    ngx_chain_t                     *busy;
+
     unsigned                         lock:1;
     unsigned                         waiting:1;
+    unsigned                         lock_stream:1;
+    unsigned                         streaming:1;
 
     unsigned                         updated:1;
     unsigned                         updating:1;
@@ -120,6 +168,8 @@ struct ngx_http_cache_s {
 
     unsigned                         stale_updating:1;
     unsigned                         stale_error:1;
+
+    unsigned                         prefetching:1;
 };
 
 
@@ -143,14 +193,27 @@ typedef struct {
 
 
 typedef struct {
+    ngx_shmtx_sh_t                   lock;
+    ngx_shmtx_t                      mutex;
     ngx_rbtree_t                     rbtree;
     ngx_rbtree_node_t                sentinel;
     ngx_queue_t                      queue;
-    ngx_atomic_t                     cold;
-    ngx_atomic_t                     loading;
     off_t                            size;
     ngx_uint_t                       count;
+    ngx_queue_t                      ram_queue;
+    size_t                           ram_size;
+} ngx_http_file_cache_shard_t;
+
+
+typedef struct {
+    ngx_atomic_t                     cold;
+    ngx_atomic_t                     loading;
+    ngx_uint_t                       verify;
     ngx_uint_t                       watermark;
+    ngx_uint_t                       nshards;
+    ngx_http_file_cache_shard_t     *shards;
+    ngx_atomic_t                     prefetch_sec;
+    ngx_atomic_t                     prefetch_n;
 } ngx_http_file_cache_sh_t;
 
 
@@ -158,6 +221,10 @@ struct ngx_http_file_cache_s {
     ngx_http_file_cache_sh_t        *sh;
     ngx_slab_pool_t                 *shpool;
 
+    ngx_http_file_cache_shard_t     *shards;
+    ngx_uint_t                       nshards;
+    ngx_uint_t                       shard;
+
     ngx_path_t                      *path;
 
     off_t                            max_size;
@@ -177,6 +244,16 @@ struct ngx_http_file_cache_s {
     ngx_msec_t                       manager_sleep;
     ngx_msec_t                       manager_threshold;
 
+    ngx_uint_t                       prefetch_rate;
+
+    size_t                           ram_size;
+    size_t                           ram_max_object;
+    ngx_uint_t                       ram_min_uses;
+
+    ngx_str_t                        index;
+    ngx_msec_t                       index_interval;
+    ngx_msec_t                       index_last;
+
     ngx_shm_zone_t                  *shm_zone;
 
     ngx_uint_t                       use_temp_path;
@@ -184,12 +261,29 @@ struct ngx_http_file_cache_s {
 };
 
 
+/*
+ * shards are laid out with a cache line stride, so the mutex
+ * of a shard does not share a cache line with its neighbours
+ */
+
+#define NGX_HTTP_FILE_CACHE_SHARD_SIZE                                       \
+    ngx_align(sizeof(ngx_http_file_cache_shard_t), NGX_CPU_CACHE_LINE)
+
+#define ngx_http_file_cache_shard_n(cache, n)                                \
+    ((ngx_http_file_cache_shard_t *) ((u_char *) (cache)->shards             \
+                                      + (n) * NGX_HTTP_FILE_CACHE_SHARD_SIZE))
+
+#define ngx_http_file_cache_shard(cache, key)                                \
+    ngx_http_file_cache_shard_n(cache, (key) % (cache)->nshards)
+
+
 ngx_int_t ngx_http_file_cache_new(ngx_http_request_t *r);
 ngx_int_t ngx_http_file_cache_create(ngx_http_request_t *r);
 void ngx_http_file_cache_create_key(ngx_http_request_t *r);
 ngx_int_t ngx_http_file_cache_open(ngx_http_request_t *r);
 ngx_int_t ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf);
 void ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf);
+void ngx_http_file_cache_fill(ngx_http_request_t *r, ngx_temp_file_t *tf);
 void ngx_http_file_cache_update_header(ngx_http_request_t *r);
 ngx_int_t ngx_http_cache_send(ngx_http_request_t *);
 void ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf);
@@ -75,8 +75,10 @@ static char *ngx_http_core_internal(ngx_conf_t *cf, ngx_command_t *cmd,
 static char *ngx_http_core_resolver(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 #if (NGX_HTTP_GZIP)
+static ngx_int_t ngx_http_compression_ok(ngx_http_request_t *r);
 static ngx_int_t ngx_http_gzip_accept_encoding(ngx_str_t *ae);
 static ngx_uint_t ngx_http_gzip_quantity(u_char *p, u_char *last);
+static ngx_uint_t ngx_http_encoding_quantity(ngx_str_t *ae, ngx_str_t *name);
 static char *ngx_http_gzip_disable(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 #endif
@@ -177,6 +179,23 @@ static ngx_str_t  ngx_http_gzip_no_cache = ngx_string("no-cache");
 static ngx_str_t  ngx_http_gzip_no_store = ngx_string("no-store");
 static ngx_str_t  ngx_http_gzip_private = ngx_string("private");
 
+
+/* in the order of the filters in the chain */
+
+static ngx_str_t  ngx_http_encodings[] = {
+#if (NGX_HTTP_ZSTD)
+    ngx_string("zstd"),
+#else
+    ngx_null_string,
+#endif
+#if (NGX_HTTP_BROTLI)
+    ngx_string("br"),
+#else
+    ngx_null_string,
+#endif
+    ngx_string("gzip")
+};
+
 #endif
 
 
@@ -1380,7 +1399,7 @@ ngx_http_core_find_location(ngx_http_request_t *r)
     ngx_http_core_loc_conf_t  *pclcf;
 #if (NGX_PCRE)
     ngx_int_t                  n;
-    ngx_uint_t                 noregex;
+    ngx_uint_t                 noregex, *cand;
     ngx_http_core_loc_conf_t  *clcf, **clcfp;
 
     noregex = 0;
@@ -1413,8 +1432,19 @@ ngx_http_core_find_location(ngx_http_request_t *r)
 
     if (noregex == 0 && pclcf->regex_locations) {
 
+        cand = pclcf->regex_set ? ngx_regex_set_match(pclcf->regex_set,
+                                                      &r->uri)
+                                : NULL;
+
         for (clcfp = pclcf->regex_locations; *clcfp; clcfp++) {
 
+            if (cand
+                && !ngx_regex_set_candidate(cand,
+                                            clcfp - pclcf->regex_locations))
+            {
+                continue;
+            }
+
             ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                            "test location: ~ \"%V\"", &(*clcfp)->name);
 
@@ -2005,11 +2035,7 @@ ngx_http_auth_basic_user(ngx_http_request_t *r)
 ngx_int_t
 ngx_http_gzip_ok(ngx_http_request_t *r)
 {
-    time_t                     date, expires;
-    ngx_uint_t                 p;
-    ngx_array_t               *cc;
-    ngx_table_elt_t           *e, *d, *ae;
-    ngx_http_core_loc_conf_t  *clcf;
+    ngx_table_elt_t  *ae;
 
     r->gzip_tested = 1;
 
@@ -2041,6 +2067,66 @@ ngx_http_gzip_ok(ngx_http_request_t *r)
         return NGX_DECLINED;
     }
 
+    if (ngx_http_compression_ok(r) != NGX_OK) {
+        return NGX_DECLINED;
+    }
+
+    r->gzip_ok = 1;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_encoding_ok(ngx_http_request_t *r, ngx_uint_t encoding)
+{
+    ngx_uint_t        i, q;
+    ngx_table_elt_t  *ae;
+
+    if (r != r->main) {
+        return NGX_DECLINED;
+    }
+
+    ae = r->headers_in.accept_encoding;
+    if (ae == NULL) {
+        return NGX_DECLINED;
+    }
+
+    q = ngx_http_encoding_quantity(&ae->value, &ngx_http_encodings[encoding]);
+
+    if (q == 0) {
+        return NGX_DECLINED;
+    }
+
+    /*
+     * a coding the client prefers is left to the filters further down
+     * the chain, on equal quantities the first coding in the chain wins
+     */
+
+    for (i = encoding + 1; i < sizeof(ngx_http_encodings) / sizeof(ngx_str_t);
+         i++)
+    {
+        if (ngx_http_encodings[i].len
+            && ngx_http_encoding_quantity(&ae->value, &ngx_http_encodings[i])
+               > q)
+        {
+            return NGX_DECLINED;
+        }
+    }
+
+    return ngx_http_compression_ok(r);
+}
+
+
+static ngx_int_t
+ngx_http_compression_ok(ngx_http_request_t *r)
+{
+    time_t                     date, expires;
+    ngx_uint_t                 p;
+    ngx_array_t               *cc;
+    ngx_table_elt_t           *e, *d;
+    ngx_http_core_loc_conf_t  *clcf;
+
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
     if (r->headers_in.msie6 && clcf->gzip_disable_msie6) {
@@ -2157,8 +2243,6 @@ ok:
 
 #endif
 
-    r->gzip_ok = 1;
-
     return NGX_OK;
 }
 
@@ -2291,6 +2375,96 @@ ngx_http_gzip_quantity(u_char *p, u_char *last)
     return q;
 }
 
+
+/*
+ * returns the quantity of the coding multiplied by 1000,
+ * 0 if the coding is not listed or listed with an invalid quantity
+ */
+
+static ngx_uint_t
+ngx_http_encoding_quantity(ngx_str_t *ae, ngx_str_t *name)
+{
+    u_char      *p, *start, *last;
+    ngx_uint_t   q, n;
+
+    start = ae->data;
+    last = start + ae->len;
+
+    for ( ;; ) {
+        p = ngx_strlcasestrn(start, last, name->data, name->len - 1);
+        if (p == NULL) {
+            return 0;
+        }
+
+        start = p + name->len;
+
+        if ((p == ae->data || *(p - 1) == ',' || *(p - 1) == ' ')
+            && (start == last
+                || *start == ',' || *start == ';' || *start == ' '))
+        {
+            break;
+        }
+    }
+
+    p = start;
+
+    while (p < last && *p == ' ') {
+        p++;
+    }
+
+    if (p == last || *p == ',') {
+        return 1000;
+    }
+
+    if (*p++ != ';') {
+        return 0;
+    }
+
+    while (p < last && *p == ' ') {
+        p++;
+    }
+
+    if (p + 3 > last || (*p != 'q' && *p != 'Q') || *(p + 1) != '=') {
+        return 0;
+    }
+
+    p += 2;
+
+    switch (*p++) {
+    case '0':
+        q = 0;
+        break;
+    case '1':
+        q = 1000;
+        break;
+    default:
+        return 0;
+    }
+
+    if (p < last && *p == '.') {
+        p++;
+
+        for (n = 100; p < last && *p >= '0' && *p <= '9'; n /= 10) {
+
+            if (n == 0) {
+                return 0;
+            }
+
+            q += (*p++ - '0') * n;
+        }
+    }
+
+    while (p < last && *p == ' ') {
+        p++;
+    }
+
+    if ((p < last && *p != ',') || q > 1000) {
+        return 0;
+    }
+
+    return q;
+}
+
 #endif
 
 
@@ -4054,6 +4228,17 @@ ngx_http_core_listen(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strcmp(value[n].data, "incoming_cpu") == 0) {
+#if (NGX_HAVE_REUSEPORT_CBPF)
+            lsopt.incoming_cpu = 1;
+#else
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "incoming_cpu is not supported "
+                               "on this platform, ignored");
+#endif
+            continue;
+        }
+
         if (ngx_strcmp(value[n].data, "ssl") == 0) {
 #if (NGX_HTTP_SSL)
             lsopt.ssl = 1;
@@ -4187,6 +4372,10 @@ ngx_http_core_listen(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    if (lsopt.incoming_cpu && !lsopt.reuseport) {
+        return "\"incoming_cpu\" parameter requires \"reuseport\"";
+    }
+
     for (n = 0; n < u.naddrs; n++) {
         lsopt.sockaddr = u.addrs[n].sockaddr;
         lsopt.socklen = u.addrs[n].socklen;
@@ -31,6 +31,11 @@ typedef struct ngx_thread_pool_s  ngx_thread_pool_t;
 #define NGX_HTTP_GZIP_PROXIED_ANY       0x0200
 
 
+#define NGX_HTTP_ENCODING_ZSTD          0
+#define NGX_HTTP_ENCODING_BR            1
+#define NGX_HTTP_ENCODING_GZIP          2
+
+
 #define NGX_HTTP_AIO_OFF                0
 #define NGX_HTTP_AIO_ON                 1
 #define NGX_HTTP_AIO_THREADS            2
@@ -80,6 +85,7 @@ typedef struct {
 #endif
     unsigned                   deferred_accept:1;
     unsigned                   reuseport:1;
+    unsigned                   incoming_cpu:1;
     unsigned                   so_keepalive:2;
     unsigned                   proxy_protocol:1;
 
@@ -226,6 +232,9 @@ typedef struct {
 
     ngx_uint_t                 nregex;
     ngx_http_server_name_t    *regex;
+#if (NGX_PCRE)
+    ngx_regex_set_t           *regex_set;
+#endif
 } ngx_http_virtual_names_t;
 
 
@@ -281,6 +290,7 @@ typedef struct {
 #if (NGX_PCRE)
     ngx_uint_t                 nregex;
     ngx_http_server_name_t    *regex;
+    ngx_regex_set_t           *regex_set;
 #endif
 
     /* the default server configuration for this address:port */
@@ -320,6 +330,7 @@ struct ngx_http_core_loc_conf_s {
     ngx_http_location_tree_node_t   *static_locations;
 #if (NGX_PCRE)
     ngx_http_core_loc_conf_t       **regex_locations;
+    ngx_regex_set_t                 *regex_set;
 #endif
 
     /* pointer to the modules' loc_conf */
@@ -496,6 +507,7 @@ u_char *ngx_http_map_uri_to_path(ngx_http_request_t *r, ngx_str_t *name,
 ngx_int_t ngx_http_auth_basic_user(ngx_http_request_t *r);
 #if (NGX_HTTP_GZIP)
 ngx_int_t ngx_http_gzip_ok(ngx_http_request_t *r);
+ngx_int_t ngx_http_encoding_ok(ngx_http_request_t *r, ngx_uint_t encoding);
 #endif
 
 
@@ -11,13 +11,72 @@
 #include <ngx_md5.h>
 
 
+#define NGX_HTTP_FILE_CACHE_INDEX_MAGIC    0x78646e69     /* "indx" */
+#define NGX_HTTP_FILE_CACHE_INDEX_VERSION  2
+#define NGX_HTTP_FILE_CACHE_INDEX_CHUNK    4096
+
+#define NGX_HTTP_FILE_CACHE_STREAM_POLL    10
+
+
+/*
+ * The index snapshot is a header followed by fixed size nodes,
+ * in the native byte order and layout, for the same build only.
+ * The nodes are in the key order of each shard, the inactive queue
+ * order is restored from the expiration times.
+ */
+
+typedef struct {
+    uint32_t                         magic;
+    uint32_t                         version;
+    uint32_t                         node_size;
+    uint32_t                         clean;
+    uint64_t                         bsize;
+    uint64_t                         count;
+    uint64_t                         time;
+} ngx_http_file_cache_index_header_t;
+
+
+typedef struct {
+    u_char                           key[NGX_HTTP_CACHE_KEY_LEN];
+    ngx_file_uniq_t                  uniq;
+    off_t                            fs_size;
+    size_t                           body_start;
+    time_t                           expire;
+} ngx_http_file_cache_index_node_t;
+
+
+static void ngx_http_file_cache_unlock(ngx_shm_zone_t *shm_zone,
+    ngx_pid_t pid);
 static ngx_int_t ngx_http_file_cache_lock(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static void ngx_http_file_cache_lock_wait_handler(ngx_event_t *ev);
 static void ngx_http_file_cache_lock_wait(ngx_http_request_t *r,
     ngx_http_cache_t *c);
+static void ngx_http_file_cache_fill_release(ngx_http_cache_t *c,
+    ngx_uint_t done);
+static ngx_int_t ngx_http_file_cache_stream_open(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static ngx_int_t ngx_http_file_cache_stream_read(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static ngx_int_t ngx_http_file_cache_stream_send(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static ngx_int_t ngx_http_file_cache_stream(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_stream_handler(ngx_event_t *ev);
+static void ngx_http_file_cache_stream_writer(ngx_http_request_t *r);
+static ngx_int_t ngx_http_file_cache_stream_flush(ngx_http_request_t *r);
 static ngx_int_t ngx_http_file_cache_read(ngx_http_request_t *r,
     ngx_http_cache_t *c);
+static ngx_int_t ngx_http_file_cache_prefetch(ngx_http_file_cache_t *cache,
+    time_t now);
+static ngx_int_t ngx_http_file_cache_ram_open(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_ram_add(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static size_t ngx_http_file_cache_ram_charge(ngx_http_file_cache_t *cache,
+    size_t len);
+static void ngx_http_file_cache_ram_free(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard, ngx_http_file_cache_node_t *fcn);
 static ssize_t ngx_http_file_cache_aio_read(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 #if (NGX_HAVE_FILE_AIO)
@@ -33,7 +92,7 @@ static ngx_int_t ngx_http_file_cache_exists(ngx_http_file_cache_t *cache,
 static ngx_int_t ngx_http_file_cache_name(ngx_http_request_t *r,
     ngx_path_t *path);
 static ngx_http_file_cache_node_t *
-    ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key);
+    ngx_http_file_cache_lookup(ngx_http_file_cache_shard_t *shard, u_char *key);
 static void ngx_http_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
     ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
 static void ngx_http_file_cache_vary(ngx_http_request_t *r, u_char *vary,
@@ -46,9 +105,14 @@ static ngx_int_t ngx_http_file_cache_update_variant(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static void ngx_http_file_cache_cleanup(void *data);
 static time_t ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache);
+static time_t ngx_http_file_cache_forced_expire_shard(
+    ngx_http_file_cache_t *cache, ngx_http_file_cache_shard_t *shard,
+    u_char *name);
 static time_t ngx_http_file_cache_expire(ngx_http_file_cache_t *cache);
+static time_t ngx_http_file_cache_expire_shard(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard, u_char *name);
 static void ngx_http_file_cache_delete(ngx_http_file_cache_t *cache,
-    ngx_queue_t *q, u_char *name);
+    ngx_http_file_cache_shard_t *shard, ngx_queue_t *q, u_char *name);
 static void ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache);
 static ngx_int_t ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
@@ -63,6 +127,21 @@ static ngx_int_t ngx_http_file_cache_add(ngx_http_file_cache_t *cache,
 static ngx_int_t ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
 static void ngx_http_file_cache_set_watermark(ngx_http_file_cache_t *cache);
+static void ngx_http_file_cache_size(ngx_http_file_cache_t *cache,
+    off_t *size, ngx_uint_t *count);
+static void ngx_http_file_cache_saver(void *data);
+static void ngx_http_file_cache_save_index(ngx_http_file_cache_t *cache,
+    ngx_uint_t clean);
+static void ngx_http_file_cache_load_index(ngx_http_file_cache_t *cache,
+    ngx_log_t *log);
+static ngx_int_t ngx_http_file_cache_add_index_node(
+    ngx_http_file_cache_t *cache, ngx_http_file_cache_index_node_t *node,
+    time_t shift, ngx_uint_t unverified);
+static ngx_int_t ngx_http_file_cache_index_cmp(const ngx_queue_t *one,
+    const ngx_queue_t *two);
+static ngx_http_file_cache_node_t *ngx_http_file_cache_index_next(
+    ngx_http_file_cache_shard_t *shard, u_char *key);
+static void ngx_http_file_cache_sweep(ngx_http_file_cache_t *cache);
 
 
 ngx_str_t  ngx_http_cache_status[] = {
@@ -84,9 +163,11 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 {
     ngx_http_file_cache_t  *ocache = data;
 
-    size_t                  len;
-    ngx_uint_t              n;
-    ngx_http_file_cache_t  *cache;
+    size_t                        len;
+    u_char                       *file;
+    ngx_uint_t                    n;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
 
     cache = shm_zone->data;
 
@@ -110,9 +191,17 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
             }
         }
 
+        if (cache->nshards != ocache->nshards) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "cache \"%V\" had previously different shards",
+                          &shm_zone->shm.name);
+            return NGX_ERROR;
+        }
+
         cache->sh = ocache->sh;
 
         cache->shpool = ocache->shpool;
+        cache->shards = ocache->shards;
         cache->bsize = ocache->bsize;
 
         cache->max_size /= cache->bsize;
@@ -128,6 +217,7 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 
     if (shm_zone->shm.exists) {
         cache->sh = cache->shpool->data;
+        cache->shards = cache->sh->shards;
         cache->bsize = ngx_fs_bsize(cache->path->name.data);
         cache->max_size /= cache->bsize;
 
@@ -141,16 +231,58 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 
     cache->shpool->data = cache->sh;
 
-    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
-                    ngx_http_file_cache_rbtree_insert_value);
+    /*
+     * slab chunks are aligned to their size rounded up to a power of two
+     * and larger allocations to a page, so the shards start at a cache
+     * line boundary
+     */
+
+    len = cache->nshards * NGX_HTTP_FILE_CACHE_SHARD_SIZE;
+
+    cache->shards = ngx_slab_calloc(cache->shpool, len);
+    if (cache->shards == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (n = 0; n < cache->nshards; n++) {
+        shard = ngx_http_file_cache_shard_n(cache, n);
+
+#if (NGX_HAVE_ATOMIC_OPS)
+
+        file = NULL;
+
+#else
+
+        len = cache->path->name.len + sizeof("/.lock.") + NGX_INT_T_LEN;
 
-    ngx_queue_init(&cache->sh->queue);
+        file = ngx_alloc(len, shm_zone->shm.log);
+        if (file == NULL) {
+            return NGX_ERROR;
+        }
+
+        (void) ngx_sprintf(file, "%V/.lock.%ui%Z", &cache->path->name, n);
+
+#endif
+
+        if (ngx_shmtx_create(&shard->mutex, &shard->lock, file) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        ngx_rbtree_init(&shard->rbtree, &shard->sentinel,
+                        ngx_http_file_cache_rbtree_insert_value);
+
+        ngx_queue_init(&shard->queue);
+        ngx_queue_init(&shard->ram_queue);
+    }
 
     cache->sh->cold = 1;
     cache->sh->loading = 0;
-    cache->sh->size = 0;
-    cache->sh->count = 0;
+    cache->sh->verify = 0;
     cache->sh->watermark = (ngx_uint_t) -1;
+    cache->sh->nshards = cache->nshards;
+    cache->sh->shards = cache->shards;
+    cache->sh->prefetch_sec = 0;
+    cache->sh->prefetch_n = 0;
 
     cache->bsize = ngx_fs_bsize(cache->path->name.data);
 
@@ -168,10 +300,38 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 
     cache->shpool->log_nomem = 0;
 
+    if (cache->index.len) {
+        ngx_http_file_cache_load_index(cache, shm_zone->shm.log);
+    }
+
     return NGX_OK;
 }
 
 
+static void
+ngx_http_file_cache_unlock(ngx_shm_zone_t *shm_zone, ngx_pid_t pid)
+{
+    ngx_http_file_cache_t  *cache = shm_zone->data;
+
+    ngx_uint_t                    i;
+    ngx_http_file_cache_shard_t  *shard;
+
+    if (cache->shards == NULL) {
+        return;
+    }
+
+    for (i = 0; i < cache->nshards; i++) {
+        shard = ngx_http_file_cache_shard_n(cache, i);
+
+        if (ngx_shmtx_force_unlock(&shard->mutex, pid)) {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                          "cache \"%V\" shard %ui was locked by %P",
+                          &shm_zone->shm.name, i, pid);
+        }
+    }
+}
+
+
 ngx_int_t
 ngx_http_file_cache_new(ngx_http_request_t *r)
 {
@@ -279,6 +439,11 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
     }
 
     if (c->reading) {
+
+        if (c->streaming) {
+            return ngx_http_file_cache_stream_read(r, c);
+        }
+
         return ngx_http_file_cache_read(r, c);
     }
 
@@ -343,6 +508,18 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
         goto done;
     }
 
+    if (cache->ram_size && c->node->ram) {
+        rc = ngx_http_file_cache_ram_open(r, c);
+
+        if (rc == NGX_OK) {
+            return ngx_http_file_cache_read(r, c);
+        }
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+    }
+
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
     ngx_memzero(&of, sizeof(ngx_open_file_info_t));
@@ -402,8 +579,11 @@ done:
 static ngx_int_t
 ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_msec_t                 now, timer;
-    ngx_http_file_cache_t     *cache;
+    ngx_int_t                     rc;
+    ngx_msec_t                    now, timer;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_fill_t   *fill;
+    ngx_http_file_cache_shard_t  *shard;
 
     if (!c->lock) {
         return NGX_DECLINED;
@@ -412,8 +592,9 @@ ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
     now = ngx_current_msec;
 
     cache = c->file_cache;
+    shard = ngx_http_file_cache_shard(cache, c->node->node.key);
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_shmtx_lock(&shard->mutex);
 
     timer = c->node->lock_time - now;
 
@@ -422,18 +603,39 @@ ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
         c->node->lock_time = now + c->lock_age;
         c->updating = 1;
         c->lock_time = c->node->lock_time;
+
+    } else if (c->lock_stream && c->node->fill && r == r->main) {
+
+        fill = c->node->fill;
+
+        if (!fill->done && !fill->error
+            && fill->offset >= (off_t) fill->body_start)
+        {
+            fill->refs++;
+
+            c->fill = fill;
+            c->streaming = 1;
+        }
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(&shard->mutex);
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache lock u:%d wt:%M",
-                   c->updating, c->wait_time);
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache lock u:%d s:%d wt:%M",
+                   c->updating, c->streaming, c->wait_time);
 
     if (c->updating) {
         return NGX_DECLINED;
     }
 
+    if (c->streaming) {
+        rc = ngx_http_file_cache_stream_open(r, c);
+
+        if (rc != NGX_DECLINED) {
+            return rc;
+        }
+    }
+
     if (c->lock_timeout == 0) {
         return NGX_HTTP_CACHE_SCARCE;
     }
@@ -450,6 +652,10 @@ ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
 
     timer = c->wait_time - now;
 
+    if (c->lock_stream && timer > NGX_HTTP_FILE_CACHE_STREAM_POLL) {
+        timer = NGX_HTTP_FILE_CACHE_STREAM_POLL;
+    }
+
     ngx_add_timer(&c->wait_event, (timer > 500) ? 500 : timer);
 
     r->main->blocked++;
@@ -481,9 +687,10 @@ ngx_http_file_cache_lock_wait_handler(ngx_event_t *ev)
 static void
 ngx_http_file_cache_lock_wait(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_uint_t              wait;
-    ngx_msec_t              now, timer;
-    ngx_http_file_cache_t  *cache;
+    ngx_uint_t                    wait;
+    ngx_msec_t                    now, timer;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
 
     now = ngx_current_msec;
 
@@ -497,19 +704,32 @@ ngx_http_file_cache_lock_wait(ngx_http_request_t *r, ngx_http_cache_t *c)
     }
 
     cache = c->file_cache;
+    shard = ngx_http_file_cache_shard(cache, c->node->node.key);
     wait = 0;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_shmtx_lock(&shard->mutex);
 
     timer = c->node->lock_time - now;
 
     if (c->node->updating && (ngx_msec_int_t) timer > 0) {
         wait = 1;
+
+        /* wake up to stream the element as soon as its header is written */
+
+        if (c->lock_stream && c->node->fill && r == r->main
+            && c->node->fill->offset >= (off_t) c->node->fill->body_start)
+        {
+            wait = 0;
+        }
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(&shard->mutex);
 
     if (wait) {
+        if (c->lock_stream && timer > NGX_HTTP_FILE_CACHE_STREAM_POLL) {
+            timer = NGX_HTTP_FILE_CACHE_STREAM_POLL;
+        }
+
         ngx_add_timer(&c->wait_event, (timer > 500) ? 500 : timer);
         return;
     }
@@ -522,6 +742,96 @@ wakeup:
 }
 
 
+static ngx_int_t
+ngx_http_file_cache_stream_open(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    ngx_fd_t                      fd;
+    ngx_err_t                     err;
+    ngx_pool_cleanup_t           *cln;
+    ngx_pool_cleanup_file_t      *clnf;
+    ngx_http_file_cache_shard_t  *shard;
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_pool_cleanup_file_t));
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    fd = ngx_open_file(c->fill->name, NGX_FILE_RDONLY|NGX_FILE_NONBLOCK,
+                       NGX_FILE_OPEN, 0);
+
+    if (fd == NGX_INVALID_FILE) {
+        err = ngx_errno;
+
+        if (err == NGX_ENOENT) {
+
+            /* the element may have just been completed or failed */
+
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, err,
+                           "http file cache stream open \"%s\" "
+                           "failed for \"%s\"",
+                           c->fill->name, c->file.name.data);
+
+        } else {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
+                          ngx_open_file_n " \"%s\" failed", c->fill->name);
+        }
+
+        shard = ngx_http_file_cache_shard(c->file_cache, c->node->node.key);
+
+        ngx_shmtx_lock(&shard->mutex);
+        ngx_http_file_cache_fill_release(c, 0);
+        ngx_shmtx_unlock(&shard->mutex);
+
+        c->streaming = 0;
+
+        return NGX_DECLINED;
+    }
+
+    cln->handler = ngx_pool_cleanup_file;
+    clnf = cln->data;
+
+    clnf->fd = fd;
+    clnf->name = c->file.name.data;
+    clnf->log = r->pool->log;
+
+    c->file.fd = fd;
+    c->file.log = r->connection->log;
+
+    c->buf = ngx_create_temp_buf(r->pool, c->body_start);
+    if (c->buf == NULL) {
+        return NGX_ERROR;
+    }
+
+    return ngx_http_file_cache_stream_read(r, c);
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_stream_read(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    ngx_int_t                     rc;
+    ngx_http_file_cache_shard_t  *shard;
+
+    rc = ngx_http_file_cache_read(r, c);
+
+    if (rc == NGX_OK || rc == NGX_AGAIN) {
+        return rc;
+    }
+
+    /* the element cannot be streamed, handle it as an ordinary one */
+
+    shard = ngx_http_file_cache_shard(c->file_cache, c->node->node.key);
+
+    ngx_shmtx_lock(&shard->mutex);
+    ngx_http_file_cache_fill_release(c, 0);
+    ngx_shmtx_unlock(&shard->mutex);
+
+    c->streaming = 0;
+
+    return rc;
+}
+
+
 static ngx_int_t
 ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
@@ -532,12 +842,19 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
     ngx_int_t                      rc;
     ngx_uint_t                     i;
     ngx_http_file_cache_t         *cache;
+    ngx_http_file_cache_shard_t   *shard;
     ngx_http_file_cache_header_t  *h;
 
-    n = ngx_http_file_cache_aio_read(r, c);
+    if (c->ram) {
+        n = (ssize_t) ngx_min(c->length, (off_t) c->body_start);
+        ngx_memcpy(c->buf->pos, c->ram, n);
 
-    if (n < 0) {
-        return n;
+    } else {
+        n = ngx_http_file_cache_aio_read(r, c);
+
+        if (n < 0) {
+            return n;
+        }
     }
 
     if ((size_t) n < c->header_start) {
@@ -614,10 +931,11 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
     r->cached = 1;
 
     cache = c->file_cache;
+    shard = ngx_http_file_cache_shard(cache, c->node->node.key);
 
-    if (cache->sh->cold) {
+    if (cache->sh->cold && !c->streaming) {
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
+        ngx_shmtx_lock(&shard->mutex);
 
         if (!c->node->exists) {
             c->node->uses = 1;
@@ -626,10 +944,10 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
             c->node->uniq = c->uniq;
             c->node->fs_size = c->fs_size;
 
-            cache->sh->size += c->fs_size;
+            shard->size += c->fs_size;
         }
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+        ngx_shmtx_unlock(&shard->mutex);
     }
 
     now = ngx_time();
@@ -638,7 +956,7 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
         c->stale_updating = c->valid_sec + c->updating_sec >= now;
         c->stale_error = c->valid_sec + c->error_sec >= now;
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
+        ngx_shmtx_lock(&shard->mutex);
 
         if (c->node->updating) {
             rc = NGX_HTTP_CACHE_UPDATING;
@@ -650,7 +968,7 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
             rc = NGX_HTTP_CACHE_STALE;
         }
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+        ngx_shmtx_unlock(&shard->mutex);
 
         ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                        "http file cache expired: %i %T %T",
@@ -659,135 +977,435 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
         return rc;
     }
 
-    return NGX_OK;
-}
-
-
-static ssize_t
-ngx_http_file_cache_aio_read(ngx_http_request_t *r, ngx_http_cache_t *c)
-{
-#if (NGX_HAVE_FILE_AIO || NGX_THREADS)
-    ssize_t                    n;
-    ngx_http_core_loc_conf_t  *clcf;
-
-    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
-#endif
+    /*
+     * a frequently used element which is about to expire is refreshed
+     * in background, so it does not expire for the following requests
+     */
 
-#if (NGX_HAVE_FILE_AIO)
+    if (c->prefetch && c->valid_sec - now < c->prefetch && !r->background) {
 
-    if (clcf->aio == NGX_HTTP_AIO_ON && ngx_file_aio) {
-        n = ngx_file_aio_read(&c->file, c->buf->pos, c->body_start, 0, r->pool);
+        ngx_shmtx_lock(&shard->mutex);
 
-        if (n != NGX_AGAIN) {
-            c->reading = 0;
-            return n;
+        if (!c->node->updating
+            && c->node->uses >= c->prefetch_uses
+            && ngx_http_file_cache_prefetch(cache, now) == NGX_OK)
+        {
+            c->node->updating = 1;
+            c->updating = 1;
+            c->lock_time = c->node->lock_time;
+            c->prefetching = 1;
         }
 
-        c->reading = 1;
-
-        c->file.aio->data = r;
-        c->file.aio->handler = ngx_http_cache_aio_event_handler;
+        ngx_shmtx_unlock(&shard->mutex);
 
-        r->main->blocked++;
-        r->aio = 1;
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache prefetch: %d %T %T",
+                       c->prefetching, c->valid_sec, now);
+    }
 
-        return NGX_AGAIN;
+    if (cache->ram_size && c->ram == NULL && !c->streaming) {
+        ngx_http_file_cache_ram_add(r, c);
     }
 
-#endif
+    return NGX_OK;
+}
 
-#if (NGX_THREADS)
 
-    if (clcf->aio == NGX_HTTP_AIO_THREADS) {
-        c->file.thread_task = c->thread_task;
-        c->file.thread_handler = ngx_http_cache_thread_handler;
-        c->file.thread_ctx = r;
+static ngx_int_t
+ngx_http_file_cache_prefetch(ngx_http_file_cache_t *cache, time_t now)
+{
+    ngx_atomic_uint_t  n;
 
-        n = ngx_thread_read(&c->file, c->buf->pos, c->body_start, 0, r->pool);
+    if (cache->prefetch_rate == 0) {
+        return NGX_OK;
+    }
 
-        c->thread_task = c->file.thread_task;
-        c->reading = (n == NGX_AGAIN);
+    /* the limit is approximate, concurrent resets are not coordinated */
 
-        return n;
+    if ((time_t) cache->sh->prefetch_sec != now) {
+        cache->sh->prefetch_sec = now;
+        cache->sh->prefetch_n = 0;
     }
 
-#endif
+    n = ngx_atomic_fetch_add(&cache->sh->prefetch_n, 1);
 
-    return ngx_read_file(&c->file, c->buf->pos, c->body_start, 0);
+    return (n < cache->prefetch_rate) ? NGX_OK : NGX_DECLINED;
 }
 
 
-#if (NGX_HAVE_FILE_AIO)
-
-static void
-ngx_http_cache_aio_event_handler(ngx_event_t *ev)
+static ngx_int_t
+ngx_http_file_cache_ram_open(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_event_aio_t     *aio;
-    ngx_connection_t    *c;
-    ngx_http_request_t  *r;
+    u_char                       *p;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_ram_t    *ram;
+    ngx_http_file_cache_shard_t  *shard;
 
-    aio = ev->data;
-    r = aio->data;
-    c = r->connection;
+    cache = c->file_cache;
+    shard = ngx_http_file_cache_shard(cache, c->node->node.key);
 
-    ngx_http_set_log_request(c->log, r);
+    ngx_shmtx_lock(&shard->mutex);
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                   "http file cache aio: \"%V?%V\"", &r->uri, &r->args);
+    ram = c->node->ram;
 
-    r->main->blocked--;
-    r->aio = 0;
+    if (ram && !c->node->exists) {
 
-    r->write_event_handler(r);
+        /* the file was purged */
 
-    ngx_http_run_posted_requests(c);
-}
+        ngx_http_file_cache_ram_free(cache, shard, c->node);
+        ram = NULL;
+    }
 
-#endif
+    if (ram) {
+        ram->refs++;
 
+        ngx_queue_remove(&ram->queue);
+        ngx_queue_insert_head(&shard->ram_queue, &ram->queue);
 
-#if (NGX_THREADS)
+        c->fs_size = c->node->fs_size;
+    }
 
-static ngx_int_t
-ngx_http_cache_thread_handler(ngx_thread_task_t *task, ngx_file_t *file)
-{
-    ngx_str_t                  name;
-    ngx_thread_pool_t         *tp;
-    ngx_http_request_t        *r;
-    ngx_http_core_loc_conf_t  *clcf;
+    ngx_shmtx_unlock(&shard->mutex);
 
-    r = file->thread_ctx;
+    if (ram == NULL) {
+        return NGX_DECLINED;
+    }
 
-    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
-    tp = clcf->thread_pool;
+    p = ngx_pnalloc(r->pool, ram->len);
 
-    if (tp == NULL) {
-        if (ngx_http_complex_value(r, clcf->thread_pool_value, &name)
-            != NGX_OK)
-        {
-            return NGX_ERROR;
-        }
+    if (p) {
+        ngx_memcpy(p, ram->data, ram->len);
+        c->length = ram->len;
+    }
 
-        tp = ngx_thread_pool_get((ngx_cycle_t *) ngx_cycle, &name);
+    ngx_shmtx_lock(&shard->mutex);
 
-        if (tp == NULL) {
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                          "thread pool \"%V\" not found", &name);
-            return NGX_ERROR;
-        }
+    if (--ram->refs == 0 && ram->node == NULL) {
+        ngx_slab_free(cache->shpool, ram);
     }
 
-    task->event.data = r;
-    task->event.handler = ngx_http_cache_thread_event_handler;
+    ngx_shmtx_unlock(&shard->mutex);
 
-    if (ngx_thread_task_post(tp, task) != NGX_OK) {
-        return NGX_ERROR;
+    if (p == NULL) {
+        return NGX_DECLINED;
     }
 
-    r->main->blocked++;
-    r->aio = 1;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache ram: %O", c->length);
 
-    return NGX_OK;
+    c->ram = p;
+
+    c->buf = ngx_create_temp_buf(r->pool, c->body_start);
+    if (c->buf == NULL) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_file_cache_ram_add(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    u_char                       *p;
+    size_t                        len, size, max;
+    ssize_t                       n;
+    ngx_uint_t                    evicted;
+    ngx_queue_t                  *q;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_ram_t    *ram, *last;
+    ngx_http_file_cache_shard_t  *shard;
+    ngx_http_core_loc_conf_t     *clcf;
+
+    cache = c->file_cache;
+
+    if (c->length > (off_t) cache->ram_max_object
+        || c->node->uses < cache->ram_min_uses
+        || c->node->ram)
+    {
+        return;
+    }
+
+    len = (size_t) c->length;
+    size = ngx_http_file_cache_ram_charge(cache, len);
+    max = cache->ram_size / cache->nshards;
+
+    if (size > max) {
+        return;
+    }
+
+    /* small files are usually read completely along with the header */
+
+    n = c->buf->last - c->buf->pos;
+
+    if ((size_t) n > len) {
+        n = len;
+    }
+
+    if ((size_t) n < len) {
+        clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+        if (clcf->aio != NGX_HTTP_AIO_OFF) {
+
+            /* the rest of the file is not read in a blocking way */
+
+            return;
+        }
+    }
+
+    p = ngx_pnalloc(r->pool, len);
+    if (p == NULL) {
+        return;
+    }
+
+    ngx_memcpy(p, c->buf->pos, n);
+
+    if ((size_t) n < len) {
+        if (ngx_read_file(&c->file, p + n, len - n, n) != (ssize_t) (len - n))
+        {
+            return;
+        }
+    }
+
+    /*
+     * the copy is allocated and filled without the shard mutex held;
+     * if the zone is full, the least recently used copy of the shard
+     * is freed to make room
+     */
+
+    shard = ngx_http_file_cache_shard(cache, c->node->node.key);
+
+    ram = ngx_slab_alloc(cache->shpool,
+                         offsetof(ngx_http_file_cache_ram_t, data) + len);
+
+    if (ram == NULL) {
+        ngx_shmtx_lock(&shard->mutex);
+
+        evicted = !ngx_queue_empty(&shard->ram_queue);
+
+        if (evicted) {
+            q = ngx_queue_last(&shard->ram_queue);
+            last = ngx_queue_data(q, ngx_http_file_cache_ram_t, queue);
+            ngx_http_file_cache_ram_free(cache, shard, last->node);
+        }
+
+        ngx_shmtx_unlock(&shard->mutex);
+
+        if (evicted) {
+            ram = ngx_slab_alloc(cache->shpool,
+                                 offsetof(ngx_http_file_cache_ram_t, data)
+                                 + len);
+        }
+
+        if (ram == NULL) {
+            goto done;
+        }
+    }
+
+    ram->refs = 0;
+    ram->len = len;
+    ngx_memcpy(ram->data, p, len);
+
+    ngx_shmtx_lock(&shard->mutex);
+
+    if (c->node->ram || !c->node->exists || c->node->uniq != c->uniq) {
+        ngx_shmtx_unlock(&shard->mutex);
+        ngx_slab_free(cache->shpool, ram);
+        goto done;
+    }
+
+    while (shard->ram_size + size > max) {
+        q = ngx_queue_last(&shard->ram_queue);
+        last = ngx_queue_data(q, ngx_http_file_cache_ram_t, queue);
+        ngx_http_file_cache_ram_free(cache, shard, last->node);
+    }
+
+    ram->node = c->node;
+
+    ngx_queue_insert_head(&shard->ram_queue, &ram->queue);
+    shard->ram_size += size;
+
+    c->node->ram = ram;
+
+    ngx_shmtx_unlock(&shard->mutex);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache ram add: %uz", len);
+
+done:
+
+    c->ram = p;
+}
+
+
+static size_t
+ngx_http_file_cache_ram_charge(ngx_http_file_cache_t *cache, size_t len)
+{
+    size_t  size, n;
+
+    /* the size actually taken from the slab pool */
+
+    size = offsetof(ngx_http_file_cache_ram_t, data) + len;
+
+    if (size > ngx_pagesize / 2) {
+        return ngx_align(size, ngx_pagesize);
+    }
+
+    for (n = cache->shpool->min_size; n < size; n <<= 1) { /* void */ }
+
+    return n;
+}
+
+
+static void
+ngx_http_file_cache_ram_free(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard, ngx_http_file_cache_node_t *fcn)
+{
+    ngx_http_file_cache_ram_t  *ram;
+
+    ram = fcn->ram;
+
+    if (ram == NULL) {
+        return;
+    }
+
+    ngx_queue_remove(&ram->queue);
+    shard->ram_size -= ngx_http_file_cache_ram_charge(cache, ram->len);
+
+    fcn->ram = NULL;
+    ram->node = NULL;
+
+    if (ram->refs == 0) {
+        ngx_slab_free(cache->shpool, ram);
+    }
+}
+
+
+static ssize_t
+ngx_http_file_cache_aio_read(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+#if (NGX_HAVE_FILE_AIO || NGX_THREADS)
+    ssize_t                    n;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+#endif
+
+#if (NGX_HAVE_FILE_AIO)
+
+    if (clcf->aio == NGX_HTTP_AIO_ON && ngx_file_aio) {
+        n = ngx_file_aio_read(&c->file, c->buf->pos, c->body_start, 0, r->pool);
+
+        if (n != NGX_AGAIN) {
+            c->reading = 0;
+            return n;
+        }
+
+        c->reading = 1;
+
+        c->file.aio->data = r;
+        c->file.aio->handler = ngx_http_cache_aio_event_handler;
+
+        r->main->blocked++;
+        r->aio = 1;
+
+        return NGX_AGAIN;
+    }
+
+#endif
+
+#if (NGX_THREADS)
+
+    if (clcf->aio == NGX_HTTP_AIO_THREADS) {
+        c->file.thread_task = c->thread_task;
+        c->file.thread_handler = ngx_http_cache_thread_handler;
+        c->file.thread_ctx = r;
+
+        n = ngx_thread_read(&c->file, c->buf->pos, c->body_start, 0, r->pool);
+
+        c->thread_task = c->file.thread_task;
+        c->reading = (n == NGX_AGAIN);
+
+        return n;
+    }
+
+#endif
+
+    return ngx_read_file(&c->file, c->buf->pos, c->body_start, 0);
+}
+
+
+#if (NGX_HAVE_FILE_AIO)
+
+static void
+ngx_http_cache_aio_event_handler(ngx_event_t *ev)
+{
+    ngx_event_aio_t     *aio;
+    ngx_connection_t    *c;
+    ngx_http_request_t  *r;
+
+    aio = ev->data;
+    r = aio->data;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http file cache aio: \"%V?%V\"", &r->uri, &r->args);
+
+    r->main->blocked--;
+    r->aio = 0;
+
+    r->write_event_handler(r);
+
+    ngx_http_run_posted_requests(c);
+}
+
+#endif
+
+
+#if (NGX_THREADS)
+
+static ngx_int_t
+ngx_http_cache_thread_handler(ngx_thread_task_t *task, ngx_file_t *file)
+{
+    ngx_str_t                  name;
+    ngx_thread_pool_t         *tp;
+    ngx_http_request_t        *r;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    r = file->thread_ctx;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+    tp = clcf->thread_pool;
+
+    if (tp == NULL) {
+        if (ngx_http_complex_value(r, clcf->thread_pool_value, &name)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        tp = ngx_thread_pool_get((ngx_cycle_t *) ngx_cycle, &name);
+
+        if (tp == NULL) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "thread pool \"%V\" not found", &name);
+            return NGX_ERROR;
+        }
+    }
+
+    task->event.data = r;
+    task->event.handler = ngx_http_cache_thread_event_handler;
+
+    if (ngx_thread_task_post(tp, task) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    r->main->blocked++;
+    r->aio = 1;
+
+    return NGX_OK;
 }
 
 
@@ -819,15 +1437,21 @@ ngx_http_cache_thread_event_handler(ngx_event_t *ev)
 static ngx_int_t
 ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
 {
-    ngx_int_t                    rc;
-    ngx_http_file_cache_node_t  *fcn;
+    ngx_int_t                     rc;
+    ngx_rbtree_key_t              node_key;
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *shard;
+
+    ngx_memcpy((u_char *) &node_key, c->key, sizeof(ngx_rbtree_key_t));
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    shard = ngx_http_file_cache_shard(cache, node_key);
+
+    ngx_shmtx_lock(&shard->mutex);
 
     fcn = c->node;
 
     if (fcn == NULL) {
-        fcn = ngx_http_file_cache_lookup(cache, c->key);
+        fcn = ngx_http_file_cache_lookup(shard, c->key);
     }
 
     if (fcn) {
@@ -866,19 +1490,18 @@ ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
         goto done;
     }
 
-    fcn = ngx_slab_calloc_locked(cache->shpool,
-                                 sizeof(ngx_http_file_cache_node_t));
+    fcn = ngx_slab_calloc(cache->shpool, sizeof(ngx_http_file_cache_node_t));
     if (fcn == NULL) {
         ngx_http_file_cache_set_watermark(cache);
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+        ngx_shmtx_unlock(&shard->mutex);
 
         (void) ngx_http_file_cache_forced_expire(cache);
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
+        ngx_shmtx_lock(&shard->mutex);
 
-        fcn = ngx_slab_calloc_locked(cache->shpool,
-                                     sizeof(ngx_http_file_cache_node_t));
+        fcn = ngx_slab_calloc(cache->shpool,
+                              sizeof(ngx_http_file_cache_node_t));
         if (fcn == NULL) {
             ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
                           "could not allocate node%s", cache->shpool->log_ctx);
@@ -887,14 +1510,14 @@ ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
         }
     }
 
-    cache->sh->count++;
+    shard->count++;
 
-    ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
+    fcn->node.key = node_key;
 
     ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
                NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-    ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+    ngx_rbtree_insert(&shard->rbtree, &fcn->node);
 
     fcn->uses = 1;
     fcn->count = 1;
@@ -903,6 +1526,8 @@ renew:
 
     rc = NGX_DECLINED;
 
+    ngx_http_file_cache_ram_free(cache, shard, fcn);
+
     fcn->valid_msec = 0;
     fcn->error = 0;
     fcn->exists = 0;
@@ -915,7 +1540,7 @@ done:
 
     fcn->expire = ngx_time() + cache->inactive;
 
-    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+    ngx_queue_insert_head(&shard->queue, &fcn->queue);
 
     c->uniq = fcn->uniq;
     c->error = fcn->error;
@@ -923,7 +1548,7 @@ done:
 
 failed:
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(&shard->mutex);
 
     return rc;
 }
@@ -965,7 +1590,7 @@ ngx_http_file_cache_name(ngx_http_request_t *r, ngx_path_t *path)
 
 
 static ngx_http_file_cache_node_t *
-ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key)
+ngx_http_file_cache_lookup(ngx_http_file_cache_shard_t *shard, u_char *key)
 {
     ngx_int_t                    rc;
     ngx_rbtree_key_t             node_key;
@@ -974,8 +1599,8 @@ ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key)
 
     ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
 
-    node = cache->sh->rbtree.root;
-    sentinel = cache->sh->rbtree.sentinel;
+    node = shard->rbtree.root;
+    sentinel = shard->rbtree.sentinel;
 
     while (node != sentinel) {
 
@@ -1207,7 +1832,8 @@ ngx_http_file_cache_vary_header(ngx_http_request_t *r, ngx_md5_t *md5,
 static ngx_int_t
 ngx_http_file_cache_reopen(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_http_file_cache_t  *cache;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
                    "http file cache reopen");
@@ -1220,14 +1846,16 @@ ngx_http_file_cache_reopen(ngx_http_request_t *r, ngx_http_cache_t *c)
     }
 
     cache = c->file_cache;
+    shard = ngx_http_file_cache_shard(cache, c->node->node.key);
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_shmtx_lock(&shard->mutex);
 
     c->node->count--;
     c->node = NULL;
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(&shard->mutex);
 
+    c->ram = NULL;
     c->secondary = 1;
     c->file.name.len = 0;
     c->body_start = c->buf->end - c->buf->start;
@@ -1306,7 +1934,8 @@ ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf)
 static ngx_int_t
 ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_http_file_cache_t  *cache;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
 
     if (!c->secondary) {
         return NGX_OK;
@@ -1328,13 +1957,15 @@ ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http file cache main key");
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    shard = ngx_http_file_cache_shard(cache, c->node->node.key);
+
+    ngx_shmtx_lock(&shard->mutex);
 
     c->node->count--;
     c->node->updating = 0;
     c->node = NULL;
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(&shard->mutex);
 
     c->file.name.len = 0;
 
@@ -1355,13 +1986,14 @@ ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
 void
 ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
 {
-    off_t                   fs_size;
-    ngx_int_t               rc;
-    ngx_file_uniq_t         uniq;
-    ngx_file_info_t         fi;
-    ngx_http_cache_t        *c;
-    ngx_ext_rename_file_t   ext;
-    ngx_http_file_cache_t  *cache;
+    off_t                         fs_size;
+    ngx_int_t                     rc;
+    ngx_file_uniq_t               uniq;
+    ngx_file_info_t               fi;
+    ngx_http_cache_t             *c;
+    ngx_ext_rename_file_t         ext;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
 
     c = r->cache;
 
@@ -1407,14 +2039,19 @@ ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
         }
     }
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    shard = ngx_http_file_cache_shard(cache, c->node->node.key);
+
+    ngx_shmtx_lock(&shard->mutex);
 
     c->node->count--;
     c->node->error = 0;
+    c->node->unverified = 0;
     c->node->uniq = uniq;
     c->node->body_start = c->body_start;
 
-    cache->sh->size += fs_size - c->node->fs_size;
+    ngx_http_file_cache_ram_free(cache, shard, c->node);
+
+    shard->size += fs_size - c->node->fs_size;
     c->node->fs_size = fs_size;
 
     if (rc == NGX_OK) {
@@ -1423,30 +2060,138 @@ ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
 
     c->node->updating = 0;
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    if (c->fill) {
+        c->fill->offset = tf->offset;
+        ngx_http_file_cache_fill_release(c, 1);
+    }
+
+    ngx_shmtx_unlock(&shard->mutex);
 }
 
 
 void
-ngx_http_file_cache_update_header(ngx_http_request_t *r)
+ngx_http_file_cache_fill(ngx_http_request_t *r, ngx_temp_file_t *tf)
 {
-    ssize_t                        n;
-    ngx_err_t                      err;
-    ngx_file_t                     file;
-    ngx_file_info_t                fi;
-    ngx_http_cache_t              *c;
-    ngx_http_file_cache_header_t   h;
-
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache update header");
+    ngx_http_cache_t             *c;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_fill_t   *fill;
+    ngx_http_file_cache_shard_t  *shard;
 
     c = r->cache;
 
-    ngx_memzero(&file, sizeof(ngx_file_t));
-
-    file.name = c->file.name;
-    file.log = r->connection->log;
-    file.fd = ngx_open_file(file.name.data, NGX_FILE_RDWR, NGX_FILE_OPEN, 0);
+    if (!c->lock || !c->updating || c->vary.len
+        || tf->file.fd == NGX_INVALID_FILE
+        || tf->offset < (off_t) c->body_start)
+    {
+        return;
+    }
+
+    if (c->fill && c->fill->offset == tf->offset) {
+        return;
+    }
+
+    cache = c->file_cache;
+    shard = ngx_http_file_cache_shard(cache, c->node->node.key);
+
+    if (c->fill) {
+        ngx_shmtx_lock(&shard->mutex);
+        c->fill->offset = tf->offset;
+        ngx_shmtx_unlock(&shard->mutex);
+
+        return;
+    }
+
+    /* the header is written, let the waiting requests stream the file */
+
+    fill = ngx_slab_alloc(cache->shpool,
+                          sizeof(ngx_http_file_cache_fill_t)
+                          + tf->file.name.len);
+    if (fill == NULL) {
+        c->lock_stream = 0;
+        return;
+    }
+
+    fill->offset = tf->offset;
+    fill->body_start = c->body_start;
+    fill->refs = 1;
+    fill->done = 0;
+    fill->error = 0;
+
+    ngx_memcpy(fill->name, tf->file.name.data, tf->file.name.len + 1);
+
+    ngx_shmtx_lock(&shard->mutex);
+
+    if (c->node->updating && c->node->lock_time == c->lock_time) {
+        c->node->fill = fill;
+        c->fill = fill;
+    }
+
+    ngx_shmtx_unlock(&shard->mutex);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache fill: \"%s\" %p",
+                   tf->file.name.data, c->fill);
+
+    if (c->fill == NULL) {
+        ngx_slab_free(cache->shpool, fill);
+        c->lock_stream = 0;
+    }
+}
+
+
+static void
+ngx_http_file_cache_fill_release(ngx_http_cache_t *c, ngx_uint_t done)
+{
+    ngx_http_file_cache_fill_t  *fill;
+
+    /* the shard mutex must be locked */
+
+    fill = c->fill;
+
+    if (!c->streaming) {
+
+        if (done) {
+            fill->done = 1;
+
+        } else {
+            fill->error = 1;
+        }
+
+        if (c->node->fill == fill) {
+            c->node->fill = NULL;
+        }
+    }
+
+    if (--fill->refs == 0) {
+        ngx_slab_free(c->file_cache->shpool, fill);
+    }
+
+    c->fill = NULL;
+}
+
+
+void
+ngx_http_file_cache_update_header(ngx_http_request_t *r)
+{
+    ssize_t                        n;
+    ngx_err_t                      err;
+    ngx_file_t                     file;
+    ngx_file_info_t                fi;
+    ngx_http_cache_t              *c;
+    ngx_http_file_cache_t         *cache;
+    ngx_http_file_cache_shard_t   *shard;
+    ngx_http_file_cache_header_t   h;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache update header");
+
+    c = r->cache;
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name = c->file.name;
+    file.log = r->connection->log;
+    file.fd = ngx_open_file(file.name.data, NGX_FILE_RDWR, NGX_FILE_OPEN, 0);
 
     if (file.fd == NGX_INVALID_FILE) {
         err = ngx_errno;
@@ -1550,6 +2295,15 @@ ngx_http_file_cache_update_header(ngx_http_request_t *r)
     (void) ngx_write_file(&file, (u_char *) &h,
                           sizeof(ngx_http_file_cache_header_t), 0);
 
+    /* a copy in memory still has the old header */
+
+    cache = c->file_cache;
+    shard = ngx_http_file_cache_shard(cache, c->node->node.key);
+
+    ngx_shmtx_lock(&shard->mutex);
+    ngx_http_file_cache_ram_free(cache, shard, c->node);
+    ngx_shmtx_unlock(&shard->mutex);
+
 done:
 
     if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
@@ -1572,6 +2326,10 @@ ngx_http_cache_send(ngx_http_request_t *r)
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http file cache send: %s", c->file.name.data);
 
+    if (c->streaming) {
+        return ngx_http_file_cache_stream_send(r, c);
+    }
+
     if (r != r->main && c->length - c->body_start == 0) {
         return ngx_http_send_header(r);
     }
@@ -1583,9 +2341,11 @@ ngx_http_cache_send(ngx_http_request_t *r)
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
-    if (b->file == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    if (c->ram == NULL) {
+        b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+        if (b->file == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
     }
 
     rc = ngx_http_send_header(r);
@@ -1594,16 +2354,23 @@ ngx_http_cache_send(ngx_http_request_t *r)
         return rc;
     }
 
-    b->file_pos = c->body_start;
-    b->file_last = c->length;
-
-    b->in_file = (c->length - c->body_start) ? 1: 0;
     b->last_buf = (r == r->main) ? 1: 0;
     b->last_in_chain = 1;
 
-    b->file->fd = c->file.fd;
-    b->file->name = c->file.name;
-    b->file->log = r->connection->log;
+    if (c->ram) {
+        b->pos = c->ram + c->body_start;
+        b->last = c->ram + c->length;
+        b->memory = (c->length - c->body_start) ? 1: 0;
+
+    } else {
+        b->file_pos = c->body_start;
+        b->file_last = c->length;
+        b->in_file = (c->length - c->body_start) ? 1: 0;
+
+        b->file->fd = c->file.fd;
+        b->file->name = c->file.name;
+        b->file->log = r->connection->log;
+    }
 
     out.buf = b;
     out.next = NULL;
@@ -1612,11 +2379,219 @@ ngx_http_cache_send(ngx_http_request_t *r)
 }
 
 
+static ngx_int_t
+ngx_http_file_cache_stream_send(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    ngx_int_t  rc;
+
+    /* the length is not known until the element is filled */
+
+    r->allow_ranges = 0;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    c->length = c->body_start;
+    c->fill_time = ngx_current_msec;
+
+    c->wait_event.handler = ngx_http_file_cache_stream_handler;
+    c->wait_event.data = r;
+    c->wait_event.log = r->connection->log;
+
+    r->write_event_handler = ngx_http_file_cache_stream_writer;
+
+    return ngx_http_file_cache_stream(r, c);
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_stream(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    off_t                         offset;
+    ngx_int_t                     rc;
+    ngx_buf_t                    *b;
+    ngx_uint_t                    done, error;
+    ngx_chain_t                  *cl;
+    ngx_http_file_cache_shard_t  *shard;
+
+    shard = ngx_http_file_cache_shard(c->file_cache, c->node->node.key);
+
+    ngx_shmtx_lock(&shard->mutex);
+
+    offset = c->fill->offset;
+    done = c->fill->done;
+    error = c->fill->error;
+
+    ngx_shmtx_unlock(&shard->mutex);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache stream: %O-%O d:%ui",
+                   c->length, offset, done);
+
+    if (error) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "cache file \"%s\" was not filled",
+                      c->file.name.data);
+        return NGX_ERROR;
+    }
+
+    if (offset == c->length && !done) {
+
+        if (ngx_current_msec - c->fill_time >= c->lock_age) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "cache file \"%s\" fill stalled",
+                          c->file.name.data);
+            return NGX_ERROR;
+        }
+
+        goto wait;
+    }
+
+    c->fill_time = ngx_current_msec;
+
+    if (!done && (r->buffered || r->connection->buffered)) {
+        goto wait;
+    }
+
+    cl = ngx_chain_get_free_buf(r->pool, &c->free);
+    if (cl == NULL) {
+        return NGX_ERROR;
+    }
+
+    b = cl->buf;
+
+    b->tag = (ngx_buf_tag_t) &ngx_http_file_cache_stream;
+
+    b->in_file = (offset > c->length) ? 1 : 0;
+    b->file_pos = c->length;
+    b->file_last = offset;
+    b->file = &c->file;
+
+    b->last_buf = done;
+    b->last_in_chain = done;
+    b->flush = !done;
+
+    c->length = offset;
+
+    rc = ngx_http_output_filter(r, cl);
+
+    ngx_chain_update_chains(r->pool, &c->free, &c->busy, &cl,
+                            (ngx_buf_tag_t) &ngx_http_file_cache_stream);
+
+    if (rc == NGX_ERROR || done) {
+        return rc;
+    }
+
+    if (ngx_http_file_cache_stream_flush(r) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+wait:
+
+    ngx_add_timer(&c->wait_event, NGX_HTTP_FILE_CACHE_STREAM_POLL);
+
+    return NGX_DONE;
+}
+
+
+static void
+ngx_http_file_cache_stream_handler(ngx_event_t *ev)
+{
+    ngx_int_t            rc;
+    ngx_connection_t    *c;
+    ngx_http_request_t  *r;
+
+    r = ev->data;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    rc = ngx_http_file_cache_stream(r, r->cache);
+
+    if (rc != NGX_DONE) {
+        ngx_http_finalize_request(r, rc);
+    }
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+static void
+ngx_http_file_cache_stream_writer(ngx_http_request_t *r)
+{
+    ngx_event_t       *wev;
+    ngx_connection_t  *c;
+
+    c = r->connection;
+    wev = c->write;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, wev->log, 0,
+                   "http file cache stream writer \"%V?%V\"",
+                   &r->uri, &r->args);
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                      "client timed out");
+        c->timedout = 1;
+
+        ngx_http_finalize_request(r, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
+    }
+
+    if (!wev->delayed && !r->aio) {
+
+        if (ngx_http_output_filter(r, NULL) == NGX_ERROR) {
+            ngx_http_finalize_request(r, NGX_ERROR);
+            return;
+        }
+    }
+
+    if (ngx_http_file_cache_stream_flush(r) != NGX_OK) {
+        ngx_http_finalize_request(r, NGX_ERROR);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_stream_flush(ngx_http_request_t *r)
+{
+    ngx_event_t               *wev;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    wev = r->connection->write;
+
+    if (!r->buffered && !r->connection->buffered && !r->aio) {
+
+        if (wev->timer_set && !wev->delayed) {
+            ngx_del_timer(wev);
+        }
+
+        return NGX_OK;
+    }
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (!wev->delayed) {
+        ngx_add_timer(wev, clcf->send_timeout);
+    }
+
+    if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
 void
 ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
 {
-    ngx_http_file_cache_t       *cache;
-    ngx_http_file_cache_node_t  *fcn;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *shard;
 
     if (c->updated || c->node == NULL) {
         return;
@@ -1627,15 +2602,20 @@ ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
                    "http file cache free, fd: %d", c->file.fd);
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
-
     fcn = c->node;
+    shard = ngx_http_file_cache_shard(cache, fcn->node.key);
+
+    ngx_shmtx_lock(&shard->mutex);
     fcn->count--;
 
     if (c->updating && fcn->lock_time == c->lock_time) {
         fcn->updating = 0;
     }
 
+    if (c->fill) {
+        ngx_http_file_cache_fill_release(c, 0);
+    }
+
     if (c->error) {
         fcn->error = c->error;
 
@@ -1645,14 +2625,15 @@ ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
         }
 
     } else if (!fcn->exists && fcn->count == 0 && c->min_uses == 1) {
+        ngx_http_file_cache_ram_free(cache, shard, fcn);
         ngx_queue_remove(&fcn->queue);
-        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
-        ngx_slab_free_locked(cache->shpool, fcn);
-        cache->sh->count--;
+        ngx_rbtree_delete(&shard->rbtree, &fcn->node);
+        ngx_slab_free(cache->shpool, fcn);
+        shard->count--;
         c->node = NULL;
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(&shard->mutex);
 
     c->updated = 1;
     c->updating = 0;
@@ -1701,14 +2682,12 @@ ngx_http_file_cache_cleanup(void *data)
 static time_t
 ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
 {
-    u_char                      *name, *p;
-    size_t                       len;
-    time_t                       wait;
-    ngx_uint_t                   tries;
-    ngx_path_t                  *path;
-    ngx_queue_t                 *q, *sentinel;
-    ngx_http_file_cache_node_t  *fcn;
-    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
+    u_char                       *name;
+    size_t                        len;
+    time_t                        wait, rc;
+    ngx_uint_t                    i;
+    ngx_path_t                   *path;
+    ngx_http_file_cache_shard_t  *shard;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
                    "http file cache forced expire");
@@ -1723,18 +2702,58 @@ ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
 
     ngx_memcpy(name, path->name.data, path->name.len);
 
+    wait = 10;
+
+    /*
+     * there is no global LRU order across shards, so the shards are
+     * visited round-robin and the first one able to free a node wins
+     */
+
+    for (i = 0; i < cache->nshards; i++) {
+        shard = ngx_http_file_cache_shard_n(cache,
+                                            cache->shard++ % cache->nshards);
+
+        rc = ngx_http_file_cache_forced_expire_shard(cache, shard, name);
+
+        if (rc < wait) {
+            wait = rc;
+        }
+
+        if (wait == 0) {
+            break;
+        }
+    }
+
+    ngx_free(name);
+
+    return wait;
+}
+
+
+static time_t
+ngx_http_file_cache_forced_expire_shard(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard, u_char *name)
+{
+    u_char                      *p;
+    size_t                       len;
+    time_t                       wait;
+    ngx_uint_t                   tries;
+    ngx_queue_t                 *q, *sentinel;
+    ngx_http_file_cache_node_t  *fcn;
+    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
+
     wait = 10;
     tries = 20;
     sentinel = NULL;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_shmtx_lock(&shard->mutex);
 
     for ( ;; ) {
-        if (ngx_queue_empty(&cache->sh->queue)) {
+        if (ngx_queue_empty(&shard->queue)) {
             break;
         }
 
-        q = ngx_queue_last(&cache->sh->queue);
+        q = ngx_queue_last(&shard->queue);
 
         if (q == sentinel) {
             break;
@@ -1748,7 +2767,7 @@ ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
                   fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
 
         if (fcn->count == 0) {
-            ngx_http_file_cache_delete(cache, q, name);
+            ngx_http_file_cache_delete(cache, shard, q, name);
             wait = 0;
             break;
         }
@@ -1766,7 +2785,7 @@ ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
 
         ngx_queue_remove(q);
         fcn->expire = ngx_time() + cache->inactive;
-        ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+        ngx_queue_insert_head(&shard->queue, &fcn->queue);
 
         ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
                       "ignore long locked inactive cache entry %*s, count:%d",
@@ -1784,9 +2803,7 @@ ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
         break;
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
-
-    ngx_free(name);
+    ngx_shmtx_unlock(&shard->mutex);
 
     return wait;
 }
@@ -1795,14 +2812,12 @@ ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
 static time_t
 ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
 {
-    u_char                      *name, *p;
-    size_t                       len;
-    time_t                       now, wait;
-    ngx_path_t                  *path;
-    ngx_msec_t                   elapsed;
-    ngx_queue_t                 *q;
-    ngx_http_file_cache_node_t  *fcn;
-    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
+    u_char                       *name;
+    size_t                        len;
+    time_t                        wait, rc;
+    ngx_uint_t                    i, n;
+    ngx_path_t                   *path;
+    ngx_http_file_cache_shard_t  *shard;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
                    "http file cache expire");
@@ -1817,25 +2832,66 @@ ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
 
     ngx_memcpy(name, path->name.data, path->name.len);
 
-    now = ngx_time();
+    wait = 10;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    for (i = 0; i < cache->nshards; i++) {
+        n = (cache->shard + i) % cache->nshards;
+        shard = ngx_http_file_cache_shard_n(cache, n);
 
-    for ( ;; ) {
+        rc = ngx_http_file_cache_expire_shard(cache, shard, name);
 
-        if (ngx_quit || ngx_terminate) {
-            wait = 1;
-            break;
+        if (rc < wait) {
+            wait = rc;
         }
 
-        if (ngx_queue_empty(&cache->sh->queue)) {
-            wait = 10;
+        if (wait == 0) {
+            /* the next run starts with the shard left unfinished */
+            cache->shard = n;
             break;
         }
 
-        q = ngx_queue_last(&cache->sh->queue);
-
-        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+        if (ngx_quit || ngx_terminate) {
+            break;
+        }
+    }
+
+    ngx_free(name);
+
+    return wait;
+}
+
+
+static time_t
+ngx_http_file_cache_expire_shard(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard, u_char *name)
+{
+    u_char                      *p;
+    size_t                       len;
+    time_t                       now, wait;
+    ngx_msec_t                   elapsed;
+    ngx_queue_t                 *q;
+    ngx_http_file_cache_node_t  *fcn;
+    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
+
+    now = ngx_time();
+
+    ngx_shmtx_lock(&shard->mutex);
+
+    for ( ;; ) {
+
+        if (ngx_quit || ngx_terminate) {
+            wait = 1;
+            break;
+        }
+
+        if (ngx_queue_empty(&shard->queue)) {
+            wait = 10;
+            break;
+        }
+
+        q = ngx_queue_last(&shard->queue);
+
+        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
 
         wait = fcn->expire - now;
 
@@ -1850,7 +2906,7 @@ ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
                        fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
 
         if (fcn->count == 0) {
-            ngx_http_file_cache_delete(cache, q, name);
+            ngx_http_file_cache_delete(cache, shard, q, name);
             goto next;
         }
 
@@ -1872,7 +2928,7 @@ ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
 
         ngx_queue_remove(q);
         fcn->expire = ngx_time() + cache->inactive;
-        ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+        ngx_queue_insert_head(&shard->queue, &fcn->queue);
 
         ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
                       "ignore long locked inactive cache entry %*s, count:%d",
@@ -1895,17 +2951,15 @@ next:
         }
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
-
-    ngx_free(name);
+    ngx_shmtx_unlock(&shard->mutex);
 
     return wait;
 }
 
 
 static void
-ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
-    u_char *name)
+ngx_http_file_cache_delete(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard, ngx_queue_t *q, u_char *name)
 {
     u_char                      *p;
     size_t                       len;
@@ -1914,8 +2968,10 @@ ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
 
     fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
 
+    ngx_http_file_cache_ram_free(cache, shard, fcn);
+
     if (fcn->exists) {
-        cache->sh->size -= fcn->fs_size;
+        shard->size -= fcn->fs_size;
 
         path = cache->path;
         p = name + path->name.len + 1 + path->len;
@@ -1927,7 +2983,7 @@ ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
 
         fcn->count++;
         fcn->deleting = 1;
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+        ngx_shmtx_unlock(&shard->mutex);
 
         len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
         ngx_create_hashed_filename(path, name, len);
@@ -1940,16 +2996,16 @@ ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
                           ngx_delete_file_n " \"%s\" failed", name);
         }
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
+        ngx_shmtx_lock(&shard->mutex);
         fcn->count--;
         fcn->deleting = 0;
     }
 
     if (fcn->count == 0) {
         ngx_queue_remove(q);
-        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
-        ngx_slab_free_locked(cache->shpool, fcn);
-        cache->sh->count--;
+        ngx_rbtree_delete(&shard->rbtree, &fcn->node);
+        ngx_slab_free(cache->shpool, fcn);
+        shard->count--;
     }
 }
 
@@ -1967,6 +3023,22 @@ ngx_http_file_cache_manager(void *data)
     cache->last = ngx_current_msec;
     cache->files = 0;
 
+    if (cache->index.len) {
+
+        if (cache->index_last == 0) {
+            cache->index_last = ngx_current_msec;
+
+        } else if (ngx_current_msec - cache->index_last
+                   >= cache->index_interval)
+        {
+            ngx_http_file_cache_save_index(cache, 0);
+
+            ngx_time_update();
+            cache->index_last = ngx_current_msec;
+            cache->last = ngx_current_msec;
+        }
+    }
+
     next = (ngx_msec_t) ngx_http_file_cache_expire(cache) * 1000;
 
     if (next == 0) {
@@ -1975,14 +3047,10 @@ ngx_http_file_cache_manager(void *data)
     }
 
     for ( ;; ) {
-        ngx_shmtx_lock(&cache->shpool->mutex);
+        ngx_http_file_cache_size(cache, &size, &count);
 
-        size = cache->sh->size;
-        count = cache->sh->count;
         watermark = cache->sh->watermark;
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
-
         ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
                        "http file cache size: %O c:%ui w:%i",
                        size, count, (ngx_int_t) watermark);
@@ -2034,6 +3102,8 @@ ngx_http_file_cache_loader(void *data)
 {
     ngx_http_file_cache_t  *cache = data;
 
+    off_t           size;
+    ngx_uint_t      count;
     ngx_tree_ctx_t  tree;
 
     if (!cache->sh->cold || cache->sh->loading) {
@@ -2056,220 +3126,843 @@ ngx_http_file_cache_loader(void *data)
     tree.alloc = 0;
     tree.log = ngx_cycle->log;
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
+    cache->last = ngx_current_msec;
+    cache->files = 0;
+
+    if (ngx_walk_tree(&tree, &cache->path->name) == NGX_ABORT) {
+        cache->sh->loading = 0;
+        return;
+    }
+
+    if (cache->sh->verify) {
+        ngx_http_file_cache_sweep(cache);
+        cache->sh->verify = 0;
+    }
+
+    cache->sh->cold = 0;
+    cache->sh->loading = 0;
+
+    ngx_http_file_cache_size(cache, &size, &count);
+
+    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                  "http file cache: %V %.3fM, bsize: %uz",
+                  &cache->path->name,
+                  ((double) size * cache->bsize) / (1024 * 1024),
+                  cache->bsize);
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_manage_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    ngx_msec_t              elapsed;
+    ngx_http_file_cache_t  *cache;
+
+    cache = ctx->data;
+
+    if (ngx_http_file_cache_add_file(ctx, path) != NGX_OK) {
+        (void) ngx_http_file_cache_delete_file(ctx, path);
+    }
+
+    if (++cache->files >= cache->loader_files) {
+        ngx_http_file_cache_loader_sleep(cache);
+
+    } else {
+        ngx_time_update();
+
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache loader time elapsed: %M", elapsed);
+
+        if (elapsed >= cache->loader_threshold) {
+            ngx_http_file_cache_loader_sleep(cache);
+        }
+    }
+
+    return (ngx_quit || ngx_terminate) ? NGX_ABORT : NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_manage_directory(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    if (path->len >= 5
+        && ngx_strncmp(path->data + path->len - 5, "/temp", 5) == 0)
+    {
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache)
+{
+    ngx_msleep(cache->loader_sleep);
+
+    ngx_time_update();
+
+    cache->last = ngx_current_msec;
+    cache->files = 0;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx, ngx_str_t *name)
+{
+    u_char                 *p;
+    ngx_int_t               n;
+    ngx_uint_t              i;
+    ngx_http_cache_t        c;
+    ngx_http_file_cache_t  *cache;
+
+    if (name->len < 2 * NGX_HTTP_CACHE_KEY_LEN) {
+        return NGX_ERROR;
+    }
+
+    /*
+     * Temporary files in cache have a suffix consisting of a dot
+     * followed by 10 digits.
+     */
+
+    if (name->len >= 2 * NGX_HTTP_CACHE_KEY_LEN + 1 + 10
+        && name->data[name->len - 10 - 1] == '.')
+    {
+        return NGX_OK;
+    }
+
+    if (ctx->size < (off_t) sizeof(ngx_http_file_cache_header_t)) {
+        ngx_log_error(NGX_LOG_CRIT, ctx->log, 0,
+                      "cache file \"%s\" is too small", name->data);
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(&c, sizeof(ngx_http_cache_t));
+    cache = ctx->data;
+
+    c.length = ctx->size;
+    c.fs_size = (ctx->fs_size + cache->bsize - 1) / cache->bsize;
+    c.uniq = ctx->uniq;
+
+    p = &name->data[name->len - 2 * NGX_HTTP_CACHE_KEY_LEN];
+
+    for (i = 0; i < NGX_HTTP_CACHE_KEY_LEN; i++) {
+        n = ngx_hextoi(p, 2);
+
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        p += 2;
+
+        c.key[i] = (u_char) n;
+    }
+
+    return ngx_http_file_cache_add(cache, &c);
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
+{
+    ngx_rbtree_key_t              node_key;
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *shard;
+
+    ngx_memcpy((u_char *) &node_key, c->key, sizeof(ngx_rbtree_key_t));
+
+    shard = ngx_http_file_cache_shard(cache, node_key);
+
+    ngx_shmtx_lock(&shard->mutex);
+
+    fcn = ngx_http_file_cache_lookup(shard, c->key);
+
+    if (fcn == NULL) {
+
+        fcn = ngx_slab_calloc(cache->shpool,
+                              sizeof(ngx_http_file_cache_node_t));
+        if (fcn == NULL) {
+            ngx_http_file_cache_set_watermark(cache);
+
+            if (cache->fail_time != ngx_time()) {
+                cache->fail_time = ngx_time();
+                ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                           "could not allocate node%s", cache->shpool->log_ctx);
+            }
+
+            ngx_shmtx_unlock(&shard->mutex);
+            return NGX_ERROR;
+        }
+
+        shard->count++;
+
+        fcn->node.key = node_key;
+
+        ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
+                   NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+        ngx_rbtree_insert(&shard->rbtree, &fcn->node);
+
+        fcn->uses = 1;
+        fcn->exists = 1;
+        fcn->uniq = c->uniq;
+        fcn->fs_size = c->fs_size;
+
+        shard->size += c->fs_size;
+
+    } else if (fcn->unverified) {
+
+        /*
+         * the node was loaded from the index snapshot, it is corrected
+         * from the file found and keeps its place in the inactive queue
+         */
+
+        fcn->unverified = 0;
+
+        if (fcn->uniq != c->uniq) {
+            fcn->uniq = c->uniq;
+            fcn->body_start = 0;
+        }
+
+        if (fcn->exists) {
+            shard->size += c->fs_size - fcn->fs_size;
+
+        } else {
+            fcn->exists = 1;
+            shard->size += c->fs_size;
+        }
+
+        fcn->fs_size = c->fs_size;
+
+        ngx_shmtx_unlock(&shard->mutex);
+
+        return NGX_OK;
+
+    } else {
+        ngx_queue_remove(&fcn->queue);
+    }
+
+    fcn->expire = ngx_time() + cache->inactive;
+
+    ngx_queue_insert_head(&shard->queue, &fcn->queue);
+
+    ngx_shmtx_unlock(&shard->mutex);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                   "http file cache delete: \"%s\"", path->data);
+
+    if (ngx_delete_file(path->data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ctx->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", path->data);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_file_cache_set_watermark(ngx_http_file_cache_t *cache)
+{
+    ngx_uint_t  i, count;
+
+    /*
+     * called with one of the shards locked, so the other shards
+     * are read without locking; an approximate count is enough here
+     */
+
+    count = 0;
+
+    for (i = 0; i < cache->nshards; i++) {
+        count += ngx_http_file_cache_shard_n(cache, i)->count;
+    }
+
+    cache->sh->watermark = count - count / 8;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache watermark: %ui", cache->sh->watermark);
+}
+
+
+static void
+ngx_http_file_cache_size(ngx_http_file_cache_t *cache, off_t *size,
+    ngx_uint_t *count)
+{
+    ngx_uint_t                    i;
+    ngx_http_file_cache_shard_t  *shard;
+
+    *size = 0;
+    *count = 0;
+
+    for (i = 0; i < cache->nshards; i++) {
+        shard = ngx_http_file_cache_shard_n(cache, i);
+
+        ngx_shmtx_lock(&shard->mutex);
+
+        *size += shard->size;
+        *count += shard->count;
+
+        ngx_shmtx_unlock(&shard->mutex);
+    }
+}
+
+
+static void
+ngx_http_file_cache_saver(void *data)
+{
+    ngx_http_file_cache_t  *cache = data;
+
+    if (ngx_new_binary > 0) {
+
+        /* the new binary's process keeps using the cache */
+
+        return;
+    }
+
+    /*
+     * during a binary upgrade the old and the new binary's processes
+     * use the cache directory at the same time, so neither keys zone
+     * describes it completely
+     */
+
+    ngx_http_file_cache_save_index(cache,
+                                   !ngx_inherited && !ngx_binary_upgrade);
+}
+
+
+static void
+ngx_http_file_cache_save_index(ngx_http_file_cache_t *cache, ngx_uint_t clean)
+{
+    u_char                              *p, last[NGX_HTTP_CACHE_KEY_LEN];
+    size_t                               size;
+    off_t                                offset;
+    ngx_str_t                            temp;
+    ngx_uint_t                           i, n, visited;
+    ngx_file_t                           file;
+    ngx_rbtree_node_t                   *next;
+    ngx_http_file_cache_node_t          *fcn;
+    ngx_http_file_cache_shard_t         *shard;
+    ngx_http_file_cache_index_node_t    *nodes, *node;
+    ngx_http_file_cache_index_header_t   header;
+
+    nodes = ngx_alloc(NGX_HTTP_FILE_CACHE_INDEX_CHUNK
+                      * sizeof(ngx_http_file_cache_index_node_t),
+                      ngx_cycle->log);
+    if (nodes == NULL) {
+        return;
+    }
+
+    temp.len = cache->index.len + 1 + NGX_INT64_LEN;
+    temp.data = ngx_alloc(temp.len + 1, ngx_cycle->log);
+    if (temp.data == NULL) {
+        ngx_free(nodes);
+        return;
+    }
+
+    p = ngx_sprintf(temp.data, "%V.%P", &cache->index, ngx_pid);
+    *p = '\0';
+    temp.len = p - temp.data;
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name = temp;
+    file.log = ngx_cycle->log;
+
+    file.fd = ngx_open_file(temp.data, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE,
+                            NGX_FILE_DEFAULT_ACCESS);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", temp.data);
+        ngx_free(temp.data);
+        ngx_free(nodes);
+        return;
+    }
+
+    ngx_memzero(&header, sizeof(ngx_http_file_cache_index_header_t));
+
+    header.time = ngx_time();
+
+    offset = sizeof(ngx_http_file_cache_index_header_t);
+
+    for (i = 0; i < cache->nshards; i++) {
+        shard = ngx_http_file_cache_shard_n(cache, i);
+
+        /*
+         * a shard is copied in chunks in the key order, and its mutex
+         * is released between the chunks; the next chunk starts with
+         * the node following the last key seen, wherever it is now
+         */
+
+        fcn = NULL;
+        next = NULL;
+
+        do {
+            ngx_shmtx_lock(&shard->mutex);
+
+            fcn = ngx_http_file_cache_index_next(shard, fcn ? last : NULL);
+
+            n = 0;
+
+            for (visited = 0;
+                 fcn && visited < NGX_HTTP_FILE_CACHE_INDEX_CHUNK;
+                 visited++)
+            {
+                ngx_memcpy(last, &fcn->node.key, sizeof(ngx_rbtree_key_t));
+                ngx_memcpy(&last[sizeof(ngx_rbtree_key_t)], fcn->key,
+                           NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+                if (fcn->exists && !fcn->deleting) {
+                    node = &nodes[n++];
+
+                    ngx_memcpy(node->key, last, NGX_HTTP_CACHE_KEY_LEN);
+
+                    node->uniq = fcn->uniq;
+                    node->fs_size = fcn->fs_size;
+                    node->body_start = fcn->body_start;
+                    node->expire = fcn->expire;
+                }
+
+                next = ngx_rbtree_next(&shard->rbtree, &fcn->node);
+                fcn = (ngx_http_file_cache_node_t *) next;
+            }
+
+            ngx_shmtx_unlock(&shard->mutex);
+
+            if (n) {
+                size = n * sizeof(ngx_http_file_cache_index_node_t);
+
+                if (ngx_write_file(&file, (u_char *) nodes, size, offset)
+                    != (ssize_t) size)
+                {
+                    goto failed;
+                }
+
+                offset += size;
+                header.count += n;
+            }
+
+        } while (fcn);
+    }
+
+    header.magic = NGX_HTTP_FILE_CACHE_INDEX_MAGIC;
+    header.version = NGX_HTTP_FILE_CACHE_INDEX_VERSION;
+    header.node_size = sizeof(ngx_http_file_cache_index_node_t);
+    header.clean = clean;
+    header.bsize = cache->bsize;
+
+    if (ngx_write_file(&file, (u_char *) &header, sizeof(header), 0)
+        != (ssize_t) sizeof(header))
+    {
+        goto failed;
+    }
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", temp.data);
+        file.fd = NGX_INVALID_FILE;
+        goto failed;
+    }
+
+    file.fd = NGX_INVALID_FILE;
+
+    if (ngx_rename_file(temp.data, cache->index.data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_rename_file_n " \"%s\" to \"%s\" failed",
+                      temp.data, cache->index.data);
+        goto failed;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache index \"%V\" saved, n:%uL c:%ui",
+                   &cache->index, header.count, clean);
+
+    ngx_free(nodes);
+    ngx_free(temp.data);
+
+    return;
+
+failed:
+
+    if (file.fd != NGX_INVALID_FILE
+        && ngx_close_file(file.fd) == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", temp.data);
+    }
+
+    if (ngx_delete_file(temp.data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", temp.data);
+    }
+
+    ngx_free(nodes);
+    ngx_free(temp.data);
+}
+
+
+static void
+ngx_http_file_cache_load_index(ngx_http_file_cache_t *cache, ngx_log_t *log)
+{
+    off_t                                offset;
+    size_t                               size;
+    time_t                               shift;
+    ssize_t                              n;
+    uint64_t                             i, count, loaded;
+    ngx_uint_t                           k, clean;
+    ngx_file_t                           file;
+    ngx_file_info_t                      fi;
+    ngx_http_file_cache_index_node_t    *nodes;
+    ngx_http_file_cache_index_header_t   header;
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name = cache->index;
+    file.log = log;
+
+    file.fd = ngx_open_file(cache->index.data, NGX_FILE_RDONLY,
+                            NGX_FILE_OPEN, 0);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        if (ngx_errno != NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                          ngx_open_file_n " \"%s\" failed",
+                          cache->index.data);
+        }
+
+        return;
+    }
+
+    nodes = NULL;
+
+    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", cache->index.data);
+        goto done;
+    }
+
+    n = ngx_read_file(&file, (u_char *) &header, sizeof(header), 0);
+
+    if (n == NGX_ERROR) {
+        goto done;
+    }
+
+    if ((size_t) n != sizeof(header)
+        || header.magic != NGX_HTTP_FILE_CACHE_INDEX_MAGIC
+        || header.version != NGX_HTTP_FILE_CACHE_INDEX_VERSION
+        || header.node_size != sizeof(ngx_http_file_cache_index_node_t)
+        || header.bsize != cache->bsize
+        || (uint64_t) ngx_file_size(&fi)
+           != sizeof(header) + header.count * header.node_size)
+    {
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+                      "cache index \"%s\" is invalid, ignored",
+                      cache->index.data);
+        goto done;
+    }
+
+    nodes = ngx_alloc(NGX_HTTP_FILE_CACHE_INDEX_CHUNK
+                      * sizeof(ngx_http_file_cache_index_node_t), log);
+    if (nodes == NULL) {
+        goto done;
+    }
+
+    /*
+     * a snapshot found by the new binary's process is not trusted,
+     * as the old binary's processes may still change the cache
+     */
+
+    clean = header.clean && !ngx_inherited;
+
+    /* the time the cache was not running is not counted as inactive */
+
+    shift = ngx_time() - (time_t) header.time;
+
+    if (shift < 0) {
+        shift = 0;
+    }
+
+    offset = sizeof(header);
+    loaded = 0;
+
+    for (i = 0; i < header.count; i += count) {
+
+        count = ngx_min(header.count - i, NGX_HTTP_FILE_CACHE_INDEX_CHUNK);
+        size = count * sizeof(ngx_http_file_cache_index_node_t);
+
+        n = ngx_read_file(&file, (u_char *) nodes, size, offset);
+
+        if (n == NGX_ERROR) {
+            goto done;
+        }
+
+        if ((size_t) n != size) {
+            ngx_log_error(NGX_LOG_CRIT, log, 0,
+                          ngx_read_file_n " read only %z of %uz from \"%s\"",
+                          n, size, cache->index.data);
+            goto done;
+        }
+
+        offset += size;
+
+        for (k = 0; k < count; k++) {
+            if (ngx_http_file_cache_add_index_node(cache, &nodes[k], shift,
+                                                   !clean)
+                != NGX_OK)
+            {
+                goto sort;
+            }
+        }
+
+        loaded += count;
+    }
+
+    if (clean) {
+        cache->sh->cold = 0;
+        cache->path->loader = NULL;
+    }
 
-    if (ngx_walk_tree(&tree, &cache->path->name) == NGX_ABORT) {
-        cache->sh->loading = 0;
-        return;
+    ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                  "http file cache: %V %uL entries loaded from \"%V\"%s",
+                  &cache->path->name, loaded, &cache->index,
+                  clean ? "" : ", verifying");
+
+sort:
+
+    for (k = 0; k < cache->nshards; k++) {
+        ngx_queue_sort(&ngx_http_file_cache_shard_n(cache, k)->queue,
+                       ngx_http_file_cache_index_cmp);
     }
 
-    cache->sh->cold = 0;
-    cache->sh->loading = 0;
+done:
 
-    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
-                  "http file cache: %V %.3fM, bsize: %uz",
-                  &cache->path->name,
-                  ((double) cache->sh->size * cache->bsize) / (1024 * 1024),
-                  cache->bsize);
-}
+    if (nodes) {
+        ngx_free(nodes);
+    }
 
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", cache->index.data);
+    }
 
-static ngx_int_t
-ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx, ngx_str_t *path)
-{
-    return NGX_OK;
+    /*
+     * the snapshot describes the cache only up to this moment,
+     * so it is removed to never be trusted after a crash
+     */
+
+    if (ngx_delete_file(cache->index.data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", cache->index.data);
+    }
 }
 
 
 static ngx_int_t
-ngx_http_file_cache_manage_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+ngx_http_file_cache_add_index_node(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_index_node_t *node, time_t shift,
+    ngx_uint_t unverified)
 {
-    ngx_msec_t              elapsed;
-    ngx_http_file_cache_t  *cache;
+    ngx_rbtree_key_t              node_key;
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *shard;
 
-    cache = ctx->data;
+    /* no locking is needed, worker processes are not started yet */
 
-    if (ngx_http_file_cache_add_file(ctx, path) != NGX_OK) {
-        (void) ngx_http_file_cache_delete_file(ctx, path);
+    ngx_memcpy((u_char *) &node_key, node->key, sizeof(ngx_rbtree_key_t));
+
+    shard = ngx_http_file_cache_shard(cache, node_key);
+
+    if (ngx_http_file_cache_lookup(shard, node->key)) {
+        return NGX_OK;
     }
 
-    if (++cache->files >= cache->loader_files) {
-        ngx_http_file_cache_loader_sleep(cache);
+    fcn = ngx_slab_calloc(cache->shpool, sizeof(ngx_http_file_cache_node_t));
+    if (fcn == NULL) {
+        ngx_http_file_cache_set_watermark(cache);
+        return NGX_ERROR;
+    }
 
-    } else {
-        ngx_time_update();
+    fcn->node.key = node_key;
 
-        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+    ngx_memcpy(fcn->key, &node->key[sizeof(ngx_rbtree_key_t)],
+               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache loader time elapsed: %M", elapsed);
+    ngx_rbtree_insert(&shard->rbtree, &fcn->node);
 
-        if (elapsed >= cache->loader_threshold) {
-            ngx_http_file_cache_loader_sleep(cache);
-        }
-    }
+    fcn->uses = 1;
+    fcn->exists = 1;
+    fcn->unverified = unverified;
+    fcn->uniq = node->uniq;
+    fcn->body_start = node->body_start;
+    fcn->fs_size = node->fs_size;
+    fcn->expire = ngx_min(node->expire + shift, ngx_time() + cache->inactive);
 
-    return (ngx_quit || ngx_terminate) ? NGX_ABORT : NGX_OK;
-}
+    /* the queue is sorted when all nodes are loaded */
 
+    ngx_queue_insert_head(&shard->queue, &fcn->queue);
 
-static ngx_int_t
-ngx_http_file_cache_manage_directory(ngx_tree_ctx_t *ctx, ngx_str_t *path)
-{
-    if (path->len >= 5
-        && ngx_strncmp(path->data + path->len - 5, "/temp", 5) == 0)
-    {
-        return NGX_DECLINED;
+    shard->count++;
+    shard->size += node->fs_size;
+
+    if (unverified) {
+        cache->sh->verify = 1;
     }
 
     return NGX_OK;
 }
 
 
-static void
-ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache)
+static ngx_int_t
+ngx_http_file_cache_index_cmp(const ngx_queue_t *one, const ngx_queue_t *two)
 {
-    ngx_msleep(cache->loader_sleep);
+    ngx_http_file_cache_node_t  *first, *second;
 
-    ngx_time_update();
+    first = ngx_queue_data(one, ngx_http_file_cache_node_t, queue);
+    second = ngx_queue_data(two, ngx_http_file_cache_node_t, queue);
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
+    /* the most recently used nodes are at the queue head */
+
+    if (first->expire == second->expire) {
+        return 0;
+    }
+
+    return (first->expire > second->expire) ? -1 : 1;
 }
 
 
-static ngx_int_t
-ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx, ngx_str_t *name)
+static ngx_http_file_cache_node_t *
+ngx_http_file_cache_index_next(ngx_http_file_cache_shard_t *shard, u_char *key)
 {
-    u_char                 *p;
-    ngx_int_t               n;
-    ngx_uint_t              i;
-    ngx_http_cache_t        c;
-    ngx_http_file_cache_t  *cache;
+    ngx_int_t                    rc;
+    ngx_rbtree_key_t             node_key;
+    ngx_rbtree_node_t           *node, *sentinel;
+    ngx_http_file_cache_node_t  *fcn, *next;
 
-    if (name->len < 2 * NGX_HTTP_CACHE_KEY_LEN) {
-        return NGX_ERROR;
-    }
+    /* the first node with a key greater than the key given */
 
-    /*
-     * Temporary files in cache have a suffix consisting of a dot
-     * followed by 10 digits.
-     */
+    node = shard->rbtree.root;
+    sentinel = shard->rbtree.sentinel;
 
-    if (name->len >= 2 * NGX_HTTP_CACHE_KEY_LEN + 1 + 10
-        && name->data[name->len - 10 - 1] == '.')
-    {
-        return NGX_OK;
+    if (node == sentinel) {
+        return NULL;
     }
 
-    if (ctx->size < (off_t) sizeof(ngx_http_file_cache_header_t)) {
-        ngx_log_error(NGX_LOG_CRIT, ctx->log, 0,
-                      "cache file \"%s\" is too small", name->data);
-        return NGX_ERROR;
+    if (key == NULL) {
+        return (ngx_http_file_cache_node_t *) ngx_rbtree_min(node, sentinel);
     }
 
-    ngx_memzero(&c, sizeof(ngx_http_cache_t));
-    cache = ctx->data;
+    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
 
-    c.length = ctx->size;
-    c.fs_size = (ctx->fs_size + cache->bsize - 1) / cache->bsize;
+    next = NULL;
 
-    p = &name->data[name->len - 2 * NGX_HTTP_CACHE_KEY_LEN];
+    while (node != sentinel) {
 
-    for (i = 0; i < NGX_HTTP_CACHE_KEY_LEN; i++) {
-        n = ngx_hextoi(p, 2);
+        fcn = (ngx_http_file_cache_node_t *) node;
 
-        if (n == NGX_ERROR) {
-            return NGX_ERROR;
+        if (node_key != node->key) {
+            rc = (node_key < node->key) ? -1 : 1;
+
+        } else {
+            rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                            NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
         }
 
-        p += 2;
+        if (rc < 0) {
+            next = fcn;
+            node = node->left;
 
-        c.key[i] = (u_char) n;
+        } else {
+            node = node->right;
+        }
     }
 
-    return ngx_http_file_cache_add(cache, &c);
+    return next;
 }
 
 
-static ngx_int_t
-ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
+static void
+ngx_http_file_cache_sweep(ngx_http_file_cache_t *cache)
 {
-    ngx_http_file_cache_node_t  *fcn;
-
-    ngx_shmtx_lock(&cache->shpool->mutex);
-
-    fcn = ngx_http_file_cache_lookup(cache, c->key);
+    u_char                        last[NGX_HTTP_CACHE_KEY_LEN];
+    ngx_uint_t                    i, n, swept;
+    ngx_rbtree_node_t            *next;
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *shard;
 
-    if (fcn == NULL) {
-
-        fcn = ngx_slab_calloc_locked(cache->shpool,
-                                     sizeof(ngx_http_file_cache_node_t));
-        if (fcn == NULL) {
-            ngx_http_file_cache_set_watermark(cache);
+    /*
+     * the nodes loaded from the index snapshot which files were not
+     * found by the loader are removed, in chunks as in saving the index
+     */
 
-            if (cache->fail_time != ngx_time()) {
-                cache->fail_time = ngx_time();
-                ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                           "could not allocate node%s", cache->shpool->log_ctx);
-            }
+    swept = 0;
 
-            ngx_shmtx_unlock(&cache->shpool->mutex);
-            return NGX_ERROR;
-        }
+    for (i = 0; i < cache->nshards; i++) {
+        shard = ngx_http_file_cache_shard_n(cache, i);
 
-        cache->sh->count++;
+        fcn = NULL;
 
-        ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
+        do {
+            ngx_shmtx_lock(&shard->mutex);
 
-        ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
-                   NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+            fcn = ngx_http_file_cache_index_next(shard, fcn ? last : NULL);
 
-        ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+            for (n = 0; fcn && n < NGX_HTTP_FILE_CACHE_INDEX_CHUNK; n++) {
 
-        fcn->uses = 1;
-        fcn->exists = 1;
-        fcn->fs_size = c->fs_size;
+                ngx_memcpy(last, &fcn->node.key, sizeof(ngx_rbtree_key_t));
+                ngx_memcpy(&last[sizeof(ngx_rbtree_key_t)], fcn->key,
+                           NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-        cache->sh->size += c->fs_size;
+                next = ngx_rbtree_next(&shard->rbtree, &fcn->node);
 
-    } else {
-        ngx_queue_remove(&fcn->queue);
-    }
+                if (fcn->unverified) {
+                    fcn->unverified = 0;
 
-    fcn->expire = ngx_time() + cache->inactive;
+                    ngx_http_file_cache_ram_free(cache, shard, fcn);
 
-    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+                    if (fcn->exists) {
+                        fcn->exists = 0;
+                        shard->size -= fcn->fs_size;
+                        fcn->fs_size = 0;
+                    }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+                    if (fcn->count == 0) {
+                        ngx_queue_remove(&fcn->queue);
+                        ngx_rbtree_delete(&shard->rbtree, &fcn->node);
+                        ngx_slab_free(cache->shpool, fcn);
+                        shard->count--;
+                    }
 
-    return NGX_OK;
-}
+                    swept++;
+                }
 
+                fcn = (ngx_http_file_cache_node_t *) next;
+            }
 
-static ngx_int_t
-ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
-{
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
-                   "http file cache delete: \"%s\"", path->data);
+            ngx_shmtx_unlock(&shard->mutex);
 
-    if (ngx_delete_file(path->data) == NGX_FILE_ERROR) {
-        ngx_log_error(NGX_LOG_CRIT, ctx->log, ngx_errno,
-                      ngx_delete_file_n " \"%s\" failed", path->data);
+        } while (fcn);
     }
 
-    return NGX_OK;
-}
-
-
-static void
-ngx_http_file_cache_set_watermark(ngx_http_file_cache_t *cache)
-{
-    cache->sh->watermark = cache->sh->count - cache->sh->count / 8;
-
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache watermark: %ui", cache->sh->watermark);
+    if (swept) {
+        ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                      "http file cache: %V %ui missing entries removed",
+                      &cache->path->name, swept);
+    }
 }
 
 
@@ -2307,11 +4000,12 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     off_t                   max_size;
     u_char                 *last, *p;
     time_t                  inactive;
-    ssize_t                 size;
+    ssize_t                 size, ram_size, ram_max_object;
     ngx_str_t               s, name, *value;
-    ngx_int_t               loader_files, manager_files;
+    ngx_int_t               loader_files, manager_files, shards,
+                            prefetch_rate, ram_min_uses;
     ngx_msec_t              loader_sleep, manager_sleep, loader_threshold,
-                            manager_threshold;
+                            manager_threshold, index_interval;
     ngx_uint_t              i, n, use_temp_path;
     ngx_array_t            *caches;
     ngx_http_file_cache_t  *cache, **ce;
@@ -2338,6 +4032,15 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     manager_sleep = 50;
     manager_threshold = 200;
 
+    shards = 1;
+    prefetch_rate = 0;
+
+    ram_size = 0;
+    ram_max_object = 64 * 1024;
+    ram_min_uses = 2;
+
+    index_interval = 600000;
+
     name.len = 0;
     size = 0;
     max_size = NGX_MAX_OFF_T_VALUE;
@@ -2446,6 +4149,110 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "shards=", 7) == 0) {
+
+            shards = ngx_atoi(value[i].data + 7, value[i].len - 7);
+            if (shards == NGX_ERROR || shards == 0 || shards > 1024) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid shards value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "prefetch_rate=", 14) == 0) {
+
+            prefetch_rate = ngx_atoi(value[i].data + 14, value[i].len - 14);
+            if (prefetch_rate == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid prefetch_rate value \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "ram_size=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            ram_size = ngx_parse_size(&s);
+            if (ram_size == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid ram_size value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "ram_max_object=", 15) == 0) {
+
+            s.len = value[i].len - 15;
+            s.data = value[i].data + 15;
+
+            ram_max_object = ngx_parse_size(&s);
+            if (ram_max_object == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid ram_max_object value \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "ram_min_uses=", 13) == 0) {
+
+            ram_min_uses = ngx_atoi(value[i].data + 13, value[i].len - 13);
+            if (ram_min_uses == NGX_ERROR || ram_min_uses == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid ram_min_uses value \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "index=", 6) == 0) {
+
+            cache->index.len = value[i].len - 6;
+            cache->index.data = value[i].data + 6;
+
+            if (cache->index.len == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid index value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (ngx_conf_full_name(cf->cycle, &cache->index, 0) != NGX_OK) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "index_interval=", 15) == 0) {
+
+            s.len = value[i].len - 15;
+            s.data = value[i].data + 15;
+
+            index_interval = ngx_parse_time(&s, 0);
+            if (index_interval == (ngx_msec_t) NGX_ERROR
+                || index_interval == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid index_interval value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         if (ngx_strncmp(value[i].data, "inactive=", 9) == 0) {
 
             s.len = value[i].len - 9;
@@ -2572,9 +4379,28 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    /* the loader deletes unknown files found in the cache directory */
+
+    if (cache->index.len > cache->path->name.len
+        && cache->index.data[cache->path->name.len] == '/'
+        && ngx_strncmp(cache->index.data, cache->path->name.data,
+                       cache->path->name.len)
+           == 0)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "cache index \"%V\" must not be "
+                           "inside the cache directory", &cache->index);
+        return NGX_CONF_ERROR;
+    }
+
     cache->path->manager = ngx_http_file_cache_manager;
     cache->path->loader = ngx_http_file_cache_loader;
     cache->path->data = cache;
+
+    if (cache->index.len) {
+        cache->path->saver = ngx_http_file_cache_saver;
+    }
+
     cache->path->conf_file = cf->conf_file->file.name.data;
     cache->path->line = cf->conf_file->line;
     cache->loader_files = loader_files;
@@ -2583,12 +4409,20 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     cache->manager_files = manager_files;
     cache->manager_sleep = manager_sleep;
     cache->manager_threshold = manager_threshold;
+    cache->prefetch_rate = prefetch_rate;
+    cache->ram_size = ram_size;
+    cache->ram_max_object = ram_max_object;
+    cache->ram_min_uses = ram_min_uses;
+    cache->index_interval = index_interval;
 
     if (ngx_add_path(cf, &cache->path) != NGX_OK) {
         return NGX_CONF_ERROR;
     }
 
-    cache->shm_zone = ngx_shared_memory_add(cf, &name, size, cmd->post);
+    /* elements kept in memory are allocated in the keys zone */
+
+    cache->shm_zone = ngx_shared_memory_add(cf, &name, size + ram_size,
+                                            cmd->post);
     if (cache->shm_zone == NULL) {
         return NGX_CONF_ERROR;
     }
@@ -2601,12 +4435,14 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
 
     cache->shm_zone->init = ngx_http_file_cache_init;
+    cache->shm_zone->unlock = ngx_http_file_cache_unlock;
     cache->shm_zone->data = cache;
 
     cache->use_temp_path = use_temp_path;
 
     cache->inactive = inactive;
     cache->max_size = max_size;
+    cache->nshards = shards;
 
     caches = (ngx_array_t *) (confp + cmd->offset);
 
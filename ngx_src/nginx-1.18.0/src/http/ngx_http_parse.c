@@ -9,6 +9,28 @@
 #include <ngx_core.h>
 #include <ngx_http.h>
 
+/*
+ * NGX_HTTP_PARSE_NO_SIMD builds the plain state machine, which is used
+ * as the reference by misc/bench/ngx_http_parse_bench.c
+ */
+
+#if ((NGX_HAVE_SSE2 || NGX_HAVE_AVX2) && !(NGX_HTTP_PARSE_NO_SIMD))
+#define NGX_HTTP_PARSE_SIMD  1
+#endif
+
+#if (NGX_HTTP_PARSE_SIMD && NGX_HAVE_AVX2)
+#include <immintrin.h>
+#elif (NGX_HTTP_PARSE_SIMD)
+#include <emmintrin.h>
+#endif
+
+
+#if (NGX_HTTP_PARSE_SIMD)
+static ngx_inline u_char *ngx_http_parse_skip(u_char *p, u_char *last,
+    u_char c);
+static ngx_inline u_char *ngx_http_parse_skip_path(u_char *p, u_char *last);
+#endif
+
 
 static uint32_t  usual[] = {
     0xffffdbfe, /* 1111 1111 1111 1111  1101 1011 1111 1110 */
@@ -546,6 +568,9 @@ ngx_http_parse_request_line(ngx_http_request_t *r, ngx_buf_t *b)
         case sw_check_uri:
 
             if (usual[ch >> 5] & (1U << (ch & 0x1f))) {
+#if (NGX_HTTP_PARSE_SIMD)
+                p = ngx_http_parse_skip_path(p + 1, b->last) - 1;
+#endif
                 break;
             }
 
@@ -632,6 +657,15 @@ ngx_http_parse_request_line(ngx_http_request_t *r, ngx_buf_t *b)
         case sw_uri:
 
             if (usual[ch >> 5] & (1U << (ch & 0x1f))) {
+#if (NGX_HTTP_PARSE_SIMD)
+                /*
+                 * "%", "//" and "/." need no checks in this state: either
+                 * the URI is already marked as complex or quoted, or these
+                 * are the arguments
+                 */
+
+                p = ngx_http_parse_skip(p + 1, b->last, '#') - 1;
+#endif
                 break;
             }
 
@@ -1035,6 +1069,11 @@ ngx_http_parse_header_line(ngx_http_request_t *r, ngx_buf_t *b,
                 goto done;
             case '\0':
                 return NGX_HTTP_PARSE_INVALID_HEADER;
+            default:
+#if (NGX_HTTP_PARSE_SIMD)
+                p = ngx_http_parse_skip(p + 1, b->last, ' ') - 1;
+#endif
+                break;
             }
             break;
 
@@ -1115,6 +1154,152 @@ header_done:
 }
 
 
+#if (NGX_HTTP_PARSE_SIMD)
+
+/*
+ * skips bytes which do not change the parser state: returns a pointer
+ * to the first space, CR, LF, '\0' or the given character, or to the
+ * tail which is shorter than a vector and is left to the state machine
+ */
+
+static ngx_inline u_char *
+ngx_http_parse_skip(u_char *p, u_char *last, u_char c)
+{
+    int       mask;
+
+#if (NGX_HAVE_AVX2)
+    __m256i   v, m, sp, cr, lf, nul, cc;
+
+    sp = _mm256_set1_epi8(' ');
+    cr = _mm256_set1_epi8(CR);
+    lf = _mm256_set1_epi8(LF);
+    nul = _mm256_setzero_si256();
+    cc = _mm256_set1_epi8((char) c);
+
+    while (last - p >= 32) {
+        v = _mm256_loadu_si256((__m256i *) p);
+
+        m = _mm256_or_si256(_mm256_cmpeq_epi8(v, sp),
+                            _mm256_cmpeq_epi8(v, cr));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, lf));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, nul));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, cc));
+
+        mask = _mm256_movemask_epi8(m);
+
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 32;
+    }
+
+#else
+    __m128i   v, m, sp, cr, lf, nul, cc;
+
+    sp = _mm_set1_epi8(' ');
+    cr = _mm_set1_epi8(CR);
+    lf = _mm_set1_epi8(LF);
+    nul = _mm_setzero_si128();
+    cc = _mm_set1_epi8((char) c);
+
+    while (last - p >= 16) {
+        v = _mm_loadu_si128((__m128i *) p);
+
+        m = _mm_or_si128(_mm_cmpeq_epi8(v, sp), _mm_cmpeq_epi8(v, cr));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, lf));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, nul));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, cc));
+
+        mask = _mm_movemask_epi8(m);
+
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 16;
+    }
+
+#endif
+
+    return p;
+}
+
+
+/*
+ * skips the bytes of a path segment: returns a pointer to the first byte
+ * handled by the sw_check_uri state, that is, "/" and "." which may start
+ * "//", "/." or "/..", "%", "?", "#", "+", "\\", space, CR, LF or '\0',
+ * so the complex_uri and quoted_uri flags are set as without the skip
+ */
+
+static ngx_inline u_char *
+ngx_http_parse_skip_path(u_char *p, u_char *last)
+{
+    int       mask;
+
+#if (NGX_HAVE_AVX2)
+    __m256i   v, m;
+
+    while (last - p >= 32) {
+        v = _mm256_loadu_si256((__m256i *) p);
+
+        m = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8(CR)));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(LF)));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/')));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('.')));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('%')));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('?')));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('#')));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('+')));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')));
+
+        mask = _mm256_movemask_epi8(m);
+
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 32;
+    }
+
+#else
+    __m128i   v, m;
+
+    while (last - p >= 16) {
+        v = _mm_loadu_si128((__m128i *) p);
+
+        m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                         _mm_cmpeq_epi8(v, _mm_set1_epi8(CR)));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(LF)));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('/')));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('.')));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('%')));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('?')));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('#')));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('+')));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+
+        mask = _mm_movemask_epi8(m);
+
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 16;
+    }
+
+#endif
+
+    return p;
+}
+
+#endif
+
+
 ngx_int_t
 ngx_http_parse_uri(ngx_http_request_t *r)
 {
@@ -349,6 +349,12 @@ ngx_http_init_connection(ngx_connection_t *c)
         c->log->action = "reading PROXY protocol";
     }
 
+#if (NGX_HAVE_IOURING_BUF_RING)
+    if (!hc->ssl) {
+        ngx_iouring_set_io(c);
+    }
+#endif
+
     if (rev->ready) {
         /* the deferred accept(), iocp */
 
@@ -604,7 +610,7 @@ ngx_http_alloc_request(ngx_connection_t *c)
     }
 
 #if (NGX_HTTP_SSL)
-    if (c->ssl) {
+    if (c->ssl && !c->ssl->sendfile) {
         r->main_filter_need_in_memory = 1;
     }
 #endif
@@ -2259,11 +2265,14 @@ ngx_http_find_virtual_server(ngx_connection_t *c,
 
     if (host->len && virtual_names->nregex) {
         ngx_int_t                n;
-        ngx_uint_t               i;
+        ngx_uint_t               i, *cand;
         ngx_http_server_name_t  *sn;
 
         sn = virtual_names->regex;
 
+        cand = virtual_names->regex_set
+               ? ngx_regex_set_match(virtual_names->regex_set, host) : NULL;
+
 #if (NGX_HTTP_SSL && defined SSL_CTRL_SET_TLSEXT_HOSTNAME)
 
         if (r == NULL) {
@@ -2271,6 +2280,10 @@ ngx_http_find_virtual_server(ngx_connection_t *c,
 
             for (i = 0; i < virtual_names->nregex; i++) {
 
+                if (cand && !ngx_regex_set_candidate(cand, i)) {
+                    continue;
+                }
+
                 n = ngx_regex_exec(sn[i].regex->regex, host, NULL, 0);
 
                 if (n == NGX_REGEX_NO_MATCHED) {
@@ -2300,6 +2313,10 @@ ngx_http_find_virtual_server(ngx_connection_t *c,
 
         for (i = 0; i < virtual_names->nregex; i++) {
 
+            if (cand && !ngx_regex_set_candidate(cand, i)) {
+                continue;
+            }
+
             n = ngx_http_regex_exec(r, sn[i].regex, host);
 
             if (n == NGX_DECLINED) {
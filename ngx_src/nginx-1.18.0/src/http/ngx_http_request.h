@@ -558,6 +558,7 @@ struct ngx_http_request_s {
 
     unsigned                          background:1;
     unsigned                          health_check:1;
+    unsigned                          cache_prefetch:1;
 
     /* used to parse HTTP headers */
 
@@ -881,6 +881,10 @@ ngx_http_upstream_cache(ngx_http_request_t *r, ngx_http_upstream_t *u)
         c->lock = u->conf->cache_lock;
         c->lock_timeout = u->conf->cache_lock_timeout;
         c->lock_age = u->conf->cache_lock_age;
+        c->lock_stream = u->conf->cache_lock_stream;
+
+        c->prefetch = u->conf->cache_prefetch;
+        c->prefetch_uses = u->conf->cache_prefetch_uses;
 
         u->cache_status = NGX_HTTP_CACHE_MISS;
     }
@@ -926,6 +930,22 @@ ngx_http_upstream_cache(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
     case NGX_OK:
         u->cache_status = NGX_HTTP_CACHE_HIT;
+
+        if (r->cache_prefetch) {
+
+            /* the element is still valid, but is being refreshed */
+
+            rc = NGX_HTTP_CACHE_STALE;
+
+        } else if (c->prefetching) {
+
+            if (ngx_http_upstream_cache_background_update(r, u) == NGX_OK) {
+                r->cache->background = 1;
+
+            } else {
+                rc = NGX_ERROR;
+            }
+        }
     }
 
     switch (rc) {
@@ -1120,6 +1140,7 @@ ngx_http_upstream_cache_background_update(ngx_http_request_t *r,
     }
 
     sr->header_only = 1;
+    sr->cache_prefetch = r->cache->prefetching;
 
     return NGX_OK;
 }
@@ -4023,6 +4044,9 @@ ngx_http_upstream_process_request(ngx_http_request_t *r,
 
             } else if (p->upstream_error) {
                 ngx_http_file_cache_free(r->cache, p->temp_file);
+
+            } else if (r->cache->lock_stream) {
+                ngx_http_file_cache_fill(r, p->temp_file);
             }
         }
 
@@ -204,6 +204,10 @@ typedef struct {
     ngx_flag_t                       cache_lock;
     ngx_msec_t                       cache_lock_timeout;
     ngx_msec_t                       cache_lock_age;
+    ngx_flag_t                       cache_lock_stream;
+
+    time_t                           cache_prefetch;
+    ngx_uint_t                       cache_prefetch_uses;
 
     ngx_flag_t                       cache_revalidate;
     ngx_flag_t                       cache_convert_head;
@@ -2403,13 +2403,20 @@ ngx_http_map_find(ngx_http_request_t *r, ngx_http_map_t *map, ngx_str_t *match)
 
     if (len && map->nregex) {
         ngx_int_t              n;
-        ngx_uint_t             i;
+        ngx_uint_t             i, *cand;
         ngx_http_map_regex_t  *reg;
 
         reg = map->regex;
 
+        cand = map->regex_set ? ngx_regex_set_match(map->regex_set, match)
+                              : NULL;
+
         for (i = 0; i < map->nregex; i++) {
 
+            if (cand && !ngx_regex_set_candidate(cand, i)) {
+                continue;
+            }
+
             n = ngx_http_regex_exec(r, reg[i].regex, match);
 
             if (n == NGX_OK) {
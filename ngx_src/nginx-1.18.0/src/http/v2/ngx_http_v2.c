@@ -274,8 +274,17 @@ ngx_http_v2_init(ngx_event_t *rev)
     h2scf = ngx_http_get_module_srv_conf(hc->conf_ctx, ngx_http_v2_module);
 
     h2c->concurrent_pushes = h2scf->concurrent_pushes;
+    h2c->push_diary_size = h2scf->push_diary;
     h2c->priority_limit = h2scf->concurrent_streams;
 
+    h2c->hpack_enc.limit = h2scf->hpack_table_size;
+    h2c->hpack_enc.size = NGX_HTTP_V2_DEFAULT_TABLE_SIZE;
+    h2c->hpack_enc.free = NGX_HTTP_V2_DEFAULT_TABLE_SIZE;
+
+    if (h2scf->hpack_table_size < NGX_HTTP_V2_DEFAULT_TABLE_SIZE) {
+        ngx_http_v2_table_encoder_size(h2c, h2scf->hpack_table_size);
+    }
+
     h2c->pool = ngx_create_pool(h2scf->pool_size, h2c->connection->log);
     if (h2c->pool == NULL) {
         ngx_http_close_connection(c);
@@ -2097,7 +2106,7 @@ ngx_http_v2_state_settings_params(ngx_http_v2_connection_t *h2c, u_char *pos,
 
         case NGX_HTTP_V2_HEADER_TABLE_SIZE_SETTING:
 
-            h2c->table_update = 1;
+            ngx_http_v2_table_encoder_size(h2c, value);
             break;
 
         default:
@@ -4607,6 +4616,41 @@ ngx_http_v2_finalize_connection(ngx_http_v2_connection_t *h2c,
 }
 
 
+void
+ngx_http_v2_abort_connection(ngx_http_v2_connection_t *h2c)
+{
+    ngx_connection_t  *c;
+
+    c = h2c->connection;
+
+    if (c->error) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "http2 abort connection");
+
+    /*
+     * called from stream context, so the connection is finalized
+     * from the posted read event rather than synchronously
+     */
+
+    if (!h2c->goaway) {
+        h2c->goaway = 1;
+
+        if (ngx_http_v2_send_goaway(h2c, NGX_HTTP_V2_INTERNAL_ERROR)
+            != NGX_ERROR)
+        {
+            (void) ngx_http_v2_send_output_queue(h2c);
+        }
+    }
+
+    c->error = 1;
+    c->close = 1;
+
+    ngx_post_event(c->read, &ngx_posted_events);
+}
+
+
 static ngx_int_t
 ngx_http_v2_adjust_windows(ngx_http_v2_connection_t *h2c, ssize_t delta)
 {
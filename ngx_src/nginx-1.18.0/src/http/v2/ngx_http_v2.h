@@ -21,6 +21,9 @@
 #define NGX_HTTP_V2_DEFAULT_FRAME_SIZE   (1 << 14)
 #define NGX_HTTP_V2_MAX_FRAME_SIZE       ((1 << 24) - 1)
 
+#define NGX_HTTP_V2_DEFAULT_TABLE_SIZE   4096
+#define NGX_HTTP_V2_MAX_TABLE_SIZE       65536
+
 #define NGX_HTTP_V2_INT_OCTETS           4
 #define NGX_HTTP_V2_MAX_FIELD                                                 \
     (127 + (1 << (NGX_HTTP_V2_INT_OCTETS - 1) * 7) - 1)
@@ -115,6 +118,21 @@ typedef struct {
 } ngx_http_v2_hpack_t;
 
 
+typedef struct {
+    ngx_http_v2_header_t            *entries;
+
+    ngx_uint_t                       added;
+    ngx_uint_t                       deleted;
+    ngx_uint_t                       allocated;
+
+    size_t                           size;
+    size_t                           free;
+    size_t                           limit;
+    u_char                          *storage;
+    u_char                          *pos;
+} ngx_http_v2_hpack_enc_t;
+
+
 struct ngx_http_v2_connection_s {
     ngx_connection_t                *connection;
     ngx_http_connection_t           *http_connection;
@@ -130,6 +148,10 @@ struct ngx_http_v2_connection_s {
     ngx_uint_t                       pushing;
     ngx_uint_t                       concurrent_pushes;
 
+    uint32_t                        *push_diary;
+    ngx_uint_t                       push_diary_size;
+    ngx_uint_t                       pushed;
+
     size_t                           send_window;
     size_t                           recv_window;
     size_t                           init_window;
@@ -141,6 +163,7 @@ struct ngx_http_v2_connection_s {
     ngx_http_v2_state_t              state;
 
     ngx_http_v2_hpack_t              hpack;
+    ngx_http_v2_hpack_enc_t          hpack_enc;
 
     ngx_pool_t                      *pool;
 
@@ -186,6 +209,7 @@ struct ngx_http_v2_stream_s {
     ngx_http_v2_node_t              *node;
 
     ngx_uint_t                       queued;
+    size_t                           queued_size;
 
     /*
      * A change to SETTINGS_INITIAL_WINDOW_SIZE could cause the
@@ -296,6 +320,7 @@ ngx_http_v2_stream_t *ngx_http_v2_push_stream(ngx_http_v2_stream_t *parent,
     ngx_str_t *path);
 
 void ngx_http_v2_close_stream(ngx_http_v2_stream_t *stream, ngx_int_t rc);
+void ngx_http_v2_abort_connection(ngx_http_v2_connection_t *h2c);
 
 ngx_int_t ngx_http_v2_send_output_queue(ngx_http_v2_connection_t *h2c);
 
@@ -309,6 +334,12 @@ ngx_int_t ngx_http_v2_add_header(ngx_http_v2_connection_t *h2c,
     ngx_http_v2_header_t *header);
 ngx_int_t ngx_http_v2_table_size(ngx_http_v2_connection_t *h2c, size_t size);
 
+u_char *ngx_http_v2_table_encode(ngx_http_v2_connection_t *h2c, u_char *pos,
+    ngx_uint_t index, ngx_str_t *name, ngx_str_t *value, ngx_uint_t indexing,
+    u_char *tmp);
+void ngx_http_v2_table_encoder_size(ngx_http_v2_connection_t *h2c,
+    size_t size);
+
 
 ngx_int_t ngx_http_v2_huff_decode(u_char *state, u_char *src, size_t len,
     u_char **dst, ngx_uint_t last, ngx_log_t *log);
@@ -416,6 +447,8 @@ size_t ngx_http_v2_huff_encode(u_char *src, size_t len, u_char *dst,
 
 u_char *ngx_http_v2_string_encode(u_char *dst, u_char *src, size_t len,
     u_char *tmp, ngx_uint_t lower);
+u_char *ngx_http_v2_write_int(u_char *pos, ngx_uint_t prefix,
+    ngx_uint_t value);
 
 
 #endif /* _NGX_HTTP_V2_H_INCLUDED_ */
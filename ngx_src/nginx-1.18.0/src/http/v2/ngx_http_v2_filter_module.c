@@ -52,7 +52,20 @@ static ngx_http_v2_push_header_t  ngx_http_v2_push_headers[] = {
     (sizeof(ngx_http_v2_push_headers) / sizeof(ngx_http_v2_push_header_t))
 
 
+/* response headers that are unlikely to repeat within a connection */
+
+static ngx_str_t  ngx_http_v2_no_index_headers[] = {
+    ngx_string("etag"),
+    ngx_string("content-range"),
+    ngx_string("age"),
+    ngx_null_string
+};
+
+
+static ngx_uint_t ngx_http_v2_index_header(ngx_table_elt_t *header);
 static ngx_int_t ngx_http_v2_push_resources(ngx_http_request_t *r);
+static ngx_int_t ngx_http_v2_push_link_path(ngx_http_request_t *r,
+    ngx_str_t *path);
 static ngx_int_t ngx_http_v2_push_resource(ngx_http_request_t *r,
     ngx_str_t *path, ngx_str_t *binary);
 
@@ -135,7 +148,7 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
 {
     u_char                     status, *pos, *start, *p, *tmp;
     size_t                     len, tmp_len;
-    ngx_str_t                  host, location;
+    ngx_str_t                  host, location, server, value;
     ngx_uint_t                 i, port, fin;
     ngx_list_part_t           *part;
     ngx_table_elt_t           *header;
@@ -147,19 +160,7 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
     ngx_http_core_loc_conf_t  *clcf;
     ngx_http_core_srv_conf_t  *cscf;
     u_char                     addr[NGX_SOCKADDR_STRLEN];
-
-    static const u_char nginx[5] = "\x84\xaa\x63\x55\xe7";
-#if (NGX_HTTP_GZIP)
-    static const u_char accept_encoding[12] =
-        "\x8b\x84\x84\x2d\x69\x5b\x05\x44\x3c\x86\xaa\x6f";
-#endif
-
-    static size_t nginx_ver_len = ngx_http_v2_literal_size(NGINX_VER);
-    static u_char nginx_ver[ngx_http_v2_literal_size(NGINX_VER)];
-
-    static size_t nginx_ver_build_len =
-                                  ngx_http_v2_literal_size(NGINX_VER_BUILD);
-    static u_char nginx_ver_build[ngx_http_v2_literal_size(NGINX_VER_BUILD)];
+    u_char                     buf[sizeof("Wed, 31 Dec 1986 18:00:00 GMT")];
 
     stream = r->stream;
 
@@ -253,31 +254,41 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         }
     }
 
-    len = h2c->table_update ? 1 : 0;
+    /*
+     * headers with a static table name take up to two octets before
+     * the value, as index may need a continuation octet when encoded
+     * as a literal without indexing
+     */
 
-    len += status ? 1 : 1 + ngx_http_v2_literal_size("418");
+    len = h2c->table_update ? NGX_HTTP_V2_INT_OCTETS : 0;
+
+    len += status ? 1 : 2 + ngx_http_v2_literal_size("418");
 
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
+    ngx_str_null(&server);
+
     if (r->headers_out.server == NULL) {
 
         if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_ON) {
-            len += 1 + nginx_ver_len;
+            ngx_str_set(&server, NGINX_VER);
 
         } else if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_BUILD) {
-            len += 1 + nginx_ver_build_len;
+            ngx_str_set(&server, NGINX_VER_BUILD);
 
         } else {
-            len += 1 + sizeof(nginx);
+            ngx_str_set(&server, "nginx");
         }
+
+        len += 2 + NGX_HTTP_V2_INT_OCTETS + server.len;
     }
 
     if (r->headers_out.date == NULL) {
-        len += 1 + ngx_http_v2_literal_size("Wed, 31 Dec 1986 18:00:00 GMT");
+        len += 2 + ngx_http_v2_literal_size("Wed, 31 Dec 1986 18:00:00 GMT");
     }
 
     if (r->headers_out.content_type.len) {
-        len += 1 + NGX_HTTP_V2_INT_OCTETS + r->headers_out.content_type.len;
+        len += 2 + NGX_HTTP_V2_INT_OCTETS + r->headers_out.content_type.len;
 
         if (r->headers_out.content_type_len == r->headers_out.content_type.len
             && r->headers_out.charset.len)
@@ -289,13 +300,13 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
     if (r->headers_out.content_length == NULL
         && r->headers_out.content_length_n >= 0)
     {
-        len += 1 + ngx_http_v2_integer_octets(NGX_OFF_T_LEN) + NGX_OFF_T_LEN;
+        len += 2 + ngx_http_v2_integer_octets(NGX_OFF_T_LEN) + NGX_OFF_T_LEN;
     }
 
     if (r->headers_out.last_modified == NULL
         && r->headers_out.last_modified_time != -1)
     {
-        len += 1 + ngx_http_v2_literal_size("Wed, 31 Dec 1986 18:00:00 GMT");
+        len += 2 + ngx_http_v2_literal_size("Wed, 31 Dec 1986 18:00:00 GMT");
     }
 
     if (r->headers_out.location && r->headers_out.location->value.len) {
@@ -373,7 +384,7 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
 
         r->headers_out.location->hash = 0;
 
-        len += 1 + NGX_HTTP_V2_INT_OCTETS + r->headers_out.location->value.len;
+        len += 2 + NGX_HTTP_V2_INT_OCTETS + r->headers_out.location->value.len;
     }
 
     tmp_len = len;
@@ -381,7 +392,7 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
 #if (NGX_HTTP_GZIP)
     if (r->gzip_vary) {
         if (clcf->gzip_vary) {
-            len += 1 + sizeof(accept_encoding);
+            len += 2 + ngx_http_v2_literal_size("Accept-Encoding");
 
         } else {
             r->gzip_vary = 0;
@@ -441,12 +452,20 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         return NGX_ERROR;
     }
 
+    cln = ngx_http_cleanup_add(r, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
     start = pos;
 
     if (h2c->table_update) {
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, fc->log, 0,
-                       "http2 table size update: 0");
-        *pos++ = (1 << 5) | 0;
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
+                       "http2 table size update: %uz", h2c->hpack_enc.size);
+
+        *pos = (1 << 5);
+        pos = ngx_http_v2_write_int(pos, ngx_http_v2_prefix(5),
+                                    h2c->hpack_enc.size);
         h2c->table_update = 0;
     }
 
@@ -458,66 +477,32 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         *pos++ = status;
 
     } else {
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_STATUS_INDEX);
-        *pos++ = NGX_HTTP_V2_ENCODE_RAW | 3;
-        pos = ngx_sprintf(pos, "%03ui", r->headers_out.status);
-    }
-
-    if (r->headers_out.server == NULL) {
-
-        if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_ON) {
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
-                           "http2 output header: \"server: %s\"",
-                           NGINX_VER);
-
-        } else if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_BUILD) {
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
-                           "http2 output header: \"server: %s\"",
-                           NGINX_VER_BUILD);
+        value.data = buf;
+        value.len = ngx_sprintf(buf, "%03ui", r->headers_out.status) - buf;
 
-        } else {
-            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, fc->log, 0,
-                           "http2 output header: \"server: nginx\"");
-        }
-
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_SERVER_INDEX);
-
-        if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_ON) {
-            if (nginx_ver[0] == '\0') {
-                p = ngx_http_v2_write_value(nginx_ver, (u_char *) NGINX_VER,
-                                            sizeof(NGINX_VER) - 1, tmp);
-                nginx_ver_len = p - nginx_ver;
-            }
-
-            pos = ngx_cpymem(pos, nginx_ver, nginx_ver_len);
-
-        } else if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_BUILD) {
-            if (nginx_ver_build[0] == '\0') {
-                p = ngx_http_v2_write_value(nginx_ver_build,
-                                            (u_char *) NGINX_VER_BUILD,
-                                            sizeof(NGINX_VER_BUILD) - 1, tmp);
-                nginx_ver_build_len = p - nginx_ver_build;
-            }
+        pos = ngx_http_v2_table_encode(h2c, pos, NGX_HTTP_V2_STATUS_INDEX,
+                                       NULL, &value, 1, tmp);
+    }
 
-            pos = ngx_cpymem(pos, nginx_ver_build, nginx_ver_build_len);
+    if (server.len) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
+                       "http2 output header: \"server: %V\"", &server);
 
-        } else {
-            pos = ngx_cpymem(pos, nginx, sizeof(nginx));
-        }
+        pos = ngx_http_v2_table_encode(h2c, pos, NGX_HTTP_V2_SERVER_INDEX,
+                                       NULL, &server, 1, tmp);
     }
 
     if (r->headers_out.date == NULL) {
+        value = ngx_cached_http_time;
+
         ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
-                       "http2 output header: \"date: %V\"",
-                       &ngx_cached_http_time);
+                       "http2 output header: \"date: %V\"", &value);
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_DATE_INDEX);
-        pos = ngx_http_v2_write_value(pos, ngx_cached_http_time.data,
-                                      ngx_cached_http_time.len, tmp);
+        pos = ngx_http_v2_table_encode(h2c, pos, NGX_HTTP_V2_DATE_INDEX,
+                                       NULL, &value, 0, tmp);
     }
 
     if (r->headers_out.content_type.len) {
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_CONTENT_TYPE_INDEX);
 
         if (r->headers_out.content_type_len == r->headers_out.content_type.len
             && r->headers_out.charset.len)
@@ -548,8 +533,9 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                        "http2 output header: \"content-type: %V\"",
                        &r->headers_out.content_type);
 
-        pos = ngx_http_v2_write_value(pos, r->headers_out.content_type.data,
-                                      r->headers_out.content_type.len, tmp);
+        pos = ngx_http_v2_table_encode(h2c, pos,
+                                       NGX_HTTP_V2_CONTENT_TYPE_INDEX, NULL,
+                                       &r->headers_out.content_type, 1, tmp);
     }
 
     if (r->headers_out.content_length == NULL
@@ -559,30 +545,29 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                        "http2 output header: \"content-length: %O\"",
                        r->headers_out.content_length_n);
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_CONTENT_LENGTH_INDEX);
+        value.data = buf;
+        value.len = ngx_sprintf(buf, "%O", r->headers_out.content_length_n)
+                    - buf;
 
-        p = pos;
-        pos = ngx_sprintf(pos + 1, "%O", r->headers_out.content_length_n);
-        *p = NGX_HTTP_V2_ENCODE_RAW | (u_char) (pos - p - 1);
+        pos = ngx_http_v2_table_encode(h2c, pos,
+                                       NGX_HTTP_V2_CONTENT_LENGTH_INDEX, NULL,
+                                       &value, 0, tmp);
     }
 
     if (r->headers_out.last_modified == NULL
         && r->headers_out.last_modified_time != -1)
     {
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_LAST_MODIFIED_INDEX);
-
-        ngx_http_time(pos, r->headers_out.last_modified_time);
-        len = sizeof("Wed, 31 Dec 1986 18:00:00 GMT") - 1;
+        value.data = buf;
+        value.len = ngx_http_time(buf, r->headers_out.last_modified_time)
+                    - buf;
 
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, fc->log, 0,
-                       "http2 output header: \"last-modified: %*s\"",
-                       len, pos);
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
+                       "http2 output header: \"last-modified: %V\"",
+                       &value);
 
-        /*
-         * Date will always be encoded using huffman in the temporary buffer,
-         * so it's safe here to use src and dst pointing to the same address.
-         */
-        pos = ngx_http_v2_write_value(pos, pos, len, tmp);
+        pos = ngx_http_v2_table_encode(h2c, pos,
+                                       NGX_HTTP_V2_LAST_MODIFIED_INDEX, NULL,
+                                       &value, 0, tmp);
     }
 
     if (r->headers_out.location && r->headers_out.location->value.len) {
@@ -590,9 +575,9 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                        "http2 output header: \"location: %V\"",
                        &r->headers_out.location->value);
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_LOCATION_INDEX);
-        pos = ngx_http_v2_write_value(pos, r->headers_out.location->value.data,
-                                      r->headers_out.location->value.len, tmp);
+        pos = ngx_http_v2_table_encode(h2c, pos, NGX_HTTP_V2_LOCATION_INDEX,
+                                       NULL, &r->headers_out.location->value,
+                                       0, tmp);
     }
 
 #if (NGX_HTTP_GZIP)
@@ -600,8 +585,10 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         ngx_log_debug0(NGX_LOG_DEBUG_HTTP, fc->log, 0,
                        "http2 output header: \"vary: Accept-Encoding\"");
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_VARY_INDEX);
-        pos = ngx_cpymem(pos, accept_encoding, sizeof(accept_encoding));
+        ngx_str_set(&value, "Accept-Encoding");
+
+        pos = ngx_http_v2_table_encode(h2c, pos, NGX_HTTP_V2_VARY_INDEX,
+                                       NULL, &value, 1, tmp);
     }
 #endif
 
@@ -634,13 +621,10 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         }
 #endif
 
-        *pos++ = 0;
-
-        pos = ngx_http_v2_write_name(pos, header[i].key.data,
-                                     header[i].key.len, tmp);
-
-        pos = ngx_http_v2_write_value(pos, header[i].value.data,
-                                      header[i].value.len, tmp);
+        pos = ngx_http_v2_table_encode(h2c, pos, 0, &header[i].key,
+                                       &header[i].value,
+                                       ngx_http_v2_index_header(&header[i]),
+                                       tmp);
     }
 
     fin = r->header_only
@@ -648,6 +632,8 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
 
     frame = ngx_http_v2_create_headers_frame(r, start, pos, fin);
     if (frame == NULL) {
+        /* the encoder table is already updated and cannot be rolled back */
+        ngx_http_v2_abort_connection(h2c);
         return NGX_ERROR;
     }
 
@@ -655,11 +641,6 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
 
     stream->queued++;
 
-    cln = ngx_http_cleanup_add(r, 0);
-    if (cln == NULL) {
-        return NGX_ERROR;
-    }
-
     cln->handler = ngx_http_v2_filter_cleanup;
     cln->data = stream;
 
@@ -670,6 +651,23 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
 }
 
 
+static ngx_uint_t
+ngx_http_v2_index_header(ngx_table_elt_t *header)
+{
+    ngx_str_t  *name;
+
+    for (name = ngx_http_v2_no_index_headers; name->len; name++) {
+        if (header->key.len == name->len
+            && ngx_strncasecmp(header->key.data, name->data, name->len) == 0)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
 static ngx_int_t
 ngx_http_v2_push_resources(ngx_http_request_t *r)
 {
@@ -869,7 +867,7 @@ ngx_http_v2_push_resources(ngx_http_request_t *r)
         }
 
         if (push && path.len
-            && !(path.len > 1 && path.data[0] == '/' && path.data[1] == '/'))
+            && ngx_http_v2_push_link_path(r, &path) == NGX_OK)
         {
             rc = ngx_http_v2_push_resource(r, &path, binary);
 
@@ -894,12 +892,72 @@ ngx_http_v2_push_resources(ngx_http_request_t *r)
 }
 
 
+/*
+ * a preload link to an absolute URL is pushed if it refers
+ * to the scheme and the authority of the request
+ */
+
+static ngx_int_t
+ngx_http_v2_push_link_path(ngx_http_request_t *r, ngx_str_t *path)
+{
+    u_char     *p, *last, *host;
+    ngx_str_t  *authority;
+
+    p = path->data;
+    last = path->data + path->len;
+
+    if (last - p > 1 && p[0] == '/' && p[1] == '/') {
+        p += 2;
+
+    } else if (last - p > (ssize_t) r->schema.len + 3
+               && ngx_strncasecmp(p, r->schema.data, r->schema.len) == 0
+               && ngx_strncmp(p + r->schema.len, "://", 3) == 0)
+    {
+        p += r->schema.len + 3;
+
+    } else {
+        return NGX_OK;
+    }
+
+    if (r->headers_in.host == NULL) {
+        return NGX_DECLINED;
+    }
+
+    authority = &r->headers_in.host->value;
+
+    host = p;
+
+    while (p < last && *p != '/' && *p != '?' && *p != '#') {
+        p++;
+    }
+
+    if ((size_t) (p - host) != authority->len
+        || ngx_strncasecmp(host, authority->data, authority->len) != 0)
+    {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http2 preload link to other origin \"%V\" not pushed",
+                       path);
+        return NGX_DECLINED;
+    }
+
+    if (p == last || *p != '/') {
+        return NGX_DECLINED;
+    }
+
+    path->len = last - p;
+    path->data = p;
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_http_v2_push_resource(ngx_http_request_t *r, ngx_str_t *path,
     ngx_str_t *binary)
 {
     u_char                      *start, *pos, *tmp;
     size_t                       len;
+    uint32_t                     hash;
     ngx_str_t                   *value;
     ngx_uint_t                   i;
     ngx_table_elt_t            **h;
@@ -942,6 +1000,49 @@ ngx_http_v2_push_resource(ngx_http_request_t *r, ngx_str_t *path,
         return NGX_ABORT;
     }
 
+    /*
+     * resources already pushed on the connection are remembered
+     * in a diary of hashes, as the client keeps them in its push cache;
+     * a hash collision merely costs a push
+     */
+
+    if (h2c->push_diary_size) {
+        ngx_crc32_init(hash);
+        ngx_crc32_update(&hash, r->headers_in.host->value.data,
+                         r->headers_in.host->value.len);
+        ngx_crc32_update(&hash, path->data, path->len);
+        ngx_crc32_final(hash);
+
+        if (h2c->push_diary == NULL) {
+            h2c->push_diary = ngx_palloc(h2c->connection->pool,
+                                         h2c->push_diary_size
+                                         * sizeof(uint32_t));
+            if (h2c->push_diary == NULL) {
+                return NGX_ERROR;
+            }
+        }
+
+        len = ngx_min(h2c->pushed, h2c->push_diary_size);
+
+        for (i = 0; i < len; i++) {
+            if (h2c->push_diary[i] == hash) {
+                ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
+                               "http2 push diary: \"%V\" already pushed",
+                               path);
+                return NGX_DECLINED;
+            }
+        }
+
+    } else {
+        hash = 0;
+    }
+
+    /*
+     * push headers are sent as literals without indexing: the binary
+     * representation is reused across pushes, and the dynamic table
+     * is maintained by ngx_http_v2_table_encode() only
+     */
+
     ph = ngx_http_v2_push_headers;
 
     len = ngx_max(r->schema.len, path->len);
@@ -975,7 +1076,7 @@ ngx_http_v2_push_resource(ngx_http_request_t *r, ngx_str_t *path,
 
             value = &(*h)->value;
 
-            len = 1 + NGX_HTTP_V2_INT_OCTETS + value->len;
+            len = 2 + NGX_HTTP_V2_INT_OCTETS + value->len;
 
             pos = ngx_pnalloc(r->pool, len);
             if (pos == NULL) {
@@ -984,14 +1085,16 @@ ngx_http_v2_push_resource(ngx_http_request_t *r, ngx_str_t *path,
 
             binary[i].data = pos;
 
-            *pos++ = ngx_http_v2_inc_indexed(ph[i].index);
+            *pos = 0;
+            pos = ngx_http_v2_write_int(pos, ngx_http_v2_prefix(4),
+                                        ph[i].index);
             pos = ngx_http_v2_write_value(pos, value->data, value->len, tmp);
 
             binary[i].len = pos - binary[i].data;
         }
     }
 
-    len = (h2c->table_update ? 1 : 0)
+    len = (h2c->table_update ? NGX_HTTP_V2_INT_OCTETS : 0)
           + 1
           + 1 + NGX_HTTP_V2_INT_OCTETS + path->len
           + 1 + NGX_HTTP_V2_INT_OCTETS + r->schema.len;
@@ -1008,9 +1111,12 @@ ngx_http_v2_push_resource(ngx_http_request_t *r, ngx_str_t *path,
     start = pos;
 
     if (h2c->table_update) {
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, fc->log, 0,
-                       "http2 table size update: 0");
-        *pos++ = (1 << 5) | 0;
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
+                       "http2 table size update: %uz", h2c->hpack_enc.size);
+
+        *pos = (1 << 5);
+        pos = ngx_http_v2_write_int(pos, ngx_http_v2_prefix(5),
+                                    h2c->hpack_enc.size);
         h2c->table_update = 0;
     }
 
@@ -1022,7 +1128,7 @@ ngx_http_v2_push_resource(ngx_http_request_t *r, ngx_str_t *path,
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
                    "http2 push header: \":path: %V\"", path);
 
-    *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_PATH_INDEX);
+    *pos++ = NGX_HTTP_V2_PATH_INDEX;
     pos = ngx_http_v2_write_value(pos, path->data, path->len, tmp);
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
@@ -1037,7 +1143,7 @@ ngx_http_v2_push_resource(ngx_http_request_t *r, ngx_str_t *path,
         *pos++ = ngx_http_v2_indexed(NGX_HTTP_V2_SCHEME_HTTP_INDEX);
 
     } else {
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_SCHEME_HTTP_INDEX);
+        *pos++ = NGX_HTTP_V2_SCHEME_HTTP_INDEX;
         pos = ngx_http_v2_write_value(pos, r->schema.data, r->schema.len, tmp);
     }
 
@@ -1057,6 +1163,8 @@ ngx_http_v2_push_resource(ngx_http_request_t *r, ngx_str_t *path,
 
     frame = ngx_http_v2_create_push_frame(r, start, pos);
     if (frame == NULL) {
+        /* a table size update may have been consumed */
+        ngx_http_v2_abort_connection(h2c);
         return NGX_ERROR;
     }
 
@@ -1068,6 +1176,11 @@ ngx_http_v2_push_resource(ngx_http_request_t *r, ngx_str_t *path,
 
     if (stream) {
         stream->request->request_length = pos - start;
+
+        if (h2c->push_diary_size) {
+            h2c->push_diary[h2c->pushed++ % h2c->push_diary_size] = hash;
+        }
+
         return NGX_OK;
     }
 
@@ -1417,7 +1530,8 @@ static ngx_chain_t *
 ngx_http_v2_send_chain(ngx_connection_t *fc, ngx_chain_t *in, off_t limit)
 {
     off_t                      size, offset;
-    size_t                     rest, frame_size;
+    size_t                     rest, frame_size, quantum;
+    ngx_uint_t                 yield;
     ngx_chain_t               *cl, *out, **ln;
     ngx_http_request_t        *r;
     ngx_http_v2_stream_t      *stream;
@@ -1469,6 +1583,27 @@ ngx_http_v2_send_chain(ngx_connection_t *fc, ngx_chain_t *in, off_t limit)
         return in;
     }
 
+    h2lcf = ngx_http_get_module_loc_conf(r, ngx_http_v2_module);
+
+    /*
+     * a stream may only have a quantum of DATA frames in the output
+     * queue, scaled by its weight; the rest is queued when they are
+     * sent, after frames of other streams with the same priority
+     */
+
+    quantum = h2lcf->stream_quantum * stream->node->weight
+              / NGX_HTTP_V2_DEFAULT_WEIGHT;
+
+    if (size && quantum && stream->queued_size >= quantum) {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, fc->log, 0,
+                       "http2:%ui quantum exhausted: %uz",
+                       stream->node->id, stream->queued_size);
+
+        fc->write->active = 1;
+        fc->write->ready = 0;
+        return in;
+    }
+
     if (in->buf->tag == (ngx_buf_tag_t) &ngx_http_v2_filter_get_shadow) {
         cl = ngx_alloc_chain_link(r->pool);
         if (cl == NULL) {
@@ -1497,7 +1632,12 @@ ngx_http_v2_send_chain(ngx_connection_t *fc, ngx_chain_t *in, off_t limit)
         limit = (stream->send_window > 0) ? stream->send_window : 0;
     }
 
-    h2lcf = ngx_http_get_module_loc_conf(r, ngx_http_v2_module);
+    yield = 0;
+
+    if (quantum && limit > (off_t) (quantum - stream->queued_size)) {
+        limit = quantum - stream->queued_size;
+        yield = 1;
+    }
 
     frame_size = (h2lcf->chunk_size < h2c->frame_size)
                  ? h2lcf->chunk_size : h2c->frame_size;
@@ -1589,6 +1729,7 @@ ngx_http_v2_send_chain(ngx_connection_t *fc, ngx_chain_t *in, off_t limit)
             h2c->send_window -= frame_size;
 
             stream->send_window -= frame_size;
+            stream->queued_size += frame_size;
             stream->queued++;
         }
 
@@ -1626,6 +1767,18 @@ ngx_http_v2_send_chain(ngx_connection_t *fc, ngx_chain_t *in, off_t limit)
     if (in && ngx_http_v2_flow_control(h2c, stream) == NGX_DECLINED) {
         fc->write->active = 1;
         fc->write->ready = 0;
+
+    } else if (in && yield && stream->queued == 0) {
+
+        /*
+         * the quantum has been sent at once, so no frame is left to wake
+         * the stream up; continue in the next event loop iteration
+         */
+
+        fc->write->active = 0;
+        fc->write->ready = 1;
+
+        ngx_post_event(fc->write, &ngx_posted_next_events);
     }
 
     return in;
@@ -2030,6 +2183,8 @@ done:
 
     h2c->payload_bytes += frame->length;
 
+    stream->queued_size -= frame->length;
+
     ngx_http_v2_handle_frame(stream, frame);
 
     ngx_http_v2_handle_stream(h2c, stream);
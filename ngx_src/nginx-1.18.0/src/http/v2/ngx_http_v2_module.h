@@ -24,9 +24,11 @@ typedef struct {
     size_t                          pool_size;
     ngx_uint_t                      concurrent_streams;
     ngx_uint_t                      concurrent_pushes;
+    ngx_uint_t                      push_diary;
     ngx_uint_t                      max_requests;
     size_t                          max_field_size;
     size_t                          max_header_size;
+    size_t                          hpack_table_size;
     size_t                          preread_size;
     ngx_uint_t                      streams_index_mask;
     ngx_msec_t                      recv_timeout;
@@ -36,6 +38,7 @@ typedef struct {
 
 typedef struct {
     size_t                          chunk_size;
+    size_t                          stream_quantum;
 
     ngx_flag_t                      push_preload;
 
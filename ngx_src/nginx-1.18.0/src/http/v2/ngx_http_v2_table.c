@@ -15,6 +15,14 @@
 
 static ngx_int_t ngx_http_v2_table_account(ngx_http_v2_connection_t *h2c,
     size_t size);
+static ngx_int_t ngx_http_v2_table_find(ngx_http_v2_hpack_enc_t *hpack,
+    ngx_str_t *name, ngx_str_t *value, ngx_uint_t *name_index);
+static ngx_int_t ngx_http_v2_table_cmp(ngx_http_v2_hpack_enc_t *hpack,
+    ngx_str_t *entry, ngx_str_t *str, ngx_uint_t lower);
+static ngx_int_t ngx_http_v2_table_insert(ngx_http_v2_hpack_enc_t *hpack,
+    ngx_pool_t *pool, ngx_str_t *name, ngx_str_t *value);
+static u_char *ngx_http_v2_table_copy(ngx_http_v2_hpack_enc_t *hpack,
+    ngx_str_t *dst, ngx_str_t *src, ngx_uint_t lower);
 
 
 static ngx_http_v2_header_t  ngx_http_v2_static_table[] = {
@@ -361,3 +369,257 @@ ngx_http_v2_table_size(ngx_http_v2_connection_t *h2c, size_t size)
 
     return NGX_OK;
 }
+
+
+u_char *
+ngx_http_v2_table_encode(ngx_http_v2_connection_t *h2c, u_char *pos,
+    ngx_uint_t index, ngx_str_t *name, ngx_str_t *value, ngx_uint_t indexing,
+    u_char *tmp)
+{
+    size_t                    size;
+    ngx_int_t                 rc;
+    ngx_uint_t                i, name_index;
+    ngx_http_v2_header_t     *header;
+    ngx_http_v2_hpack_enc_t  *hpack;
+
+    hpack = &h2c->hpack_enc;
+
+    if (index) {
+        name = &ngx_http_v2_static_table[index - 1].name;
+        name_index = index;
+
+    } else {
+        name_index = 0;
+
+        for (i = 0; i < NGX_HTTP_V2_STATIC_TABLE_ENTRIES; i++) {
+            header = &ngx_http_v2_static_table[i];
+
+            if (header->name.len != name->len
+                || ngx_strncasecmp(header->name.data, name->data, name->len)
+                   != 0)
+            {
+                continue;
+            }
+
+            if (header->value.len == value->len
+                && ngx_strncmp(header->value.data, value->data, value->len)
+                   == 0)
+            {
+                *pos = 0x80;
+                return ngx_http_v2_write_int(pos, ngx_http_v2_prefix(7), i + 1);
+            }
+
+            if (name_index == 0) {
+                name_index = i + 1;
+            }
+        }
+    }
+
+    size = 32 + name->len + value->len;
+
+    /*
+     * large entries would flush the whole table on every response,
+     * so only headers up to a quarter of the table size are indexed
+     */
+
+    if (size > hpack->size / 4) {
+        indexing = 0;
+    }
+
+    if (indexing) {
+        rc = ngx_http_v2_table_find(hpack, name, value, &name_index);
+
+        if (rc != NGX_DECLINED) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                           "http2 table hit: %i", rc);
+
+            *pos = 0x80;
+            return ngx_http_v2_write_int(pos, ngx_http_v2_prefix(7), rc);
+        }
+
+        if (ngx_http_v2_table_insert(hpack, h2c->connection->pool, name, value)
+            != NGX_OK)
+        {
+            indexing = 0;
+        }
+    }
+
+    if (indexing) {
+        *pos = 0x40;
+        pos = ngx_http_v2_write_int(pos, ngx_http_v2_prefix(6), name_index);
+
+    } else {
+        *pos = 0;
+        pos = ngx_http_v2_write_int(pos, ngx_http_v2_prefix(4), name_index);
+    }
+
+    if (name_index == 0) {
+        pos = ngx_http_v2_write_name(pos, name->data, name->len, tmp);
+    }
+
+    return ngx_http_v2_write_value(pos, value->data, value->len, tmp);
+}
+
+
+static ngx_int_t
+ngx_http_v2_table_find(ngx_http_v2_hpack_enc_t *hpack, ngx_str_t *name,
+    ngx_str_t *value, ngx_uint_t *name_index)
+{
+    ngx_uint_t             i;
+    ngx_http_v2_header_t  *entry;
+
+    for (i = hpack->added; i != hpack->deleted; /* void */) {
+        entry = &hpack->entries[--i % hpack->allocated];
+
+        if (entry->name.len != name->len
+            || ngx_http_v2_table_cmp(hpack, &entry->name, name, 1) != 0)
+        {
+            continue;
+        }
+
+        if (entry->value.len == value->len
+            && ngx_http_v2_table_cmp(hpack, &entry->value, value, 0) == 0)
+        {
+            return NGX_HTTP_V2_STATIC_TABLE_ENTRIES + hpack->added - i;
+        }
+
+        if (*name_index == 0) {
+            *name_index = NGX_HTTP_V2_STATIC_TABLE_ENTRIES + hpack->added - i;
+        }
+    }
+
+    return NGX_DECLINED;
+}
+
+
+static ngx_int_t
+ngx_http_v2_table_cmp(ngx_http_v2_hpack_enc_t *hpack, ngx_str_t *entry,
+    ngx_str_t *str, ngx_uint_t lower)
+{
+    size_t  rest;
+
+    rest = hpack->storage + hpack->limit - entry->data;
+
+    if (rest > entry->len) {
+        rest = entry->len;
+    }
+
+    if (lower) {
+        if (ngx_strncasecmp(entry->data, str->data, rest) != 0) {
+            return 1;
+        }
+
+        return ngx_strncasecmp(hpack->storage, str->data + rest,
+                               entry->len - rest);
+    }
+
+    if (ngx_memcmp(entry->data, str->data, rest) != 0) {
+        return 1;
+    }
+
+    return ngx_memcmp(hpack->storage, str->data + rest, entry->len - rest);
+}
+
+
+static ngx_int_t
+ngx_http_v2_table_insert(ngx_http_v2_hpack_enc_t *hpack, ngx_pool_t *pool,
+    ngx_str_t *name, ngx_str_t *value)
+{
+    size_t                 size;
+    ngx_http_v2_header_t  *entry;
+
+    if (hpack->storage == NULL) {
+        hpack->allocated = hpack->limit / 32;
+
+        hpack->entries = ngx_palloc(pool, sizeof(ngx_http_v2_header_t)
+                                          * hpack->allocated);
+        if (hpack->entries == NULL) {
+            return NGX_ERROR;
+        }
+
+        hpack->storage = ngx_palloc(pool, hpack->limit);
+        if (hpack->storage == NULL) {
+            return NGX_ERROR;
+        }
+
+        hpack->pos = hpack->storage;
+    }
+
+    size = 32 + name->len + value->len;
+
+    while (size > hpack->free) {
+        entry = &hpack->entries[hpack->deleted++ % hpack->allocated];
+        hpack->free += 32 + entry->name.len + entry->value.len;
+    }
+
+    hpack->free -= size;
+
+    /*
+     * every entry takes more than 32 bytes of the table, hence
+     * no more than limit / 32 entries are alive at the same time
+     */
+
+    entry = &hpack->entries[hpack->added++ % hpack->allocated];
+
+    hpack->pos = ngx_http_v2_table_copy(hpack, &entry->name, name, 1);
+    hpack->pos = ngx_http_v2_table_copy(hpack, &entry->value, value, 0);
+
+    return NGX_OK;
+}
+
+
+static u_char *
+ngx_http_v2_table_copy(ngx_http_v2_hpack_enc_t *hpack, ngx_str_t *dst,
+    ngx_str_t *src, ngx_uint_t lower)
+{
+    u_char  *p, *end;
+    size_t   i;
+
+    p = hpack->pos;
+    end = hpack->storage + hpack->limit;
+
+    dst->len = src->len;
+    dst->data = p;
+
+    for (i = 0; i < src->len; i++) {
+        if (p == end) {
+            p = hpack->storage;
+        }
+
+        *p++ = lower ? ngx_tolower(src->data[i]) : src->data[i];
+    }
+
+    return (p == end) ? hpack->storage : p;
+}
+
+
+void
+ngx_http_v2_table_encoder_size(ngx_http_v2_connection_t *h2c, size_t size)
+{
+    ngx_http_v2_header_t     *entry;
+    ngx_http_v2_hpack_enc_t  *hpack;
+
+    hpack = &h2c->hpack_enc;
+
+    if (size > hpack->limit) {
+        size = hpack->limit;
+    }
+
+    if (size == hpack->size) {
+        return;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 new encoder table size: %uz was:%uz",
+                   size, hpack->size);
+
+    while (hpack->size - hpack->free > size) {
+        entry = &hpack->entries[hpack->deleted++ % hpack->allocated];
+        hpack->free += 32 + entry->name.len + entry->value.len;
+    }
+
+    hpack->free = size - (hpack->size - hpack->free);
+    hpack->size = size;
+
+    h2c->table_update = 1;
+}
@@ -281,6 +281,7 @@ ngx_de_info(u_char *name, ngx_dir_t *dir)
 #define ngx_de_fs_size(dir)                                                  \
     ngx_max((dir)->info.st_size, (dir)->info.st_blocks * 512)
 #define ngx_de_mtime(dir)        (dir)->info.st_mtime
+#define ngx_de_uniq(dir)         (dir)->info.st_ino
 
 
 ngx_int_t ngx_open_glob(ngx_glob_t *gl);
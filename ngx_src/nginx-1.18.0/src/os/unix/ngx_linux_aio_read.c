@@ -13,6 +13,13 @@
 extern int            ngx_eventfd;
 extern aio_context_t  ngx_aio_ctx;
 
+#if (NGX_HAVE_IOURING)
+extern ngx_uint_t     ngx_iouring_aio;
+
+ngx_int_t ngx_iouring_aio_read(ngx_file_t *file, u_char *buf, size_t size,
+    off_t offset);
+#endif
+
 
 static void ngx_file_aio_event_handler(ngx_event_t *ev);
 
@@ -106,6 +113,25 @@ ngx_file_aio_read(ngx_file_t *file, u_char *buf, size_t size, off_t offset,
 
     ev->handler = ngx_file_aio_event_handler;
 
+#if (NGX_HAVE_IOURING)
+
+    if (ngx_iouring_aio) {
+
+        /* io_uring reads do not require O_DIRECT to be asynchronous */
+
+        if (ngx_iouring_aio_read(file, buf, size, offset) == NGX_OK) {
+            ev->active = 1;
+            ev->ready = 0;
+            ev->complete = 0;
+
+            return NGX_AGAIN;
+        }
+
+        return ngx_read_file(file, buf, size, offset);
+    }
+
+#endif
+
     piocb[0] = &aio->aiocb;
 
     if (io_submit(ngx_aio_ctx, 1, piocb) == 1) {
@@ -23,6 +23,7 @@ static void ngx_worker_process_cycle(ngx_cycle_t *cycle, void *data);
 static void ngx_worker_process_init(ngx_cycle_t *cycle, ngx_int_t worker);
 static void ngx_worker_process_exit(ngx_cycle_t *cycle);
 static void ngx_channel_handler(ngx_event_t *ev);
+static void ngx_pool_cache_handler(ngx_event_t *ev);
 static void ngx_cache_manager_process_cycle(ngx_cycle_t *cycle, void *data);
 static void ngx_cache_manager_process_handler(ngx_event_t *ev);
 static void ngx_cache_loader_process_handler(ngx_event_t *ev);
@@ -45,6 +46,7 @@ sig_atomic_t  ngx_reopen;
 
 sig_atomic_t  ngx_change_binary;
 ngx_pid_t     ngx_new_binary;
+ngx_uint_t    ngx_binary_upgrade;
 ngx_uint_t    ngx_inherited;
 ngx_uint_t    ngx_daemonized;
 
@@ -65,6 +67,9 @@ static ngx_cache_manager_ctx_t  ngx_cache_loader_ctx = {
 };
 
 
+static ngx_event_t      ngx_pool_cache_event;
+static void            *ngx_pool_cache_ident[4];
+
 static ngx_cycle_t      ngx_exit_cycle;
 static ngx_log_t        ngx_exit_log;
 static ngx_open_file_t  ngx_exit_log_file;
@@ -273,6 +278,10 @@ ngx_master_process_cycle(ngx_cycle_t *cycle)
             ngx_change_binary = 0;
             ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0, "changing binary");
             ngx_new_binary = ngx_exec_new_binary(cycle, ngx_argv);
+
+            if (ngx_new_binary != NGX_INVALID_PID) {
+                ngx_binary_upgrade = 1;
+            }
         }
 
         if (ngx_noaccept) {
@@ -684,10 +693,21 @@ ngx_reap_children(ngx_cycle_t *cycle)
 static void
 ngx_master_process_exit(ngx_cycle_t *cycle)
 {
-    ngx_uint_t  i;
+    ngx_uint_t    i;
+    ngx_path_t  **path;
 
     ngx_delete_pidfile(cycle);
 
+    /* all other processes have exited, save what is left in shared memory */
+
+    path = cycle->paths.elts;
+    for (i = 0; i < cycle->paths.nelts; i++) {
+
+        if (path[i]->saver) {
+            path[i]->saver(path[i]->data);
+        }
+    }
+
     ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0, "exit");
 
     for (i = 0; cycle->modules[i]; i++) {
@@ -917,6 +937,8 @@ ngx_worker_process_init(ngx_cycle_t *cycle, ngx_int_t worker)
     tp = ngx_timeofday();
     srandom(((unsigned) ngx_pid << 16) ^ tp->sec ^ tp->msec);
 
+    ngx_pool_cache_init(ccf->pool_cache_size);
+
     /*
      * disable deleting previous events for the listening sockets because
      * in the worker processes there are no events at all at this point
@@ -971,6 +993,20 @@ ngx_worker_process_init(ngx_cycle_t *cycle, ngx_int_t worker)
         /* fatal */
         exit(2);
     }
+
+    if (ccf->pool_cache_size) {
+
+        /* an idle worker does not leave the event loop to trim the cache */
+
+        ngx_pool_cache_ident[3] = (void *) -1;
+
+        ngx_pool_cache_event.handler = ngx_pool_cache_handler;
+        ngx_pool_cache_event.data = ngx_pool_cache_ident;
+        ngx_pool_cache_event.log = cycle->log;
+        ngx_pool_cache_event.cancelable = 1;
+
+        ngx_add_timer(&ngx_pool_cache_event, NGX_POOL_CACHE_TRIM_INTERVAL);
+    }
 }
 
 
@@ -1123,6 +1159,17 @@ ngx_channel_handler(ngx_event_t *ev)
 }
 
 
+static void
+ngx_pool_cache_handler(ngx_event_t *ev)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_CORE, ev->log, 0, "pool cache trim handler");
+
+    ngx_pool_cache_trim();
+
+    ngx_add_timer(ev, NGX_POOL_CACHE_TRIM_INTERVAL);
+}
+
+
 static void
 ngx_cache_manager_process_cycle(ngx_cycle_t *cycle, void *data)
 {
@@ -42,6 +42,7 @@ extern ngx_uint_t      ngx_process;
 extern ngx_uint_t      ngx_worker;
 extern ngx_pid_t       ngx_pid;
 extern ngx_pid_t       ngx_new_binary;
+extern ngx_uint_t      ngx_binary_upgrade;
 extern ngx_uint_t      ngx_inherited;
 extern ngx_uint_t      ngx_daemonized;
 extern ngx_uint_t      ngx_exiting;
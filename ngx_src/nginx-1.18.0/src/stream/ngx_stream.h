@@ -55,6 +55,7 @@ typedef struct {
     unsigned                       ipv6only:1;
 #endif
     unsigned                       reuseport:1;
+    unsigned                       incoming_cpu:1;
     unsigned                       so_keepalive:2;
     unsigned                       proxy_protocol:1;
 #if (NGX_HAVE_KEEPALIVE_TUNABLE)
@@ -277,7 +278,8 @@ typedef struct {
         NULL)
 
 
-#define NGX_STREAM_WRITE_BUFFERED  0x10
+#define NGX_STREAM_WRITE_BUFFERED   0x10
+#define NGX_STREAM_SPLICE_BUFFERED  0x20
 
 
 void ngx_stream_core_run_phases(ngx_stream_session_t *s);
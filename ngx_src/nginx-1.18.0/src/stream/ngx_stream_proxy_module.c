@@ -33,6 +33,7 @@ typedef struct {
     ngx_flag_t                       proxy_protocol;
     ngx_stream_upstream_local_t     *local;
     ngx_flag_t                       socket_keepalive;
+    ngx_flag_t                       splice;
 
 #if (NGX_STREAM_SSL)
     ngx_flag_t                       ssl_enable;
@@ -74,6 +75,12 @@ static void ngx_stream_proxy_connect_handler(ngx_event_t *ev);
 static ngx_int_t ngx_stream_proxy_test_connect(ngx_connection_t *c);
 static void ngx_stream_proxy_process(ngx_stream_session_t *s,
     ngx_uint_t from_upstream, ngx_uint_t do_write);
+#if (NGX_HAVE_SPLICE)
+static ngx_int_t ngx_stream_proxy_init_splice(ngx_stream_session_t *s);
+static void ngx_stream_proxy_splice_cleanup(void *data);
+static ngx_int_t ngx_stream_proxy_splice(ngx_stream_session_t *s,
+    ngx_uint_t from_upstream, ngx_uint_t do_write);
+#endif
 static ngx_int_t ngx_stream_proxy_test_finalize(ngx_stream_session_t *s,
     ngx_uint_t from_upstream);
 static void ngx_stream_proxy_next_upstream(ngx_stream_session_t *s);
@@ -147,6 +154,13 @@ static ngx_command_t  ngx_stream_proxy_commands[] = {
       offsetof(ngx_stream_proxy_srv_conf_t, socket_keepalive),
       NULL },
 
+    { ngx_string("proxy_splice"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, splice),
+      NULL },
+
     { ngx_string("proxy_connect_timeout"),
       NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_msec_slot,
@@ -898,6 +912,17 @@ ngx_stream_proxy_init_upstream(ngx_stream_session_t *s)
     u->upload_rate = ngx_stream_complex_value_size(s, pscf->upload_rate, 0);
     u->download_rate = ngx_stream_complex_value_size(s, pscf->download_rate, 0);
 
+#if (NGX_HAVE_SPLICE)
+
+    if (pscf->splice && !u->splice && pc->type == SOCK_STREAM) {
+        if (ngx_stream_proxy_init_splice(s) != NGX_OK) {
+            ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+            return;
+        }
+    }
+
+#endif
+
     u->connected = 1;
 
     pc->read->handler = ngx_stream_proxy_upstream_handler;
@@ -1556,6 +1581,25 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
         send_action = "proxying and sending to upstream";
     }
 
+#if (NGX_HAVE_SPLICE)
+
+    /*
+     * data already buffered, such as preread data or the PROXY protocol
+     * header, is sent before switching to splice()
+     */
+
+    if (u->splice && dst && *out == NULL && *busy == NULL
+        && !(dst->buffered & ~NGX_STREAM_SPLICE_BUFFERED))
+    {
+        if (ngx_stream_proxy_splice(s, from_upstream, do_write) != NGX_OK) {
+            return;
+        }
+
+        goto done;
+    }
+
+#endif
+
     for ( ;; ) {
 
         if (do_write && dst) {
@@ -1662,6 +1706,10 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
         break;
     }
 
+#if (NGX_HAVE_SPLICE)
+done:
+#endif
+
     c->log->action = "proxying connection";
 
     if (ngx_stream_proxy_test_finalize(s, from_upstream) == NGX_OK) {
@@ -1691,6 +1739,258 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
 }
 
 
+#if (NGX_HAVE_SPLICE)
+
+static ngx_int_t
+ngx_stream_proxy_init_splice(ngx_stream_session_t *s)
+{
+    int                           size, n;
+    ngx_connection_t             *c;
+    ngx_pool_cleanup_t           *cln;
+    ngx_stream_upstream_t        *u;
+    ngx_stream_proxy_srv_conf_t  *pscf;
+
+    c = s->connection;
+    u = s->upstream;
+
+    /* stream filters are bypassed, so the data must be passed as is */
+
+#if (NGX_STREAM_SSL)
+    if (c->ssl || u->peer.connection->ssl) {
+        return NGX_OK;
+    }
+#endif
+
+    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
+
+    cln = ngx_pool_cleanup_add(c->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (pipe2(u->upstream_pipe, O_NONBLOCK|O_CLOEXEC) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, c->log, ngx_errno, "pipe2() failed");
+        return NGX_OK;
+    }
+
+    if (pipe2(u->downstream_pipe, O_NONBLOCK|O_CLOEXEC) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, c->log, ngx_errno, "pipe2() failed");
+
+        (void) close(u->upstream_pipe[0]);
+        (void) close(u->upstream_pipe[1]);
+
+        return NGX_OK;
+    }
+
+    cln->handler = ngx_stream_proxy_splice_cleanup;
+    cln->data = u;
+
+    /* the pipes hold up to proxy_buffer_size bytes in each direction */
+
+    (void) fcntl(u->upstream_pipe[1], F_SETPIPE_SZ, (int) pscf->buffer_size);
+    (void) fcntl(u->downstream_pipe[1], F_SETPIPE_SZ, (int) pscf->buffer_size);
+
+    size = fcntl(u->upstream_pipe[1], F_GETPIPE_SZ);
+    n = fcntl(u->downstream_pipe[1], F_GETPIPE_SZ);
+
+    if (size == -1 || n == -1) {
+        ngx_log_error(NGX_LOG_ALERT, c->log, ngx_errno,
+                      "fcntl(F_GETPIPE_SZ) failed");
+        return NGX_OK;
+    }
+
+    u->pipe_size = ngx_min((size_t) ngx_min(size, n), pscf->buffer_size);
+    u->splice = 1;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                   "stream proxy splice, pipe size: %uz", u->pipe_size);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_stream_proxy_splice_cleanup(void *data)
+{
+    ngx_stream_upstream_t  *u = data;
+
+    (void) close(u->upstream_pipe[0]);
+    (void) close(u->upstream_pipe[1]);
+    (void) close(u->downstream_pipe[0]);
+    (void) close(u->downstream_pipe[1]);
+}
+
+
+static ngx_int_t
+ngx_stream_proxy_splice(ngx_stream_session_t *s, ngx_uint_t from_upstream,
+    ngx_uint_t do_write)
+{
+    char                   *recv_action, *send_action;
+    off_t                  *received, limit;
+    size_t                  size, limit_rate, *piped;
+    ssize_t                 n;
+    ngx_fd_t               *fds;
+    ngx_err_t               err;
+    ngx_uint_t             *packets;
+    ngx_msec_t              delay;
+    ngx_connection_t       *c, *pc, *src, *dst;
+    ngx_stream_upstream_t  *u;
+
+    u = s->upstream;
+
+    c = s->connection;
+    pc = u->peer.connection;
+
+    if (from_upstream) {
+        src = pc;
+        dst = c;
+        fds = u->downstream_pipe;
+        piped = &u->downstream_piped;
+        limit_rate = u->download_rate;
+        received = &u->received;
+        packets = &u->responses;
+        recv_action = "proxying and reading from upstream";
+        send_action = "proxying and sending to client";
+
+    } else {
+        src = c;
+        dst = pc;
+        fds = u->upstream_pipe;
+        piped = &u->upstream_piped;
+        limit_rate = u->upload_rate;
+        received = &s->received;
+        packets = &u->requests;
+        recv_action = "proxying and reading from client";
+        send_action = "proxying and sending to upstream";
+    }
+
+    for ( ;; ) {
+
+        if (do_write && *piped && dst->write->ready && !dst->write->error) {
+            c->log->action = send_action;
+
+            n = splice(fds[0], NULL, dst->fd, NULL, *piped,
+                       SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+            ngx_log_debug3(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                           "splice() to %d: %z of %uz", dst->fd, n, *piped);
+
+            if (n == -1) {
+                err = ngx_errno;
+
+                if (err != NGX_EAGAIN) {
+                    dst->write->error = 1;
+                    ngx_connection_error(dst, err, "splice() failed");
+                    ngx_stream_proxy_finalize(s, NGX_STREAM_OK);
+                    return NGX_ERROR;
+                }
+
+                dst->write->ready = 0;
+
+            } else {
+                *piped -= n;
+                dst->sent += n;
+            }
+
+            if (*piped) {
+                dst->buffered |= NGX_STREAM_SPLICE_BUFFERED;
+
+            } else {
+                dst->buffered &= ~NGX_STREAM_SPLICE_BUFFERED;
+            }
+        }
+
+        size = u->pipe_size - *piped;
+
+        if (size && src->read->ready && !src->read->delayed
+            && !src->read->error)
+        {
+            if (limit_rate) {
+                limit = (off_t) limit_rate * (ngx_time() - u->start_sec + 1)
+                        - *received;
+
+                if (limit <= 0) {
+                    src->read->delayed = 1;
+                    delay = (ngx_msec_t) (- limit * 1000 / limit_rate + 1);
+                    ngx_add_timer(src->read, delay);
+                    break;
+                }
+
+                if ((off_t) size > limit) {
+                    size = (size_t) limit;
+                }
+            }
+
+            c->log->action = recv_action;
+
+            n = splice(src->fd, NULL, fds[1], NULL, size,
+                       SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+            ngx_log_debug3(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                           "splice() from %d: %z of %uz", src->fd, n, size);
+
+            if (n == -1) {
+                err = ngx_errno;
+
+                if (err == NGX_EAGAIN) {
+
+                    /*
+                     * pipe buffers are page fragments, so a pipe
+                     * with data may be full before pipe_size bytes
+                     */
+
+                    if (*piped == 0) {
+                        src->read->ready = 0;
+                    }
+
+                    break;
+                }
+
+                ngx_connection_error(src, err, "splice() failed");
+
+                src->read->error = 1;
+                n = 0;
+            }
+
+            if (n == 0) {
+                src->read->ready = 0;
+                src->read->eof = 1;
+            }
+
+            if (limit_rate) {
+                delay = (ngx_msec_t) (n * 1000 / limit_rate);
+
+                if (delay > 0) {
+                    src->read->delayed = 1;
+                    ngx_add_timer(src->read, delay);
+                }
+            }
+
+            if (from_upstream) {
+                if (u->state->first_byte_time == (ngx_msec_t) -1) {
+                    u->state->first_byte_time = ngx_current_msec
+                                                - u->start_time;
+                }
+            }
+
+            if (n) {
+                (*packets)++;
+                *received += n;
+                *piped += n;
+                do_write = 1;
+
+                continue;
+            }
+        }
+
+        break;
+    }
+
+    return NGX_OK;
+}
+
+#endif
+
 static ngx_int_t
 ngx_stream_proxy_test_finalize(ngx_stream_session_t *s,
     ngx_uint_t from_upstream)
@@ -1976,6 +2276,7 @@ ngx_stream_proxy_create_srv_conf(ngx_conf_t *cf)
     conf->proxy_protocol = NGX_CONF_UNSET;
     conf->local = NGX_CONF_UNSET_PTR;
     conf->socket_keepalive = NGX_CONF_UNSET;
+    conf->splice = NGX_CONF_UNSET;
 
 #if (NGX_STREAM_SSL)
     conf->ssl_enable = NGX_CONF_UNSET;
@@ -2034,6 +2335,19 @@ ngx_stream_proxy_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_value(conf->socket_keepalive,
                               prev->socket_keepalive, 0);
 
+    ngx_conf_merge_value(conf->splice, prev->splice, 0);
+
+#if !(NGX_HAVE_SPLICE)
+
+    if (conf->splice) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "\"proxy_splice\" is not supported "
+                           "on this platform, ignored");
+        conf->splice = 0;
+    }
+
+#endif
+
 #if (NGX_STREAM_SSL)
 
     ngx_conf_merge_value(conf->ssl_enable, prev->ssl_enable, 0);
@@ -126,6 +126,14 @@ typedef struct {
     ngx_chain_t                       *downstream_out;
     ngx_chain_t                       *downstream_busy;
 
+#if (NGX_HAVE_SPLICE)
+    ngx_fd_t                           upstream_pipe[2];
+    ngx_fd_t                           downstream_pipe[2];
+    size_t                             upstream_piped;
+    size_t                             downstream_piped;
+    size_t                             pipe_size;
+#endif
+
     off_t                              received;
     time_t                             start_sec;
     ngx_uint_t                         requests;
@@ -142,6 +150,7 @@ typedef struct {
     ngx_stream_upstream_state_t       *state;
     unsigned                           connected:1;
     unsigned                           proxy_protocol:1;
+    unsigned                           splice:1;
 } ngx_stream_upstream_t;
 
 
@@ -0,0 +1,528 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+
+/*
+ * Peak EWMA balancing: each peer keeps an exponentially weighted moving
+ * average of the time to the first byte of its responses (or to the
+ * connection establishment, if nothing was received), scaled by
+ * NGX_STREAM_UPSTREAM_EWMA_SCALE, in peer->ewma, which is placed in the
+ * shared memory zone along with the rest of the peer when the upstream
+ * "zone" is used.  A sample slower than the average replaces it
+ * immediately, faster samples are averaged in over the "decay" time, and
+ * the average of a peer which is not used decays towards zero, so it is
+ * eventually tried again.
+ *
+ * A connection is passed to the better of two randomly chosen peers, the
+ * cost of a peer being its average multiplied by the number of active
+ * connections.
+ */
+
+
+#define NGX_STREAM_UPSTREAM_EWMA_SCALE  1000
+
+
+typedef struct {
+    ngx_stream_upstream_rr_peer_t          *peer;
+    ngx_uint_t                              range;
+} ngx_stream_upstream_ewma_range_t;
+
+
+typedef struct {
+    ngx_msec_t                              decay;
+    ngx_stream_upstream_ewma_range_t       *ranges;
+} ngx_stream_upstream_ewma_srv_conf_t;
+
+
+typedef struct {
+    /* the round robin data must be first */
+    ngx_stream_upstream_rr_peer_data_t      rrp;
+
+    ngx_stream_upstream_ewma_srv_conf_t    *conf;
+    ngx_stream_session_t                   *session;
+    u_char                                  tries;
+} ngx_stream_upstream_ewma_peer_data_t;
+
+
+static ngx_int_t ngx_stream_upstream_init_ewma(ngx_conf_t *cf,
+    ngx_stream_upstream_srv_conf_t *us);
+static ngx_int_t ngx_stream_upstream_update_ewma(ngx_pool_t *pool,
+    ngx_stream_upstream_srv_conf_t *us);
+
+static ngx_int_t ngx_stream_upstream_init_ewma_peer(ngx_stream_session_t *s,
+    ngx_stream_upstream_srv_conf_t *us);
+static ngx_int_t ngx_stream_upstream_get_ewma_peer(ngx_peer_connection_t *pc,
+    void *data);
+static void ngx_stream_upstream_free_ewma_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+static ngx_uint_t ngx_stream_upstream_peek_ewma_peer(
+    ngx_stream_upstream_rr_peers_t *peers,
+    ngx_stream_upstream_ewma_peer_data_t *ep);
+static uint64_t ngx_stream_upstream_ewma_cost(
+    ngx_stream_upstream_rr_peer_t *peer, ngx_msec_t decay);
+static void *ngx_stream_upstream_ewma_create_conf(ngx_conf_t *cf);
+static char *ngx_stream_upstream_ewma(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_command_t  ngx_stream_upstream_ewma_commands[] = {
+
+    { ngx_string("ewma"),
+      NGX_STREAM_UPS_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE1,
+      ngx_stream_upstream_ewma,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_stream_module_t  ngx_stream_upstream_ewma_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_stream_upstream_ewma_create_conf,    /* create server configuration */
+    NULL                                   /* merge server configuration */
+};
+
+
+ngx_module_t  ngx_stream_upstream_ewma_module = {
+    NGX_MODULE_V1,
+    &ngx_stream_upstream_ewma_module_ctx,    /* module context */
+    ngx_stream_upstream_ewma_commands,       /* module directives */
+    NGX_STREAM_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_stream_upstream_init_ewma(ngx_conf_t *cf,
+    ngx_stream_upstream_srv_conf_t *us)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, cf->log, 0, "init ewma");
+
+    if (ngx_stream_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    us->peer.init = ngx_stream_upstream_init_ewma_peer;
+
+#if (NGX_STREAM_UPSTREAM_ZONE)
+    if (us->shm_zone) {
+        return NGX_OK;
+    }
+#endif
+
+    return ngx_stream_upstream_update_ewma(cf->pool, us);
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_update_ewma(ngx_pool_t *pool,
+    ngx_stream_upstream_srv_conf_t *us)
+{
+    size_t                                size;
+    ngx_uint_t                            i, total_weight;
+    ngx_stream_upstream_rr_peer_t        *peer;
+    ngx_stream_upstream_rr_peers_t       *peers;
+    ngx_stream_upstream_ewma_range_t     *ranges;
+    ngx_stream_upstream_ewma_srv_conf_t  *ecf;
+
+    ecf = ngx_stream_conf_upstream_srv_conf(us,
+                                            ngx_stream_upstream_ewma_module);
+
+    peers = us->peer.data;
+
+    size = peers->number * sizeof(ngx_stream_upstream_ewma_range_t);
+
+    ranges = pool ? ngx_palloc(pool, size) : ngx_alloc(size, ngx_cycle->log);
+    if (ranges == NULL) {
+        return NGX_ERROR;
+    }
+
+    total_weight = 0;
+
+    for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+        ranges[i].peer = peer;
+        ranges[i].range = total_weight;
+        total_weight += peer->weight;
+    }
+
+    ecf->ranges = ranges;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_init_ewma_peer(ngx_stream_session_t *s,
+    ngx_stream_upstream_srv_conf_t *us)
+{
+    ngx_stream_upstream_ewma_srv_conf_t   *ecf;
+    ngx_stream_upstream_ewma_peer_data_t  *ep;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                   "init ewma peer");
+
+    ecf = ngx_stream_conf_upstream_srv_conf(us,
+                                            ngx_stream_upstream_ewma_module);
+
+    ep = ngx_palloc(s->connection->pool,
+                    sizeof(ngx_stream_upstream_ewma_peer_data_t));
+    if (ep == NULL) {
+        return NGX_ERROR;
+    }
+
+    s->upstream->peer.data = &ep->rrp;
+
+    if (ngx_stream_upstream_init_round_robin_peer(s, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    s->upstream->peer.get = ngx_stream_upstream_get_ewma_peer;
+    s->upstream->peer.free = ngx_stream_upstream_free_ewma_peer;
+
+    ep->conf = ecf;
+    ep->session = s;
+    ep->tries = 0;
+
+    ngx_stream_upstream_rr_peers_rlock(ep->rrp.peers);
+
+#if (NGX_STREAM_UPSTREAM_ZONE)
+    if (ep->rrp.peers->shpool && ecf->ranges == NULL) {
+        if (ngx_stream_upstream_update_ewma(NULL, us) != NGX_OK) {
+            ngx_stream_upstream_rr_peers_unlock(ep->rrp.peers);
+            return NGX_ERROR;
+        }
+    }
+#endif
+
+    ngx_stream_upstream_rr_peers_unlock(ep->rrp.peers);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_get_ewma_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_stream_upstream_ewma_peer_data_t  *ep = data;
+
+    time_t                               now;
+    uint64_t                             cost, prev_cost;
+    uintptr_t                            m;
+    ngx_uint_t                           i, n, p;
+    ngx_stream_upstream_rr_peer_t       *peer, *prev;
+    ngx_stream_upstream_rr_peers_t      *peers;
+    ngx_stream_upstream_rr_peer_data_t  *rrp;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                   "get ewma peer, try: %ui", pc->tries);
+
+    rrp = &ep->rrp;
+    peers = rrp->peers;
+
+    ngx_stream_upstream_rr_peers_wlock(peers);
+
+    if (ep->tries > 20 || peers->single) {
+        ngx_stream_upstream_rr_peers_unlock(peers);
+        return ngx_stream_upstream_get_round_robin_peer(pc, rrp);
+    }
+
+    pc->cached = 0;
+    pc->connection = NULL;
+
+    now = ngx_time();
+
+    prev = NULL;
+
+#if (NGX_SUPPRESS_WARN)
+    p = 0;
+    prev_cost = 0;
+#endif
+
+    for ( ;; ) {
+
+        i = ngx_stream_upstream_peek_ewma_peer(peers, ep);
+
+        peer = ep->conf->ranges[i].peer;
+
+        if (peer == prev) {
+            goto next;
+        }
+
+        n = i / (8 * sizeof(uintptr_t));
+        m = (uintptr_t) 1 << i % (8 * sizeof(uintptr_t));
+
+        if (rrp->tried[n] & m) {
+            goto next;
+        }
+
+        if (peer->down) {
+            goto next;
+        }
+
+        if (peer->max_fails
+            && peer->fails >= peer->max_fails
+            && now - peer->checked <= peer->fail_timeout)
+        {
+            goto next;
+        }
+
+        if (peer->max_conns && peer->conns >= peer->max_conns) {
+            goto next;
+        }
+
+        cost = ngx_stream_upstream_ewma_cost(peer, ep->conf->decay);
+
+        if (prev) {
+            ngx_log_debug4(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                           "get ewma peer, cost: %uL %V, %uL %V",
+                           prev_cost, &prev->name, cost, &peer->name);
+
+            if (cost * prev->weight > prev_cost * peer->weight) {
+                peer = prev;
+                n = p / (8 * sizeof(uintptr_t));
+                m = (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
+            }
+
+            break;
+        }
+
+        prev = peer;
+        prev_cost = cost;
+        p = i;
+
+    next:
+
+        if (++ep->tries > 20) {
+            ngx_stream_upstream_rr_peers_unlock(peers);
+            return ngx_stream_upstream_get_round_robin_peer(pc, rrp);
+        }
+    }
+
+    rrp->current = peer;
+
+    if (now - peer->checked > peer->fail_timeout) {
+        peer->checked = now;
+    }
+
+    pc->sockaddr = peer->sockaddr;
+    pc->socklen = peer->socklen;
+    pc->name = &peer->name;
+
+    peer->conns++;
+
+    ngx_stream_upstream_rr_peers_unlock(peers);
+
+    rrp->tried[n] |= m;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_stream_upstream_free_ewma_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_stream_upstream_ewma_peer_data_t  *ep = data;
+
+    ngx_msec_t                       now, rtt, elapsed, decay;
+    ngx_stream_upstream_t           *u;
+    ngx_stream_upstream_rr_peer_t   *peer;
+    ngx_stream_upstream_rr_peers_t  *peers;
+
+    peers = ep->rrp.peers;
+    peer = ep->rrp.current;
+
+    if (peers->single) {
+        goto done;
+    }
+
+    u = ep->session->upstream;
+    now = ngx_current_msec;
+    decay = ep->conf->decay;
+
+    if (state & NGX_PEER_FAILED) {
+
+        /* a failed attempt counts as a response taking the decay time */
+
+        rtt = decay;
+
+    } else if (u->state && u->state->first_byte_time != (ngx_msec_t) -1) {
+        rtt = u->state->first_byte_time;
+
+    } else if (u->state && u->state->connect_time != (ngx_msec_t) -1) {
+        rtt = u->state->connect_time;
+
+    } else {
+        rtt = now - u->start_time;
+    }
+
+    rtt = ngx_min(rtt, NGX_MAX_UINT32_VALUE / NGX_STREAM_UPSTREAM_EWMA_SCALE)
+          * NGX_STREAM_UPSTREAM_EWMA_SCALE;
+
+    ngx_stream_upstream_rr_peers_rlock(peers);
+    ngx_stream_upstream_rr_peer_lock(peers, peer);
+
+    if (peer->ewma_time == 0 || rtt >= peer->ewma) {
+        peer->ewma = rtt;
+
+    } else {
+        elapsed = now - peer->ewma_time;
+
+        peer->ewma = ((uint64_t) peer->ewma * decay + (uint64_t) rtt * elapsed)
+                     / (decay + elapsed);
+    }
+
+    peer->ewma_time = now;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                   "free ewma peer %V, rtt: %M, ewma: %M",
+                   &peer->name, rtt, peer->ewma);
+
+    ngx_stream_upstream_rr_peer_unlock(peers, peer);
+    ngx_stream_upstream_rr_peers_unlock(peers);
+
+done:
+
+    ngx_stream_upstream_free_round_robin_peer(pc, &ep->rrp, state);
+}
+
+
+static ngx_uint_t
+ngx_stream_upstream_peek_ewma_peer(ngx_stream_upstream_rr_peers_t *peers,
+    ngx_stream_upstream_ewma_peer_data_t *ep)
+{
+    ngx_uint_t  i, j, k, x;
+
+    x = ngx_random() % peers->total_weight;
+
+    i = 0;
+    j = peers->number;
+
+    while (j - i > 1) {
+        k = (i + j) / 2;
+
+        if (x < ep->conf->ranges[k].range) {
+            j = k;
+
+        } else {
+            i = k;
+        }
+    }
+
+    return i;
+}
+
+
+static uint64_t
+ngx_stream_upstream_ewma_cost(ngx_stream_upstream_rr_peer_t *peer,
+    ngx_msec_t decay)
+{
+    uint64_t    ewma;
+    ngx_msec_t  elapsed;
+
+    ewma = peer->ewma;
+    elapsed = ngx_current_msec - peer->ewma_time;
+
+    if (ewma && elapsed) {
+        ewma = ewma * decay / (decay + elapsed);
+    }
+
+    return (ewma + 1) * (peer->conns + 1);
+}
+
+
+static void *
+ngx_stream_upstream_ewma_create_conf(ngx_conf_t *cf)
+{
+    ngx_stream_upstream_ewma_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_stream_upstream_ewma_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->ranges = NULL;
+     */
+
+    conf->decay = 10000;
+
+    return conf;
+}
+
+
+static char *
+ngx_stream_upstream_ewma(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_upstream_ewma_srv_conf_t  *ecf = conf;
+
+    ngx_str_t                       *value, s;
+    ngx_msec_t                       decay;
+    ngx_stream_upstream_srv_conf_t  *uscf;
+
+    uscf = ngx_stream_conf_get_module_srv_conf(cf, ngx_stream_upstream_module);
+
+    if (uscf->peer.init_upstream) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "load balancing method redefined");
+    }
+
+    uscf->peer.init_upstream = ngx_stream_upstream_init_ewma;
+
+    uscf->flags = NGX_STREAM_UPSTREAM_CREATE
+                  |NGX_STREAM_UPSTREAM_WEIGHT
+                  |NGX_STREAM_UPSTREAM_MAX_CONNS
+                  |NGX_STREAM_UPSTREAM_MAX_FAILS
+                  |NGX_STREAM_UPSTREAM_FAIL_TIMEOUT
+                  |NGX_STREAM_UPSTREAM_DOWN;
+
+    if (cf->args->nelts == 1) {
+        return NGX_CONF_OK;
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strncmp(value[1].data, "decay=", 6) == 0) {
+
+        s.len = value[1].len - 6;
+        s.data = &value[1].data[6];
+
+        decay = ngx_parse_time(&s, 0);
+        if (decay == (ngx_msec_t) NGX_ERROR || decay == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid decay \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+
+        ecf->decay = decay;
+
+        return NGX_CONF_OK;
+    }
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[1]);
+    return NGX_CONF_ERROR;
+}
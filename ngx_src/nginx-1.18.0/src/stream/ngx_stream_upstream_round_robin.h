@@ -38,6 +38,13 @@ struct ngx_stream_upstream_rr_peer_s {
     ngx_msec_t                       slow_start;
     ngx_msec_t                       start_time;
 
+    ngx_msec_t                       ewma;
+    ngx_msec_t                       ewma_time;
+
+    ngx_uint_t                       check_fails;
+    ngx_uint_t                       check_passes;
+    ngx_msec_t                       check_time;
+
     ngx_uint_t                       down;
 
     void                            *ssl_session;
@@ -943,13 +943,20 @@ ngx_stream_map_find(ngx_stream_session_t *s, ngx_stream_map_t *map,
 
     if (len && map->nregex) {
         ngx_int_t                n;
-        ngx_uint_t               i;
+        ngx_uint_t               i, *cand;
         ngx_stream_map_regex_t  *reg;
 
         reg = map->regex;
 
+        cand = map->regex_set ? ngx_regex_set_match(map->regex_set, match)
+                              : NULL;
+
         for (i = 0; i < map->nregex; i++) {
 
+            if (cand && !ngx_regex_set_candidate(cand, i)) {
+                continue;
+            }
+
             n = ngx_stream_regex_exec(s, reg[i].regex, match);
 
             if (n == NGX_OK) {
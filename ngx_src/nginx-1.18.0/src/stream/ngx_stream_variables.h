@@ -94,6 +94,7 @@ typedef struct {
 #if (NGX_PCRE)
     ngx_stream_map_regex_t       *regex;
     ngx_uint_t                    nregex;
+    ngx_regex_set_t              *regex_set;
 #endif
 } ngx_stream_map_t;
 